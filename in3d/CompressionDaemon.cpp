@@ -0,0 +1,334 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <utility>
+#include "CompressionDaemon.h"
+#include "UnixSocket.h"
+
+CompressionDaemon::Connection::Connection(SOCKET socket)
+	: Socket(socket)
+{
+}
+
+CompressionDaemon::Connection::~Connection()
+{
+	UnixSocket::Close(Socket);
+}
+
+BOOL CompressionDaemon::listen(const std::wstring & path)
+{
+	if (Context == NULL) {
+		return FALSE;
+	}
+	ListenSocket = UnixSocket::Listen(path);
+	ListenPath = path;
+	return ListenSocket != INVALID_SOCKET;
+}
+
+void CompressionDaemon::run()
+{
+	Dispatcher = std::thread(&CompressionDaemon::dispatch, this);
+	while (!ShutdownRequested) {
+		SOCKET clientSocket = accept(ListenSocket, NULL, NULL);
+		if (clientSocket == INVALID_SOCKET) {
+			break;
+		}
+		if (ShutdownRequested) {
+			// The connection that woke the accept loop up
+			UnixSocket::Close(clientSocket);
+			break;
+		}
+		std::shared_ptr<Connection> connection = std::make_shared<Connection>(clientSocket);
+		{
+			std::lock_guard<std::mutex> lock(ConnectionsLock);
+			Connections.erase(
+				std::remove_if(
+					Connections.begin(),
+					Connections.end(),
+					[](const std::weak_ptr<Connection>& c) { return c.expired(); }),
+				Connections.end());
+			Connections.push_back(connection);
+			ActiveReaders += 1;
+		}
+		std::thread(&CompressionDaemon::serveConnection, this, connection).detach();
+	}
+	stop();
+}
+
+void CompressionDaemon::stop()
+{
+	UnixSocket::Close(ListenSocket);
+	ListenSocket = INVALID_SOCKET;
+	DeleteFileW(ListenPath.c_str());
+	// Readers are stopped first so that no request is queued after the
+	// dispatcher has drained the queue. Requests already queued still run,
+	// but their responses to the closed connections are dropped.
+	{
+		std::unique_lock<std::mutex> lock(ConnectionsLock);
+		for (const std::weak_ptr<Connection>& c : Connections) {
+			std::shared_ptr<Connection> connection = c.lock();
+			if (connection) {
+				shutdown(connection->Socket, SD_BOTH);
+			}
+		}
+		ReadersDone.wait(lock, [this]() { return ActiveReaders == 0; });
+	}
+	{
+		std::lock_guard<std::mutex> lock(QueueLock);
+		Stopping = TRUE;
+	}
+	QueueReady.notify_all();
+	if (Dispatcher.joinable()) {
+		Dispatcher.join();
+	}
+	Pool.waitIdle();
+}
+
+void CompressionDaemon::serveConnection(std::shared_ptr<Connection> connection)
+{
+	DaemonRequest request;
+	while (UnixSocket::ReceiveAll(connection->Socket, &request, sizeof(request)) &&
+		request.Magic == DAEMON_MAGIC) {
+		Clock::time_point received = Clock::now();
+		DaemonResponse response = { DAEMON_MAGIC, IN3_OK, request.Id, 0, 0, 0 };
+		if (request.Operation == DAEMON_STATISTICS) {
+			DaemonStatistics statistics = getStatistics();
+			respond(*connection, response, &statistics);
+			continue;
+		}
+		if (request.Operation == DAEMON_SHUTDOWN) {
+			respond(*connection, response, NULL);
+			// Wake the accept loop with a connection of our own
+			ShutdownRequested = TRUE;
+			UnixSocket::Close(UnixSocket::Connect(ListenPath));
+			break;
+		}
+		std::shared_ptr<SharedSection> section;
+		if (request.Operation == DAEMON_COMPRESS || request.Operation == DAEMON_DECOMPRESS) {
+			section = mapSection(*connection, request);
+		}
+		if (!section || !checkRegions(request, section->getSize())) {
+			Failed++;
+			response.Status = IN3_ERROR_INVALID_ARGUMENT;
+			respond(*connection, response, NULL);
+			continue;
+		}
+		Job job = { connection, section, request, received };
+		enqueue(std::move(job));
+	}
+	// Notified under the lock, since stop may return and the daemon be
+	// destroyed as soon as the lock is released
+	std::lock_guard<std::mutex> lock(ConnectionsLock);
+	ActiveReaders -= 1;
+	ReadersDone.notify_all();
+}
+
+std::shared_ptr<SharedSection> CompressionDaemon::mapSection(
+	Connection & connection,
+	const DaemonRequest & request)
+{
+	const WCHAR* nameEnd = std::find(
+		request.SectionName,
+		request.SectionName + DAEMON_SECTION_NAME_LENGTH,
+		L'\0');
+	if (nameEnd == request.SectionName + DAEMON_SECTION_NAME_LENGTH) {
+		return std::shared_ptr<SharedSection>();
+	}
+	std::wstring name(request.SectionName, nameEnd);
+	// Clients keep one section for many requests, so it is mapped once
+	if (connection.Section &&
+		connection.Section->getName() == name &&
+		connection.Section->getSize() == request.SectionSize) {
+		return connection.Section;
+	}
+	connection.Section = SharedSection::Open(name, request.SectionSize);
+	return connection.Section;
+}
+
+BOOL CompressionDaemon::checkRegions(const DaemonRequest & request, UINT64 sectionSize)
+{
+	if (request.InputSize > sectionSize ||
+		request.OutputOffset > sectionSize ||
+		request.OutputCapacity > sectionSize - request.OutputOffset) {
+		return FALSE;
+	}
+	if (request.Operation != DAEMON_COMPRESS) {
+		return TRUE;
+	}
+	// Every row of the pixels must lie in the input
+	UINT64 rowBytes = static_cast<UINT64>(request.Width) * 3;
+	UINT64 stride = request.Stride != 0 ? request.Stride : rowBytes;
+	return request.Width != 0 && request.Height != 0 &&
+		stride >= rowBytes &&
+		rowBytes <= request.InputSize &&
+		request.Height - 1 <= (request.InputSize - rowBytes) / stride;
+}
+
+void CompressionDaemon::enqueue(Job&& job)
+{
+	UINT64 depth = ++QueueDepth;
+	UINT64 peak = PeakQueueDepth.load(std::memory_order_relaxed);
+	while (depth > peak && !PeakQueueDepth.compare_exchange_weak(peak, depth)) {
+	}
+	{
+		std::lock_guard<std::mutex> lock(QueueLock);
+		Queue.push_back(std::move(job));
+	}
+	QueueReady.notify_one();
+}
+
+void CompressionDaemon::dispatch()
+{
+	// Requests wait in the queue rather than in the pool while every worker
+	// is busy, so they run in the order they arrived and later ones pile up
+	// into batches
+	UINT32 workers = Pool.getThreadCount();
+	std::unique_lock<std::mutex> lock(QueueLock);
+	for (;;) {
+		QueueReady.wait(lock, [this, workers]() {
+			return (Stopping && Queue.empty()) || (!Queue.empty() && RunningTasks < workers);
+		});
+		if (Queue.empty()) {
+			break;
+		}
+		// Take the small requests at the front of the queue together, or a
+		// single large one
+		std::shared_ptr<std::vector<Job>> batch = std::make_shared<std::vector<Job>>();
+		while (!Queue.empty() && batch->size() < MaxBatch) {
+			BOOL small = Queue.front().Request.InputSize < SMALL_REQUEST_BYTES;
+			if (!small && !batch->empty()) {
+				break;
+			}
+			batch->push_back(std::move(Queue.front()));
+			Queue.pop_front();
+			if (!small) {
+				break;
+			}
+		}
+		RunningTasks++;
+		lock.unlock();
+		if (batch->size() > 1) {
+			Batches++;
+			BatchedRequests += batch->size();
+		}
+		Pool.submit([this, batch]() {
+			for (Job& job : *batch) {
+				runJob(job);
+			}
+			{
+				std::lock_guard<std::mutex> taskLock(QueueLock);
+				RunningTasks--;
+			}
+			QueueReady.notify_one();
+		});
+		lock.lock();
+	}
+}
+
+void CompressionDaemon::runJob(Job & job)
+{
+	const DaemonRequest& request = job.Request;
+	DaemonResponse response = { DAEMON_MAGIC, IN3_OK, request.Id, 0, 0, 0 };
+	BYTE* data = job.Section->getData();
+	BYTE* output = data + request.OutputOffset;
+	if (request.Operation == DAEMON_COMPRESS) {
+		size_t outputSize = 0;
+		response.Status = in3_encode(
+			Context,
+			data,
+			request.Width,
+			request.Height,
+			static_cast<size_t>(request.Stride != 0 ? request.Stride : request.Width * 3ull),
+			output,
+			static_cast<size_t>(request.OutputCapacity),
+			&outputSize);
+		response.OutputSize = outputSize;
+		response.Width = request.Width;
+		response.Height = request.Height;
+	}
+	else {
+		in3_image_info info;
+		response.Status = in3_get_info(data, static_cast<size_t>(request.InputSize), &info);
+		if (response.Status == IN3_OK) {
+			UINT64 stride = request.Stride != 0 ? request.Stride : info.width * 3ull;
+			response.Status = in3_decode(
+				Context,
+				data,
+				static_cast<size_t>(request.InputSize),
+				output,
+				static_cast<size_t>(stride),
+				static_cast<size_t>(request.OutputCapacity));
+			response.OutputSize = stride * (info.height - 1) + info.width * 3ull;
+			response.Width = info.width;
+			response.Height = info.height;
+		}
+	}
+	if (response.Status == IN3_OK) {
+		Completed[request.Operation]++;
+	}
+	else {
+		Failed++;
+	}
+	QueueDepth--;
+	respond(*job.Client, response, NULL);
+	UINT64 microseconds = std::chrono::duration_cast<std::chrono::microseconds>(
+		Clock::now() - job.Received).count();
+	Latency[request.Operation].record(microseconds);
+}
+
+BOOL CompressionDaemon::respond(
+	Connection & connection,
+	const DaemonResponse & response,
+	const DaemonStatistics * statistics)
+{
+	std::lock_guard<std::mutex> lock(connection.SendLock);
+	return UnixSocket::SendAll(connection.Socket, &response, sizeof(response)) &&
+		(statistics == NULL ||
+			UnixSocket::SendAll(connection.Socket, statistics, sizeof(*statistics)));
+}
+
+DaemonStatistics CompressionDaemon::getStatistics()
+{
+	DaemonStatistics statistics = {};
+	statistics.QueueDepth = QueueDepth;
+	statistics.PeakQueueDepth = PeakQueueDepth;
+	statistics.Batches = Batches;
+	statistics.BatchedRequests = BatchedRequests;
+	statistics.Failed = Failed;
+	for (UINT32 op = 0; op < DAEMON_CODING_OPERATIONS; op++) {
+		statistics.Completed[op] = Completed[op];
+		Latency[op].copyTo(statistics.Latency[op]);
+	}
+	return statistics;
+}
+
+CompressionDaemon::CompressionDaemon(
+	const in3_settings* settings,
+	UINT32 threadCount,
+	UINT32 maxBatch)
+	: Context(NULL),
+	  Pool(threadCount),
+	  MaxBatch(std::max<UINT32>(maxBatch, 1)),
+	  ListenSocket(INVALID_SOCKET),
+	  RunningTasks(0),
+	  Stopping(FALSE),
+	  ShutdownRequested(FALSE),
+	  ActiveReaders(0),
+	  QueueDepth(0),
+	  PeakQueueDepth(0),
+	  Batches(0),
+	  BatchedRequests(0),
+	  Failed(0)
+{
+	for (UINT32 op = 0; op < DAEMON_CODING_OPERATIONS; op++) {
+		Completed[op] = 0;
+	}
+	if (in3_context_create(settings, &Context) != IN3_OK) {
+		Context = NULL;
+	}
+}
+
+CompressionDaemon::~CompressionDaemon()
+{
+	UnixSocket::Close(ListenSocket);
+	in3_context_destroy(Context);
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <winsock2.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DaemonProtocol.h"
+#include "LatencyHistogram.h"
+#include "libin3.h"
+#include "SharedSection.h"
+#include "WorkStealingPool.h"
+
+// Serves compress and decompress requests of local clients
+// Each client connection has a thread reading its requests into one queue.
+// A dispatcher thread hands the queue to a shared worker pool as workers
+// free up, running queued small requests together as one pool task and
+// large requests on their own. Workers code straight between the client's
+// shared section and libin3, whose context is shared by every worker.
+class CompressionDaemon
+{
+public:
+	// Requests with less input than this are batched
+	static const UINT64 SMALL_REQUEST_BYTES = 1 << 16;
+	// Most small requests run by one pool task
+	static const UINT32 DEFAULT_MAX_BATCH = 16;
+private:
+	typedef std::chrono::steady_clock Clock;
+	// Client connection, kept alive by its reader and its requests in flight
+	struct Connection {
+		SOCKET Socket;
+		// Responses of different workers are sent whole, one at a time
+		std::mutex SendLock;
+		// Section the client named last
+		std::shared_ptr<SharedSection> Section;
+		Connection(SOCKET socket);
+		~Connection();
+	};
+	struct Job {
+		std::shared_ptr<Connection> Client;
+		std::shared_ptr<SharedSection> Section;
+		DaemonRequest Request;
+		Clock::time_point Received;
+	};
+	in3_context* Context;
+	WorkStealingPool Pool;
+	UINT32 MaxBatch;
+	SOCKET ListenSocket;
+	std::wstring ListenPath;
+	std::thread Dispatcher;
+	// Requests waiting for the dispatcher
+	std::mutex QueueLock;
+	std::condition_variable QueueReady;
+	std::deque<Job> Queue;
+	// Pool tasks submitted and not yet finished
+	UINT32 RunningTasks;
+	BOOL Stopping;
+	// Set by a shutdown request to end the accept loop
+	std::atomic<BOOL> ShutdownRequested;
+	// Open connections and running reader threads, for shutdown
+	std::mutex ConnectionsLock;
+	std::condition_variable ReadersDone;
+	std::vector<std::weak_ptr<Connection>> Connections;
+	UINT32 ActiveReaders;
+	// Statistics
+	std::atomic<UINT64> QueueDepth;
+	std::atomic<UINT64> PeakQueueDepth;
+	std::atomic<UINT64> Batches;
+	std::atomic<UINT64> BatchedRequests;
+	std::atomic<UINT64> Completed[DAEMON_CODING_OPERATIONS];
+	std::atomic<UINT64> Failed;
+	LatencyHistogram Latency[DAEMON_CODING_OPERATIONS];
+	// Read requests of a connection until it closes
+	void serveConnection(std::shared_ptr<Connection> connection);
+	// Map the section a request names, reusing the connection's last one
+	std::shared_ptr<SharedSection> mapSection(Connection& connection, const DaemonRequest& request);
+	// Check that the input and output regions lie inside the section
+	static BOOL checkRegions(const DaemonRequest& request, UINT64 sectionSize);
+	void enqueue(Job&& job);
+	// Dispatcher thread loop
+	void dispatch();
+	// Code one request and answer it
+	void runJob(Job& job);
+	static BOOL respond(Connection& connection, const DaemonResponse& response,
+		const DaemonStatistics* statistics);
+	DaemonStatistics getStatistics();
+	// Close every connection and wait for the requests already read to run
+	void stop();
+public:
+	// Listen on a socket path
+	BOOL listen(const std::wstring& path);
+	// Accept clients until one sends a shutdown request
+	void run();
+	CompressionDaemon(const in3_settings* settings, UINT32 threadCount, UINT32 maxBatch);
+	CompressionDaemon(const CompressionDaemon&) = delete;
+	CompressionDaemon& operator=(const CompressionDaemon&) = delete;
+	~CompressionDaemon();
+};
@@ -0,0 +1,112 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <cstring>
+#include "DaemonClient.h"
+#include "UnixSocket.h"
+
+BOOL DaemonClient::request(
+	DaemonRequest & request,
+	DaemonResponse & response,
+	DaemonStatistics * statistics)
+{
+	request.Magic = DAEMON_MAGIC;
+	request.Id = NextId++;
+	std::memset(request.SectionName, 0, sizeof(request.SectionName));
+	if (Section) {
+		const std::wstring& name = Section->getName();
+		std::copy(
+			name.begin(),
+			name.begin() + std::min<size_t>(name.size(), DAEMON_SECTION_NAME_LENGTH - 1),
+			request.SectionName);
+		request.SectionSize = Section->getSize();
+	}
+	if (!UnixSocket::SendAll(Socket, &request, sizeof(request)) ||
+		!UnixSocket::ReceiveAll(Socket, &response, sizeof(response)) ||
+		response.Magic != DAEMON_MAGIC ||
+		response.Id != request.Id) {
+		return FALSE;
+	}
+	return statistics == NULL ||
+		UnixSocket::ReceiveAll(Socket, statistics, sizeof(*statistics));
+}
+
+BOOL DaemonClient::connect(const std::wstring & socketPath)
+{
+	UnixSocket::Close(Socket);
+	Socket = UnixSocket::Connect(socketPath);
+	return Socket != INVALID_SOCKET;
+}
+
+BYTE * DaemonClient::reserve(UINT64 size)
+{
+	if (!Section || Section->getSize() < size) {
+		Section = SharedSection::Create(size);
+	}
+	return getSection();
+}
+
+BYTE * DaemonClient::getSection() const
+{
+	return Section ? Section->getData() : NULL;
+}
+
+BOOL DaemonClient::compress(
+	UINT32 width,
+	UINT32 height,
+	UINT64 stride,
+	UINT64 inputSize,
+	UINT64 outputOffset,
+	UINT64 outputCapacity,
+	DaemonResponse & response)
+{
+	DaemonRequest message = {};
+	message.Operation = DAEMON_COMPRESS;
+	message.InputSize = inputSize;
+	message.OutputOffset = outputOffset;
+	message.OutputCapacity = outputCapacity;
+	message.Width = width;
+	message.Height = height;
+	message.Stride = stride;
+	return request(message, response, NULL);
+}
+
+BOOL DaemonClient::decompress(
+	UINT64 inputSize,
+	UINT64 outputOffset,
+	UINT64 outputCapacity,
+	DaemonResponse & response)
+{
+	DaemonRequest message = {};
+	message.Operation = DAEMON_DECOMPRESS;
+	message.InputSize = inputSize;
+	message.OutputOffset = outputOffset;
+	message.OutputCapacity = outputCapacity;
+	return request(message, response, NULL);
+}
+
+BOOL DaemonClient::getStatistics(DaemonStatistics & statistics)
+{
+	DaemonRequest message = {};
+	message.Operation = DAEMON_STATISTICS;
+	DaemonResponse response;
+	return request(message, response, &statistics);
+}
+
+BOOL DaemonClient::shutdown()
+{
+	DaemonRequest message = {};
+	message.Operation = DAEMON_SHUTDOWN;
+	DaemonResponse response;
+	return request(message, response, NULL);
+}
+
+DaemonClient::DaemonClient()
+	: Socket(INVALID_SOCKET),
+	  NextId(0)
+{
+}
+
+DaemonClient::~DaemonClient()
+{
+	UnixSocket::Close(Socket);
+}
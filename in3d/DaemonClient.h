@@ -0,0 +1,49 @@
+#pragma once
+#include <winsock2.h>
+#include <memory>
+#include <string>
+#include "DaemonProtocol.h"
+#include "SharedSection.h"
+
+// Connection of a client to in3d with the shared section it codes in
+// Inputs are written at the start of the section and outputs are read from
+// it after a request returns. One request is in flight at a time.
+class DaemonClient
+{
+private:
+	SOCKET Socket;
+	std::unique_ptr<SharedSection> Section;
+	UINT64 NextId;
+	// Send a request naming the section and wait for its response
+	BOOL request(DaemonRequest& request, DaemonResponse& response,
+		DaemonStatistics* statistics);
+public:
+	BOOL connect(const std::wstring& socketPath);
+	// Make the section at least a size, replacing it when it is smaller
+	// Returns the start of the section, or NULL if it could not be created
+	BYTE* reserve(UINT64 size);
+	BYTE* getSection() const;
+	// Compress pixels at the start of the section into the section at an
+	// offset, the response giving the compressed size
+	BOOL compress(
+		UINT32 width,
+		UINT32 height,
+		UINT64 stride,
+		UINT64 inputSize,
+		UINT64 outputOffset,
+		UINT64 outputCapacity,
+		DaemonResponse& response);
+	// Decompress an image at the start of the section into the section at
+	// an offset, with rows packed back-to-back
+	BOOL decompress(
+		UINT64 inputSize,
+		UINT64 outputOffset,
+		UINT64 outputCapacity,
+		DaemonResponse& response);
+	BOOL getStatistics(DaemonStatistics& statistics);
+	BOOL shutdown();
+	DaemonClient();
+	DaemonClient(const DaemonClient&) = delete;
+	DaemonClient& operator=(const DaemonClient&) = delete;
+	~DaemonClient();
+};
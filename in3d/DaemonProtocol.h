@@ -0,0 +1,76 @@
+#pragma once
+#include "libin3.h"
+
+// Messages exchanged by in3d and its clients over a Unix domain socket
+// Pixels and IN3 data never pass through the socket. The client creates a
+// named shared memory section, writes the input at its start and names the
+// section in each request; the daemon maps the section once per client and
+// writes the output into it at the offset given by the request.
+
+// First field of every message
+static const UINT32 DAEMON_MAGIC = 0x44334E49;
+// Characters of a section name, including the terminating null
+static const UINT32 DAEMON_SECTION_NAME_LENGTH = 64;
+// Latency histogram buckets, bucket i counting [2^i, 2^(i+1)) microseconds
+static const UINT32 DAEMON_LATENCY_BUCKETS = 32;
+
+enum DaemonOperation : UINT32 {
+	// RGB pixels in the section to an IN3 image in the section
+	DAEMON_COMPRESS = 0,
+	// IN3 image in the section to RGB pixels in the section
+	DAEMON_DECOMPRESS = 1,
+	// Answered with DaemonStatistics after the response
+	DAEMON_STATISTICS = 2,
+	// Close every connection, finish the requests already read and exit
+	DAEMON_SHUTDOWN = 3
+};
+
+// Operations whose latency is measured
+static const UINT32 DAEMON_CODING_OPERATIONS = 2;
+
+struct DaemonRequest {
+	UINT32 Magic;
+	UINT32 Operation;
+	// Returned in the response, so a client may have several requests in
+	// flight on one connection
+	UINT64 Id;
+	WCHAR SectionName[DAEMON_SECTION_NAME_LENGTH];
+	UINT64 SectionSize;
+	// Input at the start of the section
+	UINT64 InputSize;
+	// Region of the section the output is written to
+	UINT64 OutputOffset;
+	UINT64 OutputCapacity;
+	// Dimensions of the pixels to compress
+	UINT32 Width;
+	UINT32 Height;
+	// Bytes between rows of the input pixels when compressing, or of the
+	// output pixels when decompressing; zero for rows packed back-to-back
+	UINT64 Stride;
+};
+
+struct DaemonResponse {
+	UINT32 Magic;
+	// An in3_status
+	UINT32 Status;
+	UINT64 Id;
+	// Bytes written at the output offset, or needed when the output region
+	// was too small
+	UINT64 OutputSize;
+	// Dimensions of the decompressed image
+	UINT32 Width;
+	UINT32 Height;
+};
+
+struct DaemonStatistics {
+	// Requests received and not yet answered
+	UINT64 QueueDepth;
+	UINT64 PeakQueueDepth;
+	// Pool tasks that ran more than one small request, and their requests
+	UINT64 Batches;
+	UINT64 BatchedRequests;
+	UINT64 Completed[DAEMON_CODING_OPERATIONS];
+	UINT64 Failed;
+	// Time from receiving a request to sending its response
+	UINT64 Latency[DAEMON_CODING_OPERATIONS][DAEMON_LATENCY_BUCKETS];
+};
@@ -0,0 +1,52 @@
+#include "stdafx.h"
+#include "LatencyHistogram.h"
+
+void LatencyHistogram::record(UINT64 microseconds)
+{
+	// Bucket of the highest set bit, with zero counted as one microsecond
+	UINT32 bucket = 0;
+	while (bucket + 1 < DAEMON_LATENCY_BUCKETS && (microseconds >> (bucket + 1)) != 0) {
+		bucket++;
+	}
+	Buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::copyTo(UINT64 * buckets) const
+{
+	for (UINT32 i = 0; i < DAEMON_LATENCY_BUCKETS; i++) {
+		buckets[i] = Buckets[i].load(std::memory_order_relaxed);
+	}
+}
+
+UINT64 LatencyHistogram::Percentile(const UINT64 * buckets, DOUBLE fraction)
+{
+	UINT64 total = Count(buckets);
+	if (total == 0) {
+		return 0;
+	}
+	UINT64 rank = static_cast<UINT64>(fraction * static_cast<DOUBLE>(total));
+	UINT64 seen = 0;
+	for (UINT32 i = 0; i < DAEMON_LATENCY_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen > rank) {
+			return 2ull << i;
+		}
+	}
+	return 2ull << (DAEMON_LATENCY_BUCKETS - 1);
+}
+
+UINT64 LatencyHistogram::Count(const UINT64 * buckets)
+{
+	UINT64 total = 0;
+	for (UINT32 i = 0; i < DAEMON_LATENCY_BUCKETS; i++) {
+		total += buckets[i];
+	}
+	return total;
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+	for (UINT32 i = 0; i < DAEMON_LATENCY_BUCKETS; i++) {
+		Buckets[i].store(0, std::memory_order_relaxed);
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <atomic>
+#include "DaemonProtocol.h"
+
+// Counts of latencies in power of two buckets of microseconds
+// Recording is a single relaxed increment, so any thread may record
+class LatencyHistogram
+{
+private:
+	std::atomic<UINT64> Buckets[DAEMON_LATENCY_BUCKETS];
+public:
+	void record(UINT64 microseconds);
+	// Copy the counts out, DAEMON_LATENCY_BUCKETS of them
+	void copyTo(UINT64* buckets) const;
+	// Upper bound in microseconds of the bucket holding a fraction of the
+	// counts, such as 0.99 for the 99th percentile
+	static UINT64 Percentile(const UINT64* buckets, DOUBLE fraction);
+	static UINT64 Count(const UINT64* buckets);
+	LatencyHistogram();
+};
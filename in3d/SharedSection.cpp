@@ -0,0 +1,86 @@
+#include "stdafx.h"
+#include <atomic>
+#include <string>
+#include "SharedSection.h"
+
+SharedSection::SharedSection()
+	: Mapping(NULL),
+	  View(NULL),
+	  Size(0)
+{
+}
+
+std::unique_ptr<SharedSection> SharedSection::Create(UINT64 size)
+{
+	static std::atomic<UINT32> sectionCount(0);
+	std::unique_ptr<SharedSection> section(new SharedSection());
+	section->Name = L"Local\\in3d-" + std::to_wstring(GetCurrentProcessId()) +
+		L"-" + std::to_wstring(sectionCount++);
+	section->Mapping = CreateFileMappingW(
+		INVALID_HANDLE_VALUE,
+		NULL,
+		PAGE_READWRITE,
+		static_cast<DWORD>(size >> 32),
+		static_cast<DWORD>(size),
+		section->Name.c_str());
+	if (section->Mapping == NULL) {
+		return std::unique_ptr<SharedSection>();
+	}
+	section->View = static_cast<BYTE*>(MapViewOfFile(
+		section->Mapping,
+		FILE_MAP_ALL_ACCESS,
+		0,
+		0,
+		static_cast<SIZE_T>(size)));
+	if (section->View == NULL) {
+		return std::unique_ptr<SharedSection>();
+	}
+	section->Size = size;
+	return section;
+}
+
+std::unique_ptr<SharedSection> SharedSection::Open(const std::wstring& name, UINT64 size)
+{
+	std::unique_ptr<SharedSection> section(new SharedSection());
+	section->Name = name;
+	section->Mapping = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+	if (section->Mapping == NULL) {
+		return std::unique_ptr<SharedSection>();
+	}
+	section->View = static_cast<BYTE*>(MapViewOfFile(
+		section->Mapping,
+		FILE_MAP_ALL_ACCESS,
+		0,
+		0,
+		static_cast<SIZE_T>(size)));
+	if (section->View == NULL) {
+		return std::unique_ptr<SharedSection>();
+	}
+	section->Size = size;
+	return section;
+}
+
+BYTE* SharedSection::getData() const
+{
+	return View;
+}
+
+UINT64 SharedSection::getSize() const
+{
+	return Size;
+}
+
+const std::wstring& SharedSection::getName() const
+{
+	return Name;
+}
+
+SharedSection::~SharedSection()
+{
+	if (View != NULL) {
+		UnmapViewOfFile(View);
+	}
+	if (Mapping != NULL) {
+		CloseHandle(Mapping);
+	}
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <memory>
+#include <string>
+
+// Named shared memory section mapped into the calling process
+class SharedSection
+{
+private:
+	HANDLE Mapping;
+	BYTE* View;
+	UINT64 Size;
+	std::wstring Name;
+	SharedSection();
+public:
+	// Create a new section of a size with a name unique to this process
+	static std::unique_ptr<SharedSection> Create(UINT64 size);
+	// Map a section another process created, of at least a size
+	static std::unique_ptr<SharedSection> Open(const std::wstring& name, UINT64 size);
+	BYTE* getData() const;
+	UINT64 getSize() const;
+	const std::wstring& getName() const;
+	SharedSection(const SharedSection&) = delete;
+	SharedSection& operator=(const SharedSection&) = delete;
+	~SharedSection();
+};
@@ -0,0 +1,112 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <afunix.h>
+#include <cstring>
+#include <string>
+#include "UnixSocket.h"
+
+// Fill an address with the UTF-8 form of a path, FALSE if it is too long
+static BOOL makeAddress(const std::wstring& path, sockaddr_un& address)
+{
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	int size = WideCharToMultiByte(CP_UTF8, 0, path.c_str(), -1, NULL, 0, NULL, NULL);
+	if (size <= 0 || static_cast<size_t>(size) > sizeof(address.sun_path)) {
+		return FALSE;
+	}
+	WideCharToMultiByte(CP_UTF8, 0, path.c_str(), -1, address.sun_path, size, NULL, NULL);
+	return TRUE;
+}
+
+BOOL UnixSocket::Startup()
+{
+	WSADATA data;
+	return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+}
+
+void UnixSocket::Cleanup()
+{
+	WSACleanup();
+}
+
+std::wstring UnixSocket::DefaultPath()
+{
+	WCHAR directory[MAX_PATH + 1];
+	DWORD length = GetTempPathW(MAX_PATH + 1, directory);
+	if (length == 0 || length > MAX_PATH) {
+		return L"in3d.sock";
+	}
+	return std::wstring(directory, length) + L"in3d.sock";
+}
+
+SOCKET UnixSocket::Listen(const std::wstring& path)
+{
+	sockaddr_un address;
+	if (!makeAddress(path, address)) {
+		return INVALID_SOCKET;
+	}
+	SOCKET listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenSocket == INVALID_SOCKET) {
+		return INVALID_SOCKET;
+	}
+	// A daemon that did not exit cleanly leaves its socket file behind
+	DeleteFileW(path.c_str());
+	if (bind(listenSocket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+		listen(listenSocket, SOMAXCONN) != 0) {
+		closesocket(listenSocket);
+		return INVALID_SOCKET;
+	}
+	return listenSocket;
+}
+
+SOCKET UnixSocket::Connect(const std::wstring& path)
+{
+	sockaddr_un address;
+	if (!makeAddress(path, address)) {
+		return INVALID_SOCKET;
+	}
+	SOCKET connectSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (connectSocket == INVALID_SOCKET) {
+		return INVALID_SOCKET;
+	}
+	if (connect(connectSocket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+		closesocket(connectSocket);
+		return INVALID_SOCKET;
+	}
+	return connectSocket;
+}
+
+BOOL UnixSocket::SendAll(SOCKET socket, const void* data, size_t size)
+{
+	const char* bytes = static_cast<const char*>(data);
+	while (size > 0) {
+		int sent = send(socket, bytes, static_cast<int>(size), 0);
+		if (sent <= 0) {
+			return FALSE;
+		}
+		bytes += sent;
+		size -= sent;
+	}
+	return TRUE;
+}
+
+BOOL UnixSocket::ReceiveAll(SOCKET socket, void* data, size_t size)
+{
+	char* bytes = static_cast<char*>(data);
+	while (size > 0) {
+		int received = recv(socket, bytes, static_cast<int>(size), 0);
+		if (received <= 0) {
+			return FALSE;
+		}
+		bytes += received;
+		size -= received;
+	}
+	return TRUE;
+}
+
+void UnixSocket::Close(SOCKET socket)
+{
+	if (socket != INVALID_SOCKET) {
+		closesocket(socket);
+	}
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <winsock2.h>
+#include <string>
+
+// Stream sockets on a Unix domain socket path
+// Windows supports AF_UNIX stream sockets from Windows 10 version 1803.
+class UnixSocket
+{
+public:
+	// Initialize Winsock, once per process before any other call
+	static BOOL Startup();
+	static void Cleanup();
+	// Socket path used when none is given, in the temporary directory
+	static std::wstring DefaultPath();
+	// Bind and listen on a path, replacing a socket file left behind
+	static SOCKET Listen(const std::wstring& path);
+	static SOCKET Connect(const std::wstring& path);
+	// Send or receive exactly size bytes, FALSE if the peer went away
+	static BOOL SendAll(SOCKET socket, const void* data, size_t size);
+	static BOOL ReceiveAll(SOCKET socket, void* data, size_t size);
+	static void Close(SOCKET socket);
+};
@@ -0,0 +1,69 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include "CompressionDaemon.h"
+#include "libin3.h"
+#include "UnixSocket.h"
+
+// Local compression daemon
+//   /socket <path>   Socket to listen on (default: in3d.sock in %TEMP%)
+//   /threads <count> Worker threads (default: all)
+//   /batch <count>   Most small requests run together by one worker
+//   /ycocg           Use the lossless YCoCg-R color transform
+//   /quant <step>    Quantize the YUV samples of every plane by a step
+//   /bpp <bits>      Pick quantization steps for a target bits per pixel
+int wmain(int argc, wchar_t* argv[])
+{
+	std::wstring socketPath = UnixSocket::DefaultPath();
+	UINT32 threadCount = 0;
+	UINT32 maxBatch = CompressionDaemon::DEFAULT_MAX_BATCH;
+	in3_settings settings;
+	in3_settings_default(&settings);
+	for (int i = 1; i < argc; i++) {
+		std::wstring argument = argv[i];
+		BOOL hasValue = i + 1 < argc;
+		if (argument == L"/socket" && hasValue) {
+			socketPath = argv[++i];
+		}
+		else if (argument == L"/threads" && hasValue) {
+			threadCount = static_cast<UINT32>(std::stoul(argv[++i]));
+		}
+		else if (argument == L"/batch" && hasValue) {
+			maxBatch = static_cast<UINT32>(std::stoul(argv[++i]));
+		}
+		else if (argument == L"/ycocg") {
+			settings.color_transform = IN3_COLOR_TRANSFORM_YCOCG_R;
+		}
+		else if (argument == L"/quant" && hasValue) {
+			uint8_t step = static_cast<uint8_t>(
+				std::max<unsigned long>(std::min<unsigned long>(std::stoul(argv[++i]), 64), 1));
+			std::fill(settings.quantization_steps, settings.quantization_steps + 3, step);
+		}
+		else if (argument == L"/bpp" && hasValue) {
+			settings.target_bits_per_pixel = std::stod(argv[++i]);
+		}
+		else {
+			std::wcerr << L"Unknown argument: " << argument << std::endl;
+			return 1;
+		}
+	}
+	if (!UnixSocket::Startup()) {
+		std::wcerr << L"Winsock could not be initialized" << std::endl;
+		return 1;
+	}
+	int exitCode = 0;
+	{
+		CompressionDaemon daemon(&settings, threadCount, maxBatch);
+		if (daemon.listen(socketPath)) {
+			std::wcout << L"in3d listening on " << socketPath << std::endl;
+			daemon.run();
+		}
+		else {
+			std::wcerr << L"Cannot listen on " << socketPath << std::endl;
+			exitCode = 1;
+		}
+	}
+	UnixSocket::Cleanup();
+	return exitCode;
+}
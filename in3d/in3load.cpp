@@ -0,0 +1,220 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DaemonClient.h"
+#include "LatencyHistogram.h"
+#include "libin3.h"
+#include "UnixSocket.h"
+
+// Load generator for in3d
+// Every connection checks one compress and decompress round trip, then
+// sends its requests back-to-back and measures their latency. The default
+// color transform is lossy, so the round trip reports the largest channel
+// error instead of requiring identical pixels.
+//   /socket <path>       Socket of the daemon (default: in3d.sock in %TEMP%)
+//   /connections <count> Concurrent client connections (default: 4)
+//   /requests <count>    Requests sent by each connection (default: 1000)
+//   /size <w> <h>        Dimensions of the test image (default: 64 64)
+//   /decompress          Send decompress instead of compress requests
+//   /shutdown            Ask the daemon to exit afterwards
+
+namespace {
+	struct LoadResult {
+		std::atomic<UINT64> Requests;
+		std::atomic<UINT64> Errors;
+		std::atomic<UINT64> RoundTripFailures;
+		std::atomic<UINT32> RoundTripError;
+		LatencyHistogram Latency;
+		LoadResult()
+			: Requests(0),
+			  Errors(0),
+			  RoundTripFailures(0),
+			  RoundTripError(0)
+		{
+		}
+	};
+
+	void fillImage(std::vector<BYTE>& pixels, UINT32 width, UINT32 height, UINT32 seed)
+	{
+		for (UINT32 y = 0; y < height; y++) {
+			for (UINT32 x = 0; x < width; x++) {
+				BYTE* pixel = &pixels[(static_cast<size_t>(y) * width + x) * 3];
+				pixel[0] = static_cast<BYTE>(x * 3 + seed);
+				pixel[1] = static_cast<BYTE>(y * 5 + (x ^ y));
+				pixel[2] = static_cast<BYTE>(((x >> 3) + (y >> 3)) * 17 + seed * 7);
+			}
+		}
+	}
+
+	void runConnection(
+		const std::wstring& socketPath,
+		UINT32 width,
+		UINT32 height,
+		UINT32 requests,
+		BOOL decompress,
+		UINT32 seed,
+		LoadResult& result)
+	{
+		typedef std::chrono::steady_clock Clock;
+		DaemonClient client;
+		UINT64 pixelBytes = static_cast<UINT64>(width) * height * 3;
+		UINT64 region = std::max<UINT64>(pixelBytes, in3_encode_bound(width, height));
+		if (!client.connect(socketPath) || client.reserve(region * 2) == NULL) {
+			result.Errors += requests;
+			return;
+		}
+		std::vector<BYTE> pixels(static_cast<size_t>(pixelBytes));
+		fillImage(pixels, width, height, seed);
+		BYTE* section = client.getSection();
+		// Round trip: pixels at the start, compressed image written after
+		// them, moved to the start and decompressed after it again
+		DaemonResponse response;
+		std::memcpy(section, pixels.data(), pixels.size());
+		if (!client.compress(width, height, 0, pixelBytes, region, region, response) ||
+			response.Status != IN3_OK) {
+			result.Errors += requests;
+			return;
+		}
+		UINT64 compressedSize = response.OutputSize;
+		std::memmove(section, section + region, static_cast<size_t>(compressedSize));
+		if (!client.decompress(compressedSize, region, region, response) ||
+			response.Status != IN3_OK ||
+			response.Width != width ||
+			response.Height != height ||
+			response.OutputSize != pixelBytes) {
+			result.RoundTripFailures++;
+		}
+		else {
+			UINT32 error = 0;
+			for (size_t i = 0; i < pixels.size(); i++) {
+				error = std::max<UINT32>(error, std::abs(section[region + i] - pixels[i]));
+			}
+			UINT32 largest = result.RoundTripError;
+			while (error > largest && !result.RoundTripError.compare_exchange_weak(largest, error)) {
+			}
+		}
+		// The compressed image stays at the start for decompress requests
+		if (!decompress) {
+			std::memcpy(section, pixels.data(), pixels.size());
+		}
+		for (UINT32 i = 0; i < requests; i++) {
+			Clock::time_point start = Clock::now();
+			BOOL sent = decompress ?
+				client.decompress(compressedSize, region, region, response) :
+				client.compress(width, height, 0, pixelBytes, region, region, response);
+			UINT64 microseconds = std::chrono::duration_cast<std::chrono::microseconds>(
+				Clock::now() - start).count();
+			if (!sent || response.Status != IN3_OK) {
+				result.Errors++;
+				if (!sent) {
+					return;
+				}
+				continue;
+			}
+			result.Requests++;
+			result.Latency.record(microseconds);
+		}
+	}
+
+	void printLatency(const std::wstring& label, const UINT64* buckets)
+	{
+		std::wcout << label << L" latency (us, bucket upper bounds): p50 "
+			<< LatencyHistogram::Percentile(buckets, 0.50) << L", p90 "
+			<< LatencyHistogram::Percentile(buckets, 0.90) << L", p99 "
+			<< LatencyHistogram::Percentile(buckets, 0.99) << L" over "
+			<< LatencyHistogram::Count(buckets) << L" requests" << std::endl;
+	}
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+	std::wstring socketPath = UnixSocket::DefaultPath();
+	UINT32 connections = 4;
+	UINT32 requests = 1000;
+	UINT32 width = 64;
+	UINT32 height = 64;
+	BOOL decompress = FALSE;
+	BOOL shutdownDaemon = FALSE;
+	for (int i = 1; i < argc; i++) {
+		std::wstring argument = argv[i];
+		BOOL hasValue = i + 1 < argc;
+		if (argument == L"/socket" && hasValue) {
+			socketPath = argv[++i];
+		}
+		else if (argument == L"/connections" && hasValue) {
+			connections = static_cast<UINT32>(std::stoul(argv[++i]));
+		}
+		else if (argument == L"/requests" && hasValue) {
+			requests = static_cast<UINT32>(std::stoul(argv[++i]));
+		}
+		else if (argument == L"/size" && i + 2 < argc) {
+			width = static_cast<UINT32>(std::stoul(argv[++i]));
+			height = static_cast<UINT32>(std::stoul(argv[++i]));
+		}
+		else if (argument == L"/decompress") {
+			decompress = TRUE;
+		}
+		else if (argument == L"/shutdown") {
+			shutdownDaemon = TRUE;
+		}
+		else {
+			std::wcerr << L"Unknown argument: " << argument << std::endl;
+			return 1;
+		}
+	}
+	if (width == 0 || height == 0 || !UnixSocket::Startup()) {
+		return 1;
+	}
+	LoadResult result;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (UINT32 c = 0; c < connections; c++) {
+		threads.emplace_back(
+			runConnection,
+			std::cref(socketPath),
+			width,
+			height,
+			requests,
+			decompress,
+			c,
+			std::ref(result));
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	DOUBLE seconds = std::chrono::duration<DOUBLE>(
+		std::chrono::steady_clock::now() - start).count();
+	UINT64 completed = result.Requests;
+	std::wcout << completed << L" " << (decompress ? L"decompress" : L"compress")
+		<< L" requests of " << width << L"x" << height << L" in " << seconds << L" s, "
+		<< static_cast<DOUBLE>(completed) / seconds << L" requests/s" << std::endl;
+	std::wcout << result.Errors << L" errors, " << result.RoundTripFailures
+		<< L" round trip failures, largest round trip channel error "
+		<< result.RoundTripError << std::endl;
+	UINT64 buckets[DAEMON_LATENCY_BUCKETS];
+	result.Latency.copyTo(buckets);
+	printLatency(L"Client", buckets);
+	DaemonClient client;
+	DaemonStatistics statistics;
+	if (client.connect(socketPath) && client.getStatistics(statistics)) {
+		std::wcout << L"Daemon queue depth " << statistics.QueueDepth << L", peak "
+			<< statistics.PeakQueueDepth << L"; " << statistics.Batches << L" batches of "
+			<< (statistics.Batches != 0 ?
+				static_cast<DOUBLE>(statistics.BatchedRequests) / statistics.Batches : 0.0)
+			<< L" requests on average; " << statistics.Failed << L" failed" << std::endl;
+		printLatency(L"Daemon compress", statistics.Latency[DAEMON_COMPRESS]);
+		printLatency(L"Daemon decompress", statistics.Latency[DAEMON_DECOMPRESS]);
+		if (shutdownDaemon) {
+			client.shutdown();
+		}
+	}
+	UnixSocket::Cleanup();
+	return result.Errors == 0 && result.RoundTripFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,205 @@
+#include "stdafx.h"
+#include <algorithm>
+#include "AsyncFileIO.h"
+#include "IN3File.h"
+#include "MemoryAccounting.h"
+#include "Trace.h"
+
+BOOL AsyncFileIO::ReadWholeFile(const std::wstring& fileName, std::vector<BYTE>& data)
+{
+	HANDLE fileHandle = CreateFileW(
+		fileName.c_str(),
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+	LARGE_INTEGER fileSize;
+	BOOL success = GetFileSizeEx(fileHandle, &fileSize);
+	if (success) {
+		data.resize(static_cast<size_t>(fileSize.QuadPart));
+		success = IN3File::ReadChunked(fileHandle, data.data(), data.size());
+	}
+	CloseHandle(fileHandle);
+	return success;
+}
+
+BOOL AsyncFileIO::WriteWholeFile(const std::wstring& fileName, const std::vector<BYTE>& data)
+{
+	HANDLE fileHandle = CreateFileW(
+		fileName.c_str(),
+		GENERIC_WRITE,
+		0,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+	BOOL success = IN3File::WriteChunked(fileHandle, data.data(), data.size());
+	CloseHandle(fileHandle);
+	return success;
+}
+
+void AsyncFileIO::readLoop()
+{
+	IN3_TRACE_THREAD("Reader", 0);
+	// Buffers read ahead are counted against the prefetch stage
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_PREFETCH);
+	for (size_t i = 0; i < ReadNames.size(); i++) {
+		{
+			// Stay at most the queue depth ahead of the caller
+			std::unique_lock<std::mutex> lock(Lock);
+			ReadSpace.wait(lock, [this]() {
+				return Stopping || ReadsCancelled || CompletedReads.size() < QueueDepth;
+			});
+			if (Stopping || ReadsCancelled) {
+				break;
+			}
+		}
+		ReadResult result;
+		result.FileName = ReadNames[i];
+		{
+			IN3_TRACE_SCOPE("Read file");
+			result.Success = ReadWholeFile(result.FileName, result.Data);
+		}
+		{
+			std::lock_guard<std::mutex> lock(Lock);
+			CompletedReads.push_back(std::move(result));
+		}
+		ReadReady.notify_one();
+	}
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		ReadingDone = TRUE;
+	}
+	ReadReady.notify_all();
+}
+
+void AsyncFileIO::writeLoop()
+{
+	IN3_TRACE_THREAD("Writer", 0);
+	std::unique_lock<std::mutex> lock(Lock);
+	while (TRUE) {
+		WriteReady.wait(lock, [this]() {
+			return Stopping || !PendingWrites.empty();
+		});
+		if (PendingWrites.empty()) {
+			break;
+		}
+		WriteRequest request = std::move(PendingWrites.front());
+		PendingWrites.pop_front();
+		WritesInProgress += 1;
+		lock.unlock();
+		BOOL success;
+		{
+			IN3_TRACE_SCOPE("Write file");
+			success = WriteWholeFile(request.FileName, request.Data);
+		}
+		// Free the buffer before the callback releases its memory budget
+		request.Data = std::vector<BYTE>();
+		if (request.Callback) {
+			request.Callback(success);
+		}
+		lock.lock();
+		WritesInProgress -= 1;
+		WriteSpace.notify_all();
+	}
+}
+
+void AsyncFileIO::prefetch(const std::vector<std::wstring>& fileNames)
+{
+	// A reader waiting for the caller to take its files would never wake,
+	// so it is cancelled before it is joined
+	if (ReadThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(Lock);
+			ReadsCancelled = TRUE;
+		}
+		ReadSpace.notify_all();
+		ReadThread.join();
+	}
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		ReadNames = fileNames;
+		CompletedReads.clear();
+		ReadingDone = FALSE;
+		ReadsCancelled = FALSE;
+	}
+	ReadThread = std::thread(&AsyncFileIO::readLoop, this);
+}
+
+BOOL AsyncFileIO::nextRead(ReadResult& result)
+{
+	std::unique_lock<std::mutex> lock(Lock);
+	ReadReady.wait(lock, [this]() {
+		return ReadingDone || !CompletedReads.empty();
+	});
+	if (CompletedReads.empty()) {
+		return FALSE;
+	}
+	result = std::move(CompletedReads.front());
+	CompletedReads.pop_front();
+	lock.unlock();
+	ReadSpace.notify_one();
+	return TRUE;
+}
+
+void AsyncFileIO::write(
+	const std::wstring& fileName,
+	std::vector<BYTE>&& data,
+	WriteCallback callback)
+{
+	{
+		std::unique_lock<std::mutex> lock(Lock);
+		WriteSpace.wait(lock, [this]() {
+			return PendingWrites.size() < QueueDepth;
+		});
+		WriteRequest request;
+		request.FileName = fileName;
+		request.Data = std::move(data);
+		request.Callback = callback;
+		PendingWrites.push_back(std::move(request));
+	}
+	WriteReady.notify_one();
+}
+
+void AsyncFileIO::drain()
+{
+	std::unique_lock<std::mutex> lock(Lock);
+	WriteSpace.wait(lock, [this]() {
+		return PendingWrites.empty() && WritesInProgress == 0;
+	});
+}
+
+AsyncFileIO::AsyncFileIO(UINT32 queueDepth)
+	: QueueDepth(std::max<UINT32>(queueDepth, 1)),
+	  ReadingDone(TRUE),
+	  ReadsCancelled(FALSE),
+	  WritesInProgress(0),
+	  Stopping(FALSE)
+{
+	WriteThread = std::thread(&AsyncFileIO::writeLoop, this);
+}
+
+AsyncFileIO::~AsyncFileIO()
+{
+	// Queued writes are finished, reads not yet started are abandoned
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Stopping = TRUE;
+	}
+	ReadSpace.notify_all();
+	WriteReady.notify_all();
+	if (ReadThread.joinable()) {
+		ReadThread.join();
+	}
+	if (WriteThread.joinable()) {
+		WriteThread.join();
+	}
+}
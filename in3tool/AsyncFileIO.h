@@ -0,0 +1,73 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "commontypes.h"
+
+// Overlaps file reads and writes with compression
+// A read thread prefetches whole input files ahead of the caller and a
+// write thread drains finished outputs behind it. Both queues are bounded
+// by the queue depth, so the reader waits when the caller falls behind and
+// the caller waits when the disk falls behind.
+class AsyncFileIO
+{
+public:
+	// Files read ahead of the caller and writes queued behind it
+	static const UINT32 DEFAULT_QUEUE_DEPTH = 4;
+	// Contents of one prefetched file
+	struct ReadResult {
+		std::wstring FileName;
+		std::vector<BYTE> Data;
+		BOOL Success = FALSE;
+	};
+	// Called on the write thread once a file has been written
+	typedef std::function<void(BOOL success)> WriteCallback;
+private:
+	struct WriteRequest {
+		std::wstring FileName;
+		std::vector<BYTE> Data;
+		WriteCallback Callback;
+	};
+	UINT32 QueueDepth;
+	std::mutex Lock;
+	// Prefetch state
+	std::thread ReadThread;
+	std::vector<std::wstring> ReadNames;
+	std::deque<ReadResult> CompletedReads;
+	BOOL ReadingDone;
+	// Set to stop the read thread of a prefetch that is being replaced
+	BOOL ReadsCancelled;
+	std::condition_variable ReadReady;
+	std::condition_variable ReadSpace;
+	// Drain state
+	std::thread WriteThread;
+	std::deque<WriteRequest> PendingWrites;
+	UINT32 WritesInProgress;
+	BOOL Stopping;
+	std::condition_variable WriteReady;
+	std::condition_variable WriteSpace;
+	// Thread bodies
+	void readLoop();
+	void writeLoop();
+public:
+	// Synchronous whole-file I/O used by the threads
+	static BOOL ReadWholeFile(const std::wstring& fileName, std::vector<BYTE>& data);
+	static BOOL WriteWholeFile(const std::wstring& fileName, const std::vector<BYTE>& data);
+	// Start reading files in order, replacing any earlier prefetch list
+	// The earlier list stops after the file being read and files read but
+	// not yet taken are dropped
+	void prefetch(const std::vector<std::wstring>& fileNames);
+	// Take the next file in prefetch order, waiting for it to be read
+	// Returns FALSE once every prefetched file has been taken
+	BOOL nextRead(ReadResult& result);
+	// Queue a file to be written, waiting while the queue is full
+	void write(const std::wstring& fileName, std::vector<BYTE>&& data, WriteCallback callback);
+	// Wait for every queued write to finish
+	void drain();
+	AsyncFileIO(UINT32 queueDepth = DEFAULT_QUEUE_DEPTH);
+	~AsyncFileIO();
+};
@@ -0,0 +1,210 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include "BatchCompressor.h"
+#include "IN3File.h"
+#include "Trace.h"
+
+const UINT64 BatchCompressor::DEFAULT_MEMORY_BUDGET = 1ull << 30;
+
+DOUBLE BatchCompressor::Statistics::MegabytesPerSecond() const
+{
+	if (Seconds <= 0.0) {
+		return 0.0;
+	}
+	return BytesRead / (1024.0 * 1024.0) / Seconds;
+}
+
+UINT64 BatchCompressor::estimateMemory(UINT64 fileSize)
+{
+	// A 24-bit bitmap holds about 3 bytes per pixel
+	// The bitmap and the three 8-bit planes take 3 bytes per pixel each
+	// Coded bits are held in the encoder, the pair result and the file copy,
+	// and can reach 8 bits per sample, so about 9 bytes per pixel
+	static const UINT64 BYTES_PER_FILE_BYTE = (3 + 3 + 9) / 3;
+	return fileSize * BYTES_PER_FILE_BYTE;
+}
+
+std::vector<std::wstring> BatchCompressor::findBitmapFiles(const std::wstring& directory)
+{
+	std::vector<std::wstring> fileNames;
+	std::wstring prefix = directory;
+	if (!prefix.empty() && prefix.back() != L'\\' && prefix.back() != L'/') {
+		prefix += L'\\';
+	}
+	WIN32_FIND_DATAW findData;
+	HANDLE findHandle = FindFirstFileW((prefix + L"*.bmp").c_str(), &findData);
+	if (findHandle == INVALID_HANDLE_VALUE) {
+		return fileNames;
+	}
+	do {
+		if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			fileNames.push_back(prefix + findData.cFileName);
+		}
+	} while (FindNextFileW(findHandle, &findData));
+	FindClose(findHandle);
+	return fileNames;
+}
+
+void BatchCompressor::decodeFile(std::shared_ptr<Job> job)
+{
+	IN3_TRACE_SCOPE("Decode file");
+	// The file contents and bitmap are only needed until the planes exist
+	BitmapFile::CreateResult result;
+	std::unique_ptr<BitmapFile> bitmapFile(new BitmapFile(
+		job->FileData.data(),
+		job->FileData.size(),
+		&result));
+	job->FileData = std::vector<BYTE>();
+	if (result != BitmapFile::OK) {
+		finishJob(*job, FALSE, 0);
+		return;
+	}
+	if (Cache != NULL) {
+		job->CacheKey = CompressionCache::MakeKey(*bitmapFile, FileCodec.getSettings());
+		std::vector<BYTE> bytes;
+		BOOL hit;
+		{
+			IN3_TRACE_SCOPE("Cache lookup");
+			hit = Cache->lookup(job->CacheKey, bytes);
+		}
+		if (hit) {
+			bitmapFile.reset();
+			{
+				std::lock_guard<std::mutex> lock(StatisticsLock);
+				BatchStatistics.CacheHits += 1;
+			}
+			writeBytes(job, std::move(bytes));
+			return;
+		}
+	}
+	if (FileCodec.cvtBmpToPaletteVector(*bitmapFile, job->Planes, job->Palette)) {
+		bitmapFile.reset();
+		job->Header = FileCodec.createHeader(job->Planes, COLOR_TRANSFORM_PALETTE);
+	}
+	else {
+		job->Planes = FileCodec.cvtBmpToYUVVector(*bitmapFile);
+		bitmapFile.reset();
+		job->Header = FileCodec.createHeader(job->Planes);
+	}
+	job->Compressed.Width = job->Planes.getWidth();
+	job->Compressed.Height = job->Planes.getHeight();
+	// Code the planes as separate tasks, the last one to finish writes
+	job->PlanesRemaining = 3;
+	Pool.submit([this, job]() { compressPlane(job, Codec::PLANE_Y); });
+	Pool.submit([this, job]() { compressPlane(job, Codec::PLANE_U); });
+	Pool.submit([this, job]() { compressPlane(job, Codec::PLANE_V); });
+}
+
+void BatchCompressor::compressPlane(std::shared_ptr<Job> job, Codec::Plane plane)
+{
+	IN3_TRACE_SCOPE("Compress plane task");
+	FileCodec.compressPlane(job->Planes, plane, job->Header, job->Compressed);
+	if (--job->PlanesRemaining == 0) {
+		job->Planes = YUVVectors<INT8>();
+		writeFile(job);
+	}
+}
+
+void BatchCompressor::writeFile(std::shared_ptr<Job> job)
+{
+	IN3_TRACE_SCOPE("Pack file");
+	std::vector<BYTE> bytes;
+	{
+		IN3File in3File(job->Header, std::move(job->Compressed), job->Palette);
+		bytes = in3File.SaveToMemory();
+	}
+	if (Cache != NULL) {
+		Cache->store(job->CacheKey, bytes);
+	}
+	writeBytes(job, std::move(bytes));
+}
+
+void BatchCompressor::writeBytes(std::shared_ptr<Job> job, std::vector<BYTE>&& bytes)
+{
+	UINT64 bytesWritten = bytes.size();
+	// The write thread finishes the job once the file is on disk
+	FileIO.write(
+		job->FileName + L".in3",
+		std::move(bytes),
+		[this, job, bytesWritten](BOOL success) {
+		finishJob(*job, success, success ? bytesWritten : 0);
+	});
+}
+
+void BatchCompressor::finishJob(const Job& job, BOOL success, UINT64 bytesWritten)
+{
+	{
+		std::lock_guard<std::mutex> lock(StatisticsLock);
+		if (success) {
+			BatchStatistics.FilesCompressed += 1;
+			BatchStatistics.BytesRead += job.FileSize;
+			BatchStatistics.BytesWritten += bytesWritten;
+		}
+		else {
+			BatchStatistics.FilesFailed += 1;
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(BudgetLock);
+		MemoryInFlight -= job.EstimatedMemory;
+	}
+	BudgetAvailable.notify_all();
+}
+
+BatchCompressor::Statistics BatchCompressor::compressFiles(
+	const std::vector<std::wstring>& fileNames)
+{
+	BatchStatistics = Statistics();
+	auto start = std::chrono::steady_clock::now();
+	FileIO.prefetch(fileNames);
+	AsyncFileIO::ReadResult read;
+	while (FileIO.nextRead(read)) {
+		std::shared_ptr<Job> job(new Job);
+		job->FileName = read.FileName;
+		if (!read.Success) {
+			finishJob(*job, FALSE, 0);
+			continue;
+		}
+		job->FileSize = read.Data.size();
+		job->FileData = std::move(read.Data);
+		job->EstimatedMemory = estimateMemory(job->FileSize);
+		{
+			// Admit the file once it fits in the budget
+			// A file larger than the whole budget runs on its own
+			std::unique_lock<std::mutex> lock(BudgetLock);
+			BudgetAvailable.wait(lock, [this, &job]() {
+				return MemoryInFlight == 0 ||
+					MemoryInFlight + job->EstimatedMemory <= MemoryBudget;
+			});
+			MemoryInFlight += job->EstimatedMemory;
+			std::lock_guard<std::mutex> statisticsLock(StatisticsLock);
+			BatchStatistics.PeakEstimatedMemory = std::max(
+				BatchStatistics.PeakEstimatedMemory,
+				MemoryInFlight);
+		}
+		Pool.submit([this, job]() { decodeFile(job); });
+	}
+	Pool.waitIdle();
+	FileIO.drain();
+	std::chrono::duration<DOUBLE> elapsed = std::chrono::steady_clock::now() - start;
+	std::lock_guard<std::mutex> lock(StatisticsLock);
+	BatchStatistics.Seconds = elapsed.count();
+	return BatchStatistics;
+}
+
+BatchCompressor::BatchCompressor(
+	const Codec::Settings& settings,
+	UINT32 threadCount,
+	UINT64 memoryBudget,
+	UINT32 queueDepth,
+	CompressionCache* cache)
+	: FileCodec(settings),
+	  Cache(cache),
+	  Pool(threadCount),
+	  FileIO(queueDepth),
+	  MemoryBudget(memoryBudget),
+	  MemoryInFlight(0)
+{
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "AsyncFileIO.h"
+#include "BitmapFile.h"
+#include "Codec.h"
+#include "commontypes.h"
+#include "CompressionCache.h"
+#include "WorkStealingPool.h"
+
+// Compresses many bitmap files at once on a shared work-stealing pool
+// Files are prefetched and written back by an asynchronous I/O stage while
+// the pool runs a color conversion task per file and one task per plane
+// for entropy coding. New files are only started while their estimated
+// memory fits in the remaining budget; prefetched files waiting to start
+// are bounded by the I/O queue depth instead. With a compression cache,
+// files whose pixels were compressed before with the same settings are
+// written from the cache once hashed, skipping conversion and coding.
+class BatchCompressor
+{
+public:
+	// Aggregate results of a batch
+	struct Statistics {
+		UINT64 FilesCompressed = 0;
+		UINT64 FilesFailed = 0;
+		UINT64 BytesRead = 0;
+		UINT64 BytesWritten = 0;
+		UINT64 PeakEstimatedMemory = 0;
+		UINT64 CacheHits = 0;
+		DOUBLE Seconds = 0.0;
+		// Input bytes processed per second in megabytes
+		DOUBLE MegabytesPerSecond() const;
+	};
+	// Default memory budget for files in flight
+	static const UINT64 DEFAULT_MEMORY_BUDGET;
+private:
+	// State of one file moving through the pipeline
+	struct Job {
+		std::wstring FileName;
+		UINT64 FileSize = 0;
+		UINT64 EstimatedMemory = 0;
+		std::vector<BYTE> FileData;
+		YUVVectors<INT8> Planes;
+		// Colors indexed by the Y plane of a palette coded image, or empty
+		std::vector<IN3PaletteEntry> Palette;
+		IN3Header<INT8> Header;
+		YUVVectors<bool> Compressed;
+		std::atomic<UINT32> PlanesRemaining;
+		CompressionCache::Key CacheKey;
+	};
+	Codec FileCodec;
+	CompressionCache* Cache;
+	WorkStealingPool Pool;
+	AsyncFileIO FileIO;
+	UINT64 MemoryBudget;
+	// Memory admission control
+	std::mutex BudgetLock;
+	std::condition_variable BudgetAvailable;
+	UINT64 MemoryInFlight;
+	// Results of the current batch
+	std::mutex StatisticsLock;
+	Statistics BatchStatistics;
+	// Pipeline stages of one file
+	void decodeFile(std::shared_ptr<Job> job);
+	void compressPlane(std::shared_ptr<Job> job, Codec::Plane plane);
+	void writeFile(std::shared_ptr<Job> job);
+	void writeBytes(std::shared_ptr<Job> job, std::vector<BYTE>&& bytes);
+	// Record the result of a file and release its memory budget
+	void finishJob(const Job& job, BOOL success, UINT64 bytesWritten);
+public:
+	// Estimate the peak memory needed to compress a bitmap file of a size
+	static UINT64 estimateMemory(UINT64 fileSize);
+	// List the bitmap files in a directory
+	static std::vector<std::wstring> findBitmapFiles(const std::wstring& directory);
+	// Compress each file to the same name with an .in3 extension appended
+	Statistics compressFiles(const std::vector<std::wstring>& fileNames);
+	BatchCompressor(
+		const Codec::Settings& settings,
+		UINT32 threadCount = 0,
+		UINT64 memoryBudget = DEFAULT_MEMORY_BUDGET,
+		UINT32 queueDepth = AsyncFileIO::DEFAULT_QUEUE_DEPTH,
+		CompressionCache* cache = NULL);
+};
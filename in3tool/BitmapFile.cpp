@@ -1,6 +1,9 @@
 #include "stdafx.h"
+#include <utility>
 #include "BitmapFile.h"
 #include "BitmapPixelOperation.h"
+#include "MemoryAccounting.h"
+#include "Trace.h"
 
 BitmapFile::CreateResult BitmapFile::TestFile() {
   // Record any difference between expected and actual values
@@ -33,7 +36,10 @@ BitmapFile::CreateResult BitmapFile::TestFile() {
   return OK;
 }
 
+#ifdef _WIN32
 BitmapFile::CreateResult BitmapFile::ReadBitmapFile(HANDLE fileHandle) {
+  MemoryAccounting::Scope memoryScope(MEMORY_STAGE_BMP_READ);
+  IN3_TRACE_SCOPE("BMP read");
   // The basic header information is the first 54 bytes
   static const int HEADERSIZE = 54;
   // Record any differences between expected and actual bytes read
@@ -51,7 +57,7 @@ BitmapFile::CreateResult BitmapFile::ReadBitmapFile(HANDLE fileHandle) {
     NULL,
     FILE_CURRENT);
   // Allocate space to store image pixel data
-  File.Pixels = new Pixel[File.Header.Width * absHeight()];
+  File.Pixels = new Pixel[pixelCount()];
   // Read and store the image pixels one scan line at a time
   for (INT32 i = 0; i < absHeight(); i++) {
     // Get the number of bytes in the pixel line
@@ -60,10 +66,10 @@ BitmapFile::CreateResult BitmapFile::ReadBitmapFile(HANDLE fileHandle) {
     Pixel* bufPos = NULL;
     if (File.Header.Height >= 0) // Pixel lines ordered bottom first
     {
-      bufPos = File.Pixels + (File.Header.Width * (absHeight() - i - 1));
+      bufPos = File.Pixels + (static_cast<size_t>(File.Header.Width) * (absHeight() - i - 1));
     } else // Pixel lines ordered top first
     {
-      bufPos = File.Pixels + (i * File.Header.Width);
+      bufPos = File.Pixels + (static_cast<size_t>(i) * File.Header.Width);
     }
     // Read the pixel line
     errorAccumulator |= ReadFile(
@@ -90,18 +96,57 @@ BitmapFile::CreateResult BitmapFile::ReadBitmapFile(HANDLE fileHandle) {
   // Test header fields to determine if supported format
   return TestFile();
 }
+#endif
 
-INT32 BitmapFile::absHeight() {
+BitmapFile::CreateResult BitmapFile::ReadBitmapMemory(const BYTE* data, UINT64 size) {
+  MemoryAccounting::Scope memoryScope(MEMORY_STAGE_BMP_READ);
+  IN3_TRACE_SCOPE("BMP parse");
+  // The basic header information is the first 54 bytes
+  static const int HEADERSIZE = 54;
+  if (size < HEADERSIZE) {
+    return ERROR_READ_FAILED;
+  }
+  memcpy(&File.Header, data, HEADERSIZE);
+  // Test header fields before trusting the dimensions
+  CreateResult result = TestFile();
+  if (result != OK) {
+    return result;
+  }
+  // The last scan line may omit its zero padding
+  UINT64 height = absHeight();
+  if (File.Header.Width < 0 ||
+    (height != 0 && size < File.Header.Offset +
+      static_cast<UINT64>(scanLineBytes()) * (height - 1) + pixelLineBytes())) {
+    return ERROR_READ_FAILED;
+  }
+  // Allocate space to store image pixel data
+  File.Pixels = new Pixel[pixelCount()];
+  // Copy the image pixels one scan line at a time
+  for (INT32 i = 0; i < absHeight(); i++) {
+    const BYTE* linePos = data + File.Header.Offset + static_cast<size_t>(i) * scanLineBytes();
+    // Pixel lines ordered bottom first unless the height is negative
+    Pixel* bufPos = getRow(File.Header.Height >= 0 ? absHeight() - i - 1 : i);
+    memcpy(bufPos, linePos, pixelLineBytes());
+  }
+  return OK;
+}
+
+INT32 BitmapFile::absHeight() const {
   // How many scan lines are present
   return abs(File.Header.Height);
 }
 
-INT32 BitmapFile::pixelLineBytes() {
+size_t BitmapFile::pixelCount() const {
+  // How many pixels are in the image, computed without 32-bit overflow
+  return static_cast<size_t>(File.Header.Width) * absHeight();
+}
+
+INT32 BitmapFile::pixelLineBytes() const {
   // How many bytes per scan line are pixels
   return File.Header.Width * 3;
 }
 
-INT32 BitmapFile::scanLineBytes() {
+INT32 BitmapFile::scanLineBytes() const {
   // Each scan line is zero-padded to a multiple of 4
   INT32 bytes = pixelLineBytes();
   INT32 remainder = bytes % 4;
@@ -112,62 +157,80 @@ INT32 BitmapFile::scanLineBytes() {
   return bytes - remainder + 4;
 }
 
+#ifdef _WIN32
 BitmapFile::BitmapFile(HANDLE fileHandle, CreateResult* result) {
   // Read a bitmap from the file
   *result = ReadBitmapFile(fileHandle);
 }
+#endif
+
+BitmapFile::BitmapFile(const BYTE* data, UINT64 size, CreateResult* result) {
+  // Read a bitmap from file contents already in memory
+  *result = ReadBitmapMemory(data, size);
+}
 
 BitmapFile::BitmapFile(INT32 width, INT32 height)
 {
 	File.Header.Width = width;
 	File.Header.Height = height;
-	File.Pixels = new Pixel[width * height];
+	File.Pixels = new Pixel[pixelCount()];
+}
+
+BitmapFile::BitmapFile(BitmapFile && bitmapFile) {
+  // Take the header and pixel data, leaving the other instance empty
+  File.Header = bitmapFile.File.Header;
+  File.Pixels = bitmapFile.File.Pixels;
+  bitmapFile.File.Pixels = NULL;
 }
 
-BitmapFile::BitmapFile(const BitmapFile & bitmapFile) {
-  File = bitmapFile.File;
-  // Find how many bytes are in the image pixel data
-  INT32 length = File.Header.Width * absHeight() * sizeof(Pixel);
-  // Perform a deep copy of the image pixel data
-  if (length != 0) {
-    File.Pixels = new Pixel[length];
-    memcpy(File.Pixels, bitmapFile.File.Pixels, length);
+BitmapFile & BitmapFile::operator=(BitmapFile && bitmapFile) {
+  // Swap so the other instance frees the pixels this one held
+  if (this != &bitmapFile) {
+    std::swap(File.Header, bitmapFile.File.Header);
+    std::swap(File.Pixels, bitmapFile.File.Pixels);
   }
+  return *this;
 }
 
-BitmapFile::Pixel BitmapFile::getPixel(UINT32 x, UINT32 y) {
+BitmapFile::Pixel BitmapFile::getPixel(UINT32 x, UINT32 y) const {
   // Get the pixel at the location
-  return File.Pixels[y * File.Header.Width + x];
+  return File.Pixels[static_cast<size_t>(y) * File.Header.Width + x];
 }
 
-INT32 BitmapFile::getWidth() {
+INT32 BitmapFile::getWidth() const {
   // Width in pixels of the bitmap
   return File.Header.Width;
 }
 
-INT32 BitmapFile::getHeight() {
+INT32 BitmapFile::getHeight() const {
   // Height in pixels (or scan lines) of the bitmap
   return absHeight();
 }
 
 void BitmapFile::setPixel(UINT32 x, UINT32 y, Pixel pixel) {
   // Set the pixel at the location
-  File.Pixels[y * File.Header.Width + x] = pixel;
+  File.Pixels[static_cast<size_t>(y) * File.Header.Width + x] = pixel;
+}
+
+BitmapFile::Pixel* BitmapFile::getRow(UINT32 y) {
+  // Rows are stored top first without padding
+  return File.Pixels + static_cast<size_t>(y) * File.Header.Width;
+}
+
+const BitmapFile::Pixel* BitmapFile::getRow(UINT32 y) const {
+  // Rows are stored top first without padding
+  return File.Pixels + static_cast<size_t>(y) * File.Header.Width;
+}
+
+Span<BitmapFile::Pixel> BitmapFile::getPixels() const {
+  // Every row back-to-back, top first
+  return Span<Pixel>(File.Pixels, pixelCount());
 }
 
 void BitmapFile::doPixelOperation(BitmapPixelOperation& operation) {
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_OPERATIONS);
 	// Take in a pixel-based operation and apply it to every pixel
-	// Get image dimensions
-	INT32 width = getWidth();
-	INT32 height = getHeight();
-	// For each pixel in the image
-	for (INT32 y = 0; y < height; y++) {
-		for (INT32 x = 0; x < width; x++) {
-			Pixel pixel = getPixel(x, y);
-			// Apply the operation on the pixel
-			setPixel(x, y, operation.OnPixel(pixel, x, y));
-		}
-	}
+	operation.OnBitmap(*this);
 }
 
 BitmapFile::File::File() : Pixels(NULL) {
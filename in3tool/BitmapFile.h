@@ -1,4 +1,5 @@
 #pragma once
+#include "commontypes.h"
 // Forward declarations for class dependencies
 class BitmapPixelOperation;
 // BitmapFile class declaration
@@ -49,19 +50,32 @@ private:
     ~File(); // Destruct by deallocating pixels memory
   } File;
   // Utility functions used by other class functions
-  INT32 absHeight(); // Image height
-  INT32 pixelLineBytes(); // Bytes per pixel line
-  INT32 scanLineBytes(); // Bytes per scan line
+  INT32 absHeight() const; // Image height
+  size_t pixelCount() const; // Number of pixels in the image
+  INT32 pixelLineBytes() const; // Bytes per pixel line
+  INT32 scanLineBytes() const; // Bytes per scan line
   CreateResult TestFile(); // Run tests to check file validity
+#ifdef _WIN32
   CreateResult ReadBitmapFile(HANDLE fileHandle); // Read a file
+#endif
+  CreateResult ReadBitmapMemory(const BYTE* data, UINT64 size); // Read file contents from memory
 public:
   // Public functions used by other classes and window code
+#ifdef _WIN32
   BitmapFile(HANDLE fileHandle, CreateResult* result); // Constructor from file
+#endif
+  BitmapFile(const BYTE* data, UINT64 size, CreateResult* result); // Constructor from file contents
   BitmapFile(INT32 width, INT32 height);
-  BitmapFile(const BitmapFile& bitmapFile); // Deep copy constructor from other instance
-  Pixel getPixel(UINT32 x, UINT32 y); // Get a pixel from the location
-  INT32 getWidth(); // Get image width in pixels
-  INT32 getHeight(); // Get image height in pixels
+  BitmapFile(const BitmapFile& bitmapFile) = delete; // Pixels are moved, never copied
+  BitmapFile(BitmapFile&& bitmapFile); // Take over the pixels of another instance
+  BitmapFile& operator=(const BitmapFile& bitmapFile) = delete;
+  BitmapFile& operator=(BitmapFile&& bitmapFile);
+  Pixel getPixel(UINT32 x, UINT32 y) const; // Get a pixel from the location
+  INT32 getWidth() const; // Get image width in pixels
+  INT32 getHeight() const; // Get image height in pixels
   void setPixel(UINT32 x, UINT32 y, Pixel pixel); // Set a pixel at location
+  Pixel* getRow(UINT32 y); // Get the contiguous pixels of a row
+  const Pixel* getRow(UINT32 y) const;
+  Span<Pixel> getPixels() const; // Read-only view of every pixel, top row first
   void doPixelOperation(BitmapPixelOperation & operation); // Execute a per-pixel operation
 };
\ No newline at end of file
@@ -1,7 +1,10 @@
 #include "stdafx.h"
 #include <algorithm>
+#include <cstdlib>
+#include <vector>
 #include "BitmapFile.h"
 #include "BitmapPixelOperation.h"
+#include "CpuDispatch.h"
 
 
 // Base class BitmapPixelOperation definitions
@@ -14,24 +17,77 @@ BitmapFile::Pixel BitmapPixelOperation::OnPixel(BitmapFile::Pixel pixel, INT32 x
   return pixel;
 }
 
+void BitmapPixelOperation::OnRow(BitmapFile::Pixel* pixels, INT32 width, INT32 y) {
+  // Default to the per-pixel operation across the row
+  for (INT32 x = 0; x < width; x++) {
+    pixels[x] = OnPixel(pixels[x], x, y);
+  }
+}
+
+void BitmapPixelOperation::OnBitmap(BitmapFile& bitmapFile) {
+  // Default to the row operation on every row
+  INT32 width = bitmapFile.getWidth();
+  INT32 height = bitmapFile.getHeight();
+  for (INT32 y = 0; y < height; y++) {
+    OnRow(bitmapFile.getRow(y), width, y);
+  }
+}
+
 // Derived class Brighten definitions
 
-Brighten::Brighten(DOUBLE factor) : Factor(factor) {}
+Brighten::Brighten(DOUBLE factor) : ReferenceFactor(factor) {
+  // Past 255 every pixel but black is already at full value
+  DOUBLE fixed = ClampToRange(factor, 0.0, 255.0) * CpuDispatch::BRIGHTEN_ONE;
+  Factor = std::min(static_cast<UINT32>(fixed + 0.5), CpuDispatch::BRIGHTEN_MAX_FACTOR);
+}
 
 BitmapFile::Pixel Brighten::OnPixel(BitmapFile::Pixel pixel, INT32 x, INT32 y) {
   // Unreferenced parameter macro silences compiler warnings
   UNREFERENCED_PARAMETER(x);
   UNREFERENCED_PARAMETER(y);
+  // Multiply the HSV Value (Brightness) without leaving RGB, see the kernels
+  CpuDispatch::getKernels().BrightenPixels(&pixel, 1, Factor);
+  return pixel;
+}
+
+void Brighten::OnRow(BitmapFile::Pixel* pixels, INT32 width, INT32 y) {
+  UNREFERENCED_PARAMETER(y);
+  CpuDispatch::getKernels().BrightenPixels(pixels, width, Factor);
+}
+
+BitmapFile::Pixel Brighten::OnPixelReference(BitmapFile::Pixel pixel) {
   // Go from RGB to HSV then HSV V-channel * factor then back to RGB
   NormalizedRGB rgb = PixelToNormalizedRGB(pixel);
   HSV hsv = NormalizedRGBtoHSV(rgb);
   // Brighten the pixel by a factor
-  hsv.V *= Factor; // Multiply the HSV Value (Brightness)
+  hsv.V *= ReferenceFactor; // Multiply the HSV Value (Brightness)
   hsv.V = ClampToRange(hsv.V, 0.0, 1.0); // Restore it to valid range [0,1]
   rgb = HSVtoNormalizedRGB(hsv);
   return NormalizedRGBtoPixel(rgb);
 }
 
+BOOL Brighten::MatchesReference() {
+  // One row per red value holds every green and blue value
+  static const INT32 ROW = 1 << 16;
+  std::vector<BitmapFile::Pixel> row(ROW);
+  for (INT32 red = 0; red < 256; red++) {
+    for (INT32 i = 0; i < ROW; i++) {
+      row[i] = { static_cast<BYTE>(i), static_cast<BYTE>(i >> 8), static_cast<BYTE>(red) };
+    }
+    OnRow(row.data(), ROW, red);
+    for (INT32 i = 0; i < ROW; i++) {
+      BitmapFile::Pixel input = { static_cast<BYTE>(i), static_cast<BYTE>(i >> 8), static_cast<BYTE>(red) };
+      BitmapFile::Pixel expected = OnPixelReference(input);
+      if (std::abs(row[i].Red - expected.Red) > 1 ||
+        std::abs(row[i].Green - expected.Green) > 1 ||
+        std::abs(row[i].Blue - expected.Blue) > 1) {
+        return FALSE;
+      }
+    }
+  }
+  return TRUE;
+}
+
 // Derived class Grayscale definitions
 
 BitmapFile::Pixel Grayscale::OnPixel(BitmapFile::Pixel pixel, INT32 x, INT32 y) {
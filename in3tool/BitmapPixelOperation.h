@@ -9,17 +9,33 @@ public:
   // OnPixel is overrided by child classes to implement a new pixel operation
   // as it is what is called by BitmapFile's doPixelOperation function
   virtual BitmapFile::Pixel OnPixel(BitmapFile::Pixel pixel, INT32 x, INT32 y);
+  // OnRow is what OnBitmap calls, once per row of pixels
+  // It defaults to OnPixel on each pixel and is overrided by operations
+  // that process whole rows at once
+  virtual void OnRow(BitmapFile::Pixel* pixels, INT32 width, INT32 y);
+  // OnBitmap is what doPixelOperation actually calls, once per image
+  // It defaults to OnRow on each row and is overrided by operations whose
+  // pixels depend on other rows
+  virtual void OnBitmap(BitmapFile& bitmapFile);
 };
 
 // Derived class Brighten declarations
 
 class Brighten : public BitmapPixelOperation {
 private:
-  DOUBLE Factor; // Factor to brighten by
+  DOUBLE ReferenceFactor; // Factor to brighten by
+  UINT32 Factor; // Factor to brighten by in 16.16 fixed point
 public:
   Brighten(DOUBLE factor); // Constructor to initialize brighten factor
   // Brighten the pixel
   virtual BitmapFile::Pixel OnPixel(BitmapFile::Pixel pixel, INT32 x, INT32 y);
+  // Brighten a row of pixels with the vector kernels
+  virtual void OnRow(BitmapFile::Pixel* pixels, INT32 width, INT32 y);
+  // Brighten the pixel through floating point HSV, as the kernels replace
+  BitmapFile::Pixel OnPixelReference(BitmapFile::Pixel pixel);
+  // Check the kernels in use against the floating point path over every
+  // pixel value, allowing each channel to differ by one
+  BOOL MatchesReference();
 };
 
 // Derived class Grayscale declarations
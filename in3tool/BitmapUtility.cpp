@@ -1,6 +1,8 @@
 #include "stdafx.h"
 #include <algorithm>
+#include <cmath>
 #include "BitmapUtility.h"
+#include "CpuDispatch.h"
 
 
 // Base class BitmapUtility definitions
@@ -137,3 +139,59 @@ BitmapUtility::HSV BitmapUtility::NormalizedRGBtoHSV(NormalizedRGB rgb) {
 
 	return{ H, S, V };
 }
+
+void BitmapUtility::PixelsToYCoCgR(
+	const BitmapFile::Pixel* pixels,
+	INT8* y,
+	INT8* co,
+	INT8* cg,
+	size_t count) {
+	CpuDispatch::getKernels().PixelsToYCoCgR(pixels, y, co, cg, count);
+}
+
+void BitmapUtility::YCoCgRtoPixels(
+	const INT8* y,
+	const INT8* co,
+	const INT8* cg,
+	BitmapFile::Pixel* pixels,
+	size_t count) {
+	CpuDispatch::getKernels().YCoCgRToPixels(y, co, cg, pixels, count);
+}
+
+void BitmapUtility::RGB16toYCoCgR(
+	UINT16* r,
+	UINT16* g,
+	UINT16* b,
+	size_t count) {
+	// Planes are converted in place: R becomes Y, G becomes Co, B becomes Cg
+	for (size_t i = 0; i < count; i++) {
+		INT16 R = static_cast<INT16>(r[i]);
+		INT16 G = static_cast<INT16>(g[i]);
+		INT16 B = static_cast<INT16>(b[i]);
+		INT16 Co = static_cast<INT16>(R - B);
+		INT16 t = static_cast<INT16>(B + (Co >> 1));
+		INT16 Cg = static_cast<INT16>(G - t);
+		r[i] = static_cast<UINT16>(t + (Cg >> 1));
+		g[i] = static_cast<UINT16>(Co);
+		b[i] = static_cast<UINT16>(Cg);
+	}
+}
+
+void BitmapUtility::YCoCgR16toRGB(
+	UINT16* y,
+	UINT16* co,
+	UINT16* cg,
+	size_t count) {
+	// Planes are converted in place: Y becomes R, Co becomes G, Cg becomes B
+	for (size_t i = 0; i < count; i++) {
+		INT16 Co = static_cast<INT16>(co[i]);
+		INT16 Cg = static_cast<INT16>(cg[i]);
+		INT16 t = static_cast<INT16>(y[i] - (Cg >> 1));
+		INT16 G = static_cast<INT16>(Cg + t);
+		INT16 B = static_cast<INT16>(t - (Co >> 1));
+		INT16 R = static_cast<INT16>(B + Co);
+		y[i] = static_cast<UINT16>(R);
+		co[i] = static_cast<UINT16>(G);
+		cg[i] = static_cast<UINT16>(B);
+	}
+}
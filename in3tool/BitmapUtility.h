@@ -46,5 +46,35 @@ protected:
 	// Normalized RGB <---> HSV
 	NormalizedRGB HSVtoNormalizedRGB(HSV hsv);
 	HSV NormalizedRGBtoHSV(NormalizedRGB rgb);
+
+	// Pixel row <---> YCoCg-R planes
+	// Integer lifting computed modulo 256 so every plane stays 8-bit
+	// and the inverse reproduces the input pixels exactly
+	// Runs the kernels CpuDispatch selects for the CPU
+	void PixelsToYCoCgR(
+		const BitmapFile::Pixel* pixels,
+		INT8* y,
+		INT8* co,
+		INT8* cg,
+		size_t count);
+	void YCoCgRtoPixels(
+		const INT8* y,
+		const INT8* co,
+		const INT8* cg,
+		BitmapFile::Pixel* pixels,
+		size_t count);
+
+	// 16-bit RGB planes <---> YCoCg-R planes, in place
+	// The same lifting steps as the 8-bit transform computed modulo 65536
+	void RGB16toYCoCgR(
+		UINT16* r,
+		UINT16* g,
+		UINT16* b,
+		size_t count);
+	void YCoCgR16toRGB(
+		UINT16* y,
+		UINT16* co,
+		UINT16* cg,
+		size_t count);
 };
 
@@ -0,0 +1,178 @@
+#include "stdafx.h"
+#include <cstring>
+#include <limits>
+#include "BitmapWriter.h"
+#include "IN3File.h"
+
+UINT64 BitmapWriter::scanLineOffset(UINT32 y) const
+{
+	UINT64 line = Order == ROW_ORDER_TOP_DOWN ? y : static_cast<UINT64>(Height) - y - 1;
+	return sizeof(Header) + line * ScanLineBytes;
+}
+
+BitmapWriter::BitmapWriter(
+	const std::wstring& fileName,
+	INT32 width,
+	INT32 height,
+	UINT16 bitCount,
+	RowOrder order)
+	: FileHandle(INVALID_HANDLE_VALUE),
+	  MappingHandle(NULL),
+	  View(NULL),
+	  Width(width),
+	  Height(height),
+	  BitCount(bitCount),
+	  Order(order),
+	  ScanLineBytes(0),
+	  Failed(TRUE)
+{
+	if (width <= 0 || height <= 0 || (bitCount != 24 && bitCount != 32)) {
+		return;
+	}
+	// Scan lines are padded to a multiple of four bytes
+	ScanLineBytes = (static_cast<UINT64>(width) * (bitCount / 8) + 3) & ~static_cast<UINT64>(3);
+	UINT64 fileSize = sizeof(Header) + ScanLineBytes * height;
+	if (fileSize > std::numeric_limits<UINT32>::max()) {
+		return;
+	}
+	FileHandle = CreateFileW(
+		fileName.c_str(),
+		GENERIC_READ | GENERIC_WRITE,
+		0,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	if (FileHandle == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	Header header;
+	header.fSize = static_cast<UINT32>(fileSize);
+	header.Width = width;
+	header.Height = order == ROW_ORDER_TOP_DOWN ? -height : height;
+	header.BitCount = bitCount;
+	header.SizeImage = static_cast<UINT32>(fileSize - sizeof(Header));
+	// Mapping the file extends it to its full size, with the padding of
+	// every scan line already zero
+	MappingHandle = CreateFileMapping(FileHandle, NULL, PAGE_READWRITE, 0, static_cast<DWORD>(fileSize), NULL);
+	if (MappingHandle != NULL) {
+		View = static_cast<BYTE*>(MapViewOfFile(MappingHandle, FILE_MAP_WRITE, 0, 0, 0));
+	}
+	if (View != NULL) {
+		std::memcpy(View, &header, sizeof(header));
+		Failed = FALSE;
+		return;
+	}
+	// A view may not fit in the address space of a 32-bit process, so the
+	// file is written through the handle instead
+	if (MappingHandle != NULL) {
+		CloseHandle(MappingHandle);
+		MappingHandle = NULL;
+	}
+	LARGE_INTEGER end;
+	end.QuadPart = static_cast<LONGLONG>(fileSize);
+	LARGE_INTEGER start;
+	start.QuadPart = 0;
+	RowBuffer.resize(static_cast<size_t>(ScanLineBytes));
+	Failed = !SetFilePointerEx(FileHandle, end, NULL, FILE_BEGIN) ||
+		!SetEndOfFile(FileHandle) ||
+		!SetFilePointerEx(FileHandle, start, NULL, FILE_BEGIN) ||
+		!IN3File::WriteChunked(FileHandle, reinterpret_cast<const BYTE*>(&header), sizeof(header));
+}
+
+BitmapWriter::~BitmapWriter()
+{
+	close();
+}
+
+BOOL BitmapWriter::isValid() const
+{
+	return FileHandle != INVALID_HANDLE_VALUE && !Failed;
+}
+
+INT32 BitmapWriter::getWidth() const
+{
+	return Width;
+}
+
+INT32 BitmapWriter::getHeight() const
+{
+	return Height;
+}
+
+PixelFormat BitmapWriter::getPixelFormat() const
+{
+	return BitCount == 32 ? PIXEL_FORMAT_BGRA : PIXEL_FORMAT_BGR;
+}
+
+BYTE* BitmapWriter::getRow(UINT32 y)
+{
+	if (View != NULL) {
+		return View + scanLineOffset(y);
+	}
+	return RowBuffer.data();
+}
+
+void BitmapWriter::commitRow(UINT32 y)
+{
+	if (View != NULL || !isValid()) {
+		return;
+	}
+	LARGE_INTEGER offset;
+	offset.QuadPart = static_cast<LONGLONG>(scanLineOffset(y));
+	Failed = !SetFilePointerEx(FileHandle, offset, NULL, FILE_BEGIN) ||
+		!IN3File::WriteChunked(FileHandle, RowBuffer.data(), RowBuffer.size());
+}
+
+void BitmapWriter::writeRow(UINT32 y, const BitmapFile::Pixel* pixels)
+{
+	BYTE* row = getRow(y);
+	if (row == NULL) {
+		return;
+	}
+	if (BitCount == 24) {
+		std::memcpy(row, pixels, static_cast<size_t>(Width) * sizeof(BitmapFile::Pixel));
+	}
+	else {
+		for (INT32 x = 0; x < Width; x++) {
+			row[0] = pixels[x].Blue;
+			row[1] = pixels[x].Green;
+			row[2] = pixels[x].Red;
+			row[3] = 255;
+			row += 4;
+		}
+	}
+	commitRow(y);
+}
+
+BOOL BitmapWriter::close()
+{
+	BOOL written = isValid();
+	if (View != NULL) {
+		UnmapViewOfFile(View);
+		View = NULL;
+	}
+	if (MappingHandle != NULL) {
+		CloseHandle(MappingHandle);
+		MappingHandle = NULL;
+	}
+	if (FileHandle != INVALID_HANDLE_VALUE) {
+		CloseHandle(FileHandle);
+		FileHandle = INVALID_HANDLE_VALUE;
+	}
+	Failed = TRUE;
+	return written;
+}
+
+BOOL BitmapWriter::Write(
+	const BitmapFile& bitmapFile,
+	const std::wstring& fileName,
+	UINT16 bitCount,
+	RowOrder order)
+{
+	BitmapWriter writer(fileName, bitmapFile.getWidth(), bitmapFile.getHeight(), bitCount, order);
+	for (INT32 y = 0; y < bitmapFile.getHeight() && writer.isValid(); y++) {
+		writer.writeRow(static_cast<UINT32>(y), bitmapFile.getRow(static_cast<UINT32>(y)));
+	}
+	return writer.close();
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "BitmapFile.h"
+#include "commontypes.h"
+
+// Writer of uncompressed 24 or 32-bit BMP files one row at a time
+// The file is created at its full size and mapped, so rows are filled in
+// straight where their scan lines lie, in any order, and no image is held
+// in memory. A file that cannot be mapped has each row written at its
+// offset instead. Rows are numbered top first whichever order the file
+// stores them in.
+class BitmapWriter
+{
+public:
+	// Order of the scan lines in the file
+	enum RowOrder {
+		ROW_ORDER_BOTTOM_UP, // Positive height, as most BMP files are stored
+		ROW_ORDER_TOP_DOWN // Negative height
+	};
+private:
+#pragma pack(push, 1)
+	// BITMAPFILEHEADER and BITMAPINFOHEADER (see wingdi.h)
+	struct Header {
+		UINT16 Type = 0x4D42; // "BM"
+		UINT32 fSize = 0;
+		UINT16 Reserved1 = 0;
+		UINT16 Reserved2 = 0;
+		UINT32 Offset = sizeof(Header);
+		UINT32 iSize = 40;
+		INT32 Width = 0;
+		INT32 Height = 0;
+		UINT16 Planes = 1;
+		UINT16 BitCount = 24;
+		UINT32 Compression = 0;
+		UINT32 SizeImage = 0;
+		INT32 XPixelsPerMeter = 0;
+		INT32 YPixelsPerMeter = 0;
+		UINT32 ColorsUsed = 0;
+		UINT32 ColorsImportant = 0;
+	};
+#pragma pack(pop)
+	HANDLE FileHandle;
+	HANDLE MappingHandle;
+	BYTE* View;
+	INT32 Width;
+	INT32 Height;
+	UINT16 BitCount;
+	RowOrder Order;
+	UINT64 ScanLineBytes;
+	// Scan line of the row being written when the file is not mapped
+	std::vector<BYTE> RowBuffer;
+	// Set once any part of the file could not be written
+	BOOL Failed;
+	// Offset into the file of the scan line of a row
+	UINT64 scanLineOffset(UINT32 y) const;
+public:
+	// Create a file of the dimensions, replacing any file of the name
+	// Only 24 and 32 bits per pixel are written, and a file larger than
+	// the 32-bit sizes of the header can describe is not created
+	BitmapWriter(
+		const std::wstring& fileName,
+		INT32 width,
+		INT32 height,
+		UINT16 bitCount = 24,
+		RowOrder order = ROW_ORDER_BOTTOM_UP);
+	BitmapWriter(const BitmapWriter&) = delete;
+	BitmapWriter& operator=(const BitmapWriter&) = delete;
+	~BitmapWriter();
+	// Whether the file was created and every row so far was written
+	BOOL isValid() const;
+	INT32 getWidth() const;
+	INT32 getHeight() const;
+	// Packed layout of a scan line, BGR at 24 bits and BGRA at 32 bits
+	PixelFormat getPixelFormat() const;
+	// Scan line of a row to fill with pixels in the packed layout
+	// The pointer stays usable until commitRow is called for the row
+	BYTE* getRow(UINT32 y);
+	// Finish a row filled in through getRow
+	void commitRow(UINT32 y);
+	// Write a row of bitmap pixels
+	void writeRow(UINT32 y, const BitmapFile::Pixel* pixels);
+	// Finish the file, returning FALSE if any part of it was not written
+	BOOL close();
+	// Write a whole bitmap to a file
+	static BOOL Write(
+		const BitmapFile& bitmapFile,
+		const std::wstring& fileName,
+		UINT16 bitCount = 24,
+		RowOrder order = ROW_ORDER_BOTTOM_UP);
+};
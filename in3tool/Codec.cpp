@@ -1,161 +1,1509 @@
 #include "stdafx.h"
 #include <cmath>
 #include <limits>
+#include <memory>
+#include <utility>
 #include "BitmapUtility.h"
+#ifdef _WIN32
+#include "BitmapWriter.h"
+#endif
 #include "commontypes.h"
 #include "Codec.h"
+#include "CpuDispatch.h"
 #include "IN3File.h"
+#include "MemoryAccounting.h"
+#include "IN3WideFile.h"
+#include "SparseHuffman.h"
+#include "Trace.h"
 
-YUVVectors<INT8> Codec::cvtBmpToYUVVector(BitmapFile * bitmapFile)
+// Channel positions of the packed pixel formats
+struct PackedLayout {
+	UINT8 Bytes;
+	UINT8 Red;
+	UINT8 Green;
+	UINT8 Blue;
+	BOOL HasAlpha;
+	UINT8 Alpha;
+};
+
+// Indexed by PixelFormat
+static const PackedLayout PACKED_LAYOUTS[] = {
+	{ 3, 0, 1, 2, FALSE, 0 }, // RGB
+	{ 3, 2, 1, 0, FALSE, 0 }, // BGR
+	{ 4, 0, 1, 2, TRUE, 3 }, // RGBA
+	{ 4, 2, 1, 0, TRUE, 3 }, // BGRA
+	{ 4, 0, 1, 2, FALSE, 3 }, // RGBX
+	{ 4, 2, 1, 0, FALSE, 3 } // BGRX
+};
+
+void Codec::cvtPixelToYUV(BitmapFile::Pixel pixel, INT8 & y, INT8 & u, INT8 & v)
+{
+	NormalizedRGB rgb = PixelToNormalizedRGB(pixel);
+	YUV yuvValue = NormalizedRGBtoYUV(rgb);
+	y = static_cast<INT8>((yuvValue.Y * 255) - 128);
+	u = static_cast<INT8>((yuvValue.U * 255) - 128);
+	v = static_cast<INT8>((yuvValue.V * 255) - 128);
+}
+
+void Codec::cvtRowToYUV(
+	const BYTE * row,
+	PixelFormat format,
+	size_t width,
+	IN3ColorTransform colorTransform,
+	INT8 * y,
+	INT8 * u,
+	INT8 * v,
+	std::vector<BitmapFile::Pixel>& scratch)
+{
+	const PackedLayout& layout = PACKED_LAYOUTS[format];
+	// The kernels read BitmapFile pixels, which BGR rows are
+	const BitmapFile::Pixel* pixels = reinterpret_cast<const BitmapFile::Pixel*>(row);
+	if (format != PIXEL_FORMAT_BGR) {
+		scratch.resize(width);
+		for (size_t x = 0; x < width; x++) {
+			const BYTE* source = row + x * layout.Bytes;
+			scratch[x] = { source[layout.Blue], source[layout.Green], source[layout.Red] };
+		}
+		pixels = scratch.data();
+	}
+	const CpuDispatch::Kernels& kernels = CpuDispatch::getKernels();
+	if (colorTransform == COLOR_TRANSFORM_YCOCG_R) {
+		kernels.PixelsToYCoCgR(pixels, y, u, v, width);
+	}
+	else {
+		kernels.PixelsToYUV(pixels, y, u, v, width);
+	}
+}
+
+void Codec::cvtYUVToRow(
+	const INT8 * y,
+	const INT8 * u,
+	const INT8 * v,
+	IN3ColorTransform colorTransform,
+	PixelFormat format,
+	size_t width,
+	BYTE * row,
+	std::vector<BitmapFile::Pixel>& scratch)
 {
-	INT32 width = bitmapFile->getWidth();
-	INT32 height = bitmapFile->getHeight();
+	const PackedLayout& layout = PACKED_LAYOUTS[format];
+	// BGR rows are written by the kernels, other formats from their pixels
+	BitmapFile::Pixel* pixels = reinterpret_cast<BitmapFile::Pixel*>(row);
+	if (format != PIXEL_FORMAT_BGR) {
+		scratch.resize(width);
+		pixels = scratch.data();
+	}
+	const CpuDispatch::Kernels& kernels = CpuDispatch::getKernels();
+	if (colorTransform == COLOR_TRANSFORM_YCOCG_R) {
+		kernels.YCoCgRToPixels(y, u, v, pixels, width);
+	}
+	else {
+		kernels.YUVToPixels(y, u, v, pixels, width);
+	}
+	if (format == PIXEL_FORMAT_BGR) {
+		return;
+	}
+	for (size_t x = 0; x < width; x++) {
+		BYTE* target = row + x * layout.Bytes;
+		target[layout.Red] = scratch[x].Red;
+		target[layout.Green] = scratch[x].Green;
+		target[layout.Blue] = scratch[x].Blue;
+		if (layout.HasAlpha) {
+			target[layout.Alpha] = 255;
+		}
+	}
+}
+
+void Codec::cvtPaletteToRow(
+	const INT8 * indices,
+	const std::vector<IN3PaletteEntry>& palette,
+	PixelFormat format,
+	size_t width,
+	BYTE * row)
+{
+	const PackedLayout& layout = PACKED_LAYOUTS[format];
+	for (size_t x = 0; x < width; x++) {
+		const IN3PaletteEntry& entry = palette[static_cast<UINT8>(indices[x] + 128)];
+		BYTE* target = row + x * layout.Bytes;
+		target[layout.Red] = entry.Red;
+		target[layout.Green] = entry.Green;
+		target[layout.Blue] = entry.Blue;
+		if (layout.HasAlpha) {
+			target[layout.Alpha] = 255;
+		}
+	}
+}
+
+YUVVectors<INT8> Codec::cvtBmpToYUVVector(const BitmapFile & bitmapFile)
+{
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_COLOR_CONVERSION);
+	IN3_TRACE_SCOPE("Color conversion");
+	UINT64 width = bitmapFile.getWidth();
+	UINT64 height = bitmapFile.getHeight();
 	YUVVectors<INT8> yuv(width, height);
-	INT32 i = 0;
-	for (INT32 j = 0; j < height; j++) {
-		for (INT32 k = 0; k < width; k++) {
-			BitmapFile::Pixel pixel = bitmapFile->getPixel(k, j);
-			NormalizedRGB rgb = PixelToNormalizedRGB(pixel);
-			YUV yuvValue = NormalizedRGBtoYUV(rgb);
-			yuv.Y[i] = static_cast<INT8>((yuvValue.Y * 255) - 128);
-			yuv.U[i] = static_cast<INT8>((yuvValue.U * 255) - 128);
-			yuv.V[i] = static_cast<INT8>((yuvValue.V * 255) - 128);
-			i += 1;
+	std::vector<BitmapFile::Pixel> scratch;
+	for (UINT64 j = 0; j < height; j++) {
+		UINT64 offset = j * width;
+		cvtRowToYUV(
+			reinterpret_cast<const BYTE*>(bitmapFile.getRow(static_cast<UINT32>(j))),
+			PIXEL_FORMAT_BGR,
+			static_cast<size_t>(width),
+			EncoderSettings.ColorTransform,
+			yuv.Y.data() + offset,
+			yuv.U.data() + offset,
+			yuv.V.data() + offset,
+			scratch);
+	}
+	return yuv;
+}
+
+YUVVectors<INT8> Codec::cvtPixelsToYUVVector(const PixelBuffer & pixels)
+{
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_COLOR_CONVERSION);
+	IN3_TRACE_SCOPE("Color conversion");
+	UINT64 width = pixels.Width;
+	UINT64 height = pixels.Height;
+	YUVVectors<INT8> yuv(width, height);
+	if (pixels.Format == PIXEL_FORMAT_YUV_PLANAR) {
+		std::vector<INT8>* planes[3] = { &yuv.Y, &yuv.U, &yuv.V };
+		for (UINT8 p = 0; p < 3; p++) {
+			for (UINT64 j = 0; j < height; j++) {
+				const BYTE* row = pixels.Planes[p] + j * pixels.Strides[p];
+				INT8* samples = planes[p]->data() + j * width;
+				for (UINT64 k = 0; k < width; k++) {
+					samples[k] = static_cast<INT8>(row[k] - 128);
+				}
+			}
 		}
+		return yuv;
+	}
+	std::vector<BitmapFile::Pixel> scratch;
+	for (UINT64 j = 0; j < height; j++) {
+		UINT64 offset = j * width;
+		cvtRowToYUV(
+			pixels.Planes[0] + j * pixels.Strides[0],
+			pixels.Format,
+			static_cast<size_t>(width),
+			EncoderSettings.ColorTransform,
+			yuv.Y.data() + offset,
+			yuv.U.data() + offset,
+			yuv.V.data() + offset,
+			scratch);
 	}
 	return yuv;
 }
 
-std::pair<IN3Header<INT8>, YUVVectors<bool>> Codec::compressYUVVector(
-	const YUVVectors<INT8>& yuvVectors)
+// Slots of the color lookup that builds a palette, a power of two four
+// times the largest palette so that probe sequences stay short
+static const UINT32 PALETTE_HASH_BITS = 10;
+static const UINT32 PALETTE_HASH_SLOTS = 1 << PALETTE_HASH_BITS;
+
+BOOL Codec::cvtRowsToPalette(
+	const BYTE * rows,
+	size_t stride,
+	PixelFormat format,
+	UINT64 width,
+	UINT64 height,
+	YUVVectors<INT8>& indices,
+	std::vector<IN3PaletteEntry>& palette)
+{
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_COLOR_CONVERSION);
+	IN3_TRACE_SCOPE("Palette conversion");
+	size_t maxColors = std::min<UINT16>(EncoderSettings.MaxPaletteColors, IN3_MAX_PALETTE_SIZE);
+	palette.clear();
+	if (maxColors == 0) {
+		return FALSE;
+	}
+	const PackedLayout& layout = PACKED_LAYOUTS[format];
+	// Colors are keyed with a bit above their 24 bits, so that zero marks
+	// an empty slot
+	UINT32 keys[PALETTE_HASH_SLOTS] = {};
+	UINT8 slotIndices[PALETTE_HASH_SLOTS];
+	// Rows are only zero-filled as they are reached, so an image with too
+	// many colors costs little more than the rows read before finding out
+	std::vector<INT8> samples;
+	samples.reserve(static_cast<size_t>(width * height));
+	UINT32 previousKey = 0;
+	INT8 previousSample = 0;
+	for (UINT64 j = 0; j < height; j++) {
+		const BYTE* row = rows + j * stride;
+		samples.resize(static_cast<size_t>((j + 1) * width));
+		INT8* target = samples.data() + j * width;
+		for (UINT64 k = 0; k < width; k++) {
+			const BYTE* source = row + k * layout.Bytes;
+			UINT32 key = 0x1000000 |
+				(static_cast<UINT32>(source[layout.Red]) << 16) |
+				(static_cast<UINT32>(source[layout.Green]) << 8) |
+				source[layout.Blue];
+			// Runs of one color skip the lookup
+			if (key != previousKey) {
+				UINT32 slot = (key * 2654435761u) >> (32 - PALETTE_HASH_BITS);
+				while (keys[slot] != 0 && keys[slot] != key) {
+					slot = (slot + 1) & (PALETTE_HASH_SLOTS - 1);
+				}
+				if (keys[slot] == 0) {
+					if (palette.size() == maxColors) {
+						palette.clear();
+						return FALSE;
+					}
+					keys[slot] = key;
+					slotIndices[slot] = static_cast<UINT8>(palette.size());
+					palette.push_back({ source[layout.Blue], source[layout.Green], source[layout.Red] });
+				}
+				previousKey = key;
+				previousSample = static_cast<INT8>(slotIndices[slot] - 128);
+			}
+			target[k] = previousSample;
+		}
+	}
+	// An image without pixels has no colors to index
+	if (palette.empty()) {
+		return FALSE;
+	}
+	indices = YUVVectors<INT8>();
+	indices.Width = width;
+	indices.Height = height;
+	indices.Y = std::move(samples);
+	return TRUE;
+}
+
+BOOL Codec::cvtBmpToPaletteVector(
+	const BitmapFile & bitmapFile,
+	YUVVectors<INT8>& indices,
+	std::vector<IN3PaletteEntry>& palette)
+{
+	return cvtRowsToPalette(
+		reinterpret_cast<const BYTE*>(bitmapFile.getRow(0)),
+		static_cast<size_t>(bitmapFile.getWidth()) * sizeof(BitmapFile::Pixel),
+		PIXEL_FORMAT_BGR,
+		bitmapFile.getWidth(),
+		bitmapFile.getHeight(),
+		indices,
+		palette);
+}
+
+IN3ColorTransform Codec::getColorTransform(PixelFormat format) const
+{
+	return format == PIXEL_FORMAT_YUV_PLANAR ?
+		COLOR_TRANSFORM_YUV :
+		EncoderSettings.ColorTransform;
+}
+
+BOOL Codec::IsValidPixelBuffer(const PixelBuffer & pixels)
+{
+	if (pixels.Width == 0 || pixels.Height == 0) {
+		return FALSE;
+	}
+	if (pixels.Format == PIXEL_FORMAT_YUV_PLANAR) {
+		for (UINT8 p = 0; p < 3; p++) {
+			if (pixels.Planes[p] == NULL || pixels.Strides[p] < pixels.Width) {
+				return FALSE;
+			}
+		}
+		return TRUE;
+	}
+	return pixels.Format < PIXEL_FORMAT_YUV_PLANAR &&
+		pixels.Planes[0] != NULL &&
+		pixels.Strides[0] / PACKED_LAYOUTS[pixels.Format].Bytes >= pixels.Width;
+}
+
+// Candidate quantization steps tried by rate control, in increasing order
+static const UINT8 QUANTIZATION_STEPS[] = { 1, 2, 3, 4, 5, 6, 8, 10, 12, 16, 20, 24, 32, 48, 64 };
+
+// Quantize a sample to the nearest multiple of the step
+static inline INT8 quantizeSample(INT8 sample, UINT8 step)
+{
+	INT32 value = sample;
+	INT32 half = step / 2;
+	return static_cast<INT8>(value >= 0 ?
+		(value + half) / step :
+		-((half - value) / step));
+}
+
+// Reconstruct a sample from its quantized value
+static inline INT8 dequantizeSample(INT8 quantized, UINT8 step)
+{
+	INT32 value = static_cast<INT32>(quantized) * step;
+	return static_cast<INT8>(std::min(std::max(value, -128), 127));
+}
+
+// Estimated coded bits and squared error of a plane quantized with a step
+// from the histogram of its samples
+static void estimateQuantizedPlane(
+	const std::vector<UINT64>& counts,
+	UINT8 step,
+	DOUBLE& bits,
+	DOUBLE& error)
+{
+	std::array<UINT64, 256> quantizedCounts = {};
+	UINT64 total = 0;
+	error = 0.0;
+	for (INT32 i = 0; i < 256; i++) {
+		if (counts[i] == 0) {
+			continue;
+		}
+		INT8 sample = static_cast<INT8>(i - 128);
+		INT8 quantized = quantizeSample(sample, step);
+		INT32 difference = sample - dequantizeSample(quantized, step);
+		quantizedCounts[quantized + 128] += counts[i];
+		error += static_cast<DOUBLE>(counts[i]) * difference * difference;
+		total += counts[i];
+	}
+	// Huffman codes come close to the entropy but spend at least one bit
+	// on every symbol
+	bits = 0.0;
+	for (auto it = quantizedCounts.begin(); it != quantizedCounts.end(); it++) {
+		if (*it != 0) {
+			bits += static_cast<DOUBLE>(*it) * std::log2(static_cast<DOUBLE>(total) / *it);
+		}
+	}
+	bits = std::max(bits, static_cast<DOUBLE>(total));
+}
+
+IN3Header<INT8> Codec::createHeader(const YUVVectors<INT8>& yuvVectors)
+{
+	return createHeader(yuvVectors, EncoderSettings.ColorTransform);
+}
+
+IN3Header<INT8> Codec::createHeader(
+	const YUVVectors<INT8>& yuvVectors,
+	IN3ColorTransform colorTransform)
 {
 	IN3Header<INT8> header;
-	header.Width = static_cast<UINT16>(yuvVectors.getWidth());
-	header.Height = static_cast<UINT16>(yuvVectors.getHeight());
-	std::pair<LengthTable<INT8>, std::vector<bool>> compressedY =
-		huffmanEncode(yuvVectors.Y);
-	std::pair<LengthTable<INT8>, std::vector<bool>> compressedU =
-		huffmanEncode(yuvVectors.U);
-	std::pair<LengthTable<INT8>, std::vector<bool>> compressedV =
-		huffmanEncode(yuvVectors.V);
-	header.YTable = compressedY.first;
-	header.UTable = compressedU.first;
-	header.VTable = compressedV.first;
-	YUVVectors<bool> compressed;
-	compressed.Y = compressedY.second;
-	compressed.U = compressedU.second;
-	compressed.V = compressedV.second;
-	UINT32 ySize = static_cast<UINT32>(compressed.Y.size());
-	UINT32 uSize = static_cast<UINT32>(compressed.U.size());
-	UINT32 vSize = static_cast<UINT32>(compressed.V.size());
-	ySize = (ySize % 8 == 0 ? ySize : ySize + 8 - (ySize % 8)) / 8;
-	uSize = (uSize % 8 == 0 ? uSize : uSize + 8 - (uSize % 8)) / 8;
-	vSize = (vSize % 8 == 0 ? vSize : vSize + 8 - (vSize % 8)) / 8;
-	header.YSize = ySize;
-	header.USize = uSize;
-	header.VSize = vSize;
-	return std::pair<IN3Header<INT8>, YUVVectors<bool>>(header, compressed);
-}
-
-std::pair<IN3Header<INT8>, YUVVectors<bool>> Codec::cvtIn3ToYUVVector(IN3File * in3File)
-{
-	IN3Header<INT8> header = in3File->getHeader();
-	std::vector<bool> bitsReadFromFile = in3File->getBitsReadFromFile();
-	YUVVectors<bool> compressed;
-	compressed.Y.resize(header.YSize * 8);
-	compressed.U.resize(header.USize * 8);
-	compressed.V.resize(header.VSize * 8);
-	std::copy(
-		bitsReadFromFile.begin(),
-		bitsReadFromFile.begin() + header.YSize * 8,
-		compressed.Y.begin());
-	bitsReadFromFile.erase(
-		bitsReadFromFile.begin(),
-		bitsReadFromFile.begin() + header.YSize * 8);
-	std::copy(
-		bitsReadFromFile.begin(),
-		bitsReadFromFile.begin() + header.USize * 8,
-		compressed.U.begin());
-	bitsReadFromFile.erase(
-		bitsReadFromFile.begin(),
-		bitsReadFromFile.begin() + header.USize * 8);
-	std::copy(
-		bitsReadFromFile.begin(),
-		bitsReadFromFile.begin() + header.VSize * 8,
-		compressed.V.begin());
-	bitsReadFromFile.erase(
-		bitsReadFromFile.begin(),
-		bitsReadFromFile.begin() + header.VSize * 8);
-	return std::pair<IN3Header<INT8>, YUVVectors<bool>>(header, compressed);
+	header.Width = yuvVectors.getWidth();
+	header.Height = yuvVectors.getHeight();
+	header.ColorTransform = colorTransform;
+	if (colorTransform == COLOR_TRANSFORM_YUV) {
+		std::array<UINT8, 3> steps = {
+			EncoderSettings.QuantizationSteps[0],
+			EncoderSettings.QuantizationSteps[1],
+			EncoderSettings.QuantizationSteps[2] };
+		if (EncoderSettings.TargetBitsPerPixel > 0.0) {
+			steps = chooseQuantizationSteps(yuvVectors, EncoderSettings.TargetBitsPerPixel);
+		}
+		for (UINT8 p = 0; p < 3; p++) {
+			header.QuantizationSteps[p] = std::max<UINT8>(steps[p], 1);
+		}
+	}
+	return header;
+}
+
+std::array<UINT8, 3> Codec::chooseQuantizationSteps(
+	const YUVVectors<INT8>& yuvVectors,
+	DOUBLE targetBitsPerPixel)
+{
+	static const size_t STEP_COUNT = sizeof(QUANTIZATION_STEPS) / sizeof(QUANTIZATION_STEPS[0]);
+	const std::vector<INT8>* planes[3] = { &yuvVectors.Y, &yuvVectors.U, &yuvVectors.V };
+	// Estimate every candidate step of every plane from one histogram each
+	DOUBLE bits[3][STEP_COUNT];
+	DOUBLE error[3][STEP_COUNT];
+	for (UINT8 p = 0; p < 3; p++) {
+		Histogram<INT8> histogram;
+		histogram.add(*planes[p]);
+		for (size_t s = 0; s < STEP_COUNT; s++) {
+			estimateQuantizedPlane(histogram.getCounts(), QUANTIZATION_STEPS[s], bits[p][s], error[p][s]);
+		}
+	}
+	// Starting from lossless, coarsen the plane that gives up the least
+	// error per bit saved until the estimate meets the target
+	DOUBLE targetBits = targetBitsPerPixel * yuvVectors.getWidth() * yuvVectors.getHeight();
+	size_t chosen[3] = { 0, 0, 0 };
+	while (bits[0][chosen[0]] + bits[1][chosen[1]] + bits[2][chosen[2]] > targetBits) {
+		INT32 bestPlane = -1;
+		size_t bestStep = 0;
+		DOUBLE bestSlope = 0.0;
+		for (UINT8 p = 0; p < 3; p++) {
+			for (size_t s = chosen[p] + 1; s < STEP_COUNT; s++) {
+				DOUBLE saved = bits[p][chosen[p]] - bits[p][s];
+				if (saved <= 0.0) {
+					continue;
+				}
+				DOUBLE slope = (error[p][s] - error[p][chosen[p]]) / saved;
+				if (bestPlane < 0 || slope < bestSlope) {
+					bestPlane = p;
+					bestStep = s;
+					bestSlope = slope;
+				}
+			}
+		}
+		if (bestPlane < 0) {
+			break;
+		}
+		chosen[bestPlane] = bestStep;
+	}
+	std::array<UINT8, 3> steps;
+	for (UINT8 p = 0; p < 3; p++) {
+		steps[p] = QUANTIZATION_STEPS[chosen[p]];
+	}
+	return steps;
+}
+
+DOUBLE Codec::bitsPerPixelForFileSize(
+	UINT64 fileSize,
+	UINT64 width,
+	UINT64 height)
+{
+	UINT64 pixels = width * height;
+	if (pixels == 0 || fileSize <= sizeof(IN3Header<INT8>)) {
+		return 0.0;
+	}
+	return static_cast<DOUBLE>(fileSize - sizeof(IN3Header<INT8>)) * 8.0 / pixels;
+}
+
+// Store samples of a raw plane as their bytes, least significant bit first
+// so that packing the bits gives back the bytes
+static void storeRawSamples(const std::vector<INT8>& samples, std::vector<bool>& bits)
+{
+	bits.assign(samples.size() * 8, false);
+	for (size_t i = 0; i < samples.size(); i++) {
+		BYTE sample = static_cast<BYTE>(samples[i]);
+		for (UINT8 b = 0; b < 8; b++) {
+			bits[i * 8 + b] = (sample >> b) & 1;
+		}
+	}
+}
+
+// Load the samples of a raw plane starting at a bit, or none if the input
+// ends before the plane does
+static std::vector<INT8> loadRawSamples(
+	const std::vector<bool>& bits,
+	UINT64 numSymbols,
+	UINT64 firstBit)
+{
+	if (firstBit > bits.size() || numSymbols > (bits.size() - firstBit) / 8) {
+		return std::vector<INT8>();
+	}
+	std::vector<INT8> samples(static_cast<size_t>(numSymbols));
+	auto it = bits.begin() + static_cast<size_t>(firstBit);
+	for (size_t i = 0; i < samples.size(); i++) {
+		BYTE sample = 0;
+		for (UINT8 b = 0; b < 8; b++, it++) {
+			sample |= static_cast<BYTE>(*it) << b;
+		}
+		samples[i] = static_cast<INT8>(sample);
+	}
+	return samples;
+}
+
+// Append bytes to coded bits, least significant bit first like raw planes
+static void appendBytes(const BYTE* bytes, size_t size, std::vector<bool>& bits)
+{
+	for (size_t i = 0; i < size; i++) {
+		for (UINT8 b = 0; b < 8; b++) {
+			bits.push_back(((bytes[i] >> b) & 1) != 0);
+		}
+	}
+}
+
+// Read bytes appended by appendBytes at a bit position, advancing it, or
+// return FALSE if the input ends first
+static BOOL readBytes(const std::vector<bool>& bits, UINT64& position, BYTE* bytes, size_t size)
+{
+	if (position > bits.size() || size > (bits.size() - position) / 8) {
+		return FALSE;
+	}
+	auto it = bits.begin() + static_cast<size_t>(position);
+	for (size_t i = 0; i < size; i++) {
+		BYTE value = 0;
+		for (UINT8 b = 0; b < 8; b++, it++) {
+			value |= static_cast<BYTE>(*it) << b;
+		}
+		bytes[i] = value;
+	}
+	position += static_cast<UINT64>(size) * 8;
+	return TRUE;
+}
+
+// Samples per block of block coded planes, and the most tables they share
+static const UINT32 BLOCK_SAMPLES = 1 << 14;
+static const size_t MAX_BLOCK_TABLES = 8;
+// Rounds of assigning blocks to tables and rebuilding the tables
+static const UINT8 CLUSTER_ROUNDS = 4;
+
+// Bits taken by the samples counted in a histogram when coded with a table
+static UINT64 tableBits(const std::array<UINT32, 256>& counts, const LengthTable<INT8>& table)
+{
+	UINT64 bits = 0;
+	for (size_t i = 0; i < counts.size(); i++) {
+		bits += static_cast<UINT64>(counts[i]) * table[i];
+	}
+	return bits;
+}
+
+// Entropy of the samples counted in a histogram, in bits, which no table
+// built for other samples beats
+static DOUBLE entropyBits(const std::array<UINT32, 256>& counts)
+{
+	UINT64 total = 0;
+	for (auto it = counts.begin(); it != counts.end(); it++) {
+		total += *it;
+	}
+	DOUBLE bits = 0.0;
+	for (auto it = counts.begin(); it != counts.end(); it++) {
+		if (*it != 0) {
+			bits += static_cast<DOUBLE>(*it) * std::log2(static_cast<DOUBLE>(total) / *it);
+		}
+	}
+	return bits;
+}
+
+Codec::BlockTables Codec::clusterBlockTables(
+	const std::vector<INT8>& samples,
+	const LengthTable<INT8>& planeTable)
+{
+	IN3_TRACE_SCOPE("Cluster block tables");
+	size_t blockCount = (samples.size() + BLOCK_SAMPLES - 1) / BLOCK_SAMPLES;
+	std::vector<std::array<UINT32, 256>> counts(blockCount);
+	for (size_t b = 0; b < blockCount; b++) {
+		Histogram<INT8> histogram;
+		size_t first = b * BLOCK_SAMPLES;
+		histogram.add(samples.data() + first, std::min<size_t>(BLOCK_SAMPLES, samples.size() - first));
+		for (size_t i = 0; i < 256; i++) {
+			counts[b][i] = static_cast<UINT32>(histogram.getCounts()[i]);
+		}
+	}
+	// Bits of the payload with the tables and block assignment of a candidate
+	auto payloadBits = [&counts](const BlockTables& candidate) {
+		UINT64 bits = 8 + 32 + (candidate.Tables.size() - 1) * 256 * 8 + counts.size() * 8;
+		for (size_t b = 0; b < counts.size(); b++) {
+			bits += tableBits(counts[b], candidate.Tables[candidate.BlockTable[b]]);
+		}
+		return bits;
+	};
+	BlockTables best;
+	best.Tables.push_back(planeTable);
+	best.BlockTable.assign(blockCount, 0);
+	best.Bits = payloadBits(best);
+	BlockTables current = best;
+	while (current.Tables.size() < MAX_BLOCK_TABLES) {
+		// Seed a table from the block the current tables code worst
+		// compared to the entropy of its own samples
+		size_t worstBlock = 0;
+		DOUBLE worstExcess = 0.0;
+		for (size_t b = 0; b < blockCount; b++) {
+			DOUBLE excess = tableBits(counts[b], current.Tables[current.BlockTable[b]]) - entropyBits(counts[b]);
+			if (excess > worstExcess) {
+				worstBlock = b;
+				worstExcess = excess;
+			}
+		}
+		if (worstExcess <= 0.0) {
+			break;
+		}
+		FrequencyTable<INT8> seed;
+		for (size_t i = 0; i < 256; i++) {
+			seed[i] = { static_cast<INT32>(i) - 128, counts[worstBlock][i] };
+		}
+		current.Tables.push_back(huffmanLengths<INT8>(seed));
+		for (UINT8 round = 0; round < CLUSTER_ROUNDS; round++) {
+			// Move every block to the table that codes it shortest
+			for (size_t b = 0; b < blockCount; b++) {
+				UINT64 bestBits = std::numeric_limits<UINT64>::max();
+				for (size_t t = 0; t < current.Tables.size(); t++) {
+					UINT64 bits = tableBits(counts[b], current.Tables[t]);
+					if (bits < bestBits) {
+						bestBits = bits;
+						current.BlockTable[b] = static_cast<UINT8>(t);
+					}
+				}
+			}
+			// Rebuild each table from the blocks that picked it, dropping
+			// tables that none did
+			std::vector<FrequencyTable<INT8>> sums(current.Tables.size());
+			std::vector<size_t> users(current.Tables.size(), 0);
+			for (size_t t = 0; t < sums.size(); t++) {
+				for (size_t i = 0; i < 256; i++) {
+					sums[t][i] = { static_cast<INT32>(i) - 128, 0 };
+				}
+			}
+			for (size_t b = 0; b < blockCount; b++) {
+				UINT8 t = current.BlockTable[b];
+				users[t]++;
+				for (size_t i = 0; i < 256; i++) {
+					sums[t][i].Count += counts[b][i];
+				}
+			}
+			std::vector<UINT8> renumbered(current.Tables.size(), 0);
+			std::vector<LengthTable<INT8>> tables;
+			for (size_t t = 0; t < sums.size(); t++) {
+				if (users[t] != 0) {
+					renumbered[t] = static_cast<UINT8>(tables.size());
+					tables.push_back(huffmanLengths<INT8>(sums[t]));
+				}
+			}
+			for (size_t b = 0; b < blockCount; b++) {
+				current.BlockTable[b] = renumbered[current.BlockTable[b]];
+			}
+			current.Tables = std::move(tables);
+		}
+		current.Bits = payloadBits(current);
+		if (current.Bits >= best.Bits) {
+			break;
+		}
+		best = current;
+	}
+	return best;
+}
+
+void Codec::compressPlane(
+	const YUVVectors<INT8>& yuvVectors,
+	Plane plane,
+	IN3Header<INT8>& header,
+	YUVVectors<bool>& compressed)
+{
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_ENTROPY_CODING);
+	IN3_TRACE_SCOPE("Compress plane");
+	const std::vector<INT8>* input = NULL;
+	std::vector<bool>* output = NULL;
+	LengthTable<INT8>* table = NULL;
+	UINT64* size = NULL;
+	switch (plane) {
+	case PLANE_Y:
+		input = &yuvVectors.Y;
+		output = &compressed.Y;
+		table = &header.YTable;
+		size = &header.YSize;
+		break;
+	case PLANE_U:
+		input = &yuvVectors.U;
+		output = &compressed.U;
+		table = &header.UTable;
+		size = &header.USize;
+		break;
+	case PLANE_V:
+		input = &yuvVectors.V;
+		output = &compressed.V;
+		table = &header.VTable;
+		size = &header.VSize;
+		break;
+	}
+	// Quantized samples are coded in place of the originals
+	UINT8 step = header.QuantizationSteps[plane];
+	std::vector<INT8> quantized;
+	if (step > 1) {
+		quantized.resize(input->size());
+		for (size_t i = 0; i < quantized.size(); i++) {
+			quantized[i] = quantizeSample((*input)[i], step);
+		}
+		input = &quantized;
+	}
+	// The histogram decides the mode before any coding effort is spent
+	FrequencyTable<INT8> freqTable = freqCount(*input);
+	UINT32 distinctSymbols = 0;
+	INT8 constantSample = 0;
+	for (auto it = freqTable.begin(); it != freqTable.end(); it++) {
+		if (it->Count != 0) {
+			distinctSymbols++;
+			constantSample = static_cast<INT8>(it->Symbol);
+		}
+	}
+	if (distinctSymbols <= 1) {
+		header.PlaneModes[plane] = PLANE_MODE_CONSTANT;
+		header.ConstantSamples[plane] = constantSample;
+		table->fill(0);
+		output->clear();
+		*size = 0;
+		return;
+	}
+	LengthTable<INT8> lengths = huffmanLengths<INT8>(freqTable);
+	UINT64 codedBits = 0;
+	for (size_t i = 0; i < freqTable.size(); i++) {
+		codedBits += freqTable[i].Count * lengths[i];
+	}
+	// The high effort tries block tables on planes of several blocks and
+	// keeps them if they beat both the single table and raw bytes
+	if (EncoderSettings.Effort == EFFORT_HIGH && input->size() > BLOCK_SAMPLES) {
+		BlockTables blocks = clusterBlockTables(*input, lengths);
+		if (blocks.Tables.size() > 1 &&
+			blocks.Bits < codedBits &&
+			blocks.Bits < static_cast<UINT64>(input->size()) * 8) {
+			IN3_TRACE_SCOPE("Code blocks");
+			header.PlaneModes[plane] = PLANE_MODE_BLOCKS;
+			*table = blocks.Tables[0];
+			output->clear();
+			output->reserve(static_cast<size_t>(blocks.Bits));
+			BYTE tableCount = static_cast<BYTE>(blocks.Tables.size());
+			BYTE blockSamples[4] = {
+				static_cast<BYTE>(BLOCK_SAMPLES),
+				static_cast<BYTE>(BLOCK_SAMPLES >> 8),
+				static_cast<BYTE>(BLOCK_SAMPLES >> 16),
+				static_cast<BYTE>(BLOCK_SAMPLES >> 24) };
+			appendBytes(&tableCount, 1, *output);
+			appendBytes(blockSamples, 4, *output);
+			for (size_t t = 1; t < blocks.Tables.size(); t++) {
+				appendBytes(blocks.Tables[t].data(), blocks.Tables[t].size(), *output);
+			}
+			appendBytes(blocks.BlockTable.data(), blocks.BlockTable.size(), *output);
+			std::vector<CodeTable<INT8>> codes;
+			codes.reserve(blocks.Tables.size());
+			for (size_t t = 0; t < blocks.Tables.size(); t++) {
+				codes.push_back(huffmanCodes<INT8>(blocks.Tables[t]));
+			}
+			for (size_t b = 0; b < blocks.BlockTable.size(); b++) {
+				auto first = input->begin() + b * BLOCK_SAMPLES;
+				auto last = input->begin() + std::min<size_t>((b + 1) * BLOCK_SAMPLES, input->size());
+				huffmanEncodeWithCodes<INT8>(codes[blocks.BlockTable[b]], first, last, *output);
+			}
+			UINT64 numBits = output->size();
+			*size = (numBits % 8 == 0 ? numBits : numBits + 8 - (numBits % 8)) / 8;
+			return;
+		}
+	}
+	if (codedBits >= static_cast<UINT64>(input->size()) * 8) {
+		header.PlaneModes[plane] = PLANE_MODE_RAW;
+		table->fill(0);
+		storeRawSamples(*input, *output);
+		*size = input->size();
+		return;
+	}
+	// The histogram gave the coded size, so the output grows only once
+	header.PlaneModes[plane] = PLANE_MODE_HUFFMAN;
+	*table = lengths;
+	output->clear();
+	output->reserve(static_cast<size_t>(codedBits));
+	huffmanEncodeWithCodes<INT8>(huffmanCodes<INT8>(lengths), input->begin(), input->end(), *output);
+	UINT64 numBits = output->size();
+	*size = (numBits % 8 == 0 ? numBits : numBits + 8 - (numBits % 8)) / 8;
+}
+
+void Codec::compressYUVVector(
+	const YUVVectors<INT8>& yuvVectors,
+	IN3ColorTransform colorTransform,
+	IN3Header<INT8>& header,
+	YUVVectors<bool>& compressed)
+{
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_ENTROPY_CODING);
+	header = createHeader(yuvVectors, colorTransform);
+	compressed.Width = yuvVectors.getWidth();
+	compressed.Height = yuvVectors.getHeight();
+	compressPlane(yuvVectors, PLANE_Y, header, compressed);
+	compressPlane(yuvVectors, PLANE_U, header, compressed);
+	compressPlane(yuvVectors, PLANE_V, header, compressed);
+}
+
+std::vector<INT8> Codec::decompressPlane(
+	const IN3Header<INT8>& header,
+	Plane plane,
+	const std::vector<bool>& bits,
+	UINT64 numSymbols,
+	UINT64 firstBit)
+{
+	IN3_TRACE_SCOPE("Decompress plane");
+	const LengthTable<INT8>* tables[3] = { &header.YTable, &header.UTable, &header.VTable };
+	std::vector<INT8> samples;
+	switch (header.PlaneModes[plane]) {
+	case PLANE_MODE_HUFFMAN:
+		samples = huffmanDecode<INT8>(
+			*tables[plane],
+			bits,
+			static_cast<size_t>(numSymbols),
+			static_cast<size_t>(firstBit));
+		break;
+	case PLANE_MODE_CONSTANT:
+		samples.assign(static_cast<size_t>(numSymbols), header.ConstantSamples[plane]);
+		break;
+	case PLANE_MODE_RAW:
+		samples = loadRawSamples(bits, numSymbols, firstBit);
+		break;
+	case PLANE_MODE_BLOCKS:
+		samples = decompressBlocks(*tables[plane], bits, numSymbols, firstBit);
+		break;
+	default:
+		// Unknown modes decode nothing, like a damaged plane
+		break;
+	}
+	UINT8 step = header.QuantizationSteps[plane];
+	if (step > 1) {
+		for (auto it = samples.begin(); it != samples.end(); it++) {
+			*it = dequantizeSample(*it, step);
+		}
+	}
+	return samples;
+}
+
+std::vector<INT8> Codec::decompressBlocks(
+	const LengthTable<INT8>& firstTable,
+	const std::vector<bool>& bits,
+	UINT64 numSymbols,
+	UINT64 firstBit)
+{
+	UINT64 position = firstBit;
+	BYTE tableCount = 0;
+	BYTE blockSampleBytes[4];
+	if (!readBytes(bits, position, &tableCount, 1) ||
+		!readBytes(bits, position, blockSampleBytes, 4)) {
+		return std::vector<INT8>();
+	}
+	UINT32 blockSamples =
+		static_cast<UINT32>(blockSampleBytes[0]) |
+		static_cast<UINT32>(blockSampleBytes[1]) << 8 |
+		static_cast<UINT32>(blockSampleBytes[2]) << 16 |
+		static_cast<UINT32>(blockSampleBytes[3]) << 24;
+	if (tableCount == 0 || blockSamples == 0) {
+		return std::vector<INT8>();
+	}
+	std::vector<LengthTable<INT8>> tables(tableCount);
+	tables[0] = firstTable;
+	for (size_t t = 1; t < tables.size(); t++) {
+		if (!readBytes(bits, position, tables[t].data(), tables[t].size())) {
+			return std::vector<INT8>();
+		}
+	}
+	// A damaged block count cannot be larger than the bits left
+	UINT64 blockCount = numSymbols / blockSamples + (numSymbols % blockSamples != 0 ? 1 : 0);
+	if (position > bits.size() || blockCount > (bits.size() - position) / 8) {
+		return std::vector<INT8>();
+	}
+	std::vector<BYTE> blockTables(static_cast<size_t>(blockCount));
+	readBytes(bits, position, blockTables.data(), blockTables.size());
+	// The codes of each table are assigned once for all its blocks
+	std::vector<DecodeTable<INT8>> decodeTables;
+	decodeTables.reserve(tables.size());
+	for (size_t t = 0; t < tables.size(); t++) {
+		decodeTables.push_back(huffmanDecodeTable<INT8>(tables[t]));
+	}
+	std::vector<INT8> samples;
+	samples.reserve(static_cast<size_t>(numSymbols));
+	// Blocks are not padded, so each one starts where the codes of the
+	// previous one end
+	size_t blockPosition = static_cast<size_t>(position);
+	for (size_t b = 0; b < blockTables.size(); b++) {
+		if (blockTables[b] >= tables.size()) {
+			break;
+		}
+		UINT64 count = std::min<UINT64>(blockSamples, numSymbols - samples.size());
+		std::vector<INT8> block = huffmanDecodeWithCodes<INT8>(
+			decodeTables[blockTables[b]],
+			bits,
+			static_cast<size_t>(count),
+			blockPosition);
+		samples.insert(samples.end(), block.begin(), block.end());
+		if (block.size() != count) {
+			break;
+		}
+	}
+	return samples;
 }
 
 YUVVectors<INT8> Codec::decompressYUVVector(
 	const IN3Header<INT8>& header,
-	YUVVectors<bool>& yuvVectors)
-{
-	INT32 numSymbols = header.Width * header.Height;
-	std::vector<INT8> yVec = huffmanDecode<INT8>(
-		header.YTable,
-		yuvVectors.Y,
-		numSymbols);
-	std::vector<INT8> uVec = huffmanDecode<INT8>(
-		header.UTable,
-		yuvVectors.U,
-		numSymbols);
-	std::vector<INT8> vVec = huffmanDecode<INT8>(
-		header.VTable,
-		yuvVectors.V,
-		numSymbols);
-	YUVVectors<INT8> yuvVec(header.Width, header.Height);
-	yuvVec.Y = yVec;
-	yuvVec.U = uVec;
-	yuvVec.V = vVec;
+	const std::vector<bool>& bits)
+{
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_ENTROPY_CODING);
+	UINT64 numSymbols = header.Width * header.Height;
+	// Each plane is decoded straight from its offset in the file bits
+	YUVVectors<INT8> yuvVec;
+	yuvVec.Width = header.Width;
+	yuvVec.Height = header.Height;
+	std::vector<INT8>* planes[3] = { &yuvVec.Y, &yuvVec.U, &yuvVec.V };
+	UINT64 firstBits[3] = { 0, header.YSize * 8, (header.YSize + header.USize) * 8 };
+	for (UINT8 p = 0; p < 3; p++) {
+		*planes[p] = decompressPlane(header, static_cast<Plane>(p), bits, numSymbols, firstBits[p]);
+	}
 	return yuvVec;
 }
 
-BitmapFile * Codec::cvtYUVVectorToBmp(const YUVVectors<INT8>& yuvVectors)
+std::vector<INT8> Codec::decompressPaletteIndices(const IN3File & in3File)
+{
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_ENTROPY_CODING);
+	const IN3Header<INT8>& header = in3File.getHeader();
+	const std::vector<IN3PaletteEntry>& palette = in3File.getPalette();
+	UINT64 numSymbols = header.Width * header.Height;
+	if (palette.empty() || palette.size() != header.PaletteSize) {
+		return std::vector<INT8>();
+	}
+	// Only the Y plane holds samples, the U and V planes are empty
+	std::vector<INT8> indices = decompressPlane(
+		header,
+		PLANE_Y,
+		in3File.getBitsReadFromFile(),
+		numSymbols,
+		0);
+	if (indices.size() != numSymbols) {
+		return std::vector<INT8>();
+	}
+	for (auto it = indices.begin(); it != indices.end(); it++) {
+		if (static_cast<size_t>(*it + 128) >= palette.size()) {
+			return std::vector<INT8>();
+		}
+	}
+	return indices;
+}
+
+std::vector<INT8> Codec::decompressLumaSamples(const IN3File & in3File)
 {
-	INT32 width = static_cast<INT32>(yuvVectors.getWidth());
-	INT32 height = static_cast<INT32>(yuvVectors.getHeight());
-	BitmapFile* bitmapFile = new BitmapFile(width, height);
-	INT32 i = 0;
-	for (INT32 j = 0; j < height; j++) {
-		for (INT32 k = 0; k < width; k++) {
-			YUV yuvValue;
-			yuvValue.Y = static_cast<DOUBLE>(yuvVectors.Y[i] + 128) / 255.0;
-			yuvValue.U = static_cast<DOUBLE>(yuvVectors.U[i] + 128) / 255.0;
-			yuvValue.V = static_cast<DOUBLE>(yuvVectors.V[i] + 128) / 255.0;
-			NormalizedRGB rgb = YUVtoNormalizedRGB(yuvValue);
-			BitmapFile::Pixel pixel = NormalizedRGBtoPixel(rgb);
-			bitmapFile->setPixel(k, j, pixel);
-			i++;
+	if (in3File.getHeader().ColorTransform == COLOR_TRANSFORM_PALETTE) {
+		// The luma of every palette entry is looked up by index
+		std::vector<INT8> indices = decompressPaletteIndices(in3File);
+		const std::vector<IN3PaletteEntry>& palette = in3File.getPalette();
+		INT8 lumaTable[IN3_MAX_PALETTE_SIZE] = {};
+		for (size_t i = 0; i < palette.size() && !indices.empty(); i++) {
+			BitmapFile::Pixel pixel = { palette[i].Blue, palette[i].Green, palette[i].Red };
+			INT8 u;
+			INT8 v;
+			cvtPixelToYUV(pixel, lumaTable[i], u, v);
+		}
+		for (auto it = indices.begin(); it != indices.end(); it++) {
+			*it = lumaTable[static_cast<UINT8>(*it + 128)];
+		}
+		return indices;
+	}
+	const IN3Header<INT8>& header = in3File.getHeader();
+	UINT64 numSymbols = header.Width * header.Height;
+	if (header.ColorTransform == COLOR_TRANSFORM_YUV) {
+		MemoryAccounting::Scope memoryScope(MEMORY_STAGE_ENTROPY_CODING);
+		std::vector<INT8> luma = decompressPlane(
+			header,
+			PLANE_Y,
+			in3File.getBitsReadFromFile(),
+			numSymbols,
+			0);
+		if (luma.size() != numSymbols) {
+			luma.clear();
+		}
+		return luma;
+	}
+	YUVVectors<INT8> yuv = decompressYUVVector(
+		header,
+		in3File.getBitsReadFromFile());
+	if (yuv.Y.size() != numSymbols ||
+		yuv.U.size() != numSymbols ||
+		yuv.V.size() != numSymbols) {
+		return std::vector<INT8>();
+	}
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_COLOR_CONVERSION);
+	UINT64 width = header.Width;
+	std::vector<BitmapFile::Pixel> row(static_cast<size_t>(width));
+	for (UINT64 j = 0; j < header.Height; j++) {
+		UINT64 offset = j * width;
+		YCoCgRtoPixels(
+			yuv.Y.data() + offset,
+			yuv.U.data() + offset,
+			yuv.V.data() + offset,
+			row.data(),
+			row.size());
+		// The Y plane is overwritten by the luma of the pixels it gave
+		for (UINT64 k = 0; k < width; k++) {
+			INT8 u;
+			INT8 v;
+			cvtPixelToYUV(row[static_cast<size_t>(k)], yuv.Y[static_cast<size_t>(offset + k)], u, v);
 		}
 	}
+	return std::move(yuv.Y);
+}
+
+std::unique_ptr<BitmapFile> Codec::cvtYUVVectorToBmp(
+	const YUVVectors<INT8>& yuvVectors,
+	IN3ColorTransform colorTransform)
+{
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_COLOR_CONVERSION);
+	IN3_TRACE_SCOPE("Inverse color conversion");
+	UINT64 width = yuvVectors.getWidth();
+	UINT64 height = yuvVectors.getHeight();
+	std::unique_ptr<BitmapFile> bitmapFile(new BitmapFile(
+		static_cast<INT32>(width),
+		static_cast<INT32>(height)));
+	std::vector<BitmapFile::Pixel> scratch;
+	for (UINT64 j = 0; j < height; j++) {
+		UINT64 offset = j * width;
+		cvtYUVToRow(
+			yuvVectors.Y.data() + offset,
+			yuvVectors.U.data() + offset,
+			yuvVectors.V.data() + offset,
+			colorTransform,
+			PIXEL_FORMAT_BGR,
+			static_cast<size_t>(width),
+			reinterpret_cast<BYTE*>(bitmapFile->getRow(static_cast<UINT32>(j))),
+			scratch);
+	}
 	return bitmapFile;
 }
 
-IN3File* Codec::compress(BitmapFile * bitmapFile)
+BOOL Codec::cvtYUVVectorToPixels(
+	const YUVVectors<INT8>& yuvVectors,
+	IN3ColorTransform colorTransform,
+	const PixelBuffer & pixels)
+{
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_COLOR_CONVERSION);
+	IN3_TRACE_SCOPE("Inverse color conversion");
+	UINT64 width = yuvVectors.getWidth();
+	UINT64 height = yuvVectors.getHeight();
+	if (!IsValidPixelBuffer(pixels) || pixels.Width != width || pixels.Height != height) {
+		return FALSE;
+	}
+	std::vector<BitmapFile::Pixel> scratch;
+	if (pixels.Format == PIXEL_FORMAT_YUV_PLANAR) {
+		const std::vector<INT8>* planes[3] = { &yuvVectors.Y, &yuvVectors.U, &yuvVectors.V };
+		for (UINT64 j = 0; j < height; j++) {
+			UINT64 offset = j * width;
+			BYTE* rows[3];
+			for (UINT8 p = 0; p < 3; p++) {
+				rows[p] = pixels.Planes[p] + j * pixels.Strides[p];
+			}
+			if (colorTransform == COLOR_TRANSFORM_YUV) {
+				for (UINT8 p = 0; p < 3; p++) {
+					const INT8* samples = planes[p]->data() + offset;
+					for (UINT64 k = 0; k < width; k++) {
+						rows[p][k] = static_cast<BYTE>(samples[k] + 128);
+					}
+				}
+				continue;
+			}
+			// YCoCg-R planes go through pixels to reach YUV samples
+			scratch.resize(static_cast<size_t>(width));
+			YCoCgRtoPixels(
+				yuvVectors.Y.data() + offset,
+				yuvVectors.U.data() + offset,
+				yuvVectors.V.data() + offset,
+				scratch.data(),
+				static_cast<size_t>(width));
+			for (UINT64 k = 0; k < width; k++) {
+				INT8 y;
+				INT8 u;
+				INT8 v;
+				cvtPixelToYUV(scratch[k], y, u, v);
+				rows[0][k] = static_cast<BYTE>(y + 128);
+				rows[1][k] = static_cast<BYTE>(u + 128);
+				rows[2][k] = static_cast<BYTE>(v + 128);
+			}
+		}
+		return TRUE;
+	}
+	for (UINT64 j = 0; j < height; j++) {
+		UINT64 offset = j * width;
+		cvtYUVToRow(
+			yuvVectors.Y.data() + offset,
+			yuvVectors.U.data() + offset,
+			yuvVectors.V.data() + offset,
+			colorTransform,
+			pixels.Format,
+			static_cast<size_t>(width),
+			pixels.Planes[0] + j * pixels.Strides[0],
+			scratch);
+	}
+	return TRUE;
+}
+
+std::unique_ptr<IN3File> Codec::compress(const BitmapFile & bitmapFile)
+{
+	YUVVectors<INT8> planes;
+	std::vector<IN3PaletteEntry> palette;
+	IN3ColorTransform colorTransform = COLOR_TRANSFORM_PALETTE;
+	if (!cvtBmpToPaletteVector(bitmapFile, planes, palette)) {
+		planes = cvtBmpToYUVVector(bitmapFile);
+		colorTransform = EncoderSettings.ColorTransform;
+	}
+	IN3Header<INT8> header;
+	YUVVectors<bool> compressed;
+	compressYUVVector(planes, colorTransform, header, compressed);
+	return std::unique_ptr<IN3File>(new IN3File(
+		header,
+		std::move(compressed),
+		palette));
+}
+
+std::unique_ptr<IN3File> Codec::compress(const PixelBuffer & pixels)
+{
+	if (!IsValidPixelBuffer(pixels)) {
+		return std::unique_ptr<IN3File>();
+	}
+	YUVVectors<INT8> planes;
+	std::vector<IN3PaletteEntry> palette;
+	IN3ColorTransform colorTransform = COLOR_TRANSFORM_PALETTE;
+	if (pixels.Format == PIXEL_FORMAT_YUV_PLANAR ||
+		!cvtRowsToPalette(
+			pixels.Planes[0],
+			pixels.Strides[0],
+			pixels.Format,
+			pixels.Width,
+			pixels.Height,
+			planes,
+			palette)) {
+		planes = cvtPixelsToYUVVector(pixels);
+		colorTransform = getColorTransform(pixels.Format);
+	}
+	IN3Header<INT8> header;
+	YUVVectors<bool> compressed;
+	compressYUVVector(planes, colorTransform, header, compressed);
+	return std::unique_ptr<IN3File>(new IN3File(
+		header,
+		std::move(compressed),
+		palette));
+}
+
+std::unique_ptr<BitmapFile> Codec::decompress(const IN3File& in3File)
+{
+	const IN3Header<INT8>& header = in3File.getHeader();
+	if (!IN3File::IsValidHeader(header)) {
+		return std::unique_ptr<BitmapFile>();
+	}
+	if (header.ColorTransform == COLOR_TRANSFORM_PALETTE) {
+		std::vector<INT8> indices = decompressPaletteIndices(in3File);
+		if (indices.size() != header.Width * header.Height) {
+			return std::unique_ptr<BitmapFile>();
+		}
+		MemoryAccounting::Scope memoryScope(MEMORY_STAGE_COLOR_CONVERSION);
+		IN3_TRACE_SCOPE("Palette lookup");
+		std::unique_ptr<BitmapFile> bitmapFile(new BitmapFile(
+			static_cast<INT32>(header.Width),
+			static_cast<INT32>(header.Height)));
+		for (UINT64 j = 0; j < header.Height; j++) {
+			cvtPaletteToRow(
+				indices.data() + j * header.Width,
+				in3File.getPalette(),
+				PIXEL_FORMAT_BGR,
+				static_cast<size_t>(header.Width),
+				reinterpret_cast<BYTE*>(bitmapFile->getRow(static_cast<UINT32>(j))));
+		}
+		return bitmapFile;
+	}
+	YUVVectors<INT8> yuv = decompressYUVVector(
+		header,
+		in3File.getBitsReadFromFile());
+	// A damaged or truncated file decodes fewer samples than it has pixels
+	UINT64 numSymbols = header.Width * header.Height;
+	if (yuv.Y.size() != numSymbols ||
+		yuv.U.size() != numSymbols ||
+		yuv.V.size() != numSymbols) {
+		return std::unique_ptr<BitmapFile>();
+	}
+	return cvtYUVVectorToBmp(
+		yuv,
+		static_cast<IN3ColorTransform>(header.ColorTransform));
+}
+
+BOOL Codec::decompress(const IN3File & in3File, const PixelBuffer & pixels)
 {
-	YUVVectors<INT8> yuv = cvtBmpToYUVVector(bitmapFile);
-	std::pair<IN3Header<INT8>, YUVVectors<bool>> compressed =
-		compressYUVVector(yuv);
-	IN3File* in3File = new IN3File(
-		compressed.first,
-		compressed.second);
-	return in3File;
+	const IN3Header<INT8>& header = in3File.getHeader();
+	// Checked first so that nothing is decoded for a buffer that cannot
+	// hold the image
+	if (!IN3File::IsValidHeader(header) ||
+		!IsValidPixelBuffer(pixels) ||
+		pixels.Width != header.Width ||
+		pixels.Height != header.Height) {
+		return FALSE;
+	}
+	if (header.ColorTransform == COLOR_TRANSFORM_PALETTE) {
+		std::vector<INT8> indices = decompressPaletteIndices(in3File);
+		if (indices.size() != header.Width * header.Height) {
+			return FALSE;
+		}
+		MemoryAccounting::Scope memoryScope(MEMORY_STAGE_COLOR_CONVERSION);
+		IN3_TRACE_SCOPE("Palette lookup");
+		const std::vector<IN3PaletteEntry>& palette = in3File.getPalette();
+		if (pixels.Format == PIXEL_FORMAT_YUV_PLANAR) {
+			// Planar YUV samples of every entry are looked up by index
+			BYTE samples[3][IN3_MAX_PALETTE_SIZE];
+			for (size_t i = 0; i < palette.size(); i++) {
+				BitmapFile::Pixel pixel = { palette[i].Blue, palette[i].Green, palette[i].Red };
+				INT8 yuvSamples[3];
+				cvtPixelToYUV(pixel, yuvSamples[0], yuvSamples[1], yuvSamples[2]);
+				for (UINT8 p = 0; p < 3; p++) {
+					samples[p][i] = static_cast<BYTE>(yuvSamples[p] + 128);
+				}
+			}
+			for (UINT64 j = 0; j < header.Height; j++) {
+				const INT8* row = indices.data() + j * header.Width;
+				for (UINT8 p = 0; p < 3; p++) {
+					BYTE* target = pixels.Planes[p] + j * pixels.Strides[p];
+					for (UINT64 k = 0; k < header.Width; k++) {
+						target[k] = samples[p][static_cast<UINT8>(row[k] + 128)];
+					}
+				}
+			}
+			return TRUE;
+		}
+		for (UINT64 j = 0; j < header.Height; j++) {
+			cvtPaletteToRow(
+				indices.data() + j * header.Width,
+				palette,
+				pixels.Format,
+				static_cast<size_t>(header.Width),
+				pixels.Planes[0] + j * pixels.Strides[0]);
+		}
+		return TRUE;
+	}
+	YUVVectors<INT8> yuv = decompressYUVVector(
+		header,
+		in3File.getBitsReadFromFile());
+	UINT64 numSymbols = header.Width * header.Height;
+	if (yuv.Y.size() != numSymbols ||
+		yuv.U.size() != numSymbols ||
+		yuv.V.size() != numSymbols) {
+		return FALSE;
+	}
+	return cvtYUVVectorToPixels(
+		yuv,
+		static_cast<IN3ColorTransform>(header.ColorTransform),
+		pixels);
 }
 
-BitmapFile * Codec::decompress(IN3File* in3File)
+#ifdef _WIN32
+BOOL Codec::decompress(const IN3File & in3File, BitmapWriter & writer)
 {
-	std::pair<IN3Header<INT8>, YUVVectors<bool>> compressed =
-		cvtIn3ToYUVVector(in3File);
+	const IN3Header<INT8>& header = in3File.getHeader();
+	if (!IN3File::IsValidHeader(header) ||
+		!writer.isValid() ||
+		static_cast<UINT64>(writer.getWidth()) != header.Width ||
+		static_cast<UINT64>(writer.getHeight()) != header.Height) {
+		return FALSE;
+	}
+	if (header.ColorTransform == COLOR_TRANSFORM_PALETTE) {
+		std::vector<INT8> indices = decompressPaletteIndices(in3File);
+		if (indices.size() != header.Width * header.Height) {
+			return FALSE;
+		}
+		MemoryAccounting::Scope memoryScope(MEMORY_STAGE_COLOR_CONVERSION);
+		IN3_TRACE_SCOPE("Palette lookup");
+		for (UINT64 j = 0; j < header.Height && writer.isValid(); j++) {
+			UINT32 y = static_cast<UINT32>(j);
+			cvtPaletteToRow(
+				indices.data() + j * header.Width,
+				in3File.getPalette(),
+				writer.getPixelFormat(),
+				static_cast<size_t>(header.Width),
+				writer.getRow(y));
+			writer.commitRow(y);
+		}
+		return writer.isValid();
+	}
 	YUVVectors<INT8> yuv = decompressYUVVector(
-		compressed.first,
-		compressed.second);
-	BitmapFile* bitmapFile = cvtYUVVectorToBmp(yuv);
+		header,
+		in3File.getBitsReadFromFile());
+	UINT64 numSymbols = header.Width * header.Height;
+	if (yuv.Y.size() != numSymbols ||
+		yuv.U.size() != numSymbols ||
+		yuv.V.size() != numSymbols) {
+		return FALSE;
+	}
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_COLOR_CONVERSION);
+	IN3_TRACE_SCOPE("Inverse color conversion");
+	UINT64 width = header.Width;
+	std::vector<BitmapFile::Pixel> scratch;
+	for (UINT64 j = 0; j < header.Height && writer.isValid(); j++) {
+		UINT64 offset = j * width;
+		UINT32 y = static_cast<UINT32>(j);
+		cvtYUVToRow(
+			yuv.Y.data() + offset,
+			yuv.U.data() + offset,
+			yuv.V.data() + offset,
+			static_cast<IN3ColorTransform>(header.ColorTransform),
+			writer.getPixelFormat(),
+			static_cast<size_t>(width),
+			writer.getRow(y),
+			scratch);
+		writer.commitRow(y);
+	}
+	return writer.isValid();
+}
+#endif
+
+std::unique_ptr<BitmapFile> Codec::decompressLuma(const IN3File & in3File)
+{
+	if (!IN3File::IsValidHeader(in3File.getHeader())) {
+		return std::unique_ptr<BitmapFile>();
+	}
+	std::vector<INT8> luma = decompressLumaSamples(in3File);
+	if (luma.empty()) {
+		return std::unique_ptr<BitmapFile>();
+	}
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_COLOR_CONVERSION);
+	const IN3Header<INT8>& header = in3File.getHeader();
+	UINT64 width = header.Width;
+	std::unique_ptr<BitmapFile> bitmapFile(new BitmapFile(
+		static_cast<INT32>(width),
+		static_cast<INT32>(header.Height)));
+	for (UINT64 j = 0; j < header.Height; j++) {
+		const INT8* samples = luma.data() + j * width;
+		BitmapFile::Pixel* pixels = bitmapFile->getRow(static_cast<UINT32>(j));
+		for (UINT64 k = 0; k < width; k++) {
+			BYTE gray = static_cast<BYTE>(samples[k] + 128);
+			pixels[k] = { gray, gray, gray };
+		}
+	}
 	return bitmapFile;
 }
 
+BOOL Codec::decompressLuma(const IN3File & in3File, BYTE * luma, size_t stride)
+{
+	const IN3Header<INT8>& header = in3File.getHeader();
+	UINT64 width = header.Width;
+	if (!IN3File::IsValidHeader(header) ||
+		luma == NULL || width == 0 || header.Height == 0 || stride < width) {
+		return FALSE;
+	}
+	std::vector<INT8> samples = decompressLumaSamples(in3File);
+	if (samples.empty()) {
+		return FALSE;
+	}
+	for (UINT64 j = 0; j < header.Height; j++) {
+		const INT8* row = samples.data() + j * width;
+		BYTE* target = luma + j * stride;
+		for (UINT64 k = 0; k < width; k++) {
+			target[k] = static_cast<BYTE>(row[k] + 128);
+		}
+	}
+	return TRUE;
+}
+
+// Median edge detecting prediction of a sample from its left, upper and
+// upper left neighbors, as used by LOCO-I
+static inline UINT16 predictWideSample(
+	const std::vector<UINT16>& samples,
+	UINT64 width,
+	UINT64 x,
+	UINT64 y)
+{
+	UINT64 i = y * width + x;
+	if (y == 0) {
+		return x == 0 ? 0 : samples[i - 1];
+	}
+	if (x == 0) {
+		return samples[i - width];
+	}
+	INT32 a = samples[i - 1];
+	INT32 b = samples[i - width];
+	INT32 c = samples[i - width - 1];
+	if (c >= std::max(a, b)) {
+		return static_cast<UINT16>(std::min(a, b));
+	}
+	if (c <= std::min(a, b)) {
+		return static_cast<UINT16>(std::max(a, b));
+	}
+	return static_cast<UINT16>(a + b - c);
+}
+
+std::unique_ptr<IN3WideFile> Codec::compressWide(const WideImage & image)
+{
+	// Every plane coded must hold a sample for each pixel
+	UINT8 planeCount = std::min<UINT8>(image.PlaneCount, 3);
+	for (UINT8 p = 0; p < planeCount; p++) {
+		if ((image.Height != 0 && image.Width > std::numeric_limits<size_t>::max() / image.Height) ||
+			image.Planes[p].size() != image.Width * image.Height) {
+			return NULL;
+		}
+	}
+	IN3WideHeader header;
+	header.SampleBits = image.SampleBits;
+	header.PlaneCount = planeCount;
+	header.Width = image.Width;
+	header.Height = image.Height;
+	UINT64 width = image.Width;
+	UINT64 height = image.Height;
+	std::vector<UINT16> planes[3];
+	for (UINT8 p = 0; p < header.PlaneCount; p++) {
+		planes[p] = image.Planes[p];
+	}
+	if (header.PlaneCount == 3 &&
+		EncoderSettings.ColorTransform == COLOR_TRANSFORM_YCOCG_R) {
+		RGB16toYCoCgR(
+			planes[0].data(),
+			planes[1].data(),
+			planes[2].data(),
+			static_cast<size_t>(width * height));
+		header.ColorTransform = COLOR_TRANSFORM_YCOCG_R;
+	}
+	std::vector<BYTE> coded[3];
+	for (UINT8 p = 0; p < header.PlaneCount; p++) {
+		// Prediction residuals wrap modulo 65536 so they stay 16-bit
+		std::vector<INT16> residuals(planes[p].size());
+		for (UINT64 y = 0; y < height; y++) {
+			for (UINT64 x = 0; x < width; x++) {
+				UINT64 i = y * width + x;
+				residuals[i] = static_cast<INT16>(
+					planes[p][i] - predictWideSample(planes[p], width, x, y));
+			}
+		}
+		SparseLengthTable<INT16> table = SparseHuffman<INT16>::buildTable(residuals);
+		coded[p] = SparseHuffman<INT16>::serialize(table);
+		std::vector<BYTE> bits = IN3File::PackBits(
+			SparseHuffman<INT16>::encode(table, residuals));
+		coded[p].insert(coded[p].end(), bits.begin(), bits.end());
+		header.PlaneSize[p] = coded[p].size();
+	}
+	return std::unique_ptr<IN3WideFile>(new IN3WideFile(header, coded));
+}
+
+BOOL Codec::decompressWide(const IN3WideFile & in3WideFile, WideImage & image)
+{
+	if (!in3WideFile.isValid()) {
+		return FALSE;
+	}
+	const IN3WideHeader& header = in3WideFile.getHeader();
+	UINT64 width = header.Width;
+	UINT64 height = header.Height;
+	// The dimensions are limited like those of 8-bit files, and their
+	// product must be indexable before it is checked against each plane
+	static const UINT64 MAX_DIMENSION = std::numeric_limits<INT32>::max();
+	if (width > MAX_DIMENSION ||
+		height > MAX_DIMENSION ||
+		(height != 0 && width > std::numeric_limits<size_t>::max() / height)) {
+		return FALSE;
+	}
+	UINT64 numSymbols = width * height;
+	image.Width = width;
+	image.Height = height;
+	image.SampleBits = header.SampleBits;
+	image.PlaneCount = header.PlaneCount;
+	for (UINT8 p = 0; p < header.PlaneCount; p++) {
+		const std::vector<BYTE>& plane = in3WideFile.getPlane(p);
+		SparseLengthTable<INT16> table;
+		UINT64 tableSize = 0;
+		if (!SparseHuffman<INT16>::deserialize(plane.data(), plane.size(), table, tableSize)) {
+			return FALSE;
+		}
+		// Every code is at least a bit long, so a plane cannot hold more
+		// samples than it has bits
+		UINT64 payloadSize = plane.size() - tableSize;
+		if (numSymbols > payloadSize * 8) {
+			return FALSE;
+		}
+		std::vector<bool> bits;
+		IN3File::UnpackBits(plane.data() + tableSize, payloadSize, bits);
+		size_t bitPosition = 0;
+		std::vector<INT16> residuals = SparseHuffman<INT16>::decode(
+			table,
+			bits,
+			bitPosition,
+			static_cast<size_t>(numSymbols));
+		if (residuals.size() != numSymbols) {
+			return FALSE;
+		}
+		std::vector<UINT16>& samples = image.Planes[p];
+		samples.resize(static_cast<size_t>(numSymbols));
+		for (UINT64 y = 0; y < height; y++) {
+			for (UINT64 x = 0; x < width; x++) {
+				UINT64 i = y * width + x;
+				samples[i] = static_cast<UINT16>(
+					residuals[i] + predictWideSample(samples, width, x, y));
+			}
+		}
+	}
+	if (header.PlaneCount == 3 &&
+		header.ColorTransform == COLOR_TRANSFORM_YCOCG_R) {
+		YCoCgR16toRGB(
+			image.Planes[0].data(),
+			image.Planes[1].data(),
+			image.Planes[2].data(),
+			static_cast<size_t>(numSymbols));
+	}
+	return TRUE;
+}
+
+const Codec::Settings & Codec::getSettings() const
+{
+	return EncoderSettings;
+}
+
+void Codec::setSettings(const Settings & settings)
+{
+	EncoderSettings = settings;
+}
+
 Codec::Codec()
 {
 }
+
+Codec::Codec(const Settings & settings)
+	: EncoderSettings(settings)
+{
+}
@@ -5,31 +5,181 @@
 #include <vector>
 #include <queue>
 #include <map>
+#include <memory>
 #include <utility>
 #include <limits>
 #include <math.h>
 #include "BitmapUtility.h"
 #include "BitmapFile.h"
 #include "commontypes.h"
+#include "Histogram.h"
 #include "IN3File.h"
 
 // Forward declaration of class dependencies
+class BitmapWriter;
 class IN3File;
+class IN3WideFile;
 
 class Codec : public BitmapUtility
 {
-private:
+public:
+	// Encoder effort levels, trading coding time for size
+	enum EncoderEffort : UINT8 {
+		// One code table per plane built from the histogram of the plane
+		EFFORT_DEFAULT = 0,
+		// Planes are also split into blocks whose histograms are clustered
+		// into a few shared code tables, each block picking the table that
+		// codes it shortest, when that beats the single table
+		EFFORT_HIGH = 1
+	};
+	// Encoder settings
+	struct Settings {
+		// How much coding time is spent on smaller planes
+		EncoderEffort Effort = EFFORT_DEFAULT;
+		// Color transform applied before entropy coding to images that are
+		// not palette coded
+		IN3ColorTransform ColorTransform = COLOR_TRANSFORM_YUV;
+		// Threads counting each plane histogram, or zero for one per
+		// hardware thread; planes too small to split are counted on the
+		// calling thread
+		UINT32 HistogramThreads = 1;
+		// Quantization step of the Y, U and V samples, 1 for lossless
+		// Ignored with YCoCg-R, whose modular samples do not tolerate errors
+		UINT8 QuantizationSteps[3] = { 1, 1, 1 };
+		// Target size of the coded planes in bits per pixel, or zero to use
+		// the fixed steps; rate control then picks the steps of each image
+		DOUBLE TargetBitsPerPixel = 0.0;
+		// Images of at most this many distinct colors, up to 256, are coded
+		// losslessly as one plane of indices into a palette of their colors,
+		// or zero to always use the color transform
+		UINT16 MaxPaletteColors = IN3_MAX_PALETTE_SIZE;
+	};
+	// Planes of the YUV vector structure
+	enum Plane {
+		PLANE_Y = 0,
+		PLANE_U = 1,
+		PLANE_V = 2
+	};
+
+	// Compression stages, usable separately so that planes can be
+	// compressed concurrently by a scheduler
+
 	// Convert an RGB bitmap to a YUV vector structure
-	YUVVectors<INT8> cvtBmpToYUVVector(BitmapFile* bitmapFile);
+	YUVVectors<INT8> cvtBmpToYUVVector(const BitmapFile& bitmapFile);
+
+	// Convert an RGB bitmap of few enough colors to a Y plane of indices into
+	// a palette of its colors, with empty U and V planes, returning FALSE if
+	// it has more colors than the settings allow a palette
+	BOOL cvtBmpToPaletteVector(
+		const BitmapFile& bitmapFile,
+		YUVVectors<INT8>& indices,
+		std::vector<IN3PaletteEntry>& palette);
+
+	// Convert pixels in a caller's buffer to a YUV vector structure in the
+	// color transform given by getColorTransform, without copying them
+	YUVVectors<INT8> cvtPixelsToYUVVector(const PixelBuffer& pixels);
+
+	// Color transform that pixels of a format are coded with
+	// Planar YUV samples are coded as they are, other formats with the
+	// transform of the settings
+	IN3ColorTransform getColorTransform(PixelFormat format) const;
+
+	// Whether a buffer has the planes and row strides its format and
+	// dimensions need
+	static BOOL IsValidPixelBuffer(const PixelBuffer& pixels);
+
+	// Create a header with the fields that do not depend on plane coding,
+	// including the quantization steps picked by rate control
+	IN3Header<INT8> createHeader(const YUVVectors<INT8>& yuvVectors);
+	IN3Header<INT8> createHeader(
+		const YUVVectors<INT8>& yuvVectors,
+		IN3ColorTransform colorTransform);
+
+	// Pick the quantization steps that fit a target rate with the least
+	// squared error, estimated from the plane histograms without encoding
+	std::array<UINT8, 3> chooseQuantizationSteps(
+		const YUVVectors<INT8>& yuvVectors,
+		DOUBLE targetBitsPerPixel);
+
+	// Bits per pixel of the coded planes that give a file size
+	static DOUBLE bitsPerPixelForFileSize(
+		UINT64 fileSize,
+		UINT64 width,
+		UINT64 height);
+
+	// Compress one plane, storing its mode, table and size in the header
+	// Constant planes are stored without a payload and planes that Huffman
+	// codes would not shrink as raw bytes, both decided from the histogram
+	// counted for the code lengths. The effort of the settings picks how
+	// the code tables are built. Different planes may be compressed at the
+	// same time
+	void compressPlane(
+		const YUVVectors<INT8>& yuvVectors,
+		Plane plane,
+		IN3Header<INT8>& header,
+		YUVVectors<bool>& compressed);
+private:
+	// Settings used when compressing
+	Settings EncoderSettings;
 
 	// Compress the YUV vectors
-	std::pair<IN3Header<INT8>, YUVVectors<bool>> compressYUVVector(
-		const YUVVectors<INT8>& yuvVectors);
+	void compressYUVVector(
+		const YUVVectors<INT8>& yuvVectors,
+		IN3ColorTransform colorTransform,
+		IN3Header<INT8>& header,
+		YUVVectors<bool>& compressed);
+
+	// Convert a row of packed pixels to Y, U and V samples
+	// The scratch row holds the row as BitmapFile pixels when the format
+	// is not already laid out that way
+	void cvtRowToYUV(
+		const BYTE* row,
+		PixelFormat format,
+		size_t width,
+		IN3ColorTransform colorTransform,
+		INT8* y,
+		INT8* u,
+		INT8* v,
+		std::vector<BitmapFile::Pixel>& scratch);
+
+	// Convert a row of Y, U and V samples to packed pixels
+	void cvtYUVToRow(
+		const INT8* y,
+		const INT8* u,
+		const INT8* v,
+		IN3ColorTransform colorTransform,
+		PixelFormat format,
+		size_t width,
+		BYTE* row,
+		std::vector<BitmapFile::Pixel>& scratch);
+
+	// Index rows of packed pixels stride bytes apart into a palette,
+	// returning FALSE as soon as there are more colors than the settings
+	// allow a palette
+	BOOL cvtRowsToPalette(
+		const BYTE* rows,
+		size_t stride,
+		PixelFormat format,
+		UINT64 width,
+		UINT64 height,
+		YUVVectors<INT8>& indices,
+		std::vector<IN3PaletteEntry>& palette);
+
+	// Convert a row of palette indices to packed pixels
+	void cvtPaletteToRow(
+		const INT8* indices,
+		const std::vector<IN3PaletteEntry>& palette,
+		PixelFormat format,
+		size_t width,
+		BYTE* row);
+
+	// Samples of a pixel in the floating point YUV transform
+	void cvtPixelToYUV(BitmapFile::Pixel pixel, INT8& y, INT8& u, INT8& v);
 
 	// Huffman coding utility types and functions
 	struct SymbolWithCount {
 		INT32 Symbol;
-		UINT32 Count;
+		UINT64 Count;
 		bool operator>(const SymbolWithCount& a) const {
 			return Count > a.Count;
 		}
@@ -39,6 +189,22 @@ private:
 	template <typename T>
 	using FrequencyTable = std::array<SymbolWithCount, std::numeric_limits<T>::max() - std::numeric_limits<T>::min() + 1>;
 
+	// Code tables shared by the blocks of a block coded plane
+	struct BlockTables {
+		std::vector<LengthTable<INT8>> Tables;
+		// Index of the table of each block
+		std::vector<UINT8> BlockTable;
+		// Bits of the whole payload, before padding to a byte
+		UINT64 Bits = 0;
+	};
+
+	// Cluster the histograms of the blocks of a plane into shared tables,
+	// starting from the table of the whole plane and adding tables while
+	// they shrink the payload
+	BlockTables clusterBlockTables(
+		const std::vector<INT8>& samples,
+		const LengthTable<INT8>& planeTable);
+
 	// Frequency count function
 	template <typename T>
 	FrequencyTable<T> freqCount(const std::vector<T>& symbols);
@@ -47,35 +213,175 @@ private:
 	template <typename T>
 	std::pair<LengthTable<T>, std::vector<bool>> huffmanEncode(const std::vector<T>& input);
 
-	// Huffman decoding of symbols
+	// Build a Huffman code length table from counted symbol frequencies
 	template <typename T>
-	std::vector<T> huffmanDecode(
-		const LengthTable<T>& lengthTable,
-		std::vector<bool>& input,
-		size_t numToDecode = std::numeric_limits<size_t>::max());
+	static LengthTable<T> huffmanLengths(const FrequencyTable<T>& freqTable);
 
 	// Decompression functions
 
-	// Extract data from IM3 file
-	std::pair<IN3Header<INT8>, YUVVectors<bool>> cvtIn3ToYUVVector(IN3File* in3File);
+	// Decode and dequantize the samples of one plane coded in its mode,
+	// starting at a bit of the input, or return fewer samples if the plane
+	// is damaged
+	std::vector<INT8> decompressPlane(
+		const IN3Header<INT8>& header,
+		Plane plane,
+		const std::vector<bool>& bits,
+		UINT64 numSymbols,
+		UINT64 firstBit);
+
+	// Decode the samples of a block coded plane whose first table is given,
+	// or return fewer samples if the plane is damaged
+	std::vector<INT8> decompressBlocks(
+		const LengthTable<INT8>& firstTable,
+		const std::vector<bool>& bits,
+		UINT64 numSymbols,
+		UINT64 firstBit);
 
-	// Entropy decoding
+	// Entropy decoding of the Y, U and V planes stored back-to-back
 	YUVVectors<INT8> decompressYUVVector(
 		const IN3Header<INT8>& header,
-		YUVVectors<bool>& yuvVectors);
+		const std::vector<bool>& bits);
+
+	// Palette indices of a palette coded IN3, or none if it is damaged or
+	// an index is outside its palette
+	std::vector<INT8> decompressPaletteIndices(const IN3File& in3File);
+
+	// Luma samples of an IN3 in the YUV transform, or none if it is damaged
+	std::vector<INT8> decompressLumaSamples(const IN3File& in3File);
 
-	// Convert a YUV vector structure to a RGB bitmap
-	BitmapFile* cvtYUVVectorToBmp(const YUVVectors<INT8>& yuvVectors);
 public:
+	// Convert a YUV vector structure to a RGB bitmap
+	std::unique_ptr<BitmapFile> cvtYUVVectorToBmp(
+		const YUVVectors<INT8>& yuvVectors,
+		IN3ColorTransform colorTransform);
+
+	// Convert a YUV vector structure into a caller's buffer of the same
+	// dimensions, returning FALSE if the buffer does not fit the planes
+	BOOL cvtYUVVectorToPixels(
+		const YUVVectors<INT8>& yuvVectors,
+		IN3ColorTransform colorTransform,
+		const PixelBuffer& pixels);
+
+	// Entropy coding stages, usable separately by containers that share
+	// length tables between images
+
+	// Code table type, holding the canonical code of each symbol indexed
+	// like a length table
+	template <typename T>
+	using CodeTable = std::array<std::vector<bool>, std::numeric_limits<T>::max() - std::numeric_limits<T>::min() + 1>;
+
+	// Build a Huffman code length table from the symbol frequencies
+	template <typename T>
+	LengthTable<T> huffmanLengths(const std::vector<T>& input);
+
+	// Assign the canonical codes of a length table, once for all the
+	// symbols coded with it
+	template <typename T>
+	static CodeTable<T> huffmanCodes(const LengthTable<T>& lengthTable);
+
+	// Append the codes of a range of symbols to the output
+	template <typename T>
+	static void huffmanEncodeWithCodes(
+		const CodeTable<T>& codeTable,
+		typename std::vector<T>::const_iterator first,
+		typename std::vector<T>::const_iterator last,
+		std::vector<bool>& output);
+
+	// Huffman coding of symbols with an existing length table
+	template <typename T>
+	std::vector<bool> huffmanEncodeWithTable(
+		const LengthTable<T>& lengthTable,
+		const std::vector<T>& input);
+
+	// Number of bits the symbols take when coded with a length table
+	template <typename T>
+	UINT64 huffmanCodedBits(
+		const LengthTable<T>& lengthTable,
+		const std::vector<T>& input);
+
+	// Decode table type, holding the canonical code and symbol of each
+	// symbol in the order the decoder searches them
+	template <typename T>
+	using DecodeTable = std::vector<std::pair<std::vector<bool>, T>>;
+
+	// Assign the canonical codes of a length table for decoding, once for
+	// all the runs of symbols decoded with it, or return an empty table if
+	// the lengths of a damaged table do not form a prefix code
+	template <typename T>
+	static DecodeTable<T> huffmanDecodeTable(const LengthTable<T>& lengthTable);
+
+	// Decode up to a number of symbols starting at a bit of the input,
+	// moving the position past the codes of the decoded symbols
+	template <typename T>
+	static std::vector<T> huffmanDecodeWithCodes(
+		const DecodeTable<T>& decodeTable,
+		const std::vector<bool>& input,
+		size_t numToDecode,
+		size_t& position);
+
+	// Huffman decoding of symbols starting at a bit of the input
+	template <typename T>
+	std::vector<T> huffmanDecode(
+		const LengthTable<T>& lengthTable,
+		const std::vector<bool>& input,
+		size_t numToDecode = std::numeric_limits<size_t>::max(),
+		size_t firstBit = 0);
+
 	// Compress a bitmap
-	IN3File* compress(BitmapFile* bitmapFile);
-	// Decompress an IN3
-	BitmapFile* decompress(IN3File* in3File);
+	std::unique_ptr<IN3File> compress(const BitmapFile& bitmapFile);
+	// Decompress an IN3, or return NULL if its planes are damaged
+	std::unique_ptr<BitmapFile> decompress(const IN3File& in3File);
+	// Compress pixels read straight from a caller's buffer, or return NULL
+	// if the buffer is not valid
+	std::unique_ptr<IN3File> compress(const PixelBuffer& pixels);
+	// Decompress an IN3 straight into a caller's buffer of its dimensions,
+	// returning FALSE if the buffer does not fit or the planes are damaged
+	BOOL decompress(const IN3File& in3File, const PixelBuffer& pixels);
+#ifdef _WIN32
+	// Decompress an IN3 straight into the rows of a BMP file being written,
+	// with no RGB image in between, returning FALSE if the file is not of
+	// its dimensions, the planes are damaged or the file was not written
+	BOOL decompress(const IN3File& in3File, BitmapWriter& writer);
+#endif
+	// Decompress only the luma of an IN3 as a gray bitmap, or return NULL
+	// if its planes are damaged
+	// Images coded with the YUV transform decode their Y plane alone,
+	// skipping the chroma planes and the color matrix. The modular YCoCg-R
+	// Y plane is not luma on its own, so those images are decoded whole.
+	// Palette coded images look up the luma of each entry.
+	std::unique_ptr<BitmapFile> decompressLuma(const IN3File& in3File);
+	// Decompress only the luma of an IN3 into a caller's rows of 8-bit
+	// samples, stride bytes apart, returning FALSE if the stride is shorter
+	// than a row or the planes are damaged
+	BOOL decompressLuma(const IN3File& in3File, BYTE* luma, size_t stride);
+	// Compress a high bit depth image, or return NULL if a plane does not
+	// hold a sample for every pixel
+	std::unique_ptr<IN3WideFile> compressWide(const WideImage& image);
+	// Decompress a high bit depth IN3, returning FALSE if it is damaged
+	BOOL decompressWide(const IN3WideFile& in3WideFile, WideImage& image);
+	// Get and set the encoder settings
+	const Settings& getSettings() const;
+	void setSettings(const Settings& settings);
 	Codec();
+	Codec(const Settings& settings);
 };
 
 template<typename T>
 inline std::pair<LengthTable<T>, std::vector<bool>> Codec::huffmanEncode(const std::vector<T>& input)
+{
+	LengthTable<T> lengths = huffmanLengths(input);
+	std::vector<bool> compressed = huffmanEncodeWithTable(lengths, input);
+	return std::pair<LengthTable<T>, std::vector<bool>>(lengths, std::move(compressed));
+}
+
+template<typename T>
+inline LengthTable<T> Codec::huffmanLengths(const std::vector<T>& input)
+{
+	return huffmanLengths<T>(freqCount<T>(input));
+}
+
+template<typename T>
+inline LengthTable<T> Codec::huffmanLengths(const FrequencyTable<T>& freqTable)
 {
 	// Typedef for Symbol
 	typedef INT32 Symbol;
@@ -84,8 +390,6 @@ inline std::pair<LengthTable<T>, std::vector<bool>> Codec::huffmanEncode(const s
 	static const Symbol PARENT_STEP = 1;
 	static const Symbol NO_CHILD = std::numeric_limits<T>::min() - 1;
 	static const Symbol NO_PARENT = std::numeric_limits<T>::min() - 1;
-	// Build the frequency table
-	FrequencyTable<T> freqTable = freqCount<T>(input);
 	// Sort the frequency table
 	std::priority_queue<
 		SymbolWithCount,
@@ -131,11 +435,7 @@ inline std::pair<LengthTable<T>, std::vector<bool>> Codec::huffmanEncode(const s
 	}
 	// The root node is the last parent
 	Symbol root = parentSymbol - PARENT_STEP;
-	// Set up the table for storing sorted code lengths
-	std::array<
-		std::pair<UINT8, T>,
-		std::numeric_limits<T>::max() - std::numeric_limits<T>::min() + 1> sortedLengths;
-	// Additionally generate a symbol bit length table
+	// Generate a symbol bit length table
 	LengthTable<T> lengths;
 	// Store the code lengths
 	for (Symbol i = std::numeric_limits<T>::min();
@@ -154,66 +454,89 @@ inline std::pair<LengthTable<T>, std::vector<bool>> Codec::huffmanEncode(const s
 		}
 		INT32 index = i - std::numeric_limits<T>::min();
 		lengths[index] = length;
-		sortedLengths[index] = { length, static_cast<T>(i) };
 	}
-	// Sort the code lengths
-	std::sort(sortedLengths.begin(), sortedLengths.end());
-	// Set up the canonical code table
-	std::array<
-		std::pair<std::vector<bool>, T>,
-		std::numeric_limits<T>::max() - std::numeric_limits<T>::min() + 1> canonicalCodes;
-	// Assign canonical codes
-	canonicalCodes[0] = { std::vector<bool>(sortedLengths[0].first, false), sortedLengths[0].second };
-	for (INT32 i = 1; i < canonicalCodes.size(); i++) {
-		// Increment from the previous code for the next code
-		std::vector<bool> code = canonicalCodes[i - 1].first;
-		UINT8 bitIndex;
-		for (bitIndex = static_cast<UINT8>(code.size() - 1); bitIndex >= 0; bitIndex--) {
-			if (code[bitIndex]) {
-				code[bitIndex] = false;
-			} else {
-				break;
-			}
-		}
-		code[bitIndex] = true;
-		// If the code length increases, append zeroes
-		UINT8 length = sortedLengths[i].first;
-		while (code.size() != length) {
-			code.push_back(false);
-		}
-		canonicalCodes[i] = { code, sortedLengths[i].second };
-	}
-	// Build an easier to traverse code table
+	return lengths;
+}
+
+template<typename T>
+inline Codec::CodeTable<T> Codec::huffmanCodes(const LengthTable<T>& lengthTable)
+{
+	// Typedef for Symbol
+	typedef INT32 Symbol;
+	// Set up the table for storing sorted code lengths
 	std::array<
-		std::vector<bool>,
-		std::numeric_limits<T>::max() - std::numeric_limits<T>::min() + 1> codes;
+		std::pair<UINT8, T>,
+		std::numeric_limits<T>::max() - std::numeric_limits<T>::min() + 1> sortedLengths;
+	// Generate the sorted symbol bit length table
 	for (Symbol i = std::numeric_limits<T>::min();
 		i <= std::numeric_limits<T>::max();
 		i++) {
 		INT32 index = i - std::numeric_limits<T>::min();
-		auto result = std::find_if(
-			canonicalCodes.begin(),
-			canonicalCodes.end(),
-			[i](const std::pair<std::vector<bool>, T>& entry) {
-				return entry.second == static_cast<T>(i);
-			});
-		codes[index] = result->first;
+		sortedLengths[index] = { lengthTable[index], static_cast<T>(i) };
 	}
-	// Compress the data
-	std::vector<bool> compressed;
-	for (auto it = input.begin(); it != input.end(); it++) {
+	// Sort the code lengths
+	std::sort(sortedLengths.begin(), sortedLengths.end());
+	// Assign canonical codes in sorted order, storing each by its symbol
+	CodeTable<T> codes;
+	std::vector<bool> code(sortedLengths[0].first, false);
+	codes[sortedLengths[0].second - std::numeric_limits<T>::min()] = code;
+	for (size_t i = 1; i < sortedLengths.size(); i++) {
+		// Increment from the previous code for the next code
+		size_t bitIndex = code.size();
+		while (bitIndex > 0 && code[bitIndex - 1]) {
+			code[bitIndex - 1] = false;
+			bitIndex--;
+		}
+		if (bitIndex > 0) {
+			code[bitIndex - 1] = true;
+		}
+		// If the code length increases, append zeroes
+		code.resize(sortedLengths[i].first, false);
+		codes[sortedLengths[i].second - std::numeric_limits<T>::min()] = code;
+	}
+	return codes;
+}
+
+template<typename T>
+inline void Codec::huffmanEncodeWithCodes(
+	const CodeTable<T>& codeTable,
+	typename std::vector<T>::const_iterator first,
+	typename std::vector<T>::const_iterator last,
+	std::vector<bool>& output)
+{
+	for (auto it = first; it != last; it++) {
 		INT32 index = (*it) - std::numeric_limits<T>::min();
-		std::vector<bool> code = codes[index];
-		compressed.insert(compressed.end(), code.begin(), code.end());
+		for (bool bit : codeTable[index]) {
+			output.push_back(bit);
+		}
 	}
-	return std::pair<LengthTable<T>, std::vector<bool>>(lengths, compressed);
 }
 
 template<typename T>
-inline std::vector<T> Codec::huffmanDecode(
+inline std::vector<bool> Codec::huffmanEncodeWithTable(
+	const LengthTable<T>& lengthTable,
+	const std::vector<T>& input)
+{
+	std::vector<bool> compressed;
+	huffmanEncodeWithCodes<T>(huffmanCodes<T>(lengthTable), input.begin(), input.end(), compressed);
+	return compressed;
+}
+
+template<typename T>
+inline UINT64 Codec::huffmanCodedBits(
 	const LengthTable<T>& lengthTable,
-	std::vector<bool>& input,
-	size_t numToDecode)
+	const std::vector<T>& input)
+{
+	FrequencyTable<T> freqTable = freqCount<T>(input);
+	UINT64 bits = 0;
+	for (size_t i = 0; i < freqTable.size(); i++) {
+		bits += freqTable[i].Count * lengthTable[i];
+	}
+	return bits;
+}
+
+template<typename T>
+inline Codec::DecodeTable<T> Codec::huffmanDecodeTable(const LengthTable<T>& lengthTable)
 {
 	// Typedef for Symbol
 	typedef INT32 Symbol;
@@ -230,25 +553,23 @@ inline std::vector<T> Codec::huffmanDecode(
 	}
 	// Sort the code lengths
 	std::sort(sortedLengths.begin(), sortedLengths.end());
-	// Set up the canonical code table
-	std::array<
-		std::pair<std::vector<bool>, T>,
-		std::numeric_limits<T>::max() - std::numeric_limits<T>::min() + 1> canonicalCodes;
 	// Assign canonical codes
+	DecodeTable<T> canonicalCodes(sortedLengths.size());
 	canonicalCodes[0] = { std::vector<bool>(sortedLengths[0].first, false), sortedLengths[0].second };
-	for (INT32 i = 1; i < canonicalCodes.size(); i++) {
+	for (size_t i = 1; i < canonicalCodes.size(); i++) {
 		// Increment from the previous code for the next code
 		std::vector<bool> code = canonicalCodes[i - 1].first;
-		UINT8 bitIndex;
-		for (bitIndex = static_cast<UINT8>(code.size() - 1); bitIndex >= 0; bitIndex--) {
-			if (code[bitIndex]) {
-				code[bitIndex] = false;
-			}
-			else {
-				break;
-			}
+		size_t bitIndex = code.size();
+		while (bitIndex > 0 && code[bitIndex - 1]) {
+			code[bitIndex - 1] = false;
+			bitIndex--;
 		}
-		code[bitIndex] = true;
+		// A carry out of the first bit means the lengths of a damaged
+		// table do not form a prefix code, so nothing can be decoded
+		if (bitIndex == 0) {
+			return DecodeTable<T>();
+		}
+		code[bitIndex - 1] = true;
 		// If the code length increases, append zeroes
 		UINT8 length = sortedLengths[i].first;
 		while (code.size() != length) {
@@ -256,47 +577,73 @@ inline std::vector<T> Codec::huffmanDecode(
 		}
 		canonicalCodes[i] = { code, sortedLengths[i].second };
 	}
-	// Decompress the data
-	size_t bitsRead = 0;
+	return canonicalCodes;
+}
+
+template<typename T>
+inline std::vector<T> Codec::huffmanDecodeWithCodes(
+	const DecodeTable<T>& decodeTable,
+	const std::vector<bool>& input,
+	size_t numToDecode,
+	size_t& position)
+{
 	std::vector<bool> buffer;
 	std::vector<T> decompressed;
-	for (auto it = input.begin(); it != input.end(); it++) {
+	if (numToDecode != std::numeric_limits<size_t>::max()) {
+		decompressed.reserve(numToDecode);
+	}
+	if (decodeTable.empty() || numToDecode == 0) {
+		return decompressed;
+	}
+	position = std::min(position, input.size());
+	for (auto it = input.begin() + position; it != input.end(); it++) {
 		buffer.push_back(*it);
-		bitsRead += 1;
 		auto result = std::find_if(
-			canonicalCodes.begin(),
-			canonicalCodes.end(),
-			[buffer](const std::pair<std::vector<bool>, T>& entry) {
+			decodeTable.begin(),
+			decodeTable.end(),
+			[&buffer](const std::pair<std::vector<bool>, T>& entry) {
 				return entry.first == buffer;
 			});
-		if (result != canonicalCodes.end()) {
+		if (result != decodeTable.end()) {
 			decompressed.push_back(result->second);
+			position += buffer.size();
 			buffer.clear();
 			if (decompressed.size() == numToDecode) {
 				break;
 			}
 		}
 	}
-	// Consume the bits read up to the next byte boundary
-	size_t remainder = bitsRead % 8;
-	bitsRead = remainder == 0 ? bitsRead : bitsRead + 8 - remainder;
-	input.erase(input.begin(), input.begin() + bitsRead);
 	return decompressed;
 }
 
+template<typename T>
+inline std::vector<T> Codec::huffmanDecode(
+	const LengthTable<T>& lengthTable,
+	const std::vector<bool>& input,
+	size_t numToDecode,
+	size_t firstBit)
+{
+	size_t position = firstBit;
+	return huffmanDecodeWithCodes<T>(huffmanDecodeTable<T>(lengthTable), input, numToDecode, position);
+}
+
 template<typename T>
 inline Codec::FrequencyTable<T>
 Codec::freqCount(const std::vector<T>& symbols)
 {
+	Histogram<T> histogram;
+	if (EncoderSettings.HistogramThreads == 1) {
+		histogram.add(symbols);
+	} else {
+		histogram.addParallel(symbols, EncoderSettings.HistogramThreads);
+	}
+	const std::vector<UINT64>& counts = histogram.getCounts();
 	FrequencyTable<T> table;
-	T symbol = std::numeric_limits<T>::min();
-	for (auto it = table.begin(); it != table.end(); it++) {
-		it->Symbol = symbol;
-		it->Count = 0;
+	INT32 symbol = std::numeric_limits<T>::min();
+	for (size_t i = 0; i < table.size(); i++) {
+		table[i].Symbol = symbol;
+		table[i].Count = counts[i];
 		symbol += 1;
 	}
-	for (auto it = symbols.begin(); it != symbols.end(); it++) {
-		table[(*it) - std::numeric_limits<T>::min()].Count += 1;
-	}
 	return table;
 }
@@ -0,0 +1,1404 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cwctype>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <shellapi.h>
+#include <sstream>
+#include "BatchCompressor.h"
+#include "BitmapPixelOperation.h"
+#include "BitmapWriter.h"
+#include "Codec.h"
+#include "CommandLine.h"
+#include "CpuDispatch.h"
+#include "ErrorDiffusion.h"
+#include "IN3Archive.h"
+#include "IN3File.h"
+#include "IN3Sequence.h"
+#include "IN3WideFile.h"
+#include "MemoryAccounting.h"
+#include "NeighborhoodOperation.h"
+#include "Trace.h"
+
+namespace {
+	// Heap counters of compressing, saving, reloading and decompressing a
+	// generated image, or zeroes if the image did not round trip
+	MemoryAccounting::Statistics countCodecAllocations(const Codec::Settings& settings, INT32 height, BOOL fewColors)
+	{
+		static const INT32 WIDTH = 256;
+		BitmapFile bitmapFile(WIDTH, height);
+		for (INT32 y = 0; y < height; y++) {
+			BitmapFile::Pixel* row = bitmapFile.getRow(y);
+			for (INT32 x = 0; x < WIDTH; x++) {
+				if (fewColors) {
+					row[x] = { static_cast<BYTE>(x / 16 * 16), static_cast<BYTE>(y % 4 * 64), 128 };
+				}
+				else {
+					row[x] = { static_cast<BYTE>(x * 3 + y), static_cast<BYTE>(x ^ y), static_cast<BYTE>(y * 5) };
+				}
+			}
+		}
+		Codec codec(settings);
+		MemoryAccounting::reset();
+		std::unique_ptr<IN3File> compressed = codec.compress(bitmapFile);
+		std::vector<BYTE> bytes = compressed->SaveToMemory();
+		IN3File in3File(Span<BYTE>(bytes.data(), bytes.size()));
+		std::unique_ptr<BitmapFile> decompressed = codec.decompress(in3File);
+		MemoryAccounting::Statistics statistics = MemoryAccounting::getTotal();
+		return decompressed ? statistics : MemoryAccounting::Statistics();
+	}
+
+	// Name of a new empty file in the temporary directory, or an empty
+	// name if it cannot be created
+	std::wstring createTemporaryFile()
+	{
+		WCHAR directory[MAX_PATH + 1];
+		WCHAR fileName[MAX_PATH + 1];
+		DWORD length = GetTempPathW(MAX_PATH + 1, directory);
+		if (length == 0 || length > MAX_PATH ||
+			GetTempFileNameW(directory, L"in3", 0, fileName) == 0) {
+			return std::wstring();
+		}
+		return fileName;
+	}
+
+	// A generated frame of a moving square over a still background
+	BitmapFile createSequenceFrame(INT32 width, INT32 height, INT32 frame)
+	{
+		BitmapFile bitmapFile(width, height);
+		for (INT32 y = 0; y < height; y++) {
+			BitmapFile::Pixel* row = bitmapFile.getRow(y);
+			for (INT32 x = 0; x < width; x++) {
+				BOOL square = x >= frame * 3 && x < frame * 3 + 20 && y >= frame && y < frame + 20;
+				if (square) {
+					row[x] = { 255, static_cast<BYTE>(frame * 40), 0 };
+				}
+				else {
+					row[x] = { static_cast<BYTE>(x * 2), static_cast<BYTE>(y), static_cast<BYTE>(x ^ y) };
+				}
+			}
+		}
+		return bitmapFile;
+	}
+
+	// Read a binary PGM or PPM file of more than 8 bits per sample, whose
+	// samples are stored most significant byte first
+	BOOL readNetpbmFile(const std::wstring& fileName, WideImage& image)
+	{
+		HANDLE fileHandle = CreateFileW(
+			fileName.c_str(),
+			GENERIC_READ,
+			FILE_SHARE_READ,
+			NULL,
+			OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL,
+			NULL);
+		if (fileHandle == INVALID_HANDLE_VALUE) {
+			return FALSE;
+		}
+		LARGE_INTEGER fileSize;
+		std::vector<BYTE> data;
+		BOOL success = GetFileSizeEx(fileHandle, &fileSize);
+		if (success) {
+			data.resize(static_cast<size_t>(fileSize.QuadPart));
+			success = IN3File::ReadChunked(fileHandle, data.data(), data.size());
+		}
+		CloseHandle(fileHandle);
+		if (!success || data.size() < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6')) {
+			return FALSE;
+		}
+		// The width, height and largest sample follow as decimal numbers
+		// separated by white space and comments
+		size_t position = 2;
+		UINT64 fields[3] = {};
+		for (UINT64& field : fields) {
+			while (position < data.size() && (std::isspace(data[position]) || data[position] == '#')) {
+				if (data[position] == '#') {
+					while (position < data.size() && data[position] != '\n') {
+						position++;
+					}
+				}
+				else {
+					position++;
+				}
+			}
+			size_t first = position;
+			while (position < data.size() && std::isdigit(data[position]) && field <= std::numeric_limits<INT32>::max()) {
+				field = field * 10 + (data[position] - '0');
+				position++;
+			}
+			if (position == first) {
+				return FALSE;
+			}
+		}
+		// A single white space character separates the header from the samples
+		if (position >= data.size() || !std::isspace(data[position]) ||
+			fields[0] > std::numeric_limits<INT32>::max() ||
+			fields[1] > std::numeric_limits<INT32>::max() ||
+			fields[2] < 256 || fields[2] > 65535) {
+			return FALSE;
+		}
+		position++;
+		image.Width = fields[0];
+		image.Height = fields[1];
+		image.PlaneCount = data[1] == '6' ? 3 : 1;
+		image.SampleBits = 9;
+		while ((1u << image.SampleBits) <= fields[2]) {
+			image.SampleBits++;
+		}
+		UINT64 pixelCount = image.Width * image.Height;
+		if (pixelCount > (data.size() - position) / (image.PlaneCount * 2)) {
+			return FALSE;
+		}
+		for (UINT8 p = 0; p < 3; p++) {
+			image.Planes[p].assign(p < image.PlaneCount ? static_cast<size_t>(pixelCount) : 0, 0);
+		}
+		const BYTE* sample = data.data() + position;
+		for (UINT64 i = 0; i < pixelCount; i++) {
+			for (UINT8 p = 0; p < image.PlaneCount; p++) {
+				image.Planes[p][i] = static_cast<UINT16>(sample[0] << 8 | sample[1]);
+				sample += 2;
+			}
+		}
+		return TRUE;
+	}
+
+	// Write a binary PGM or PPM file of the samples of a high bit depth image
+	BOOL writeNetpbmFile(const std::wstring& fileName, const WideImage& image)
+	{
+		std::ostringstream header;
+		header << (image.PlaneCount == 3 ? "P6" : "P5") << "\n";
+		header << image.Width << " " << image.Height << "\n";
+		header << ((1u << image.SampleBits) - 1) << "\n";
+		std::string text = header.str();
+		std::vector<BYTE> data(text.begin(), text.end());
+		UINT64 pixelCount = image.Width * image.Height;
+		data.reserve(static_cast<size_t>(data.size() + pixelCount * image.PlaneCount * 2));
+		for (UINT64 i = 0; i < pixelCount; i++) {
+			for (UINT8 p = 0; p < image.PlaneCount; p++) {
+				data.push_back(static_cast<BYTE>(image.Planes[p][i] >> 8));
+				data.push_back(static_cast<BYTE>(image.Planes[p][i]));
+			}
+		}
+		HANDLE fileHandle = CreateFileW(
+			fileName.c_str(),
+			GENERIC_WRITE,
+			0,
+			NULL,
+			CREATE_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL,
+			NULL);
+		if (fileHandle == INVALID_HANDLE_VALUE) {
+			return FALSE;
+		}
+		BOOL success = IN3File::WriteChunked(fileHandle, data.data(), data.size());
+		CloseHandle(fileHandle);
+		return success;
+	}
+
+	// File name with its extension replaced
+	std::wstring replaceExtension(const std::wstring& fileName, const std::wstring& extension)
+	{
+		size_t dot = fileName.find_last_of(L".\\/");
+		if (dot != std::wstring::npos && fileName[dot] == L'.') {
+			return fileName.substr(0, dot) + extension;
+		}
+		return fileName + extension;
+	}
+
+	// Read a bitmap file, or return NULL if it cannot be read
+	std::unique_ptr<BitmapFile> readBitmapFile(const std::wstring& fileName)
+	{
+		HANDLE fileHandle = CreateFileW(
+			fileName.c_str(),
+			GENERIC_READ,
+			FILE_SHARE_READ,
+			NULL,
+			OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL,
+			NULL);
+		if (fileHandle == INVALID_HANDLE_VALUE) {
+			return NULL;
+		}
+		// The bitmap closes the handle once it is read
+		BitmapFile::CreateResult result;
+		std::unique_ptr<BitmapFile> bitmapFile(new BitmapFile(fileHandle, &result));
+		return result == BitmapFile::OK ? std::move(bitmapFile) : NULL;
+	}
+
+	BOOL samePixels(const BitmapFile& expected, const BitmapFile& actual)
+	{
+		if (expected.getWidth() != actual.getWidth() || expected.getHeight() != actual.getHeight()) {
+			return FALSE;
+		}
+		for (INT32 y = 0; y < expected.getHeight(); y++) {
+			const BitmapFile::Pixel* expectedRow = expected.getRow(y);
+			const BitmapFile::Pixel* actualRow = actual.getRow(y);
+			for (INT32 x = 0; x < expected.getWidth(); x++) {
+				if (expectedRow[x].Red != actualRow[x].Red ||
+					expectedRow[x].Green != actualRow[x].Green ||
+					expectedRow[x].Blue != actualRow[x].Blue) {
+					return FALSE;
+				}
+			}
+		}
+		return TRUE;
+	}
+}
+
+void CommandLine::Print(const std::wstring& text)
+{
+	// The program is a windows application so attach to the parent console
+	static BOOL attached = AttachConsole(ATTACH_PARENT_PROCESS);
+	UNREFERENCED_PARAMETER(attached);
+	HANDLE output = GetStdHandle(STD_OUTPUT_HANDLE);
+	if (output == NULL || output == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	std::wstring line = text + L"\r\n";
+	DWORD written;
+	DWORD mode;
+	if (GetConsoleMode(output, &mode)) {
+		WriteConsoleW(output, line.c_str(), static_cast<DWORD>(line.size()), &written, NULL);
+		return;
+	}
+	// Output redirected to a file or pipe is written as UTF-8
+	int size = WideCharToMultiByte(CP_UTF8, 0, line.c_str(), -1, NULL, 0, NULL, NULL);
+	std::vector<CHAR> utf8(size);
+	WideCharToMultiByte(CP_UTF8, 0, line.c_str(), -1, utf8.data(), size, NULL, NULL);
+	WriteFile(output, utf8.data(), size - 1, &written, NULL);
+}
+
+BOOL CommandLine::ParseNumber(
+	const std::wstring& argument,
+	const std::wstring& text,
+	UINT64 minValue,
+	UINT64 maxValue,
+	UINT64& value)
+{
+	// std::stoull accepts a sign and stops at the first character that is
+	// not a digit, so the whole value must be digits
+	size_t used = 0;
+	try {
+		if (!text.empty() && std::iswdigit(text[0])) {
+			value = std::stoull(text, &used);
+		}
+	}
+	catch (const std::logic_error&) {
+		used = 0;
+	}
+	if (used == 0 || used != text.size() || value < minValue || value > maxValue) {
+		std::wostringstream message;
+		message << L"Invalid value for " << argument << L": " << text;
+		message << L" (expected " << minValue << L" to " << maxValue << L")";
+		Print(message.str());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL CommandLine::ParseNumber(
+	const std::wstring& argument,
+	const std::wstring& text,
+	DOUBLE& value)
+{
+	size_t used = 0;
+	try {
+		value = std::stod(text, &used);
+	}
+	catch (const std::logic_error&) {
+		used = 0;
+	}
+	if (used == 0 || used != text.size() || !(value >= 0.0) || !std::isfinite(value)) {
+		Print(L"Invalid value for " + argument + L": " + text + L" (expected a number of at least 0)");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void CommandLine::PrintMemoryStatistics()
+{
+	std::wostringstream report;
+	report << L"Stage: allocations, bytes allocated, peak live bytes";
+	for (UINT8 stage = 0; stage <= MEMORY_STAGE_COUNT; stage++) {
+		MemoryAccounting::Statistics statistics;
+		if (stage == MEMORY_STAGE_COUNT) {
+			statistics = MemoryAccounting::getTotal();
+			report << L"\r\nTotal: ";
+		}
+		else {
+			statistics = MemoryAccounting::getStatistics(static_cast<MemoryStage>(stage));
+			report << L"\r\n" << MemoryAccounting::getStageName(static_cast<MemoryStage>(stage)) << L": ";
+		}
+		report << statistics.Allocations << L", ";
+		report << statistics.BytesAllocated << L", ";
+		report << statistics.PeakLiveBytes;
+	}
+	Print(report.str());
+}
+
+BOOL CommandLine::StartTrace(const std::wstring& traceName)
+{
+	if (traceName.empty()) {
+		return TRUE;
+	}
+	if (!Trace::enable()) {
+		Print(L"Tracing is not built into this program");
+		return FALSE;
+	}
+	IN3_TRACE_THREAD("Main", 0);
+	return TRUE;
+}
+
+BOOL CommandLine::FinishTrace(const std::wstring& traceName)
+{
+	if (traceName.empty()) {
+		return TRUE;
+	}
+	if (!Trace::exportJson(traceName)) {
+		Print(L"Cannot write the trace to " + traceName);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+int CommandLine::RunBatch(const std::vector<std::wstring>& arguments)
+{
+	std::wstring directory;
+	UINT32 threadCount = 0;
+	UINT64 memoryBudget = BatchCompressor::DEFAULT_MEMORY_BUDGET;
+	UINT32 queueDepth = AsyncFileIO::DEFAULT_QUEUE_DEPTH;
+	Codec::Settings settings;
+	UINT64 value = 0;
+	BOOL memoryStatistics = FALSE;
+	std::wstring cacheDirectory;
+	UINT64 cacheSize = CompressionCache::DEFAULT_SIZE_LIMIT;
+	std::wstring traceName;
+	for (size_t i = 0; i < arguments.size(); i++) {
+		const std::wstring& argument = arguments[i];
+		BOOL hasValue = i + 1 < arguments.size();
+		if (argument == L"/batch" && hasValue) {
+			directory = arguments[++i];
+		}
+		else if (argument == L"/threads" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 0, std::numeric_limits<UINT32>::max(), value)) {
+				return 1;
+			}
+			threadCount = static_cast<UINT32>(value);
+		}
+		else if (argument == L"/budget" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 0, std::numeric_limits<UINT64>::max() >> 20, value)) {
+				return 1;
+			}
+			memoryBudget = value << 20;
+		}
+		else if (argument == L"/queue" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 0, std::numeric_limits<UINT32>::max(), value)) {
+				return 1;
+			}
+			queueDepth = static_cast<UINT32>(value);
+		}
+		else if (argument == L"/ycocg") {
+			settings.ColorTransform = COLOR_TRANSFORM_YCOCG_R;
+		}
+		else if (argument == L"/quant" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 1, IN3_MAX_QUANTIZATION_STEP, value)) {
+				return 1;
+			}
+			std::fill(settings.QuantizationSteps, settings.QuantizationSteps + 3, static_cast<UINT8>(value));
+		}
+		else if (argument == L"/bpp" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], settings.TargetBitsPerPixel)) {
+				return 1;
+			}
+		}
+		else if (argument == L"/palette" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 0, IN3_MAX_PALETTE_SIZE, value)) {
+				return 1;
+			}
+			settings.MaxPaletteColors = static_cast<UINT16>(value);
+		}
+		else if (argument == L"/effort" && hasValue) {
+			const std::wstring& effort = arguments[++i];
+			if (effort == L"default") {
+				settings.Effort = Codec::EFFORT_DEFAULT;
+			}
+			else if (effort == L"high") {
+				settings.Effort = Codec::EFFORT_HIGH;
+			}
+			else {
+				Print(L"Unknown effort: " + effort);
+				return 1;
+			}
+		}
+		else if (argument == L"/memstats") {
+			memoryStatistics = TRUE;
+		}
+		else if (argument == L"/cache" && hasValue) {
+			cacheDirectory = arguments[++i];
+		}
+		else if (argument == L"/cachesize" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 0, std::numeric_limits<UINT64>::max() >> 20, value)) {
+				return 1;
+			}
+			cacheSize = value << 20;
+		}
+		else if (argument == L"/trace" && hasValue) {
+			traceName = arguments[++i];
+		}
+		else {
+			Print(L"Unknown argument: " + argument);
+			return 1;
+		}
+	}
+	if (!StartTrace(traceName)) {
+		return 1;
+	}
+	std::vector<std::wstring> fileNames = BatchCompressor::findBitmapFiles(directory);
+	std::unique_ptr<CompressionCache> cache;
+	if (!cacheDirectory.empty()) {
+		cache.reset(new CompressionCache(cacheDirectory, cacheSize));
+	}
+	BatchCompressor compressor(settings, threadCount, memoryBudget, queueDepth, cache.get());
+	MemoryAccounting::reset();
+	BatchCompressor::Statistics statistics = compressor.compressFiles(fileNames);
+	std::wostringstream report;
+	report << L"Compressed " << statistics.FilesCompressed << L" files";
+	report << L" (" << statistics.FilesFailed << L" failed, ";
+	report << statistics.CacheHits << L" from the cache)";
+	report << L" in " << statistics.Seconds << L" s\r\n";
+	report << L"Read " << statistics.BytesRead << L" bytes, wrote ";
+	report << statistics.BytesWritten << L" bytes\r\n";
+	report << L"Throughput " << statistics.MegabytesPerSecond() << L" MB/s";
+	report << L", peak estimated memory " << (statistics.PeakEstimatedMemory >> 20) << L" MB";
+	Print(report.str());
+	if (memoryStatistics) {
+		PrintMemoryStatistics();
+	}
+	if (!FinishTrace(traceName)) {
+		return 1;
+	}
+	return statistics.FilesFailed == 0 ? 0 : 1;
+}
+
+int CommandLine::RunDecode(const std::vector<std::wstring>& arguments)
+{
+	std::wstring inputName;
+	std::wstring outputName;
+	UINT16 bitCount = 24;
+	BitmapWriter::RowOrder order = BitmapWriter::ROW_ORDER_BOTTOM_UP;
+	std::wstring traceName;
+	UINT64 value = 0;
+	for (size_t i = 0; i < arguments.size(); i++) {
+		const std::wstring& argument = arguments[i];
+		BOOL hasValue = i + 1 < arguments.size();
+		if (argument == L"/decode" && hasValue) {
+			inputName = arguments[++i];
+		}
+		else if (argument == L"/output" && hasValue) {
+			outputName = arguments[++i];
+		}
+		else if (argument == L"/bits" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 0, std::numeric_limits<UINT16>::max(), value)) {
+				return 1;
+			}
+			bitCount = static_cast<UINT16>(value);
+		}
+		else if (argument == L"/topdown") {
+			order = BitmapWriter::ROW_ORDER_TOP_DOWN;
+		}
+		else if (argument == L"/trace" && hasValue) {
+			traceName = arguments[++i];
+		}
+		else {
+			Print(L"Unknown argument: " + argument);
+			return 1;
+		}
+	}
+	if (outputName.empty()) {
+		outputName = replaceExtension(inputName, L".bmp");
+	}
+	if (!StartTrace(traceName)) {
+		return 1;
+	}
+	HANDLE fileHandle = CreateFileW(
+		inputName.c_str(),
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		Print(L"Cannot open " + inputName);
+		return 1;
+	}
+	// The IN3 file closes the handle once it is read
+	IN3File in3File(fileHandle);
+	const IN3Header<INT8>& header = in3File.getHeader();
+	if (!IN3File::IsValidHeader(header)) {
+		Print(L"Cannot decompress " + inputName);
+		return 1;
+	}
+	BitmapWriter writer(
+		outputName,
+		static_cast<INT32>(header.Width),
+		static_cast<INT32>(header.Height),
+		bitCount,
+		order);
+	Codec codec;
+	BOOL decoded = codec.decompress(in3File, writer);
+	if (!writer.close() || !decoded) {
+		DeleteFileW(outputName.c_str());
+		Print(L"Cannot decompress " + inputName + L" to " + outputName);
+		return 1;
+	}
+	Print(L"Decompressed " + inputName + L" to " + outputName);
+	return FinishTrace(traceName) ? 0 : 1;
+}
+
+int CommandLine::RunWide(const std::vector<std::wstring>& arguments)
+{
+	std::wstring inputName;
+	std::wstring outputName;
+	BOOL decode = FALSE;
+	Codec::Settings settings;
+	for (size_t i = 0; i < arguments.size(); i++) {
+		const std::wstring& argument = arguments[i];
+		BOOL hasValue = i + 1 < arguments.size();
+		if ((argument == L"/wide" || argument == L"/widedecode") && hasValue) {
+			decode = argument == L"/widedecode";
+			inputName = arguments[++i];
+		}
+		else if (argument == L"/output" && hasValue) {
+			outputName = arguments[++i];
+		}
+		else if (argument == L"/ycocg") {
+			settings.ColorTransform = COLOR_TRANSFORM_YCOCG_R;
+		}
+		else {
+			Print(L"Unknown argument: " + argument);
+			return 1;
+		}
+	}
+	Codec codec(settings);
+	WideImage image;
+	if (decode) {
+		HANDLE fileHandle = CreateFileW(
+			inputName.c_str(),
+			GENERIC_READ,
+			FILE_SHARE_READ,
+			NULL,
+			OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL,
+			NULL);
+		if (fileHandle == INVALID_HANDLE_VALUE) {
+			Print(L"Cannot open " + inputName);
+			return 1;
+		}
+		// The wide file closes the handle once it is read
+		IN3WideFile in3WideFile(fileHandle);
+		if (!codec.decompressWide(in3WideFile, image)) {
+			Print(L"Cannot decompress " + inputName);
+			return 1;
+		}
+		if (outputName.empty()) {
+			outputName = replaceExtension(inputName, image.PlaneCount == 3 ? L".ppm" : L".pgm");
+		}
+		if (!writeNetpbmFile(outputName, image)) {
+			DeleteFileW(outputName.c_str());
+			Print(L"Cannot write " + outputName);
+			return 1;
+		}
+		Print(L"Decompressed " + inputName + L" to " + outputName);
+		return 0;
+	}
+	if (!readNetpbmFile(inputName, image)) {
+		Print(L"Cannot read " + inputName + L" as a PGM or PPM file of more than 8 bits per sample");
+		return 1;
+	}
+	if (outputName.empty()) {
+		outputName = replaceExtension(inputName, L".in3w");
+	}
+	std::unique_ptr<IN3WideFile> compressed = codec.compressWide(image);
+	HANDLE fileHandle = CreateFileW(
+		outputName.c_str(),
+		GENERIC_WRITE,
+		0,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	if (!compressed || fileHandle == INVALID_HANDLE_VALUE || !compressed->Save(fileHandle)) {
+		if (fileHandle != INVALID_HANDLE_VALUE) {
+			DeleteFileW(outputName.c_str());
+		}
+		Print(L"Cannot compress " + inputName + L" to " + outputName);
+		return 1;
+	}
+	Print(L"Compressed " + inputName + L" to " + outputName);
+	return 0;
+}
+
+int CommandLine::RunArchive(const std::vector<std::wstring>& arguments)
+{
+	std::wstring directory;
+	std::wstring outputName;
+	Codec::Settings settings;
+	for (size_t i = 0; i < arguments.size(); i++) {
+		const std::wstring& argument = arguments[i];
+		BOOL hasValue = i + 1 < arguments.size();
+		if (argument == L"/archive" && hasValue) {
+			directory = arguments[++i];
+		}
+		else if (argument == L"/output" && hasValue) {
+			outputName = arguments[++i];
+		}
+		else if (argument == L"/ycocg") {
+			settings.ColorTransform = COLOR_TRANSFORM_YCOCG_R;
+		}
+		else {
+			Print(L"Unknown argument: " + argument);
+			return 1;
+		}
+	}
+	if (outputName.empty()) {
+		outputName = directory;
+		while (!outputName.empty() && (outputName.back() == L'\\' || outputName.back() == L'/')) {
+			outputName.pop_back();
+		}
+		outputName += L".in3a";
+	}
+	std::vector<std::wstring> fileNames = BatchCompressor::findBitmapFiles(directory);
+	HANDLE fileHandle = CreateFileW(
+		outputName.c_str(),
+		GENERIC_WRITE,
+		0,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		Print(L"Cannot create " + outputName);
+		return 1;
+	}
+	// Images are keyed by their file name without the directory
+	Codec codec(settings);
+	IN3ArchiveWriter writer(fileHandle);
+	UINT64 failed = 0;
+	for (const std::wstring& fileName : fileNames) {
+		std::unique_ptr<BitmapFile> bitmapFile = readBitmapFile(fileName);
+		std::unique_ptr<IN3File> in3File;
+		if (bitmapFile) {
+			in3File = codec.compress(*bitmapFile);
+		}
+		std::wstring key = fileName.substr(fileName.find_last_of(L"\\/") + 1);
+		if (!in3File || !writer.addImage(key, *in3File)) {
+			Print(L"Cannot add " + fileName);
+			failed++;
+		}
+	}
+	if (!writer.finish()) {
+		DeleteFileW(outputName.c_str());
+		Print(L"Cannot write " + outputName);
+		return 1;
+	}
+	std::wostringstream report;
+	report << L"Archived " << fileNames.size() - failed << L" images to " << outputName;
+	report << L" (" << failed << L" failed)";
+	Print(report.str());
+	return failed == 0 ? 0 : 1;
+}
+
+int CommandLine::RunExtract(const std::vector<std::wstring>& arguments)
+{
+	std::wstring archiveName;
+	std::wstring key;
+	std::wstring outputName;
+	for (size_t i = 0; i < arguments.size(); i++) {
+		const std::wstring& argument = arguments[i];
+		BOOL hasValue = i + 1 < arguments.size();
+		if (argument == L"/extract" && hasValue) {
+			archiveName = arguments[++i];
+		}
+		else if (argument == L"/key" && hasValue) {
+			key = arguments[++i];
+		}
+		else if (argument == L"/output" && hasValue) {
+			outputName = arguments[++i];
+		}
+		else {
+			Print(L"Unknown argument: " + argument);
+			return 1;
+		}
+	}
+	if (outputName.empty()) {
+		outputName = key;
+	}
+	HANDLE fileHandle = CreateFileW(
+		archiveName.c_str(),
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		Print(L"Cannot open " + archiveName);
+		return 1;
+	}
+	// The reader closes the handle
+	IN3ArchiveReader reader(fileHandle);
+	std::unique_ptr<IN3File> in3File = reader.find(key);
+	if (!in3File) {
+		Print(L"No image " + key + L" in " + archiveName);
+		return 1;
+	}
+	const IN3Header<INT8>& header = in3File->getHeader();
+	if (!IN3File::IsValidHeader(header)) {
+		Print(L"Cannot decompress " + key);
+		return 1;
+	}
+	BitmapWriter writer(
+		outputName,
+		static_cast<INT32>(header.Width),
+		static_cast<INT32>(header.Height),
+		24,
+		BitmapWriter::ROW_ORDER_BOTTOM_UP);
+	Codec codec;
+	BOOL decoded = codec.decompress(*in3File, writer);
+	if (!writer.close() || !decoded) {
+		DeleteFileW(outputName.c_str());
+		Print(L"Cannot decompress " + key + L" to " + outputName);
+		return 1;
+	}
+	Print(L"Extracted " + key + L" to " + outputName);
+	return 0;
+}
+
+int CommandLine::RunSequence(const std::vector<std::wstring>& arguments)
+{
+	std::wstring directory;
+	std::wstring outputName;
+	IN3ColorTransform colorTransform = COLOR_TRANSFORM_YUV;
+	UINT32 keyFrameInterval = IN3SequenceWriter::DEFAULT_KEY_FRAME_INTERVAL;
+	UINT32 blockSize = IN3SequenceWriter::DEFAULT_BLOCK_SIZE;
+	UINT64 value = 0;
+	for (size_t i = 0; i < arguments.size(); i++) {
+		const std::wstring& argument = arguments[i];
+		BOOL hasValue = i + 1 < arguments.size();
+		if (argument == L"/sequence" && hasValue) {
+			directory = arguments[++i];
+		}
+		else if (argument == L"/output" && hasValue) {
+			outputName = arguments[++i];
+		}
+		else if (argument == L"/ycocg") {
+			colorTransform = COLOR_TRANSFORM_YCOCG_R;
+		}
+		else if (argument == L"/keyframes" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 1, std::numeric_limits<UINT32>::max(), value)) {
+				return 1;
+			}
+			keyFrameInterval = static_cast<UINT32>(value);
+		}
+		else if (argument == L"/blocksize" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 1, std::numeric_limits<UINT32>::max(), value)) {
+				return 1;
+			}
+			blockSize = static_cast<UINT32>(value);
+		}
+		else {
+			Print(L"Unknown argument: " + argument);
+			return 1;
+		}
+	}
+	if (outputName.empty()) {
+		outputName = directory;
+		while (!outputName.empty() && (outputName.back() == L'\\' || outputName.back() == L'/')) {
+			outputName.pop_back();
+		}
+		outputName += L".in3s";
+	}
+	// Frames follow the order of their file names
+	std::vector<std::wstring> fileNames = BatchCompressor::findBitmapFiles(directory);
+	std::sort(fileNames.begin(), fileNames.end());
+	if (fileNames.empty()) {
+		Print(L"No BMP files in " + directory);
+		return 1;
+	}
+	HANDLE fileHandle = CreateFileW(
+		outputName.c_str(),
+		GENERIC_WRITE,
+		0,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		Print(L"Cannot create " + outputName);
+		return 1;
+	}
+	// The writer closes the handle when it finishes
+	IN3SequenceWriter writer(fileHandle, colorTransform, keyFrameInterval, blockSize);
+	for (const std::wstring& fileName : fileNames) {
+		std::unique_ptr<BitmapFile> bitmapFile = readBitmapFile(fileName);
+		if (!bitmapFile || !writer.addFrame(*bitmapFile)) {
+			writer.finish();
+			DeleteFileW(outputName.c_str());
+			Print(L"Cannot add " + fileName + L" to " + outputName);
+			return 1;
+		}
+	}
+	if (!writer.finish()) {
+		DeleteFileW(outputName.c_str());
+		Print(L"Cannot write " + outputName);
+		return 1;
+	}
+	std::wostringstream report;
+	report << L"Wrote " << fileNames.size() << L" frames to " << outputName;
+	Print(report.str());
+	return 0;
+}
+
+int CommandLine::RunFilter(const std::vector<std::wstring>& arguments)
+{
+	// Largest standard deviation, whose kernel already spans 1537 pixels
+	static const DOUBLE MAX_SIGMA = 256.0;
+	std::wstring inputName;
+	std::wstring outputName;
+	BOOL blur = FALSE;
+	BOOL sharpen = FALSE;
+	DOUBLE sigma = 0.0;
+	DOUBLE amount = 1.0;
+	INT32 threshold = 0;
+	INT32 width = 0;
+	INT32 height = 0;
+	UINT32 threadCount = 0;
+	UINT64 value = 0;
+	for (size_t i = 0; i < arguments.size(); i++) {
+		const std::wstring& argument = arguments[i];
+		BOOL hasValue = i + 1 < arguments.size();
+		if (argument == L"/filter" && hasValue) {
+			inputName = arguments[++i];
+		}
+		else if (argument == L"/output" && hasValue) {
+			outputName = arguments[++i];
+		}
+		else if ((argument == L"/blur" || argument == L"/sharpen") && hasValue) {
+			blur = argument == L"/blur";
+			sharpen = !blur;
+			if (!ParseNumber(argument, arguments[++i], sigma)) {
+				return 1;
+			}
+			if (sigma > MAX_SIGMA) {
+				Print(L"Invalid value for " + argument + L": " + arguments[i] + L" (expected at most 256)");
+				return 1;
+			}
+		}
+		else if (argument == L"/amount" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], amount)) {
+				return 1;
+			}
+		}
+		else if (argument == L"/threshold" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 0, 255, value)) {
+				return 1;
+			}
+			threshold = static_cast<INT32>(value);
+		}
+		else if (argument == L"/width" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 1, std::numeric_limits<INT32>::max(), value)) {
+				return 1;
+			}
+			width = static_cast<INT32>(value);
+		}
+		else if (argument == L"/height" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 1, std::numeric_limits<INT32>::max(), value)) {
+				return 1;
+			}
+			height = static_cast<INT32>(value);
+		}
+		else if (argument == L"/threads" && hasValue) {
+			if (!ParseNumber(argument, arguments[++i], 0, std::numeric_limits<UINT32>::max(), value)) {
+				return 1;
+			}
+			threadCount = static_cast<UINT32>(value);
+		}
+		else {
+			Print(L"Unknown argument: " + argument);
+			return 1;
+		}
+	}
+	BOOL resize = width != 0 || height != 0;
+	if ((blur ? 1 : 0) + (sharpen ? 1 : 0) + (resize ? 1 : 0) != 1 || (resize && (width == 0 || height == 0))) {
+		Print(L"Give one of /blur, /sharpen or /width and /height");
+		return 1;
+	}
+	if (outputName.empty()) {
+		outputName = replaceExtension(inputName, L"_filtered.bmp");
+	}
+	std::unique_ptr<BitmapFile> bitmapFile = readBitmapFile(inputName);
+	if (!bitmapFile) {
+		Print(L"Cannot read " + inputName);
+		return 1;
+	}
+	std::unique_ptr<NeighborhoodOperation> operation;
+	if (blur) {
+		operation.reset(new GaussianBlur(sigma, threadCount));
+	}
+	else if (sharpen) {
+		operation.reset(new UnsharpMask(sigma, amount, threshold, threadCount));
+	}
+	else {
+		operation.reset(new Downscale(width, height, threadCount));
+	}
+	std::unique_ptr<BitmapFile> filtered = operation->apply(*bitmapFile);
+	if (!filtered || !BitmapWriter::Write(*filtered, outputName)) {
+		DeleteFileW(outputName.c_str());
+		Print(L"Cannot filter " + inputName + L" to " + outputName);
+		return 1;
+	}
+	Print(L"Filtered " + inputName + L" to " + outputName);
+	return 0;
+}
+
+BOOL CommandLine::CheckRowAllocations()
+{
+	// Growing vectors geometrically allocates a few more times for more
+	// rows, so the check allows one allocation per 16 rows
+	static const INT32 SMALL_HEIGHT = 64;
+	static const INT32 LARGE_HEIGHT = 512;
+	static const UINT64 MAX_EXTRA = (LARGE_HEIGHT - SMALL_HEIGHT) / 16;
+	static const WCHAR* const IMAGE_NAMES[3] = { L"yuv", L"ycocg", L"palette" };
+	// Bytes per added pixel of the buffers the round trip of each image
+	// needs: its planes, coded bits, saved file and decoded bitmap. The
+	// budgets leave a quarter of a plane to spare, so one more copy of a
+	// whole plane fails the check.
+	static const DOUBLE PLANE_BYTES[3] = { 18.75, 19.25, 7.5 };
+	static const UINT64 ADDED_PIXELS = static_cast<UINT64>(LARGE_HEIGHT - SMALL_HEIGHT) * 256;
+	BOOL passed = TRUE;
+	for (UINT8 i = 0; i < 3; i++) {
+		Codec::Settings settings;
+		if (i == 1) {
+			settings.ColorTransform = COLOR_TRANSFORM_YCOCG_R;
+		}
+		// Only the palette image has few enough colors to be palette coded
+		MemoryAccounting::Statistics small = countCodecAllocations(settings, SMALL_HEIGHT, i == 2);
+		MemoryAccounting::Statistics large = countCodecAllocations(settings, LARGE_HEIGHT, i == 2);
+		DOUBLE bytesPerPixel = large.BytesAllocated < small.BytesAllocated ? 0.0 :
+			static_cast<DOUBLE>(large.BytesAllocated - small.BytesAllocated) / ADDED_PIXELS;
+		std::wostringstream report;
+		report << L"Codec allocations, " << IMAGE_NAMES[i] << L": ";
+		report << small.Allocations << L" for " << SMALL_HEIGHT << L" rows, ";
+		report << large.Allocations << L" for " << LARGE_HEIGHT << L" rows, ";
+		report << bytesPerPixel << L" bytes per added pixel: ";
+		if (small.Allocations == 0 && large.Allocations == 0) {
+			// Builds without the allocator hooks count nothing
+			report << L"not counted";
+		}
+		else if (small.Allocations != 0 &&
+			large.Allocations != 0 &&
+			large.Allocations <= small.Allocations + MAX_EXTRA &&
+			bytesPerPixel <= PLANE_BYTES[i]) {
+			report << L"passed";
+		}
+		else {
+			report << L"FAILED";
+			passed = FALSE;
+		}
+		Print(report.str());
+	}
+	return passed;
+}
+
+BOOL CommandLine::CheckBrighten()
+{
+	// The other levels match the kernels in use exactly, so checking these
+	// covers every level
+	static const DOUBLE FACTORS[] = { 0.0, 0.5, 1.0, 1.64, 4.0 };
+	BOOL passed = TRUE;
+	for (DOUBLE factor : FACTORS) {
+		Brighten brighten(factor);
+		BOOL matches = brighten.MatchesReference();
+		std::wostringstream report;
+		report << L"Brighten x" << factor << L" against floating point HSV: ";
+		report << (matches ? L"passed" : L"FAILED");
+		Print(report.str());
+		passed = passed && matches;
+	}
+	return passed;
+}
+
+BOOL CommandLine::CheckErrorDiffusion()
+{
+	// Rows end partway through a chunk of columns, and the larger thread
+	// counts leave threads waiting on each other at every row
+	static const INT32 WIDTH = 203;
+	static const INT32 HEIGHT = 57;
+	static const UINT32 THREAD_COUNTS[] = { 2, 3, 8, 64 };
+	static const ErrorDiffusionDither::Kernel KERNELS[] = {
+		ErrorDiffusionDither::FLOYD_STEINBERG,
+		ErrorDiffusionDither::JARVIS_JUDICE_NINKE,
+		ErrorDiffusionDither::STUCKI
+	};
+	static const WCHAR* const KERNEL_NAMES[] = { L"Floyd-Steinberg", L"Jarvis-Judice-Ninke", L"Stucki" };
+	BOOL passed = TRUE;
+	for (UINT8 k = 0; k < 3; k++) {
+		BitmapFile serial = createSequenceFrame(WIDTH, HEIGHT, 0);
+		ErrorDiffusionDither serialDither(KERNELS[k], 1);
+		serial.doPixelOperation(serialDither);
+		BOOL matches = TRUE;
+		for (UINT32 threadCount : THREAD_COUNTS) {
+			BitmapFile parallel = createSequenceFrame(WIDTH, HEIGHT, 0);
+			ErrorDiffusionDither parallelDither(KERNELS[k], threadCount);
+			parallel.doPixelOperation(parallelDither);
+			matches = matches && samePixels(serial, parallel);
+		}
+		Print(std::wstring(L"Error diffusion, ") + KERNEL_NAMES[k] + L", threads against one thread: " +
+			(matches ? L"passed" : L"FAILED"));
+		passed = passed && matches;
+	}
+	return passed;
+}
+
+BOOL CommandLine::CheckNeighborhood()
+{
+	// Bands end partway through the image, and the small image is shorter
+	// and narrower than its filter reaches
+	BitmapFile image = createSequenceFrame(203, 157, 0);
+	BitmapFile smallImage = createSequenceFrame(7, 3, 0);
+	GaussianBlur blur(1.5, 3);
+	GaussianBlur wideBlur(2.0, 1);
+	UnsharpMask sharpen(1.0, 1.5, 0, 4);
+	Downscale downscale(61, 40, 3);
+	Downscale upscale(250, 170, 2);
+	struct {
+		const WCHAR* Name;
+		NeighborhoodOperation* Operation;
+		const BitmapFile* Source;
+	} CASES[] = {
+		{ L"Gaussian blur", &blur, &image },
+		{ L"Gaussian blur of a small image", &wideBlur, &smallImage },
+		{ L"Unsharp mask", &sharpen, &image },
+		{ L"Downscale", &downscale, &image },
+		{ L"Upscale", &upscale, &image }
+	};
+	BOOL passed = TRUE;
+	for (const auto& test : CASES) {
+		BOOL matches = test.Operation->MatchesReference(*test.Source);
+		Print(std::wstring(test.Name) + L" against the per-pixel reference: " + (matches ? L"passed" : L"FAILED"));
+		passed = passed && matches;
+	}
+	return passed;
+}
+
+BOOL CommandLine::CheckSequence()
+{
+	static const INT32 WIDTH = 96;
+	static const INT32 HEIGHT = 40;
+	static const INT32 FRAMES = 7;
+	std::wstring fileName = createTemporaryFile();
+	if (fileName.empty()) {
+		Print(L"Sequence round trip: FAILED, cannot create a temporary file");
+		return FALSE;
+	}
+	// YCoCg-R is lossless, so decoded frames match the originals exactly
+	BOOL passed = FALSE;
+	HANDLE fileHandle = CreateFileW(fileName.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fileHandle != INVALID_HANDLE_VALUE) {
+		IN3SequenceWriter writer(fileHandle, COLOR_TRANSFORM_YCOCG_R, 3);
+		passed = TRUE;
+		for (INT32 frame = 0; frame < FRAMES; frame++) {
+			passed = writer.addFrame(createSequenceFrame(WIDTH, HEIGHT, frame)) && passed;
+		}
+		passed = writer.finish() && passed;
+	}
+	// Frames are read backwards so that each one starts from a key frame
+	fileHandle = CreateFileW(fileName.c_str(), GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (passed && fileHandle != INVALID_HANDLE_VALUE) {
+		IN3SequenceReader reader(fileHandle);
+		passed = reader.isValid() && reader.getFrameCount() == FRAMES;
+		for (INT32 frame = FRAMES - 1; frame >= 0 && passed; frame--) {
+			std::unique_ptr<BitmapFile> decoded = reader.getFrame(frame);
+			passed = decoded && samePixels(createSequenceFrame(WIDTH, HEIGHT, frame), *decoded);
+		}
+	}
+	else {
+		passed = FALSE;
+		if (fileHandle != INVALID_HANDLE_VALUE) {
+			CloseHandle(fileHandle);
+		}
+	}
+	// Cutting the last byte of the index off must make the file unreadable
+	fileHandle = CreateFileW(fileName.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER end;
+	end.QuadPart = -1;
+	BOOL truncated = fileHandle != INVALID_HANDLE_VALUE &&
+		SetFilePointerEx(fileHandle, end, NULL, FILE_END) &&
+		SetEndOfFile(fileHandle);
+	if (fileHandle != INVALID_HANDLE_VALUE) {
+		CloseHandle(fileHandle);
+	}
+	fileHandle = CreateFileW(fileName.c_str(), GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (truncated && fileHandle != INVALID_HANDLE_VALUE) {
+		IN3SequenceReader reader(fileHandle);
+		passed = passed && !reader.isValid();
+	}
+	else {
+		passed = FALSE;
+		if (fileHandle != INVALID_HANDLE_VALUE) {
+			CloseHandle(fileHandle);
+		}
+	}
+	DeleteFileW(fileName.c_str());
+	Print(std::wstring(L"Sequence round trip and truncated file: ") + (passed ? L"passed" : L"FAILED"));
+	return passed;
+}
+
+BOOL CommandLine::CheckArchive()
+{
+	static const INT32 WIDTH = 48;
+	static const INT32 HEIGHT = 24;
+	static const WCHAR* const KEYS[3] = { L"yuv", L"ycocg", L"palette" };
+	std::wstring fileName = createTemporaryFile();
+	HANDLE fileHandle = fileName.empty() ? INVALID_HANDLE_VALUE : CreateFileW(
+		fileName.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		Print(L"Archive round trip: FAILED, cannot create a temporary file");
+		return FALSE;
+	}
+	// One image of each color transform, decompressed from the file saved
+	// without the archive for comparison
+	std::unique_ptr<BitmapFile> expected[3];
+	BOOL passed = TRUE;
+	{
+		IN3ArchiveWriter writer(fileHandle);
+		for (UINT8 i = 0; i < 3; i++) {
+			BitmapFile bitmapFile(WIDTH, HEIGHT);
+			for (INT32 y = 0; y < HEIGHT; y++) {
+				BitmapFile::Pixel* row = bitmapFile.getRow(y);
+				for (INT32 x = 0; x < WIDTH; x++) {
+					if (i == 2) {
+						row[x] = { static_cast<BYTE>(x / 8 * 40), static_cast<BYTE>(y % 2 * 200), 7 };
+					}
+					else {
+						row[x] = { static_cast<BYTE>(x * 5 + y), static_cast<BYTE>(x ^ y), static_cast<BYTE>(y * 9 + i) };
+					}
+				}
+			}
+			Codec::Settings settings;
+			settings.ColorTransform = i == 1 ? COLOR_TRANSFORM_YCOCG_R : COLOR_TRANSFORM_YUV;
+			Codec codec(settings);
+			std::unique_ptr<IN3File> in3File = codec.compress(bitmapFile);
+			std::vector<BYTE> bytes = in3File->SaveToMemory();
+			expected[i] = codec.decompress(IN3File(Span<BYTE>(bytes.data(), bytes.size())));
+			passed = passed && expected[i] && writer.addImage(KEYS[i], *in3File);
+		}
+		passed = writer.finish() && passed;
+	}
+	fileHandle = CreateFileW(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (passed && fileHandle != INVALID_HANDLE_VALUE) {
+		IN3ArchiveReader reader(fileHandle);
+		passed = reader.isValid() && reader.getImageCount() == 3 && !reader.find(L"missing");
+		Codec codec;
+		for (UINT8 i = 0; i < 3 && passed; i++) {
+			std::unique_ptr<IN3File> in3File = reader.find(KEYS[i]);
+			std::unique_ptr<BitmapFile> decoded;
+			if (in3File) {
+				decoded = codec.decompress(*in3File);
+			}
+			passed = decoded && samePixels(*expected[i], *decoded);
+		}
+	}
+	else {
+		passed = FALSE;
+		if (fileHandle != INVALID_HANDLE_VALUE) {
+			CloseHandle(fileHandle);
+		}
+	}
+	DeleteFileW(fileName.c_str());
+	Print(std::wstring(L"Archive round trip: ") + (passed ? L"passed" : L"FAILED"));
+	return passed;
+}
+
+BOOL CommandLine::CheckWide()
+{
+	static const UINT64 WIDTH = 77;
+	static const UINT64 HEIGHT = 31;
+	BOOL passed = TRUE;
+	for (UINT8 t = 0; t < 2 && passed; t++) {
+		// A 12-bit gradient with noise, and a 16-bit one whose samples wrap
+		// through the color transform
+		WideImage image;
+		image.Width = WIDTH;
+		image.Height = HEIGHT;
+		image.SampleBits = t == 0 ? 12 : 16;
+		image.PlaneCount = 3;
+		UINT32 seed = 1;
+		for (UINT8 p = 0; p < 3; p++) {
+			image.Planes[p].resize(WIDTH * HEIGHT);
+			for (UINT64 i = 0; i < WIDTH * HEIGHT; i++) {
+				seed = seed * 1103515245 + 12345;
+				UINT32 value = static_cast<UINT32>(i % WIDTH * 37 + i / WIDTH * 101 * (p + 1)) + (seed >> 28);
+				image.Planes[p][i] = static_cast<UINT16>(value & ((1u << image.SampleBits) - 1));
+			}
+		}
+		Codec::Settings settings;
+		settings.ColorTransform = t == 0 ? COLOR_TRANSFORM_YUV : COLOR_TRANSFORM_YCOCG_R;
+		Codec codec(settings);
+		std::unique_ptr<IN3WideFile> compressed = codec.compressWide(image);
+		std::wstring fileName = createTemporaryFile();
+		HANDLE fileHandle = fileName.empty() ? INVALID_HANDLE_VALUE : CreateFileW(
+			fileName.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		passed = compressed && fileHandle != INVALID_HANDLE_VALUE && compressed->Save(fileHandle);
+		fileHandle = CreateFileW(fileName.c_str(), GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (passed && fileHandle != INVALID_HANDLE_VALUE) {
+			IN3WideFile in3WideFile(fileHandle);
+			WideImage decoded;
+			passed = codec.decompressWide(in3WideFile, decoded) &&
+				decoded.Width == WIDTH &&
+				decoded.Height == HEIGHT &&
+				decoded.PlaneCount == 3;
+			for (UINT8 p = 0; p < 3 && passed; p++) {
+				passed = decoded.Planes[p] == image.Planes[p];
+			}
+			// Dimensions whose samples the planes cannot hold must be
+			// rejected before anything is allocated for them
+			IN3WideHeader header = in3WideFile.getHeader();
+			header.Width = std::numeric_limits<INT32>::max();
+			header.Height = std::numeric_limits<INT32>::max();
+			std::vector<BYTE> planes[3] = {
+				in3WideFile.getPlane(0),
+				in3WideFile.getPlane(1),
+				in3WideFile.getPlane(2)
+			};
+			IN3WideFile damaged(header, planes);
+			passed = passed && !codec.decompressWide(damaged, decoded);
+		}
+		else {
+			passed = FALSE;
+			if (fileHandle != INVALID_HANDLE_VALUE) {
+				CloseHandle(fileHandle);
+			}
+		}
+		// A plane short of samples cannot be compressed
+		image.Planes[2].pop_back();
+		passed = passed && !codec.compressWide(image);
+		if (!fileName.empty()) {
+			DeleteFileW(fileName.c_str());
+		}
+	}
+	Print(std::wstring(L"High bit depth round trip: ") + (passed ? L"passed" : L"FAILED"));
+	return passed;
+}
+
+int CommandLine::RunSelfTest()
+{
+	int exitCode = 0;
+	for (UINT8 i = 0; i < CPU_LEVEL_COUNT; i++) {
+		CpuLevel level = static_cast<CpuLevel>(i);
+		std::wstring result;
+		if (level > CpuDispatch::getSupportedLevel()) {
+			result = L"not supported";
+		}
+		else if (CpuDispatch::selfTest(level)) {
+			result = L"passed";
+		}
+		else {
+			result = L"FAILED";
+			exitCode = 1;
+		}
+		Print(std::wstring(CpuDispatch::getLevelName(level)) + L": " + result);
+	}
+	Print(std::wstring(L"Using ") + CpuDispatch::getLevelName(CpuDispatch::getLevel()) + L" kernels");
+	if (!CheckBrighten()) {
+		exitCode = 1;
+	}
+	if (!CheckErrorDiffusion()) {
+		exitCode = 1;
+	}
+	if (!CheckNeighborhood()) {
+		exitCode = 1;
+	}
+	if (!CheckRowAllocations()) {
+		exitCode = 1;
+	}
+	if (!CheckWide()) {
+		exitCode = 1;
+	}
+	if (!CheckArchive()) {
+		exitCode = 1;
+	}
+	if (!CheckSequence()) {
+		exitCode = 1;
+	}
+	return exitCode;
+}
+
+BOOL CommandLine::Run(int* exitCode)
+{
+	// Parse the full command line so quoting follows the usual rules,
+	// then drop the program name
+	int argumentCount = 0;
+	LPWSTR* argumentList = CommandLineToArgvW(GetCommandLineW(), &argumentCount);
+	if (argumentList == NULL || argumentCount < 2) {
+		LocalFree(argumentList);
+		return FALSE;
+	}
+	std::vector<std::wstring> arguments(argumentList + 1, argumentList + argumentCount);
+	LocalFree(argumentList);
+	// The kernel level applies to every operation, so it is taken out first
+	auto cpu = std::find(arguments.begin(), arguments.end(), L"/cpu");
+	if (cpu != arguments.end()) {
+		CpuLevel level;
+		if (cpu + 1 == arguments.end() || !CpuDispatch::parseLevel(*(cpu + 1), level)) {
+			Print(L"Unknown CPU level");
+			*exitCode = 1;
+			return TRUE;
+		}
+		if (!CpuDispatch::setLevel(level)) {
+			Print(std::wstring(L"This CPU does not support ") + CpuDispatch::getLevelName(level));
+			*exitCode = 1;
+			return TRUE;
+		}
+		arguments.erase(cpu, cpu + 2);
+	}
+	if (std::find(arguments.begin(), arguments.end(), L"/selftest") != arguments.end()) {
+		*exitCode = RunSelfTest();
+		return TRUE;
+	}
+	if (std::find(arguments.begin(), arguments.end(), L"/batch") != arguments.end()) {
+		*exitCode = RunBatch(arguments);
+		return TRUE;
+	}
+	if (std::find(arguments.begin(), arguments.end(), L"/decode") != arguments.end()) {
+		*exitCode = RunDecode(arguments);
+		return TRUE;
+	}
+	if (std::find(arguments.begin(), arguments.end(), L"/wide") != arguments.end() ||
+		std::find(arguments.begin(), arguments.end(), L"/widedecode") != arguments.end()) {
+		*exitCode = RunWide(arguments);
+		return TRUE;
+	}
+	if (std::find(arguments.begin(), arguments.end(), L"/archive") != arguments.end()) {
+		*exitCode = RunArchive(arguments);
+		return TRUE;
+	}
+	if (std::find(arguments.begin(), arguments.end(), L"/extract") != arguments.end()) {
+		*exitCode = RunExtract(arguments);
+		return TRUE;
+	}
+	if (std::find(arguments.begin(), arguments.end(), L"/sequence") != arguments.end()) {
+		*exitCode = RunSequence(arguments);
+		return TRUE;
+	}
+	if (std::find(arguments.begin(), arguments.end(), L"/filter") != arguments.end()) {
+		*exitCode = RunFilter(arguments);
+		return TRUE;
+	}
+	return FALSE;
+}
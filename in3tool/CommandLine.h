@@ -0,0 +1,116 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Non-interactive operations selected by command line switches
+//   /batch <directory>   Compress every BMP file in the directory
+//   /threads <count>     Worker threads for batch operations and filters
+//                        (default: all)
+//   /budget <megabytes>  Memory budget for files in flight
+//   /queue <count>       Files read ahead and writes queued by batch I/O
+//   /ycocg               Use the lossless YCoCg-R color transform
+//   /quant <step>        Quantize the YUV samples of every plane by a step, 1 to 64
+//   /bpp <bits>          Pick quantization steps for a target bits per pixel
+//   /palette <colors>    Most colors coded as a palette, 0 for none (default: 256)
+//   /effort <level>      Encoder effort: default or high
+//   /memstats            Report heap allocations per pipeline stage
+//   /cache <directory>   Reuse files compressed before from a cache directory
+//   /cachesize <mb>      Size limit of the cache in megabytes (default: 1024)
+//   /decode <file>       Decompress an IN3 file to a BMP file
+//   /bits <24|32>        Bits per pixel of the BMP file (default: 24)
+//   /topdown             Store the BMP rows top first
+//   /wide <file>         Compress a binary PGM or PPM file of 9 to 16 bits
+//                        per sample to a high bit depth IN3 file
+//   /widedecode <file>   Decompress a high bit depth IN3 file to PGM or PPM
+//   /archive <dir>       Compress the BMP files of a directory into one IN3
+//                        archive, keyed by file name
+//   /extract <archive>   Decompress the image of a key from an archive
+//   /key <name>          Key of the image to extract, and the default name
+//                        of the BMP file
+//   /sequence <dir>      Code the BMP files of a directory, in name order,
+//                        as the frames of an IN3 sequence file
+//   /output <file>       File to write (default: the input name)
+//   /keyframes <count>   Frames from one key frame to the next (default: 30)
+//   /blocksize <pixels>  Side of the blocks sequence frames skip when they
+//                        did not change (default: 16)
+//   /filter <file>       Filter a BMP file with one of /blur, /sharpen or
+//                        /width and /height
+//   /blur <sigma>        Gaussian blur of a standard deviation in pixels
+//   /sharpen <sigma>     Unsharp mask with a blur of the standard deviation
+//   /amount <factor>     Strength of /sharpen (default: 1)
+//   /threshold <level>   Differences /sharpen leaves alone (default: 0)
+//   /width <pixels>      Resize to a width and height with Lanczos-3
+//   /height <pixels>
+//   /trace <file>        Write a Chrome trace of the batch or decode
+//   /cpu <level>         Use the kernels of scalar, sse4.2, avx2 or avx512
+//                        instead of the newest level the CPU supports
+//   /selftest            Check the kernels of every level against scalar
+//                        and floating point brightening, parallel error
+//                        diffusion against one thread, the neighborhood
+//                        operations against a per-pixel reference, that the
+//                        codec does not allocate per row, and the round
+//                        trips of high bit depth images, archives and
+//                        sequences
+class CommandLine
+{
+private:
+	// Write a line to the console the program was started from
+	static void Print(const std::wstring& text);
+	// Parse the value of a numeric switch, returning FALSE and reporting a
+	// usage error when it is not a number within the range
+	static BOOL ParseNumber(
+		const std::wstring& argument,
+		const std::wstring& text,
+		UINT64 minValue,
+		UINT64 maxValue,
+		UINT64& value);
+	static BOOL ParseNumber(
+		const std::wstring& argument,
+		const std::wstring& text,
+		DOUBLE& value);
+	// Report the allocation counters of every pipeline stage
+	static void PrintMemoryStatistics();
+	// Start tracing when a trace file was given, returning FALSE if
+	// tracing is compiled out
+	static BOOL StartTrace(const std::wstring& traceName);
+	// Write the trace to its file when one was given
+	static BOOL FinishTrace(const std::wstring& traceName);
+	// Run a batch compression of a directory
+	static int RunBatch(const std::vector<std::wstring>& arguments);
+	// Decompress an IN3 file to a BMP file
+	static int RunDecode(const std::vector<std::wstring>& arguments);
+	// Compress a PGM or PPM file to a high bit depth IN3 file, or back
+	static int RunWide(const std::vector<std::wstring>& arguments);
+	// Compress the bitmaps of a directory into an IN3 archive
+	static int RunArchive(const std::vector<std::wstring>& arguments);
+	// Decompress an image of an IN3 archive to a BMP file
+	static int RunExtract(const std::vector<std::wstring>& arguments);
+	// Code the bitmaps of a directory as an IN3 sequence file
+	static int RunSequence(const std::vector<std::wstring>& arguments);
+	// Blur, sharpen or resize a BMP file
+	static int RunFilter(const std::vector<std::wstring>& arguments);
+	// Check that the codec allocates per image and plane, not per row, and
+	// no more bytes than the buffers of the round trip need
+	static BOOL CheckRowAllocations();
+	// Check brightening with the kernels in use against floating point HSV
+	static BOOL CheckBrighten();
+	// Check that error diffusion on several threads matches one thread
+	static BOOL CheckErrorDiffusion();
+	// Check the neighborhood operations against their per-pixel reference
+	static BOOL CheckNeighborhood();
+	// Check that high bit depth images decode to the samples compressed and
+	// that damaged dimensions and short planes are rejected
+	static BOOL CheckWide();
+	// Check that archived images of every color transform are found and
+	// decode like the images archived
+	static BOOL CheckArchive();
+	// Check that sequence frames decode to the frames written and that a
+	// truncated sequence file is rejected
+	static BOOL CheckSequence();
+	// Check the kernels of every supported CPU level and the codec
+	static int RunSelfTest();
+public:
+	// Run the operations on the command line
+	// Returns TRUE when the command line selected a non-interactive operation
+	static BOOL Run(int* exitCode);
+};
@@ -0,0 +1,313 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include "CompressionCache.h"
+#include "IN3File.h"
+
+// Extension of entry files, which temporary files do not end with
+static const WCHAR ENTRY_EXTENSION[] = L".in3c";
+// Extension of temporary files, named after their entry file
+static const WCHAR TEMPORARY_EXTENSION[] = L".tmp";
+// File times count 100 nanosecond intervals
+static const UINT64 FILE_TIME_UNITS_PER_SECOND = 10000000;
+
+// Primes of the xxHash64 rounds
+static const UINT64 PRIME_1 = 11400714785074694791ULL;
+static const UINT64 PRIME_2 = 14029467366897019727ULL;
+static const UINT64 PRIME_3 = 1609587929392839161ULL;
+static const UINT64 PRIME_4 = 9650029242287828579ULL;
+static const UINT64 PRIME_5 = 2870177450012600261ULL;
+
+static inline UINT64 rotateLeft(UINT64 value, UINT32 bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static inline UINT64 fileTimeValue(const FILETIME& fileTime)
+{
+	return (static_cast<UINT64>(fileTime.dwHighDateTime) << 32) | fileTime.dwLowDateTime;
+}
+
+static inline UINT64 read64(const BYTE* data)
+{
+	UINT64 value;
+	std::memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static inline UINT32 read32(const BYTE* data)
+{
+	UINT32 value;
+	std::memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+// Mix eight input bytes into an accumulator
+static inline UINT64 hashRound(UINT64 accumulator, UINT64 input)
+{
+	accumulator += input * PRIME_2;
+	accumulator = rotateLeft(accumulator, 31);
+	return accumulator * PRIME_1;
+}
+
+// Fold an accumulator into the hash of the four
+static inline UINT64 mergeRound(UINT64 hash, UINT64 accumulator)
+{
+	hash ^= hashRound(0, accumulator);
+	return hash * PRIME_1 + PRIME_4;
+}
+
+UINT64 CompressionCache::Hash(const BYTE* data, size_t size, UINT64 seed)
+{
+	const BYTE* position = data;
+	const BYTE* end = data + size;
+	UINT64 hash;
+	if (size >= 32) {
+		// Four independent accumulators take 32 bytes per step
+		UINT64 accumulators[4] = { seed + PRIME_1 + PRIME_2, seed + PRIME_2, seed, seed - PRIME_1 };
+		const BYTE* limit = end - 32;
+		do {
+			for (UINT32 a = 0; a < 4; a++) {
+				accumulators[a] = hashRound(accumulators[a], read64(position + a * 8));
+			}
+			position += 32;
+		} while (position <= limit);
+		hash = rotateLeft(accumulators[0], 1) + rotateLeft(accumulators[1], 7) +
+			rotateLeft(accumulators[2], 12) + rotateLeft(accumulators[3], 18);
+		for (UINT32 a = 0; a < 4; a++) {
+			hash = mergeRound(hash, accumulators[a]);
+		}
+	}
+	else {
+		hash = seed + PRIME_5;
+	}
+	hash += size;
+	for (; position + 8 <= end; position += 8) {
+		hash ^= hashRound(0, read64(position));
+		hash = rotateLeft(hash, 27) * PRIME_1 + PRIME_4;
+	}
+	if (position + 4 <= end) {
+		hash ^= read32(position) * PRIME_1;
+		hash = rotateLeft(hash, 23) * PRIME_2 + PRIME_3;
+		position += 4;
+	}
+	for (; position < end; position++) {
+		hash ^= *position * PRIME_5;
+		hash = rotateLeft(hash, 11) * PRIME_1;
+	}
+	// Spread every input bit over the whole hash
+	hash ^= hash >> 33;
+	hash *= PRIME_2;
+	hash ^= hash >> 29;
+	hash *= PRIME_3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+CompressionCache::Key CompressionCache::MakeKey(
+	const BitmapFile& bitmapFile,
+	const Codec::Settings& settings)
+{
+	Key key;
+	key.Width = bitmapFile.getWidth();
+	key.Height = bitmapFile.getHeight();
+	// The settings that change the coded bytes and the dimensions seed the
+	// hash of the pixels
+	std::vector<BYTE> seedBytes;
+	seedBytes.push_back(settings.ColorTransform);
+	seedBytes.insert(seedBytes.end(), settings.QuantizationSteps, settings.QuantizationSteps + 3);
+	const BYTE* target = reinterpret_cast<const BYTE*>(&settings.TargetBitsPerPixel);
+	seedBytes.insert(seedBytes.end(), target, target + sizeof(settings.TargetBitsPerPixel));
+	const BYTE* paletteColors = reinterpret_cast<const BYTE*>(&settings.MaxPaletteColors);
+	seedBytes.insert(seedBytes.end(), paletteColors, paletteColors + sizeof(settings.MaxPaletteColors));
+	seedBytes.push_back(settings.Effort);
+	const BYTE* width = reinterpret_cast<const BYTE*>(&key.Width);
+	seedBytes.insert(seedBytes.end(), width, width + sizeof(key.Width));
+	const BYTE* height = reinterpret_cast<const BYTE*>(&key.Height);
+	seedBytes.insert(seedBytes.end(), height, height + sizeof(key.Height));
+	UINT64 seed = Hash(seedBytes.data(), seedBytes.size(), 0);
+	Span<BitmapFile::Pixel> pixels = bitmapFile.getPixels();
+	key.Hash = Hash(
+		reinterpret_cast<const BYTE*>(pixels.data()),
+		pixels.size() * sizeof(BitmapFile::Pixel),
+		seed);
+	return key;
+}
+
+std::wstring CompressionCache::entryFileName(const Key& key) const
+{
+	std::wostringstream name;
+	name << Directory << std::hex << std::setw(16) << std::setfill(L'0') << key.Hash << ENTRY_EXTENSION;
+	return name.str();
+}
+
+BOOL CompressionCache::lookup(const Key& key, std::vector<BYTE>& in3Bytes)
+{
+	// Other processes may evict the entry while it is read
+	HANDLE fileHandle = CreateFileW(
+		entryFileName(key).c_str(),
+		GENERIC_READ | FILE_WRITE_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+	IN3CacheEntryHeader expected;
+	IN3CacheEntryHeader header;
+	LARGE_INTEGER fileSize;
+	BOOL hit = GetFileSizeEx(fileHandle, &fileSize) &&
+		static_cast<UINT64>(fileSize.QuadPart) >= sizeof(header) &&
+		IN3File::ReadChunked(fileHandle, reinterpret_cast<BYTE*>(&header), sizeof(header)) &&
+		header.MagicByteI == expected.MagicByteI &&
+		header.MagicByteN == expected.MagicByteN &&
+		header.MagicByteC == expected.MagicByteC &&
+		header.Version == expected.Version &&
+		header.KeyHash == key.Hash &&
+		header.Width == key.Width &&
+		header.Height == key.Height &&
+		header.DataSize == static_cast<UINT64>(fileSize.QuadPart) - sizeof(header);
+	if (hit) {
+		in3Bytes.resize(static_cast<size_t>(header.DataSize));
+		hit = IN3File::ReadChunked(fileHandle, in3Bytes.data(), in3Bytes.size());
+	}
+	if (hit) {
+		// The write time orders entries for eviction
+		FILETIME now;
+		GetSystemTimeAsFileTime(&now);
+		SetFileTime(fileHandle, NULL, NULL, &now);
+	}
+	CloseHandle(fileHandle);
+	return hit;
+}
+
+BOOL CompressionCache::store(const Key& key, const std::vector<BYTE>& in3Bytes)
+{
+	std::wstring entryName = entryFileName(key);
+	std::wostringstream temporaryName;
+	temporaryName << entryName << L'.' << GetCurrentProcessId() << L'.' << TemporaryCounter++ << TEMPORARY_EXTENSION;
+	HANDLE fileHandle = CreateFileW(
+		temporaryName.str().c_str(),
+		GENERIC_WRITE,
+		0,
+		NULL,
+		CREATE_NEW,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+	IN3CacheEntryHeader header;
+	header.KeyHash = key.Hash;
+	header.Width = key.Width;
+	header.Height = key.Height;
+	header.DataSize = in3Bytes.size();
+	BOOL written =
+		IN3File::WriteChunked(fileHandle, reinterpret_cast<const BYTE*>(&header), sizeof(header)) &&
+		IN3File::WriteChunked(fileHandle, in3Bytes.data(), in3Bytes.size());
+	CloseHandle(fileHandle);
+	// Renaming publishes the whole entry at once, replacing any other
+	// process's entry for the same key
+	if (!written ||
+		!MoveFileExW(temporaryName.str().c_str(), entryName.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		DeleteFileW(temporaryName.str().c_str());
+		return FALSE;
+	}
+	// Other processes store too, so the size of the entries is only known
+	// from the directory, which is scanned again once this process has
+	// stored a sixteenth of the limit since its last scan
+	BOOL scan = FALSE;
+	{
+		std::lock_guard<std::mutex> lock(EvictionLock);
+		BytesSinceScan += sizeof(header) + in3Bytes.size();
+		if (!Scanned || BytesSinceScan > SizeLimit / 16) {
+			Scanned = TRUE;
+			BytesSinceScan = 0;
+			scan = TRUE;
+		}
+	}
+	if (scan) {
+		evict();
+	}
+	return TRUE;
+}
+
+void CompressionCache::deleteStaleTemporaries()
+{
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	UINT64 staleTime = fileTimeValue(now) - STALE_TEMPORARY_SECONDS * FILE_TIME_UNITS_PER_SECOND;
+	WIN32_FIND_DATAW findData;
+	HANDLE findHandle = FindFirstFileW(
+		(Directory + L"*" + ENTRY_EXTENSION + L".*" + TEMPORARY_EXTENSION).c_str(),
+		&findData);
+	if (findHandle == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	do {
+		if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+			fileTimeValue(findData.ftLastWriteTime) < staleTime) {
+			// Another process may delete it first
+			DeleteFileW((Directory + findData.cFileName).c_str());
+		}
+	} while (FindNextFileW(findHandle, &findData));
+	FindClose(findHandle);
+}
+
+void CompressionCache::evict()
+{
+	deleteStaleTemporaries();
+	struct Entry {
+		std::wstring FileName;
+		UINT64 Size;
+		UINT64 WriteTime;
+	};
+	std::vector<Entry> entries;
+	UINT64 totalSize = 0;
+	WIN32_FIND_DATAW findData;
+	HANDLE findHandle = FindFirstFileW((Directory + L"*" + ENTRY_EXTENSION).c_str(), &findData);
+	if (findHandle == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	do {
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			continue;
+		}
+		Entry entry;
+		entry.FileName = Directory + findData.cFileName;
+		entry.Size = (static_cast<UINT64>(findData.nFileSizeHigh) << 32) | findData.nFileSizeLow;
+		entry.WriteTime = fileTimeValue(findData.ftLastWriteTime);
+		totalSize += entry.Size;
+		entries.push_back(entry);
+	} while (FindNextFileW(findHandle, &findData));
+	FindClose(findHandle);
+	if (totalSize <= SizeLimit) {
+		return;
+	}
+	std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+		return a.WriteTime < b.WriteTime;
+	});
+	UINT64 targetSize = SizeLimit / 16 * EVICTION_TARGET_SIXTEENTHS;
+	for (auto it = entries.begin(); it != entries.end() && totalSize > targetSize; it++) {
+		// An entry another process evicted first no longer counts either
+		if (DeleteFileW(it->FileName.c_str()) || GetLastError() == ERROR_FILE_NOT_FOUND) {
+			totalSize -= it->Size;
+		}
+	}
+}
+
+CompressionCache::CompressionCache(const std::wstring& directory, UINT64 sizeLimit)
+	: Directory(directory),
+	  SizeLimit(sizeLimit),
+	  BytesSinceScan(0),
+	  Scanned(FALSE),
+	  TemporaryCounter(0)
+{
+	if (!Directory.empty() && Directory.back() != L'\\' && Directory.back() != L'/') {
+		Directory += L'\\';
+	}
+}
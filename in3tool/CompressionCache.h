@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "BitmapFile.h"
+#include "Codec.h"
+#include "commontypes.h"
+
+// Content-addressed store of compressed images on disk
+// Each entry is a file in the cache directory named after the hash of the
+// pixels it was compressed from and the encoder settings, holding the IN3
+// file bytes. Any number of processes may share a directory: entries are
+// written to a temporary file and renamed into place, so readers only see
+// whole entries, and readers let other processes delete an entry they are
+// reading. A hit refreshes the entry's write time, so evicting the entries
+// with the oldest write times first is least recently used eviction. The
+// temporary files of a process that stopped before renaming them are
+// deleted once they are old enough that no store can still be writing them.
+class CompressionCache
+{
+public:
+	// Default total size of the entries
+	static const UINT64 DEFAULT_SIZE_LIMIT = 1ull << 30;
+	// Entries are evicted down to this fraction of the limit, in sixteenths,
+	// so that a full cache does not scan its directory on every store
+	static const UINT64 EVICTION_TARGET_SIXTEENTHS = 14;
+	// Temporary files older than this many seconds were left by a store
+	// that never finished, and are deleted when the directory is scanned
+	static const UINT64 STALE_TEMPORARY_SECONDS = 60 * 60;
+	// Images hash to the same key only if their pixels, dimensions and the
+	// settings they are compressed with are the same
+	struct Key {
+		UINT64 Hash = 0;
+		UINT64 Width = 0;
+		UINT64 Height = 0;
+	};
+private:
+	std::wstring Directory;
+	UINT64 SizeLimit;
+	// Bytes this process stored since it last scanned the directory
+	std::mutex EvictionLock;
+	UINT64 BytesSinceScan;
+	BOOL Scanned;
+	// Distinguishes the temporary files of stores running at once
+	std::atomic<UINT64> TemporaryCounter;
+	// File name of an entry
+	std::wstring entryFileName(const Key& key) const;
+	// Delete the temporary files of stores that never finished
+	void deleteStaleTemporaries();
+	// Delete the least recently used entries until the cache fits
+	void evict();
+public:
+	// Fast non-cryptographic hash of bytes, in the manner of xxHash64
+	static UINT64 Hash(const BYTE* data, size_t size, UINT64 seed);
+	// Key of a bitmap compressed with the settings
+	static Key MakeKey(const BitmapFile& bitmapFile, const Codec::Settings& settings);
+	// Read the IN3 file bytes stored for a key, returning FALSE on a miss
+	BOOL lookup(const Key& key, std::vector<BYTE>& in3Bytes);
+	// Store the IN3 file bytes compressed for a key, evicting old entries
+	// once the entries outgrow the size limit
+	BOOL store(const Key& key, const std::vector<BYTE>& in3Bytes);
+	// Cache in an existing directory
+	CompressionCache(const std::wstring& directory, UINT64 sizeLimit = DEFAULT_SIZE_LIMIT);
+	CompressionCache(const CompressionCache&) = delete;
+	CompressionCache& operator=(const CompressionCache&) = delete;
+};
@@ -0,0 +1,243 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <atomic>
+#include <cwctype>
+#include <vector>
+#include "CpuDispatch.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+namespace {
+	// Level forced by setLevel, or CPU_LEVEL_COUNT to use the supported one
+	std::atomic<UINT8> ForcedLevel(CPU_LEVEL_COUNT);
+
+	const WCHAR* const LEVEL_NAMES[CPU_LEVEL_COUNT] = {
+		L"scalar",
+		L"sse4.2",
+		L"avx2",
+		L"avx512"
+	};
+
+	// EAX, EBX, ECX and EDX of a CPUID leaf
+	void cpuid(int info[4], int leaf, int subleaf)
+	{
+#ifdef _MSC_VER
+		__cpuidex(info, leaf, subleaf);
+#else
+		__cpuid_count(leaf, subleaf, info[0], info[1], info[2], info[3]);
+#endif
+	}
+
+	// State components the operating system saves, from XCR0
+	UINT64 enabledStates()
+	{
+#ifdef _MSC_VER
+		return _xgetbv(0);
+#else
+		UINT32 low;
+		UINT32 high;
+		__asm__("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+		return (static_cast<UINT64>(high) << 32) | low;
+#endif
+	}
+
+	CpuLevel detectLevel()
+	{
+		int info[4];
+		cpuid(info, 0, 0);
+		int maxLeaf = info[0];
+		if (maxLeaf < 1) {
+			return CPU_LEVEL_SCALAR;
+		}
+		cpuid(info, 1, 0);
+		// The SSE4.2 kernels also use the SSSE3 and SSE4.1 instructions
+		static const int SSSE3 = 1 << 9;
+		static const int SSE41 = 1 << 19;
+		static const int SSE42 = 1 << 20;
+		static const int OSXSAVE = 1 << 27;
+		static const int AVX = 1 << 28;
+		if ((info[2] & (SSSE3 | SSE41 | SSE42)) != (SSSE3 | SSE41 | SSE42)) {
+			return CPU_LEVEL_SCALAR;
+		}
+		// The operating system must save the vector registers it enables
+		if ((info[2] & (OSXSAVE | AVX)) != (OSXSAVE | AVX) || maxLeaf < 7) {
+			return CPU_LEVEL_SSE42;
+		}
+		static const UINT64 XCR0_AVX = 0x06;
+		static const UINT64 XCR0_AVX512 = 0xE6;
+		UINT64 enabled = enabledStates();
+		cpuid(info, 7, 0);
+		static const int AVX2 = 1 << 5;
+		static const int AVX512F = 1 << 16;
+		static const int AVX512BW = 1 << 30;
+		if ((enabled & XCR0_AVX) != XCR0_AVX || !(info[1] & AVX2)) {
+			return CPU_LEVEL_SSE42;
+		}
+		if ((enabled & XCR0_AVX512) != XCR0_AVX512 ||
+			(info[1] & (AVX512F | AVX512BW)) != (AVX512F | AVX512BW)) {
+			return CPU_LEVEL_AVX2;
+		}
+		return CPU_LEVEL_AVX512;
+	}
+
+	BOOL samePixels(const BitmapFile::Pixel* expected, const BitmapFile::Pixel* actual, size_t count)
+	{
+		for (size_t i = 0; i < count; i++) {
+			if (expected[i].Red != actual[i].Red ||
+				expected[i].Green != actual[i].Green ||
+				expected[i].Blue != actual[i].Blue) {
+				return FALSE;
+			}
+		}
+		return TRUE;
+	}
+}
+
+CpuLevel CpuDispatch::getSupportedLevel()
+{
+	static const CpuLevel supported = detectLevel();
+	return supported;
+}
+
+CpuLevel CpuDispatch::getLevel()
+{
+	UINT8 forced = ForcedLevel.load(std::memory_order_relaxed);
+	return forced < CPU_LEVEL_COUNT ? static_cast<CpuLevel>(forced) : getSupportedLevel();
+}
+
+BOOL CpuDispatch::setLevel(CpuLevel level)
+{
+	if (level > getSupportedLevel()) {
+		return FALSE;
+	}
+	ForcedLevel.store(level, std::memory_order_relaxed);
+	return TRUE;
+}
+
+const CpuDispatch::Kernels& CpuDispatch::getKernels()
+{
+	return getKernels(getLevel());
+}
+
+const CpuDispatch::Kernels& CpuDispatch::getKernels(CpuLevel level)
+{
+	static const Kernels* const TABLES[CPU_LEVEL_COUNT] = {
+		&SCALAR_KERNELS,
+		&SSE42_KERNELS,
+		&AVX2_KERNELS,
+		&AVX512_KERNELS
+	};
+	return *TABLES[level < CPU_LEVEL_COUNT ? level : CPU_LEVEL_SCALAR];
+}
+
+const WCHAR* CpuDispatch::getLevelName(CpuLevel level)
+{
+	return level < CPU_LEVEL_COUNT ? LEVEL_NAMES[level] : L"unknown";
+}
+
+BOOL CpuDispatch::parseLevel(const std::wstring& name, CpuLevel& level)
+{
+	std::wstring lower(name);
+	for (auto it = lower.begin(); it != lower.end(); it++) {
+		*it = static_cast<WCHAR>(std::towlower(*it));
+	}
+	for (UINT8 i = 0; i < CPU_LEVEL_COUNT; i++) {
+		if (lower == LEVEL_NAMES[i]) {
+			level = static_cast<CpuLevel>(i);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+BOOL CpuDispatch::selfTest(CpuLevel level)
+{
+	if (level > getSupportedLevel()) {
+		return FALSE;
+	}
+	const Kernels& reference = getKernels(CPU_LEVEL_SCALAR);
+	const Kernels& tested = getKernels(level);
+	// Each pass covers every value of two channels or samples with the
+	// third fixed. The kernels run over a middle part of the row that starts
+	// and stops a few pixels in, so that they see every misalignment and
+	// leftover count, then over the head and tail it left out.
+	static const size_t ROW = 1 << 16;
+	std::vector<BitmapFile::Pixel> pixels(ROW);
+	std::vector<BitmapFile::Pixel> expectedPixels(ROW);
+	std::vector<BitmapFile::Pixel> actualPixels(ROW);
+	std::vector<INT8> samples[3];
+	std::vector<INT8> expected[3];
+	std::vector<INT8> actual[3];
+	for (UINT8 p = 0; p < 3; p++) {
+		samples[p].resize(ROW);
+		expected[p].resize(ROW);
+		actual[p].resize(ROW);
+	}
+	for (UINT32 fixed = 0; fixed < 256; fixed++) {
+		for (size_t i = 0; i < ROW; i++) {
+			pixels[i].Red = static_cast<BYTE>(fixed);
+			pixels[i].Green = static_cast<BYTE>(i >> 8);
+			pixels[i].Blue = static_cast<BYTE>(i);
+			samples[0][i] = static_cast<INT8>(i >> 8);
+			samples[1][i] = static_cast<INT8>(i);
+			samples[2][i] = static_cast<INT8>(fixed);
+		}
+		// The misaligned middle of the row, then the head and tail it
+		// skipped, so that every input of the pass is checked
+		size_t middleFirst = fixed % 67;
+		size_t middleCount = ROW - middleFirst - fixed % 71;
+		const size_t RANGES[3][2] = {
+			{ middleFirst, middleCount },
+			{ 0, middleFirst },
+			{ middleFirst + middleCount, ROW - middleFirst - middleCount }
+		};
+		for (UINT8 r = 0; r < 3; r++) {
+			size_t first = RANGES[r][0];
+			size_t count = RANGES[r][1];
+			if (count == 0) {
+				continue;
+			}
+			// Pixels to samples in either transform
+			void(*const toSamples[2][2])(const BitmapFile::Pixel*, INT8*, INT8*, INT8*, size_t) = {
+				{ reference.PixelsToYUV, tested.PixelsToYUV },
+				{ reference.PixelsToYCoCgR, tested.PixelsToYCoCgR }
+			};
+			for (UINT8 t = 0; t < 2; t++) {
+				toSamples[t][0](&pixels[first], &expected[0][first], &expected[1][first], &expected[2][first], count);
+				toSamples[t][1](&pixels[first], &actual[0][first], &actual[1][first], &actual[2][first], count);
+				for (UINT8 p = 0; p < 3; p++) {
+					if (!std::equal(&expected[p][first], &expected[p][first] + count, &actual[p][first])) {
+						return FALSE;
+					}
+				}
+			}
+			// Samples to pixels in either transform
+			void(*const toPixels[2][2])(const INT8*, const INT8*, const INT8*, BitmapFile::Pixel*, size_t) = {
+				{ reference.YUVToPixels, tested.YUVToPixels },
+				{ reference.YCoCgRToPixels, tested.YCoCgRToPixels }
+			};
+			for (UINT8 t = 0; t < 2; t++) {
+				toPixels[t][0](&samples[0][first], &samples[1][first], &samples[2][first], &expectedPixels[first], count);
+				toPixels[t][1](&samples[0][first], &samples[1][first], &samples[2][first], &actualPixels[first], count);
+				if (!samePixels(&expectedPixels[first], &actualPixels[first], count)) {
+					return FALSE;
+				}
+			}
+			// Brightening in place, from black out to the factor that saturates
+			static const UINT32 FACTORS[] = { 0, 0x8000, 0x10000, 0x1A3D7, 0x40000, BRIGHTEN_MAX_FACTOR };
+			for (UINT32 factor : FACTORS) {
+				std::copy(&pixels[first], &pixels[first] + count, &expectedPixels[first]);
+				std::copy(&pixels[first], &pixels[first] + count, &actualPixels[first]);
+				reference.BrightenPixels(&expectedPixels[first], count, factor);
+				tested.BrightenPixels(&actualPixels[first], count, factor);
+				if (!samePixels(&expectedPixels[first], &actualPixels[first], count)) {
+					return FALSE;
+				}
+			}
+		}
+	}
+	return TRUE;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <string>
+#include "BitmapFile.h"
+#include "commontypes.h"
+
+// Instruction set levels that kernels are built for, oldest first
+enum CpuLevel : UINT8 {
+	CPU_LEVEL_SCALAR = 0,
+	CPU_LEVEL_SSE42,
+	CPU_LEVEL_AVX2,
+	CPU_LEVEL_AVX512,
+	CPU_LEVEL_COUNT
+};
+
+// Binds the hot pixel kernels to the newest instruction set of the CPU
+// The CPU is probed once on first use and every kernel is called through
+// the table of its level. Each level computes exactly what the scalar
+// reference does, so a lower level can be forced for testing and
+// benchmarking without changing any output. Levels the CPU lacks cannot.
+class CpuDispatch
+{
+public:
+	// Kernels of one level
+	struct Kernels {
+		// Pixels <---> floating point YUV samples centered around zero
+		void(*PixelsToYUV)(
+			const BitmapFile::Pixel* pixels,
+			INT8* y,
+			INT8* u,
+			INT8* v,
+			size_t count);
+		void(*YUVToPixels)(
+			const INT8* y,
+			const INT8* u,
+			const INT8* v,
+			BitmapFile::Pixel* pixels,
+			size_t count);
+		// Pixels <---> YCoCg-R planes
+		void(*PixelsToYCoCgR)(
+			const BitmapFile::Pixel* pixels,
+			INT8* y,
+			INT8* co,
+			INT8* cg,
+			size_t count);
+		void(*YCoCgRToPixels)(
+			const INT8* y,
+			const INT8* co,
+			const INT8* cg,
+			BitmapFile::Pixel* pixels,
+			size_t count);
+		// Scale the HSV value of pixels in place by a 16.16 fixed-point
+		// factor of at most BRIGHTEN_MAX_FACTOR, keeping hue and saturation
+		void(*BrightenPixels)(
+			BitmapFile::Pixel* pixels,
+			size_t count,
+			UINT32 factor);
+	};
+	// Brighten factor that leaves pixels as they are
+	static const UINT32 BRIGHTEN_ONE = 1 << 16;
+	// Brighten factor that takes every pixel but black to full value
+	static const UINT32 BRIGHTEN_MAX_FACTOR = 255 << 16;
+	// Newest level the CPU and operating system support
+	static CpuLevel getSupportedLevel();
+	// Level whose kernels are in use, the supported level unless forced
+	static CpuLevel getLevel();
+	// Force the kernels of a level, returning FALSE if it is not supported
+	static BOOL setLevel(CpuLevel level);
+	// Kernels in use and the kernels of a level
+	static const Kernels& getKernels();
+	static const Kernels& getKernels(CpuLevel level);
+	static const WCHAR* getLevelName(CpuLevel level);
+	// Level named as getLevelName does, ignoring case
+	static BOOL parseLevel(const std::wstring& name, CpuLevel& level);
+	// Compare every kernel of a supported level against the scalar
+	// reference over all pixel values and row lengths around each block
+	// size, returning FALSE on the first difference
+	static BOOL selfTest(CpuLevel level);
+private:
+	// Kernel tables, each defined in the file built for its level
+	static const Kernels SCALAR_KERNELS;
+	static const Kernels SSE42_KERNELS;
+	static const Kernels AVX2_KERNELS;
+	static const Kernels AVX512_KERNELS;
+};
@@ -0,0 +1,127 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <thread>
+#include "ErrorDiffusion.h"
+
+// Indexed by Kernel
+const ErrorDiffusionDither::Weights ErrorDiffusionDither::KERNELS[] = {
+	{ 16, 1, {
+		{ 0, 0, 0, 7, 0 },
+		{ 0, 3, 5, 1, 0 },
+		{ 0, 0, 0, 0, 0 } } },
+	{ 48, 2, {
+		{ 0, 0, 0, 7, 5 },
+		{ 3, 5, 7, 5, 3 },
+		{ 1, 3, 5, 3, 1 } } },
+	{ 42, 2, {
+		{ 0, 0, 0, 8, 4 },
+		{ 2, 4, 8, 4, 2 },
+		{ 1, 2, 4, 2, 1 } } }
+};
+
+// Accumulated error in units of the divisor, rounded to the nearest level
+static inline INT32 roundError(INT32 error, INT32 divisor)
+{
+	return error >= 0 ?
+		(error + divisor / 2) / divisor :
+		-((divisor / 2 - error) / divisor);
+}
+
+ErrorDiffusionDither::ErrorDiffusionDither(Kernel kernel, UINT32 threadCount)
+	: DiffusionKernel(kernel),
+	  ThreadCount(threadCount)
+{
+}
+
+void ErrorDiffusionDither::ditherRows(
+	BitmapFile & bitmapFile,
+	UINT32 firstRow,
+	UINT32 threadCount,
+	std::vector<std::vector<INT32>>& errorRows,
+	std::vector<std::atomic<INT32>>& progress)
+{
+	const Weights& kernel = KERNELS[DiffusionKernel];
+	INT32 width = bitmapFile.getWidth();
+	UINT32 height = static_cast<UINT32>(bitmapFile.getHeight());
+	size_t slots = errorRows.size();
+	for (UINT32 y = firstRow; y < height; y += threadCount) {
+		// Errors of this row and the rows below it, padded by the reach on
+		// both sides so that edge pixels need no bounds checks
+		INT32* errors[KERNEL_ROWS];
+		for (INT32 r = 0; r < KERNEL_ROWS; r++) {
+			errors[r] = errorRows[(y + r) % slots].data() + MAX_REACH;
+		}
+		// This row is the first to add errors to the last row it reaches,
+		// whose slot was last used by this thread's previous row
+		std::fill(
+			errorRows[(y + KERNEL_ROWS - 1) % slots].begin(),
+			errorRows[(y + KERNEL_ROWS - 1) % slots].end(),
+			0);
+		BitmapFile::Pixel* pixels = bitmapFile.getRow(y);
+		for (INT32 x0 = 0; x0 < width; x0 += CHUNK_COLUMNS) {
+			INT32 x1 = std::min(x0 + CHUNK_COLUMNS, width);
+			// The row above must be far enough ahead that its errors up to
+			// the reach past this chunk are final and the columns it still
+			// adds to lie past the ones this chunk adds to
+			if (y > 0) {
+				INT32 needed = std::min(x1 + 2 * kernel.Reach, width);
+				while (progress[y - 1].load(std::memory_order_acquire) < needed) {
+					std::this_thread::yield();
+				}
+			}
+			for (INT32 x = x0; x < x1; x++) {
+				BitmapFile::Pixel pixel = pixels[x];
+				INT32 gray = (299 * pixel.Red + 587 * pixel.Green + 114 * pixel.Blue + 500) / 1000;
+				INT32 value = ClampToRange(gray + roundError(errors[0][x], kernel.Divisor), 0, 255);
+				BYTE level = value < 128 ? 0 : 255;
+				INT32 error = value - level;
+				for (INT32 r = 0; r < KERNEL_ROWS; r++) {
+					for (INT32 d = -kernel.Reach; d <= kernel.Reach; d++) {
+						errors[r][x + d] += error * kernel.Row[r][d + MAX_REACH];
+					}
+				}
+				pixels[x] = { level, level, level };
+			}
+			progress[y].store(x1, std::memory_order_release);
+		}
+	}
+}
+
+void ErrorDiffusionDither::OnBitmap(BitmapFile & bitmapFile)
+{
+	INT32 width = bitmapFile.getWidth();
+	INT32 height = bitmapFile.getHeight();
+	if (width <= 0 || height <= 0) {
+		return;
+	}
+	UINT32 threadCount = ThreadCount;
+	if (threadCount == 0) {
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	}
+	threadCount = std::min(threadCount, static_cast<UINT32>(height));
+	// Rows are dealt to the threads in turn, and a row only finishes after
+	// the row above it has, so every row up to a thread's previous one is
+	// finished when it starts a row. The error rows of finished rows are
+	// reused, leaving the rows of one row per thread plus the two below.
+	std::vector<std::vector<INT32>> errorRows(
+		threadCount + KERNEL_ROWS - 1,
+		std::vector<INT32>(width + 2 * MAX_REACH, 0));
+	// Columns finished in each row
+	std::vector<std::atomic<INT32>> progress(height);
+	for (auto it = progress.begin(); it != progress.end(); it++) {
+		it->store(0, std::memory_order_relaxed);
+	}
+	if (threadCount == 1) {
+		ditherRows(bitmapFile, 0, 1, errorRows, progress);
+		return;
+	}
+	std::vector<std::thread> threads;
+	for (UINT32 t = 0; t < threadCount; t++) {
+		threads.emplace_back([this, &bitmapFile, t, threadCount, &errorRows, &progress]() {
+			ditherRows(bitmapFile, t, threadCount, errorRows, progress);
+		});
+	}
+	for (auto it = threads.begin(); it != threads.end(); it++) {
+		it->join();
+	}
+}
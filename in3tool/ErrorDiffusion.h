@@ -0,0 +1,54 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include "BitmapFile.h"
+#include "BitmapPixelOperation.h"
+
+// Error diffusion dithering of a bitmap to black and white pixels
+// Unlike OrderedDither it overrides OnBitmap rather than OnPixel: the
+// quantization error of each pixel is spread to the pixels right of and
+// below it, so a pixel depends on every pixel before it. Rows are still run
+// in parallel as a wavefront, each row trailing the row above it by enough
+// columns that the errors it reads are final and the errors two rows add
+// never touch the same pixels. Errors are summed as integers, so the output
+// does not depend on the thread count and matches the serial algorithm bit
+// for bit.
+class ErrorDiffusionDither : public BitmapPixelOperation
+{
+public:
+	// Diffusion kernels
+	enum Kernel {
+		FLOYD_STEINBERG = 0, // 4 neighbors, divisor 16
+		JARVIS_JUDICE_NINKE = 1, // 12 neighbors, divisor 48
+		STUCKI = 2 // 12 neighbors, divisor 42
+	};
+	// Farthest column distance and row distance a kernel reaches
+	static const INT32 MAX_REACH = 2;
+	static const INT32 KERNEL_ROWS = MAX_REACH + 1;
+	// Columns a row runs between checks of the row above
+	static const INT32 CHUNK_COLUMNS = 64;
+private:
+	// Weights of the pixels right of the current pixel on its own row and
+	// of the rows below it, indexed by row and by column offset plus reach
+	struct Weights {
+		INT32 Divisor;
+		INT32 Reach;
+		INT32 Row[KERNEL_ROWS][2 * MAX_REACH + 1];
+	};
+	static const Weights KERNELS[];
+	Kernel DiffusionKernel;
+	UINT32 ThreadCount;
+	// Dither the rows of one thread, every threadCount-th row from a first
+	void ditherRows(
+		BitmapFile& bitmapFile,
+		UINT32 firstRow,
+		UINT32 threadCount,
+		std::vector<std::vector<INT32>>& errorRows,
+		std::vector<std::atomic<INT32>>& progress);
+public:
+	// Dither with a kernel on up to threadCount threads, or one thread per
+	// hardware thread when threadCount is zero
+	ErrorDiffusionDither(Kernel kernel, UINT32 threadCount = 0);
+	// Replace every pixel of the bitmap by black or white
+	virtual void OnBitmap(BitmapFile& bitmapFile);
+};
@@ -1,4 +1,5 @@
 #include "stdafx.h"
+#include <memory>
 #include <string>
 #include "BitmapFile.h"
 #include "FileOpenDialog.h"
@@ -30,9 +31,9 @@ void FileOpenDialog::InitOpenDialog(HWND hWnd) {
   ofn.Flags = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST;
 }
 
-BitmapFile * FileOpenDialog::OpenBitmapFile(HWND hWnd) {
+std::unique_ptr<BitmapFile> FileOpenDialog::OpenBitmapFile(HWND hWnd) {
   static Codec codec;
-  BitmapFile* bitmapFile = NULL;
+  std::unique_ptr<BitmapFile> bitmapFile;
   BitmapFile::CreateResult result;
   HANDLE fileHandle;
   // Show the file open dialog
@@ -46,11 +47,14 @@ BitmapFile * FileOpenDialog::OpenBitmapFile(HWND hWnd) {
 	if (fileName.find(L".in3") != std::wstring::npos ||
 		fileName.find(L".IN3") != std::wstring::npos) {
 		IN3File in3File(fileHandle);
-		bitmapFile = codec.decompress(&in3File);
+		bitmapFile = codec.decompress(in3File);
+		if (!bitmapFile) {
+			MessageBox(hWnd, L"Damaged IN3 file", NULL, MB_OK);
+		}
 	}
 	else {
 		// Read the file into memory
-		bitmapFile = new BitmapFile(fileHandle, &result);
+		bitmapFile.reset(new BitmapFile(fileHandle, &result));
 		// If there was an error while reading the file show a message
 		switch (result) {
 		case BitmapFile::ERROR_NOT_BMP:
@@ -73,8 +77,7 @@ BitmapFile * FileOpenDialog::OpenBitmapFile(HWND hWnd) {
 		case BitmapFile::ERROR_NOT_24BIT:
 		case BitmapFile::ERROR_READ_FAILED:
 			// Deallocate the memory and set the pointer to null
-			delete bitmapFile;
-			bitmapFile = NULL;
+			bitmapFile.reset();
 			break;
 		}
 	}
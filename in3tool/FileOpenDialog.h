@@ -1,4 +1,5 @@
 #pragma once
+#include <memory>
 #include <string>
 #include "BitmapFile.h"
 
@@ -18,7 +19,7 @@ public:
   // Get the opened file name
   static std::wstring getFileName();
   // Open a bitmap file using the open file dialog
-  static BitmapFile* OpenBitmapFile(HWND hWnd);
+  static std::unique_ptr<BitmapFile> OpenBitmapFile(HWND hWnd);
   // Open a file from a file name
   static HANDLE OverwriteFileFromName(std::wstring fileNameToOpen);
 };
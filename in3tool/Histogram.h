@@ -0,0 +1,242 @@
+#pragma once
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <emmintrin.h>
+#include "commontypes.h"
+
+// Symbol histogram of 8-bit or 16-bit symbols
+// Symbols are counted into several interleaved sub-histograms so that runs
+// of equal symbols do not wait on the store of the previous increment, and
+// the 32-bit sub-histogram counters are folded into 64-bit totals with SSE2
+// Large inputs can be split into partial histograms counted on several
+// threads and merged at the end
+template <typename T>
+class Histogram
+{
+public:
+	// Number of bins, one per value of the symbol type
+	static const size_t BIN_COUNT =
+		static_cast<size_t>(std::numeric_limits<T>::max()) -
+		static_cast<size_t>(std::numeric_limits<T>::min()) + 1;
+	// Number of interleaved sub-histograms
+	static const size_t LANES = 4;
+	// Symbols counted per block before the 32-bit sub-histograms are folded,
+	// small enough that a bin summed over every lane cannot overflow
+	static const size_t BLOCK_SYMBOLS = 1 << 30;
+	// Inputs smaller than this are always counted on the calling thread
+	static const size_t MIN_PARALLEL_SYMBOLS = 1 << 22;
+	Histogram();
+	// Count symbols on the calling thread
+	void add(const T* symbols, size_t count);
+	void add(const std::vector<T>& symbols);
+	// Count symbols in partial histograms on up to threadCount threads,
+	// using one thread per hardware thread when threadCount is zero
+	void addParallel(const T* symbols, size_t count, UINT32 threadCount = 0);
+	void addParallel(const std::vector<T>& symbols, UINT32 threadCount = 0);
+	// Add the counts of another histogram
+	void merge(const Histogram<T>& other);
+	// Reset every count to zero
+	void clear();
+	// Count of one symbol
+	UINT64 getCount(T symbol) const;
+	// Counts indexed by symbol minus the minimum of the symbol type
+	const std::vector<UINT64>& getCounts() const;
+	// Number of symbols counted
+	UINT64 getTotal() const;
+	// Number of distinct symbols counted
+	size_t getUsedSymbols() const;
+private:
+	typedef typename std::make_unsigned<T>::type Unsigned;
+	// Bin of a symbol, which matches its offset from the type minimum
+	static size_t bin(T symbol);
+	// Count one block of at most BLOCK_SYMBOLS symbols
+	void addBlock(const T* symbols, size_t count, std::vector<UINT32>& lanes);
+	// Fold the sub-histograms into the totals
+	void fold(std::vector<UINT32>& lanes);
+	std::vector<UINT64> Counts;
+	UINT64 Total;
+};
+
+// Definition of the block size, which std::min takes by reference
+template<typename T>
+const size_t Histogram<T>::BLOCK_SYMBOLS;
+
+template<typename T>
+inline Histogram<T>::Histogram()
+	: Counts(BIN_COUNT, 0),
+	  Total(0)
+{
+}
+
+template<typename T>
+inline size_t Histogram<T>::bin(T symbol)
+{
+	// Offsetting by the type minimum is the same as flipping the sign bit
+	return static_cast<size_t>(static_cast<Unsigned>(
+		static_cast<Unsigned>(symbol) ^
+		static_cast<Unsigned>(std::numeric_limits<T>::min())));
+}
+
+template<typename T>
+inline void Histogram<T>::add(const T * symbols, size_t count)
+{
+	if (count == 0) {
+		return;
+	}
+	std::vector<UINT32> lanes(LANES * BIN_COUNT, 0);
+	for (size_t start = 0; start < count; start += BLOCK_SYMBOLS) {
+		size_t blockSize = std::min(BLOCK_SYMBOLS, count - start);
+		addBlock(symbols + start, blockSize, lanes);
+		fold(lanes);
+	}
+	Total += count;
+}
+
+template<typename T>
+inline void Histogram<T>::add(const std::vector<T>& symbols)
+{
+	add(symbols.data(), symbols.size());
+}
+
+template<typename T>
+inline void Histogram<T>::addBlock(
+	const T * symbols,
+	size_t count,
+	std::vector<UINT32>& lanes)
+{
+	UINT32* lane0 = lanes.data();
+	UINT32* lane1 = lane0 + BIN_COUNT;
+	UINT32* lane2 = lane1 + BIN_COUNT;
+	UINT32* lane3 = lane2 + BIN_COUNT;
+	size_t i = 0;
+	for (; i + LANES <= count; i += LANES) {
+		lane0[bin(symbols[i])] += 1;
+		lane1[bin(symbols[i + 1])] += 1;
+		lane2[bin(symbols[i + 2])] += 1;
+		lane3[bin(symbols[i + 3])] += 1;
+	}
+	for (; i < count; i++) {
+		lane0[bin(symbols[i])] += 1;
+	}
+}
+
+template<typename T>
+inline void Histogram<T>::fold(std::vector<UINT32>& lanes)
+{
+	UINT32* lane0 = lanes.data();
+	UINT32* lane1 = lane0 + BIN_COUNT;
+	UINT32* lane2 = lane1 + BIN_COUNT;
+	UINT32* lane3 = lane2 + BIN_COUNT;
+	UINT64* counts = Counts.data();
+	const __m128i zero = _mm_setzero_si128();
+	// BIN_COUNT is a multiple of four for 8-bit and 16-bit symbols
+	for (size_t b = 0; b < BIN_COUNT; b += 4) {
+		__m128i sum = _mm_add_epi32(
+			_mm_add_epi32(
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(lane0 + b)),
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(lane1 + b))),
+			_mm_add_epi32(
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(lane2 + b)),
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(lane3 + b))));
+		__m128i low = _mm_add_epi64(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(counts + b)),
+			_mm_unpacklo_epi32(sum, zero));
+		__m128i high = _mm_add_epi64(
+			_mm_loadu_si128(reinterpret_cast<const __m128i*>(counts + b + 2)),
+			_mm_unpackhi_epi32(sum, zero));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(counts + b), low);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(counts + b + 2), high);
+	}
+	std::fill(lanes.begin(), lanes.end(), 0);
+}
+
+template<typename T>
+inline void Histogram<T>::addParallel(
+	const T * symbols,
+	size_t count,
+	UINT32 threadCount)
+{
+	if (threadCount == 0) {
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	}
+	// Every thread should have enough symbols to pay for its sub-histograms
+	size_t maxThreads = std::max<size_t>(1, count / MIN_PARALLEL_SYMBOLS);
+	threadCount = static_cast<UINT32>(std::min<size_t>(threadCount, maxThreads));
+	if (threadCount <= 1) {
+		add(symbols, count);
+		return;
+	}
+	std::vector<Histogram<T>> partials(threadCount);
+	std::vector<std::thread> threads;
+	size_t share = (count + threadCount - 1) / threadCount;
+	for (UINT32 t = 0; t < threadCount; t++) {
+		size_t start = std::min(count, t * share);
+		size_t end = std::min(count, start + share);
+		threads.emplace_back([&partials, symbols, t, start, end]() {
+			partials[t].add(symbols + start, end - start);
+		});
+	}
+	for (auto it = threads.begin(); it != threads.end(); it++) {
+		it->join();
+	}
+	for (auto it = partials.begin(); it != partials.end(); it++) {
+		merge(*it);
+	}
+}
+
+template<typename T>
+inline void Histogram<T>::addParallel(
+	const std::vector<T>& symbols,
+	UINT32 threadCount)
+{
+	addParallel(symbols.data(), symbols.size(), threadCount);
+}
+
+template<typename T>
+inline void Histogram<T>::merge(const Histogram<T>& other)
+{
+	for (size_t b = 0; b < BIN_COUNT; b++) {
+		Counts[b] += other.Counts[b];
+	}
+	Total += other.Total;
+}
+
+template<typename T>
+inline void Histogram<T>::clear()
+{
+	std::fill(Counts.begin(), Counts.end(), 0);
+	Total = 0;
+}
+
+template<typename T>
+inline UINT64 Histogram<T>::getCount(T symbol) const
+{
+	return Counts[bin(symbol)];
+}
+
+template<typename T>
+inline const std::vector<UINT64>& Histogram<T>::getCounts() const
+{
+	return Counts;
+}
+
+template<typename T>
+inline UINT64 Histogram<T>::getTotal() const
+{
+	return Total;
+}
+
+template<typename T>
+inline size_t Histogram<T>::getUsedSymbols() const
+{
+	size_t used = 0;
+	for (auto it = Counts.begin(); it != Counts.end(); it++) {
+		if (*it != 0) {
+			used += 1;
+		}
+	}
+	return used;
+}
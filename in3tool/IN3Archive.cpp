@@ -0,0 +1,400 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <cstring>
+#include "commontypes.h"
+#include "IN3Archive.h"
+
+// Length table runs are coded as a literal length below 0x80, or as 0x80
+// plus the run length minus one followed by the repeated length
+static const BYTE TABLE_RUN_FLAG = 0x80;
+static const UINT32 TABLE_MAX_RUN = 0x80;
+// Interpolation probes of the index before falling back to bisection
+static const UINT32 INTERPOLATION_PROBES = 4;
+
+// Append an unsigned integer in 7-bit groups, least significant first
+static void writeVarint(std::vector<BYTE>& out, UINT64 value)
+{
+	while (value >= 0x80) {
+		out.push_back(static_cast<BYTE>(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<BYTE>(value));
+}
+
+// Bounds checked cursor over the bytes of one archived image
+struct ArchiveCursor {
+	const BYTE* Position;
+	const BYTE* End;
+	BOOL readByte(BYTE& value)
+	{
+		if (Position >= End) {
+			return FALSE;
+		}
+		value = *Position++;
+		return TRUE;
+	}
+	BOOL readVarint(UINT64& value)
+	{
+		value = 0;
+		for (UINT32 shift = 0; shift < 64; shift += 7) {
+			BYTE b = 0;
+			if (!readByte(b)) {
+				return FALSE;
+			}
+			value |= static_cast<UINT64>(b & 0x7F) << shift;
+			if (!(b & 0x80)) {
+				return TRUE;
+			}
+		}
+		return FALSE;
+	}
+};
+
+static void writeTable(std::vector<BYTE>& out, const LengthTable<INT8>& table)
+{
+	size_t i = 0;
+	while (i < table.size()) {
+		UINT8 length = table[i];
+		UINT32 run = 1;
+		while (i + run < table.size() && table[i + run] == length && run < TABLE_MAX_RUN) {
+			run++;
+		}
+		if (run == 1 && length < TABLE_RUN_FLAG) {
+			out.push_back(length);
+		}
+		else {
+			out.push_back(static_cast<BYTE>(TABLE_RUN_FLAG | (run - 1)));
+			out.push_back(length);
+		}
+		i += run;
+	}
+}
+
+static BOOL readTable(ArchiveCursor& cursor, LengthTable<INT8>& table)
+{
+	size_t i = 0;
+	while (i < table.size()) {
+		BYTE token = 0;
+		if (!cursor.readByte(token)) {
+			return FALSE;
+		}
+		if (token < TABLE_RUN_FLAG) {
+			table[i++] = token;
+			continue;
+		}
+		size_t run = (token & ~TABLE_RUN_FLAG) + 1;
+		BYTE length = 0;
+		if (i + run > table.size() || !cursor.readByte(length)) {
+			return FALSE;
+		}
+		std::fill(table.begin() + i, table.begin() + i + run, length);
+		i += run;
+	}
+	return TRUE;
+}
+
+BOOL IN3ArchiveWriter::addImage(const std::wstring& key, const IN3File& in3File)
+{
+	if (Finished || WriteFailed) {
+		return FALSE;
+	}
+	const IN3Header<INT8>& header = in3File.getHeader();
+	const YUVVectors<bool>& vectors = in3File.getVectors();
+	std::vector<BYTE> record;
+	// Keys are stored as UTF-16 code units
+	writeVarint(record, key.size());
+	for (auto it = key.begin(); it != key.end(); it++) {
+		UINT16 unit = static_cast<UINT16>(*it);
+		record.push_back(static_cast<BYTE>(unit));
+		record.push_back(static_cast<BYTE>(unit >> 8));
+	}
+	writeVarint(record, header.Width);
+	writeVarint(record, header.Height);
+	record.push_back(header.ColorTransform);
+	if (header.ColorTransform == COLOR_TRANSFORM_PALETTE) {
+		const std::vector<IN3PaletteEntry>& palette = in3File.getPalette();
+		writeVarint(record, palette.size());
+		for (auto it = palette.begin(); it != palette.end(); it++) {
+			record.push_back(it->Blue);
+			record.push_back(it->Green);
+			record.push_back(it->Red);
+		}
+	}
+	const LengthTable<INT8>* tables[3] = { &header.YTable, &header.UTable, &header.VTable };
+	const std::vector<bool>* planes[3] = { &vectors.Y, &vectors.U, &vectors.V };
+	std::vector<BYTE> packed[3];
+	for (UINT8 p = 0; p < 3; p++) {
+		packed[p] = IN3File::PackBits(*planes[p]);
+		writeVarint(record, packed[p].size());
+		record.push_back(header.QuantizationSteps[p]);
+		record.push_back(header.PlaneModes[p]);
+		record.push_back(static_cast<BYTE>(header.ConstantSamples[p]));
+		writeTable(record, *tables[p]);
+	}
+	for (UINT8 p = 0; p < 3; p++) {
+		record.insert(record.end(), packed[p].begin(), packed[p].end());
+	}
+	if (!IN3File::WriteChunked(FileHandle, record.data(), record.size())) {
+		// Go back over the partial record so the next image replaces it
+		LARGE_INTEGER position;
+		position.QuadPart = static_cast<LONGLONG>(Offset);
+		if (!SetFilePointerEx(FileHandle, position, NULL, FILE_BEGIN)) {
+			WriteFailed = TRUE;
+		}
+		return FALSE;
+	}
+	IN3ArchiveIndexEntry entry;
+	entry.KeyHash = IN3ArchiveReader::HashKey(key);
+	entry.Offset = Offset;
+	Index.push_back(entry);
+	Offset += record.size();
+	return TRUE;
+}
+
+BOOL IN3ArchiveWriter::finish()
+{
+	if (Finished) {
+		return !WriteFailed;
+	}
+	Finished = TRUE;
+	// Pad the last image so the index starts on a page of its own
+	std::vector<BYTE> padding(static_cast<size_t>(
+		(INDEX_ALIGNMENT - Offset % INDEX_ALIGNMENT) % INDEX_ALIGNMENT), 0);
+	std::sort(Index.begin(), Index.end(),
+		[](const IN3ArchiveIndexEntry& a, const IN3ArchiveIndexEntry& b) {
+		return a.KeyHash < b.KeyHash || (a.KeyHash == b.KeyHash && a.Offset < b.Offset);
+	});
+	Header.ImageCount = Index.size();
+	Header.IndexOffset = Offset + padding.size();
+	LARGE_INTEGER start = {};
+	BOOL success = !WriteFailed &&
+		IN3File::WriteChunked(FileHandle, padding.data(), padding.size()) &&
+		IN3File::WriteChunked(
+			FileHandle,
+			reinterpret_cast<const BYTE*>(Index.data()),
+			Index.size() * sizeof(IN3ArchiveIndexEntry)) &&
+		SetFilePointerEx(FileHandle, start, NULL, FILE_BEGIN) &&
+		IN3File::WriteChunked(
+			FileHandle,
+			reinterpret_cast<const BYTE*>(&Header),
+			sizeof(Header));
+	WriteFailed = !success;
+	CloseHandle(FileHandle);
+	return success;
+}
+
+IN3ArchiveWriter::IN3ArchiveWriter(HANDLE fileHandle)
+	: FileHandle(fileHandle),
+	  Offset(sizeof(IN3ArchiveHeader)),
+	  Finished(FALSE),
+	  WriteFailed(FALSE)
+{
+	Header.ImageCount = 0;
+	Header.IndexOffset = 0;
+	// Reserve the space of the header until the index is known
+	WriteFailed = !IN3File::WriteChunked(
+		FileHandle,
+		reinterpret_cast<const BYTE*>(&Header),
+		sizeof(Header));
+}
+
+IN3ArchiveWriter::~IN3ArchiveWriter()
+{
+	finish();
+}
+
+UINT64 IN3ArchiveReader::HashKey(const std::wstring& key)
+{
+	// FNV-1a over the UTF-16 code units, then mixed so that the high bits
+	// spread evenly for the interpolation search of the index
+	UINT64 hash = 14695981039346656037ULL;
+	for (auto it = key.begin(); it != key.end(); it++) {
+		UINT16 unit = static_cast<UINT16>(*it);
+		hash = (hash ^ (unit & 0xFF)) * 1099511628211ULL;
+		hash = (hash ^ (unit >> 8)) * 1099511628211ULL;
+	}
+	hash ^= hash >> 30;
+	hash *= 0xBF58476D1CE4E5B9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94D049BB133111EBULL;
+	hash ^= hash >> 31;
+	return hash;
+}
+
+IN3ArchiveIndexEntry IN3ArchiveReader::getEntry(UINT64 i) const
+{
+	IN3ArchiveIndexEntry entry;
+	std::memcpy(
+		&entry,
+		View + Header.IndexOffset + i * sizeof(IN3ArchiveIndexEntry),
+		sizeof(entry));
+	return entry;
+}
+
+UINT64 IN3ArchiveReader::findHash(UINT64 hash) const
+{
+	// Hashes are uniform, so interpolating the position usually lands on
+	// the right page of the index at the first probe
+	UINT64 low = 0;
+	UINT64 high = Header.ImageCount;
+	UINT32 probes = 0;
+	while (low < high) {
+		UINT64 mid = low + (high - low) / 2;
+		if (probes < INTERPOLATION_PROBES) {
+			UINT64 lowHash = getEntry(low).KeyHash;
+			UINT64 highHash = getEntry(high - 1).KeyHash;
+			if (hash <= lowHash) {
+				high = low;
+				break;
+			}
+			if (hash > highHash) {
+				low = high;
+				break;
+			}
+			DOUBLE fraction =
+				static_cast<DOUBLE>(hash - lowHash) /
+				static_cast<DOUBLE>(highHash - lowHash);
+			mid = low + static_cast<UINT64>(fraction * static_cast<DOUBLE>(high - 1 - low));
+			mid = std::min(std::max(mid, low), high - 1);
+			probes++;
+		}
+		if (getEntry(mid).KeyHash < hash) {
+			low = mid + 1;
+		}
+		else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+BOOL IN3ArchiveReader::isValid() const
+{
+	return Valid;
+}
+
+UINT64 IN3ArchiveReader::getImageCount() const
+{
+	return Valid ? Header.ImageCount : 0;
+}
+
+std::unique_ptr<IN3File> IN3ArchiveReader::find(const std::wstring& key) const
+{
+	if (!Valid) {
+		return NULL;
+	}
+	UINT64 hash = HashKey(key);
+	for (UINT64 i = findHash(hash); i < Header.ImageCount; i++) {
+		IN3ArchiveIndexEntry entry = getEntry(i);
+		if (entry.KeyHash != hash) {
+			break;
+		}
+		if (entry.Offset >= Header.IndexOffset) {
+			return NULL;
+		}
+		ArchiveCursor cursor = { View + entry.Offset, View + Header.IndexOffset };
+		UINT64 keyLength = 0;
+		if (!cursor.readVarint(keyLength) ||
+			keyLength > static_cast<UINT64>(cursor.End - cursor.Position) / 2) {
+			return NULL;
+		}
+		BOOL match = keyLength == key.size();
+		for (UINT64 k = 0; k < keyLength; k++) {
+			UINT16 unit = static_cast<UINT16>(cursor.Position[0] | (cursor.Position[1] << 8));
+			cursor.Position += 2;
+			match = match && unit == static_cast<UINT16>(key[static_cast<size_t>(k)]);
+		}
+		if (!match) {
+			continue;
+		}
+		IN3Header<INT8> header;
+		BYTE colorTransform = 0;
+		UINT64* sizes[3] = { &header.YSize, &header.USize, &header.VSize };
+		LengthTable<INT8>* tables[3] = { &header.YTable, &header.UTable, &header.VTable };
+		if (!cursor.readVarint(header.Width) ||
+			!cursor.readVarint(header.Height) ||
+			!cursor.readByte(colorTransform)) {
+			return NULL;
+		}
+		header.ColorTransform = colorTransform;
+		std::vector<IN3PaletteEntry> palette;
+		if (colorTransform == COLOR_TRANSFORM_PALETTE) {
+			UINT64 paletteSize = 0;
+			if (!cursor.readVarint(paletteSize) || paletteSize > IN3_MAX_PALETTE_SIZE) {
+				return NULL;
+			}
+			palette.resize(static_cast<size_t>(paletteSize));
+			for (auto it = palette.begin(); it != palette.end(); it++) {
+				if (!cursor.readByte(it->Blue) ||
+					!cursor.readByte(it->Green) ||
+					!cursor.readByte(it->Red)) {
+					return NULL;
+				}
+			}
+		}
+		UINT64 planeSize = 0;
+		for (UINT8 p = 0; p < 3; p++) {
+			BYTE constantSample = 0;
+			if (!cursor.readVarint(*sizes[p]) ||
+				!cursor.readByte(header.QuantizationSteps[p]) ||
+				!cursor.readByte(header.PlaneModes[p]) ||
+				!cursor.readByte(constantSample) ||
+				!readTable(cursor, *tables[p])) {
+				return NULL;
+			}
+			header.ConstantSamples[p] = static_cast<INT8>(constantSample);
+			planeSize += *sizes[p];
+		}
+		if (planeSize > static_cast<UINT64>(cursor.End - cursor.Position)) {
+			return NULL;
+		}
+		return std::unique_ptr<IN3File>(
+			new IN3File(header, Span<BYTE>(cursor.Position, planeSize), palette));
+	}
+	return NULL;
+}
+
+IN3ArchiveReader::IN3ArchiveReader(HANDLE fileHandle)
+	: FileHandle(fileHandle),
+	  MappingHandle(NULL),
+	  View(NULL),
+	  Size(0),
+	  Valid(FALSE)
+{
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(FileHandle, &fileSize) ||
+		static_cast<UINT64>(fileSize.QuadPart) < sizeof(IN3ArchiveHeader)) {
+		return;
+	}
+	Size = fileSize.QuadPart;
+	MappingHandle = CreateFileMapping(FileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (MappingHandle == NULL) {
+		return;
+	}
+	View = static_cast<const BYTE*>(MapViewOfFile(MappingHandle, FILE_MAP_READ, 0, 0, 0));
+	if (View == NULL) {
+		return;
+	}
+	std::memcpy(&Header, View, sizeof(Header));
+	IN3ArchiveHeader expected;
+	if (Header.MagicByteI != expected.MagicByteI ||
+		Header.MagicByteN != expected.MagicByteN ||
+		Header.MagicByteA != expected.MagicByteA ||
+		Header.Version != expected.Version ||
+		Header.IndexOffset > Size) {
+		return;
+	}
+	Valid = Header.ImageCount <=
+		(Size - Header.IndexOffset) / sizeof(IN3ArchiveIndexEntry);
+}
+
+IN3ArchiveReader::~IN3ArchiveReader()
+{
+	if (View != NULL) {
+		UnmapViewOfFile(View);
+	}
+	if (MappingHandle != NULL) {
+		CloseHandle(MappingHandle);
+	}
+	CloseHandle(FileHandle);
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "commontypes.h"
+#include "IN3File.h"
+
+// Writes many small IN3 images back-to-back into one archive file
+// Each image keeps only its dimensions, palette, quantization steps,
+// run-length coded length tables and packed planes, and is found through
+// an index sorted by key hash that is written page aligned after the last
+// image.
+// Keys should be unique.
+class IN3ArchiveWriter
+{
+public:
+	// Alignment of the index so that it starts on its own page
+	static const UINT64 INDEX_ALIGNMENT = 4096;
+private:
+	HANDLE FileHandle;
+	IN3ArchiveHeader Header;
+	std::vector<IN3ArchiveIndexEntry> Index;
+	// Offset in the file of the next image
+	UINT64 Offset;
+	BOOL Finished;
+	// Set once the file cannot be completed
+	BOOL WriteFailed;
+public:
+	// Append an image compressed by Codec::compress under a key, returning
+	// FALSE and leaving it out of the archive if it cannot be written
+	BOOL addImage(const std::wstring& key, const IN3File& in3File);
+	// Write the index and header and close the file, returning FALSE if
+	// the archive is not complete
+	BOOL finish();
+	IN3ArchiveWriter(HANDLE fileHandle);
+	~IN3ArchiveWriter();
+};
+
+// Looks up images of an IN3 archive by key through a read-only mapping of
+// the file, so a lookup only touches the index entries it probes and the
+// bytes of the image found
+class IN3ArchiveReader
+{
+private:
+	HANDLE FileHandle;
+	HANDLE MappingHandle;
+	const BYTE* View;
+	UINT64 Size;
+	IN3ArchiveHeader Header;
+	BOOL Valid;
+	// Index entry by position
+	IN3ArchiveIndexEntry getEntry(UINT64 i) const;
+	// Position of the first index entry with a hash, or the image count
+	UINT64 findHash(UINT64 hash) const;
+public:
+	// Hash of a key as stored in the index
+	static UINT64 HashKey(const std::wstring& key);
+	// Whether the file was mapped and has a valid header and index
+	BOOL isValid() const;
+	UINT64 getImageCount() const;
+	// Load an image by key, or NULL if the archive has no such image
+	std::unique_ptr<IN3File> find(const std::wstring& key) const;
+	IN3ArchiveReader(HANDLE fileHandle);
+	~IN3ArchiveReader();
+};
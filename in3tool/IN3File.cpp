@@ -1,18 +1,114 @@
 #include "stdafx.h"
+#include <algorithm>
 #include <cstring>
+#include <limits>
+#include <utility>
 #include "commontypes.h"
 #include "IN3File.h"
+#include "MemoryAccounting.h"
+#include "Trace.h"
 
+#ifdef _WIN32
+// Largest number of bytes passed to a single ReadFile or WriteFile call
+const DWORD IN3File::IO_CHUNK_SIZE = 1 << 26;
+
+BOOL IN3File::WriteChunked(HANDLE fileHandle, const BYTE* data, UINT64 size)
+{
+	// WriteFile takes a 32-bit size so write large buffers in chunks
+	BOOL success = TRUE;
+	while (size > 0 && success) {
+		DWORD bytesToWrite = static_cast<DWORD>(std::min<UINT64>(size, IO_CHUNK_SIZE));
+		DWORD bytesWritten = 0;
+		success = WriteFile(
+			fileHandle,
+			data,
+			bytesToWrite,
+			&bytesWritten,
+			NULL) && bytesWritten == bytesToWrite;
+		data += bytesWritten;
+		size -= bytesWritten;
+	}
+	return success;
+}
+
+BOOL IN3File::ReadChunked(HANDLE fileHandle, BYTE* data, UINT64 size)
+{
+	// ReadFile takes a 32-bit size so read large buffers in chunks
+	BOOL success = TRUE;
+	while (size > 0 && success) {
+		DWORD bytesToRead = static_cast<DWORD>(std::min<UINT64>(size, IO_CHUNK_SIZE));
+		DWORD bytesRead = 0;
+		success = ReadFile(
+			fileHandle,
+			data,
+			bytesToRead,
+			&bytesRead,
+			NULL) && bytesRead == bytesToRead;
+		data += bytesRead;
+		size -= bytesRead;
+	}
+	return success;
+}
+#endif
+
+std::vector<BYTE> IN3File::PackBits(const std::vector<bool>& bits)
+{
+	std::vector<BYTE> bytes;
+	PackBits(bits, bytes);
+	return bytes;
+}
+
+void IN3File::PackBits(const std::vector<bool>& bits, std::vector<BYTE>& bytes)
+{
+	// Packed bytes are appended after any already in the vector
+	size_t start = bytes.size();
+	bytes.resize(start + static_cast<size_t>((bits.size() + 7) / 8));
+	PackBits(bits, bytes.data() + start);
+}
+
+void IN3File::PackBits(const std::vector<bool>& bits, BYTE* out)
+{
+	UINT64 numBits = bits.size();
+	BYTE b = 0;
+	for (UINT64 bit = 0; bit < numBits; bit++) {
+		BYTE x = !!(bits[bit]);
+		b ^= (-x ^ b) & (1 << (bit % 8));
+		if ((bit + 1) % 8 == 0) {
+			out[bit / 8] = b;
+		}
+	}
+	if (numBits % 8 != 0) {
+		out[numBits / 8] = b & ((1 << (numBits % 8)) - 1);
+	}
+}
+
+void IN3File::UnpackBits(const BYTE* bytes, UINT64 size, std::vector<bool>& bits)
+{
+	bits.reserve(bits.size() + size * 8);
+	for (UINT64 i = 0; i < size; i++) {
+		BYTE readByte = bytes[i];
+		BYTE mask = 0x01;
+		for (UINT8 bitIndex = 0; bitIndex < 8; bitIndex++) {
+			bits.push_back(!!(readByte & mask));
+			mask <<= 1;
+		}
+	}
+}
+
+#ifdef _WIN32
 void IN3File::Save(HANDLE fileHandle)
 {
-	static const DWORD headerSize = sizeof(Header);
-	DWORD bytesWritten;
-	WriteFile(
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_IN3_WRITE);
+	IN3Header<INT8> header = Header;
+	header.HeaderSize = static_cast<UINT32>(sizeof(header) + Palette.size() * sizeof(IN3PaletteEntry));
+	WriteChunked(
+		fileHandle,
+		reinterpret_cast<const BYTE*>(&header),
+		sizeof(header));
+	WriteChunked(
 		fileHandle,
-		&Header,
-		headerSize,
-		&bytesWritten,
-		NULL);
+		reinterpret_cast<const BYTE*>(Palette.data()),
+		Palette.size() * sizeof(IN3PaletteEntry));
 	for (UINT8 i = 0; i < 3; i++) {
 		std::vector<bool>* data = NULL;
 		switch (i) {
@@ -26,75 +122,216 @@ void IN3File::Save(HANDLE fileHandle)
 			data = &Vectors.V;
 			break;
 		}
-		size_t numBits = data->size();
-		DWORD bufSize = static_cast<DWORD>(ceil(numBits / 8.0));
-		BYTE* outputBuffer = new BYTE[bufSize];
-		BYTE b;
-		for (size_t bit = 0; bit < numBits; bit++) {
-			BYTE x = !!(data->at(bit));
-			b ^= (-x ^ b) & (1 << (bit % 8));
-			if ((bit + 1) % 8 == 0) {
-				outputBuffer[bit / 8] = b;
-			}
-		}
-		outputBuffer[bufSize - 1] = b;
-		WriteFile(
+		std::vector<BYTE> outputBuffer = PackBits(*data);
+		WriteChunked(
 			fileHandle,
-			outputBuffer,
-			bufSize,
-			&bytesWritten,
-			NULL);
-		delete[] outputBuffer;
+			outputBuffer.data(),
+			outputBuffer.size());
 	}
 	CloseHandle(fileHandle);
 }
+#endif
+
+std::vector<BYTE> IN3File::SaveToMemory() const
+{
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_IN3_WRITE);
+	IN3_TRACE_SCOPE("IN3 pack");
+	// Allocate the whole file once and pack the planes in place
+	std::vector<BYTE> bytes(static_cast<size_t>(getSavedSize()));
+	SaveToBuffer(bytes.data());
+	return bytes;
+}
+
+UINT64 IN3File::getSavedSize() const
+{
+	const std::vector<bool>* planes[3] = { &Vectors.Y, &Vectors.U, &Vectors.V };
+	UINT64 size = sizeof(Header) + Palette.size() * sizeof(IN3PaletteEntry);
+	for (UINT8 i = 0; i < 3; i++) {
+		size += (planes[i]->size() + 7) / 8;
+	}
+	return size;
+}
 
-IN3Header<INT8> IN3File::getHeader()
+void IN3File::SaveToBuffer(BYTE* data) const
+{
+	const std::vector<bool>* planes[3] = { &Vectors.Y, &Vectors.U, &Vectors.V };
+	IN3Header<INT8> header = Header;
+	header.HeaderSize = static_cast<UINT32>(sizeof(header) + Palette.size() * sizeof(IN3PaletteEntry));
+	std::memcpy(data, &header, sizeof(header));
+	data += sizeof(header);
+	if (!Palette.empty()) {
+		std::memcpy(data, Palette.data(), Palette.size() * sizeof(IN3PaletteEntry));
+		data += Palette.size() * sizeof(IN3PaletteEntry);
+	}
+	for (UINT8 i = 0; i < 3; i++) {
+		PackBits(*planes[i], data);
+		data += (planes[i]->size() + 7) / 8;
+	}
+}
+
+UINT64 IN3File::ReadHeader(const BYTE* data, UINT64 size, IN3Header<INT8>& header)
+{
+	// Detect the header version from the legacy dimension fields
+	UINT64 headerSize = 0;
+	IN3HeaderPrefix prefix = {};
+	std::memcpy(
+		&prefix,
+		data,
+		static_cast<size_t>(std::min<UINT64>(sizeof(prefix), size)));
+	if (prefix.LegacyWidth != 0 || prefix.LegacyHeight != 0) {
+		// Version 1 header is converted to the version 2 layout
+		IN3HeaderV1<INT8> headerV1;
+		headerSize = std::min<UINT64>(sizeof(headerV1), size);
+		std::memcpy(
+			&headerV1,
+			data,
+			static_cast<size_t>(headerSize));
+		header = IN3Header<INT8>(headerV1);
+		header.MagicByteI = headerV1.MagicByteI;
+		header.MagicByteN = headerV1.MagicByteN;
+	}
+	else {
+		// Version 2 header may be shorter or longer than the one known here
+		// Fields missing from the file are left zero-filled
+		BYTE headerBytes[sizeof(header)] = {};
+		std::memcpy(
+			headerBytes,
+			data,
+			static_cast<size_t>(std::min<UINT64>(sizeof(header), size)));
+		std::memcpy(
+			&header,
+			headerBytes,
+			sizeof(header));
+		headerSize = std::min<UINT64>(header.HeaderSize, size);
+		if (headerSize < sizeof(header)) {
+			std::memset(
+				headerBytes + headerSize,
+				0,
+				sizeof(header) - static_cast<size_t>(headerSize));
+			std::memcpy(
+				&header,
+				headerBytes,
+				sizeof(header));
+		}
+		header.HeaderSize = sizeof(header);
+	}
+	return headerSize;
+}
+
+UINT64 IN3File::ReadHeader(
+	const BYTE* data,
+	UINT64 size,
+	IN3Header<INT8>& header,
+	std::vector<IN3PaletteEntry>& palette)
+{
+	UINT64 headerSize = ReadHeader(data, size, header);
+	palette.clear();
+	UINT64 paletteBytes = header.PaletteSize * sizeof(IN3PaletteEntry);
+	if (header.PaletteSize == 0 ||
+		header.PaletteSize > IN3_MAX_PALETTE_SIZE ||
+		headerSize < sizeof(header) + paletteBytes) {
+		return headerSize;
+	}
+	palette.resize(header.PaletteSize);
+	std::memcpy(
+		palette.data(),
+		data + headerSize - paletteBytes,
+		static_cast<size_t>(paletteBytes));
+	return headerSize;
+}
+
+BOOL IN3File::IsValidHeader(const IN3Header<INT8>& header)
+{
+	// Bitmaps take 32-bit signed dimensions and the samples of all pixels
+	// are indexed by size_t
+	static const UINT64 MAX_DIMENSION = std::numeric_limits<INT32>::max();
+	IN3Header<INT8> expected;
+	return header.MagicByteI == expected.MagicByteI &&
+		header.MagicByteN == expected.MagicByteN &&
+		header.Version <= IN3_VERSION_2 &&
+		header.Width <= MAX_DIMENSION &&
+		header.Height <= MAX_DIMENSION &&
+		(header.Height == 0 ||
+			header.Width <= std::numeric_limits<size_t>::max() / header.Height);
+}
+
+const IN3Header<INT8>& IN3File::getHeader() const
 {
 	return Header;
 }
 
-std::vector<bool> IN3File::getBitsReadFromFile()
+const std::vector<IN3PaletteEntry>& IN3File::getPalette() const
+{
+	return Palette;
+}
+
+const std::vector<bool>& IN3File::getBitsReadFromFile() const
 {
 	return bitsReadFromFile;
 }
 
+const YUVVectors<bool>& IN3File::getVectors() const
+{
+	return Vectors;
+}
+
+#ifdef _WIN32
 IN3File::IN3File(HANDLE fileHandle)
 {
-	static const UINT64 headerSize = sizeof(Header);
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_IN3_READ);
+	IN3_TRACE_SCOPE("IN3 read");
 	LARGE_INTEGER fileSizeStruct;
 	GetFileSizeEx(fileHandle, &fileSizeStruct);
 	UINT64 fileSize = fileSizeStruct.QuadPart;
 	BYTE* readBytes = new BYTE[fileSize];
-	DWORD bytesRead;
-	ReadFile(
+	ReadChunked(
 		fileHandle,
 		readBytes,
-		static_cast<DWORD>(fileSize),
-		&bytesRead,
-		NULL);
+		fileSize);
 	CloseHandle(fileHandle);
-	std::memcpy(
-		&Header,
-		readBytes,
-		headerSize);
-	for (UINT64 i = headerSize; i < fileSize; i++) {
-		BYTE readByte = readBytes[i];
-		BYTE mask = 0x01;
-		for (UINT8 bitIndex = 0; bitIndex < 8; bitIndex++) {
-			bitsReadFromFile.push_back(!!(readByte & mask));
-			mask <<= 1;
-		}
-	}
+	UINT64 headerSize = ReadHeader(readBytes, fileSize, Header, Palette);
+	UnpackBits(
+		readBytes + headerSize,
+		fileSize - headerSize,
+		bitsReadFromFile);
 	delete[] readBytes;
 }
+#endif
+
+IN3File::IN3File(Span<BYTE> fileBytes)
+{
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_IN3_READ);
+	IN3_TRACE_SCOPE("IN3 parse");
+	UINT64 headerSize = ReadHeader(fileBytes.data(), fileBytes.size(), Header, Palette);
+	UnpackBits(
+		fileBytes.data() + headerSize,
+		fileBytes.size() - headerSize,
+		bitsReadFromFile);
+}
+
+IN3File::IN3File(
+	const IN3Header<INT8>& header,
+	YUVVectors<bool>&& vectors,
+	const std::vector<IN3PaletteEntry>& palette)
+	: Header(header),
+	  Palette(palette),
+	  Vectors(std::move(vectors))
+{
+	Header.PaletteSize = static_cast<UINT16>(Palette.size());
+}
 
 IN3File::IN3File(
-	IN3Header<INT8> header,
-	YUVVectors<bool> vectors)
+	const IN3Header<INT8>& header,
+	Span<BYTE> planeBytes,
+	const std::vector<IN3PaletteEntry>& palette)
 	: Header(header),
-	  Vectors(vectors)
+	  Palette(palette)
 {
+	Header.PaletteSize = static_cast<UINT16>(Palette.size());
+	UnpackBits(
+		planeBytes.data(),
+		planeBytes.size(),
+		bitsReadFromFile);
 }
 
 IN3File::~IN3File()
@@ -10,16 +10,64 @@ class IN3File
 {
 private:
 	IN3Header<INT8> Header;
+	// Palette of a palette coded file, stored at the end of the header
+	std::vector<IN3PaletteEntry> Palette;
 	YUVVectors<bool> Vectors;
 	std::vector<bool> bitsReadFromFile;
+	static const DWORD IO_CHUNK_SIZE;
 public:
+#ifdef _WIN32
+	// Chunked file I/O for payloads larger than a single 32-bit transfer
+	static BOOL WriteChunked(HANDLE fileHandle, const BYTE* data, UINT64 size);
+	static BOOL ReadChunked(HANDLE fileHandle, BYTE* data, UINT64 size);
+#endif
+	// Bits <---> bytes, least significant bit first, zero-padded to a byte
+	static std::vector<BYTE> PackBits(const std::vector<bool>& bits);
+	static void PackBits(const std::vector<bool>& bits, std::vector<BYTE>& bytes);
+	static void PackBits(const std::vector<bool>& bits, BYTE* bytes);
+	static void UnpackBits(const BYTE* bytes, UINT64 size, std::vector<bool>& bits);
+	// Read the header at the start of a file, returning the bytes it takes
+	// Older and truncated headers are converted to the current layout
+	static UINT64 ReadHeader(const BYTE* data, UINT64 size, IN3Header<INT8>& header);
+	// Read the header and the palette that ends it
+	// A palette that does not fit in the header is left empty
+	static UINT64 ReadHeader(
+		const BYTE* data,
+		UINT64 size,
+		IN3Header<INT8>& header,
+		std::vector<IN3PaletteEntry>& palette);
+	// Whether a header read from a file has the IN3 magic bytes, a known
+	// version and dimensions a BitmapFile can hold
+	static BOOL IsValidHeader(const IN3Header<INT8>& header);
+#ifdef _WIN32
 	void Save(HANDLE fileHandle);
-	IN3Header<INT8> getHeader();
-	std::vector<bool> getBitsReadFromFile();
+#endif
+	// Bytes Save would write to a file
+	std::vector<BYTE> SaveToMemory() const;
+	// Size of the file and writing it to a buffer of at least that size
+	UINT64 getSavedSize() const;
+	void SaveToBuffer(BYTE* data) const;
+	const IN3Header<INT8>& getHeader() const;
+	const std::vector<IN3PaletteEntry>& getPalette() const;
+	const std::vector<bool>& getBitsReadFromFile() const;
+	const YUVVectors<bool>& getVectors() const;
+#ifdef _WIN32
 	IN3File(HANDLE fileHandle);
+#endif
+	// Contents of a whole file already in memory
+	IN3File(Span<BYTE> fileBytes);
+	// Header, palette and the packed Y, U and V planes stored after them
 	IN3File(
-		IN3Header<INT8> header,
-		YUVVectors<bool> vectors);
+		const IN3Header<INT8>& header,
+		Span<BYTE> planeBytes,
+		const std::vector<IN3PaletteEntry>& palette = std::vector<IN3PaletteEntry>());
+	// Header, palette and coded planes, which are moved in
+	IN3File(
+		const IN3Header<INT8>& header,
+		YUVVectors<bool>&& vectors,
+		const std::vector<IN3PaletteEntry>& palette = std::vector<IN3PaletteEntry>());
+	IN3File(const IN3File&) = delete;
+	IN3File& operator=(const IN3File&) = delete;
 	~IN3File();
 };
 
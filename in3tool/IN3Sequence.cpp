@@ -0,0 +1,430 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include "IN3File.h"
+#include "IN3Sequence.h"
+
+// Visit each pixel index of each block in block order
+template <typename F>
+static void forEachBlock(
+	UINT64 width,
+	UINT64 height,
+	UINT32 blockSize,
+	F onBlock)
+{
+	UINT64 block = 0;
+	for (UINT64 y0 = 0; y0 < height; y0 += blockSize) {
+		for (UINT64 x0 = 0; x0 < width; x0 += blockSize) {
+			UINT64 y1 = std::min<UINT64>(y0 + blockSize, height);
+			UINT64 x1 = std::min<UINT64>(x0 + blockSize, width);
+			onBlock(block, x0, y0, x1, y1);
+			block += 1;
+		}
+	}
+}
+
+// Settings of the codec that converts and codes the frames
+static Codec::Settings frameSettings(IN3ColorTransform colorTransform)
+{
+	Codec::Settings settings;
+	settings.ColorTransform = colorTransform;
+	return settings;
+}
+
+void IN3SequenceWriter::write(const void* data, UINT64 size)
+{
+	if (!WriteFailed &&
+		!IN3File::WriteChunked(FileHandle, static_cast<const BYTE*>(data), size)) {
+		WriteFailed = TRUE;
+	}
+	Offset += size;
+}
+
+void IN3SequenceWriter::collectResidual(
+	const YUVVectors<INT8>& planes,
+	std::array<std::vector<INT8>, 3>& symbols,
+	std::vector<bool>& mask)
+{
+	UINT64 width = Header.Width;
+	const std::vector<INT8>* current[3] = { &planes.Y, &planes.U, &planes.V };
+	const std::vector<INT8>* previous[3] = { &Previous.Y, &Previous.U, &Previous.V };
+	forEachBlock(width, Header.Height, Header.BlockSize,
+		[&](UINT64 block, UINT64 x0, UINT64 y0, UINT64 x1, UINT64 y1) {
+		UNREFERENCED_PARAMETER(block);
+		// A block is changed if any sample of any plane differs
+		BOOL changed = FALSE;
+		for (UINT64 y = y0; y < y1 && !changed; y++) {
+			for (UINT8 p = 0; p < 3 && !changed; p++) {
+				changed = !std::equal(
+					current[p]->begin() + y * width + x0,
+					current[p]->begin() + y * width + x1,
+					previous[p]->begin() + y * width + x0);
+			}
+		}
+		mask.push_back(!!changed);
+		if (!changed) {
+			return;
+		}
+		// Residuals wrap modulo 256 so they stay 8-bit
+		for (UINT8 p = 0; p < 3; p++) {
+			for (UINT64 y = y0; y < y1; y++) {
+				for (UINT64 x = x0; x < x1; x++) {
+					UINT64 i = y * width + x;
+					symbols[p].push_back(static_cast<INT8>(
+						(*current[p])[i] - (*previous[p])[i]));
+				}
+			}
+		}
+	});
+}
+
+BOOL IN3SequenceWriter::addFrame(const BitmapFile& bitmapFile)
+{
+	if (Finished || WriteFailed) {
+		return FALSE;
+	}
+	UINT64 frame = Index.size();
+	if (frame == 0) {
+		Header.Width = bitmapFile.getWidth();
+		Header.Height = bitmapFile.getHeight();
+	}
+	else if (Header.Width != static_cast<UINT64>(bitmapFile.getWidth()) ||
+		Header.Height != static_cast<UINT64>(bitmapFile.getHeight())) {
+		return FALSE;
+	}
+	YUVVectors<INT8> planes = FrameCodec.cvtBmpToYUVVector(bitmapFile);
+	IN3FrameHeader frameHeader = {};
+	std::array<std::vector<INT8>, 3> symbols;
+	std::vector<bool> mask;
+	if (frame % Header.KeyFrameInterval == 0) {
+		frameHeader.Flags = IN3_FRAME_KEY;
+		symbols[0] = planes.Y;
+		symbols[1] = planes.U;
+		symbols[2] = planes.V;
+	}
+	else {
+		collectResidual(planes, symbols, mask);
+	}
+	// Compare new tables, including their size, against reusing old ones
+	BOOL key = (frameHeader.Flags & IN3_FRAME_KEY) != 0;
+	IN3FrameTables& lastTables = key ? KeyTables : ResidualTables;
+	BOOL haveLastTables = key ? HaveKeyTables : HaveResidualTables;
+	IN3FrameTables newTables;
+	UINT64 newBits = sizeof(IN3FrameTables) * 8;
+	UINT64 lastBits = 0;
+	for (UINT8 p = 0; p < 3; p++) {
+		newTables[p] = FrameCodec.huffmanLengths(symbols[p]);
+		newBits += FrameCodec.huffmanCodedBits(newTables[p], symbols[p]);
+		if (haveLastTables) {
+			lastBits += FrameCodec.huffmanCodedBits(lastTables[p], symbols[p]);
+		}
+	}
+	IN3FrameIndexEntry entry = {};
+	entry.Offset = Offset;
+	if (haveLastTables && lastBits <= newBits) {
+		entry.TableOffset = key ? KeyTablesOffset : ResidualTablesOffset;
+	}
+	else {
+		frameHeader.Flags |= IN3_FRAME_TABLES;
+		entry.TableOffset = Offset;
+		lastTables = newTables;
+		if (key) {
+			KeyTablesOffset = Offset;
+			HaveKeyTables = TRUE;
+		}
+		else {
+			ResidualTablesOffset = Offset;
+			HaveResidualTables = TRUE;
+		}
+	}
+	entry.Flags = frameHeader.Flags;
+	// Code the planes and the mask
+	std::array<std::vector<BYTE>, 3> coded;
+	for (UINT8 p = 0; p < 3; p++) {
+		coded[p] = IN3File::PackBits(
+			FrameCodec.huffmanEncodeWithTable(lastTables[p], symbols[p]));
+	}
+	std::vector<BYTE> maskBytes = IN3File::PackBits(mask);
+	frameHeader.MaskSize = maskBytes.size();
+	frameHeader.YSize = coded[0].size();
+	frameHeader.USize = coded[1].size();
+	frameHeader.VSize = coded[2].size();
+	// Write the frame record
+	write(&frameHeader, sizeof(frameHeader));
+	if (frameHeader.Flags & IN3_FRAME_TABLES) {
+		write(lastTables.data(), sizeof(IN3FrameTables));
+	}
+	write(maskBytes.data(), maskBytes.size());
+	for (UINT8 p = 0; p < 3; p++) {
+		write(coded[p].data(), coded[p].size());
+	}
+	Index.push_back(entry);
+	Previous = std::move(planes);
+	return !WriteFailed;
+}
+
+BOOL IN3SequenceWriter::finish()
+{
+	if (Finished) {
+		return !WriteFailed;
+	}
+	Finished = TRUE;
+	// The index goes after the last frame, then the header is rewritten
+	Header.FrameCount = Index.size();
+	Header.IndexOffset = Offset;
+	write(Index.data(), Index.size() * sizeof(IN3FrameIndexEntry));
+	LARGE_INTEGER start = {};
+	if (!SetFilePointerEx(FileHandle, start, NULL, FILE_BEGIN)) {
+		WriteFailed = TRUE;
+	}
+	write(&Header, sizeof(Header));
+	CloseHandle(FileHandle);
+	return !WriteFailed;
+}
+
+IN3SequenceWriter::IN3SequenceWriter(
+	HANDLE fileHandle,
+	IN3ColorTransform colorTransform,
+	UINT32 keyFrameInterval,
+	UINT32 blockSize)
+	: FileHandle(fileHandle),
+	  FrameCodec(frameSettings(colorTransform)),
+	  Offset(0),
+	  KeyTablesOffset(0),
+	  ResidualTablesOffset(0),
+	  HaveKeyTables(FALSE),
+	  HaveResidualTables(FALSE),
+	  Finished(FALSE),
+	  WriteFailed(FALSE)
+{
+	Header.ColorTransform = colorTransform;
+	Header.KeyFrameInterval = std::max<UINT32>(keyFrameInterval, 1);
+	Header.BlockSize = std::max<UINT32>(blockSize, 1);
+	Header.Width = 0;
+	Header.Height = 0;
+	Header.FrameCount = 0;
+	Header.IndexOffset = 0;
+	// Reserve the space of the header until the index is known
+	write(&Header, sizeof(Header));
+}
+
+IN3SequenceWriter::~IN3SequenceWriter()
+{
+	finish();
+}
+
+BOOL IN3SequenceReader::readAt(UINT64 offset, void* data, UINT64 size)
+{
+	LARGE_INTEGER position;
+	position.QuadPart = static_cast<LONGLONG>(offset);
+	if (!SetFilePointerEx(FileHandle, position, NULL, FILE_BEGIN)) {
+		return FALSE;
+	}
+	return IN3File::ReadChunked(FileHandle, static_cast<BYTE*>(data), size);
+}
+
+BOOL IN3SequenceReader::decodeFrame(UINT64 frame)
+{
+	const IN3FrameIndexEntry& entry = Index[frame];
+	// Offsets are checked against the file size before they are added to
+	static const UINT64 RECORD_SIZE = sizeof(IN3FrameHeader) + sizeof(IN3FrameTables);
+	if (entry.Offset > FileSize - sizeof(IN3FrameHeader) ||
+		entry.TableOffset > FileSize - RECORD_SIZE) {
+		return FALSE;
+	}
+	IN3FrameHeader frameHeader;
+	if (!readAt(entry.Offset, &frameHeader, sizeof(frameHeader))) {
+		return FALSE;
+	}
+	// The index picks the key frames to start decoding at, so it must
+	// agree with the frame, and a residual frame needs the planes before it
+	BOOL key = (frameHeader.Flags & IN3_FRAME_KEY) != 0;
+	UINT64 width = Header.Width;
+	UINT64 height = Header.Height;
+	if (key != ((entry.Flags & IN3_FRAME_KEY) != 0) ||
+		(!key && (!HaveCurrent || Current.Y.size() != width * height))) {
+		return FALSE;
+	}
+	// Load the tables this frame uses unless they are already loaded
+	if (!HaveTables || TablesOffset != entry.TableOffset) {
+		if (!readAt(entry.TableOffset + sizeof(IN3FrameHeader), Tables.data(), sizeof(Tables))) {
+			return FALSE;
+		}
+		TablesOffset = entry.TableOffset;
+		HaveTables = TRUE;
+	}
+	UINT64 payloadOffset = entry.Offset + sizeof(frameHeader);
+	if (frameHeader.Flags & IN3_FRAME_TABLES) {
+		payloadOffset += sizeof(IN3FrameTables);
+	}
+	// Each size must fit in what is left of the file, so that a damaged
+	// size neither overflows the sum nor allocates more than the file holds
+	UINT64 sizes[3] = { frameHeader.YSize, frameHeader.USize, frameHeader.VSize };
+	if (payloadOffset > FileSize) {
+		return FALSE;
+	}
+	UINT64 remaining = FileSize - payloadOffset;
+	UINT64 payloadSize = 0;
+	for (UINT64 size : { frameHeader.MaskSize, sizes[0], sizes[1], sizes[2] }) {
+		if (size > remaining - payloadSize) {
+			return FALSE;
+		}
+		payloadSize += size;
+	}
+	std::vector<BYTE> payload(static_cast<size_t>(payloadSize));
+	if (!readAt(payloadOffset, payload.data(), payloadSize)) {
+		return FALSE;
+	}
+	const BYTE* position = payload.data();
+	// Count the coded samples per plane from the changed block mask
+	std::vector<bool> mask;
+	UINT64 numSymbols = width * height;
+	if (!key) {
+		IN3File::UnpackBits(position, frameHeader.MaskSize, mask);
+		numSymbols = 0;
+		forEachBlock(width, height, Header.BlockSize,
+			[&](UINT64 block, UINT64 x0, UINT64 y0, UINT64 x1, UINT64 y1) {
+			if (block < mask.size() && mask[block]) {
+				numSymbols += (x1 - x0) * (y1 - y0);
+			}
+		});
+	}
+	position += frameHeader.MaskSize;
+	std::array<std::vector<INT8>, 3> symbols;
+	for (UINT8 p = 0; p < 3; p++) {
+		// Every code is at least a bit long
+		if (numSymbols > sizes[p] * 8) {
+			return FALSE;
+		}
+		std::vector<bool> bits;
+		IN3File::UnpackBits(position, sizes[p], bits);
+		position += sizes[p];
+		symbols[p] = FrameCodec.huffmanDecode<INT8>(Tables[p], bits, numSymbols);
+		if (symbols[p].size() != numSymbols) {
+			return FALSE;
+		}
+	}
+	if (key) {
+		Current.Width = width;
+		Current.Height = height;
+		Current.Y = symbols[0];
+		Current.U = symbols[1];
+		Current.V = symbols[2];
+	}
+	else {
+		// Add the residuals of the changed blocks to the previous frame
+		std::vector<INT8>* planes[3] = { &Current.Y, &Current.U, &Current.V };
+		UINT64 i = 0;
+		UINT64 blockStart = 0;
+		forEachBlock(width, height, Header.BlockSize,
+			[&](UINT64 block, UINT64 x0, UINT64 y0, UINT64 x1, UINT64 y1) {
+			if (block >= mask.size() || !mask[block]) {
+				return;
+			}
+			for (UINT8 p = 0; p < 3; p++) {
+				i = blockStart;
+				for (UINT64 y = y0; y < y1; y++) {
+					for (UINT64 x = x0; x < x1; x++) {
+						INT8& sample = (*planes[p])[y * width + x];
+						sample = static_cast<INT8>(sample + symbols[p][i]);
+						i += 1;
+					}
+				}
+			}
+			blockStart = i;
+		});
+	}
+	CurrentFrame = frame;
+	HaveCurrent = TRUE;
+	return TRUE;
+}
+
+BOOL IN3SequenceReader::isValid() const
+{
+	return Valid;
+}
+
+UINT64 IN3SequenceReader::getFrameCount() const
+{
+	return Header.FrameCount;
+}
+
+UINT64 IN3SequenceReader::getWidth() const
+{
+	return Header.Width;
+}
+
+UINT64 IN3SequenceReader::getHeight() const
+{
+	return Header.Height;
+}
+
+std::unique_ptr<BitmapFile> IN3SequenceReader::getFrame(UINT64 frame)
+{
+	if (!Valid || frame >= Index.size()) {
+		return NULL;
+	}
+	// Find the key frame the requested frame depends on
+	UINT64 keyFrame = frame;
+	while (keyFrame > 0 && !(Index[keyFrame].Flags & IN3_FRAME_KEY)) {
+		keyFrame -= 1;
+	}
+	// Continue from the last decoded frame if it lies in between
+	UINT64 first = keyFrame;
+	if (HaveCurrent && CurrentFrame >= keyFrame && CurrentFrame <= frame) {
+		first = CurrentFrame + 1;
+	}
+	for (UINT64 i = first; i <= frame; i++) {
+		if (!decodeFrame(i)) {
+			HaveCurrent = FALSE;
+			return NULL;
+		}
+	}
+	return FrameCodec.cvtYUVVectorToBmp(
+		Current,
+		static_cast<IN3ColorTransform>(Header.ColorTransform));
+}
+
+IN3SequenceReader::IN3SequenceReader(HANDLE fileHandle)
+	: FileHandle(fileHandle),
+	  FileSize(0),
+	  Valid(FALSE),
+	  CurrentFrame(0),
+	  HaveCurrent(FALSE),
+	  TablesOffset(0),
+	  HaveTables(FALSE)
+{
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(FileHandle, &fileSize) ||
+		fileSize.QuadPart < static_cast<LONGLONG>(sizeof(Header) + sizeof(IN3FrameHeader) + sizeof(IN3FrameTables)) ||
+		!readAt(0, &Header, sizeof(Header))) {
+		return;
+	}
+	FileSize = static_cast<UINT64>(fileSize.QuadPart);
+	// Frames are converted to bitmaps of 32-bit signed dimensions, and the
+	// index must fit in the file after its offset
+	static const UINT64 MAX_DIMENSION = std::numeric_limits<INT32>::max();
+	IN3SequenceHeader expected;
+	if (Header.MagicByteI != expected.MagicByteI ||
+		Header.MagicByteN != expected.MagicByteN ||
+		Header.MagicByteS != expected.MagicByteS ||
+		Header.BlockSize == 0 ||
+		Header.Width > MAX_DIMENSION ||
+		Header.Height > MAX_DIMENSION ||
+		(Header.Height != 0 && Header.Width > std::numeric_limits<size_t>::max() / Header.Height) ||
+		Header.IndexOffset > FileSize ||
+		Header.FrameCount > (FileSize - Header.IndexOffset) / sizeof(IN3FrameIndexEntry)) {
+		return;
+	}
+	Index.resize(static_cast<size_t>(Header.FrameCount));
+	Valid = readAt(
+		Header.IndexOffset,
+		Index.data(),
+		Index.size() * sizeof(IN3FrameIndexEntry));
+}
+
+IN3SequenceReader::~IN3SequenceReader()
+{
+	CloseHandle(FileHandle);
+}
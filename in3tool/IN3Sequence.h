@@ -0,0 +1,99 @@
+#pragma once
+#include <array>
+#include <memory>
+#include <vector>
+#include "BitmapFile.h"
+#include "Codec.h"
+#include "commontypes.h"
+
+// Length tables of the Y, U and V planes of a frame
+typedef std::array<LengthTable<INT8>, 3> IN3FrameTables;
+
+// Writes equally sized bitmaps as frames of one IN3 sequence file
+// Key frames code their planes directly. The frames in between code the
+// difference to the previous frame and skip blocks that did not change.
+// A frame reuses the length tables of an earlier frame of the same kind
+// when they code it at least as compactly as new tables would.
+class IN3SequenceWriter
+{
+public:
+	static const UINT32 DEFAULT_KEY_FRAME_INTERVAL = 30;
+	static const UINT32 DEFAULT_BLOCK_SIZE = 16;
+private:
+	HANDLE FileHandle;
+	Codec FrameCodec;
+	IN3SequenceHeader Header;
+	std::vector<IN3FrameIndexEntry> Index;
+	// Offset in the file of the next frame
+	UINT64 Offset;
+	// Planes of the previous frame
+	YUVVectors<INT8> Previous;
+	// Tables last written by a key frame and by a residual frame
+	IN3FrameTables KeyTables;
+	IN3FrameTables ResidualTables;
+	UINT64 KeyTablesOffset;
+	UINT64 ResidualTablesOffset;
+	BOOL HaveKeyTables;
+	BOOL HaveResidualTables;
+	BOOL Finished;
+	// Set once a write fails, after which the file is not usable
+	BOOL WriteFailed;
+	// Write bytes at the current offset, remembering a failure
+	void write(const void* data, UINT64 size);
+	// Gather the samples of changed blocks and mark them in the mask
+	void collectResidual(
+		const YUVVectors<INT8>& planes,
+		std::array<std::vector<INT8>, 3>& symbols,
+		std::vector<bool>& mask);
+public:
+	// Append a frame, which must have the dimensions of the first frame
+	BOOL addFrame(const BitmapFile& bitmapFile);
+	// Write the frame index and header and close the file, returning FALSE
+	// if any write failed
+	BOOL finish();
+	// Frames are coded losslessly in a color transform
+	IN3SequenceWriter(
+		HANDLE fileHandle,
+		IN3ColorTransform colorTransform,
+		UINT32 keyFrameInterval = DEFAULT_KEY_FRAME_INTERVAL,
+		UINT32 blockSize = DEFAULT_BLOCK_SIZE);
+	~IN3SequenceWriter();
+};
+
+// Reads frames of an IN3 sequence file in any order
+// A frame is decoded starting from the nearest key frame before it, or
+// from the last decoded frame when reading forward.
+class IN3SequenceReader
+{
+private:
+	HANDLE FileHandle;
+	Codec FrameCodec;
+	IN3SequenceHeader Header;
+	std::vector<IN3FrameIndexEntry> Index;
+	// Size of the file, which bounds every offset and size read from it
+	UINT64 FileSize;
+	BOOL Valid;
+	// Planes of the last decoded frame
+	YUVVectors<INT8> Current;
+	UINT64 CurrentFrame;
+	BOOL HaveCurrent;
+	// Last loaded tables
+	IN3FrameTables Tables;
+	UINT64 TablesOffset;
+	BOOL HaveTables;
+	// Read bytes at an offset in the file
+	BOOL readAt(UINT64 offset, void* data, UINT64 size);
+	// Decode a frame on top of the previous frame's planes, returning FALSE
+	// if it is damaged
+	BOOL decodeFrame(UINT64 frame);
+public:
+	// Whether the header and index were read successfully
+	BOOL isValid() const;
+	UINT64 getFrameCount() const;
+	UINT64 getWidth() const;
+	UINT64 getHeight() const;
+	// Decode a frame to a new bitmap, or NULL if it cannot be read
+	std::unique_ptr<BitmapFile> getFrame(UINT64 frame);
+	IN3SequenceReader(HANDLE fileHandle);
+	~IN3SequenceReader();
+};
@@ -0,0 +1,104 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include "IN3File.h"
+#include "IN3WideFile.h"
+
+#ifdef _WIN32
+BOOL IN3WideFile::Save(HANDLE fileHandle)
+{
+	BOOL success = IN3File::WriteChunked(
+		fileHandle,
+		reinterpret_cast<const BYTE*>(&Header),
+		sizeof(Header));
+	for (UINT8 i = 0; success && i < Header.PlaneCount; i++) {
+		success = IN3File::WriteChunked(
+			fileHandle,
+			Planes[i].data(),
+			Planes[i].size());
+	}
+	CloseHandle(fileHandle);
+	return success;
+}
+#endif
+
+BOOL IN3WideFile::isValid() const
+{
+	return Valid;
+}
+
+const IN3WideHeader& IN3WideFile::getHeader() const
+{
+	return Header;
+}
+
+const std::vector<BYTE>& IN3WideFile::getPlane(UINT8 plane) const
+{
+	return Planes[plane];
+}
+
+#ifdef _WIN32
+IN3WideFile::IN3WideFile(HANDLE fileHandle)
+	: Valid(FALSE)
+{
+	// Sizes read from the file are checked against what is left of it
+	// before anything is allocated for them
+	LARGE_INTEGER fileSizeStruct;
+	BOOL success = GetFileSizeEx(fileHandle, &fileSizeStruct);
+	UINT64 remaining = success ? static_cast<UINT64>(fileSizeStruct.QuadPart) : 0;
+	// Fields missing from a shorter header are left zero-filled
+	BYTE headerBytes[sizeof(Header)] = {};
+	success = success && IN3File::ReadChunked(
+		fileHandle,
+		headerBytes,
+		offsetof(IN3WideHeader, SampleBits));
+	std::memcpy(&Header, headerBytes, sizeof(Header));
+	UINT64 headerSize = Header.HeaderSize;
+	IN3WideHeader expected;
+	if (!success ||
+		Header.MagicByteI != expected.MagicByteI ||
+		Header.MagicByteW != expected.MagicByteW ||
+		headerSize < offsetof(IN3WideHeader, SampleBits) ||
+		headerSize > remaining) {
+		CloseHandle(fileHandle);
+		return;
+	}
+	// Read the rest of the header, skipping fields this version does not know
+	UINT64 known = std::min<UINT64>(headerSize, sizeof(Header));
+	std::vector<BYTE> rest(static_cast<size_t>(headerSize - offsetof(IN3WideHeader, SampleBits)));
+	success = IN3File::ReadChunked(fileHandle, rest.data(), rest.size());
+	std::memcpy(
+		headerBytes + offsetof(IN3WideHeader, SampleBits),
+		rest.data(),
+		static_cast<size_t>(known - offsetof(IN3WideHeader, SampleBits)));
+	std::memcpy(&Header, headerBytes, sizeof(Header));
+	Header.HeaderSize = sizeof(Header);
+	remaining -= headerSize;
+	if (Header.PlaneCount > 3) {
+		success = FALSE;
+	}
+	for (UINT8 i = 0; success && i < Header.PlaneCount; i++) {
+		if (Header.PlaneSize[i] > remaining) {
+			success = FALSE;
+			break;
+		}
+		remaining -= Header.PlaneSize[i];
+		Planes[i].resize(static_cast<size_t>(Header.PlaneSize[i]));
+		success = IN3File::ReadChunked(fileHandle, Planes[i].data(), Planes[i].size());
+	}
+	CloseHandle(fileHandle);
+	Valid = success;
+}
+#endif
+
+IN3WideFile::IN3WideFile(
+	const IN3WideHeader& header,
+	std::vector<BYTE> planes[3])
+	: Header(header),
+	  Valid(TRUE)
+{
+	for (UINT8 i = 0; i < 3; i++) {
+		Planes[i].swap(planes[i]);
+	}
+}
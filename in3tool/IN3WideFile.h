@@ -0,0 +1,27 @@
+#pragma once
+#include <vector>
+#include "commontypes.h"
+
+// High bit depth IN3 file
+class IN3WideFile
+{
+private:
+	IN3WideHeader Header;
+	// Sparse length table and coded bits of each plane
+	std::vector<BYTE> Planes[3];
+	BOOL Valid;
+public:
+#ifdef _WIN32
+	// Write the file and close the handle, returning FALSE if a write failed
+	BOOL Save(HANDLE fileHandle);
+#endif
+	BOOL isValid() const;
+	const IN3WideHeader& getHeader() const;
+	const std::vector<BYTE>& getPlane(UINT8 plane) const;
+#ifdef _WIN32
+	IN3WideFile(HANDLE fileHandle);
+#endif
+	IN3WideFile(
+		const IN3WideHeader& header,
+		std::vector<BYTE> planes[3]);
+};
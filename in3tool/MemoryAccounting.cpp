@@ -0,0 +1,365 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <new>
+#include "MemoryAccounting.h"
+
+namespace {
+	// Index of the counters of all stages together
+	const UINT8 TOTAL = MEMORY_STAGE_COUNT;
+	// Net bytes a thread allocates or frees before it publishes them to the
+	// shared live and peak counters, so peaks are exact to within this much
+	// per thread while small allocations touch no shared cache line
+	const INT64 PUBLISH_BYTES = 256 << 10;
+
+	// Counters of one stage kept by one thread
+	// Only the owning thread writes them, except in the shared fallback, so
+	// they are atomics only for the threads that read them
+	struct StageCounters {
+		std::atomic<UINT64> Allocations;
+		std::atomic<UINT64> BytesAllocated;
+		// Bytes this thread allocated less the bytes it freed, which can be
+		// negative for blocks allocated on other threads
+		std::atomic<INT64> LiveBytes;
+		// Part of LiveBytes not yet added to the shared live bytes
+		std::atomic<INT64> UnpublishedBytes;
+	};
+	// Counters of every stage for one thread, on cache lines of their own
+	// Blocks are never freed so that counts outlive their thread, and are
+	// reused by threads started later
+	struct alignas(64) ThreadCounters {
+		StageCounters Stages[MEMORY_STAGE_COUNT + 1];
+		std::atomic<BOOL> InUse;
+		ThreadCounters* Next;
+	};
+	// Counters shared by all threads of one stage, updated when a thread
+	// publishes its live bytes or when the statistics are reset
+	struct alignas(64) SharedCounters {
+		std::atomic<INT64> LiveBytes;
+		std::atomic<UINT64> PeakLiveBytes;
+		// Counts at the last reset, subtracted when reading
+		std::atomic<UINT64> ResetAllocations;
+		std::atomic<UINT64> ResetBytesAllocated;
+	};
+	// Zero-initialized before any dynamic initialization, so allocations made
+	// by static constructors are counted too
+	SharedCounters Shared[MEMORY_STAGE_COUNT + 1];
+	std::atomic<ThreadCounters*> FirstCounters;
+	// Counters of threads that allocate after their own were released
+	ThreadCounters FallbackCounters;
+	thread_local MemoryStage CurrentStage = MEMORY_STAGE_OTHER;
+	thread_local ThreadCounters* CurrentCounters = NULL;
+	thread_local BOOL CountersReleased = FALSE;
+
+	// Block header in front of every allocation, sized to keep the
+	// alignment malloc guarantees
+	union AllocationHeader {
+		struct {
+			UINT64 Size;
+			MemoryStage Stage;
+		} Block;
+		std::max_align_t Alignment;
+	};
+
+	// Hands the counters of a thread back for reuse when the thread exits
+	struct CountersOwner {
+		ThreadCounters* Counters;
+		~CountersOwner()
+		{
+			if (Counters != NULL) {
+				Counters->InUse.store(FALSE, std::memory_order_release);
+			}
+			CurrentCounters = NULL;
+			CountersReleased = TRUE;
+		}
+	};
+	thread_local CountersOwner Owner;
+
+	ThreadCounters* claimCounters()
+	{
+		// Reuse the counters of a thread that has exited
+		for (ThreadCounters* counters = FirstCounters.load(std::memory_order_acquire);
+			counters != NULL;
+			counters = counters->Next) {
+			BOOL expected = FALSE;
+			if (counters->InUse.compare_exchange_strong(expected, TRUE, std::memory_order_acquire)) {
+				return counters;
+			}
+		}
+		// Allocated with malloc so as not to recurse into operator new
+		void* block = std::malloc(sizeof(ThreadCounters) + alignof(ThreadCounters));
+		if (block == NULL) {
+			return NULL;
+		}
+		size_t space = sizeof(ThreadCounters) + alignof(ThreadCounters);
+		ThreadCounters* counters = new (std::align(
+			alignof(ThreadCounters),
+			sizeof(ThreadCounters),
+			block,
+			space)) ThreadCounters();
+		counters->InUse.store(TRUE, std::memory_order_relaxed);
+		ThreadCounters* first = FirstCounters.load(std::memory_order_relaxed);
+		do {
+			counters->Next = first;
+		} while (!FirstCounters.compare_exchange_weak(first, counters, std::memory_order_release));
+		return counters;
+	}
+
+	ThreadCounters& getCounters()
+	{
+		if (CurrentCounters == NULL && !CountersReleased) {
+			CurrentCounters = claimCounters();
+			// The first use of the owner registers its release at thread exit
+			Owner.Counters = CurrentCounters;
+		}
+		return CurrentCounters != NULL ? *CurrentCounters : FallbackCounters;
+	}
+
+	void raisePeak(std::atomic<UINT64>& peak, INT64 live)
+	{
+		UINT64 current = peak.load(std::memory_order_relaxed);
+		while (live > 0 && static_cast<UINT64>(live) > current &&
+			!peak.compare_exchange_weak(current, static_cast<UINT64>(live), std::memory_order_relaxed)) {
+		}
+	}
+
+	// Add to a counter, with a plain load and store when only the current
+	// thread writes it
+	template <typename T>
+	T increase(std::atomic<T>& counter, T value, BOOL owned)
+	{
+		if (owned) {
+			T result = counter.load(std::memory_order_relaxed) + value;
+			counter.store(result, std::memory_order_relaxed);
+			return result;
+		}
+		return counter.fetch_add(value, std::memory_order_relaxed) + value;
+	}
+
+	// Add to the live bytes of a thread, publishing them once enough
+	// have built up since the last time
+	void addLive(StageCounters& counters, SharedCounters& shared, INT64 bytes, BOOL owned)
+	{
+		increase(counters.LiveBytes, bytes, owned);
+		INT64 unpublished = increase(counters.UnpublishedBytes, bytes, owned);
+		if (unpublished >= PUBLISH_BYTES || unpublished <= -PUBLISH_BYTES) {
+			unpublished = counters.UnpublishedBytes.exchange(0, std::memory_order_relaxed);
+			INT64 live = shared.LiveBytes.fetch_add(unpublished, std::memory_order_relaxed) + unpublished;
+			raisePeak(shared.PeakLiveBytes, live);
+		}
+	}
+
+	void add(ThreadCounters& counters, UINT8 stage, UINT64 size, BOOL owned)
+	{
+		StageCounters& stageCounters = counters.Stages[stage];
+		increase<UINT64>(stageCounters.Allocations, 1, owned);
+		increase(stageCounters.BytesAllocated, size, owned);
+		addLive(stageCounters, Shared[stage], static_cast<INT64>(size), owned);
+	}
+
+	// Sum of the counters of every thread
+	void sum(UINT8 stage, UINT64& allocations, UINT64& bytesAllocated, INT64& liveBytes)
+	{
+		const StageCounters& fallback = FallbackCounters.Stages[stage];
+		allocations = fallback.Allocations.load(std::memory_order_relaxed);
+		bytesAllocated = fallback.BytesAllocated.load(std::memory_order_relaxed);
+		liveBytes = fallback.LiveBytes.load(std::memory_order_relaxed);
+		for (const ThreadCounters* counters = FirstCounters.load(std::memory_order_acquire);
+			counters != NULL;
+			counters = counters->Next) {
+			const StageCounters& stageCounters = counters->Stages[stage];
+			allocations += stageCounters.Allocations.load(std::memory_order_relaxed);
+			bytesAllocated += stageCounters.BytesAllocated.load(std::memory_order_relaxed);
+			liveBytes += stageCounters.LiveBytes.load(std::memory_order_relaxed);
+		}
+	}
+
+	MemoryAccounting::Statistics read(UINT8 stage)
+	{
+		UINT64 allocations;
+		UINT64 bytesAllocated;
+		INT64 liveBytes;
+		sum(stage, allocations, bytesAllocated, liveBytes);
+		const SharedCounters& shared = Shared[stage];
+		MemoryAccounting::Statistics statistics;
+		statistics.Allocations = allocations - shared.ResetAllocations.load(std::memory_order_relaxed);
+		statistics.BytesAllocated = bytesAllocated - shared.ResetBytesAllocated.load(std::memory_order_relaxed);
+		statistics.LiveBytes = static_cast<UINT64>(std::max<INT64>(liveBytes, 0));
+		statistics.PeakLiveBytes = std::max(
+			shared.PeakLiveBytes.load(std::memory_order_relaxed),
+			statistics.LiveBytes);
+		return statistics;
+	}
+
+	void restart(UINT8 stage)
+	{
+		UINT64 allocations;
+		UINT64 bytesAllocated;
+		INT64 liveBytes;
+		sum(stage, allocations, bytesAllocated, liveBytes);
+		SharedCounters& shared = Shared[stage];
+		shared.ResetAllocations.store(allocations, std::memory_order_relaxed);
+		shared.ResetBytesAllocated.store(bytesAllocated, std::memory_order_relaxed);
+		shared.PeakLiveBytes.store(
+			static_cast<UINT64>(std::max<INT64>(liveBytes, 0)),
+			std::memory_order_relaxed);
+	}
+
+#ifndef IN3_NO_ALLOCATOR_HOOKS
+	void* allocate(size_t size)
+	{
+		if (size > std::numeric_limits<size_t>::max() - sizeof(AllocationHeader)) {
+			return NULL;
+		}
+		void* block = std::malloc(sizeof(AllocationHeader) + size);
+		if (block == NULL) {
+			return NULL;
+		}
+		AllocationHeader* header = static_cast<AllocationHeader*>(block);
+		header->Block.Size = size;
+		header->Block.Stage = CurrentStage;
+		MemoryAccounting::recordAllocation(header->Block.Stage, size);
+		return header + 1;
+	}
+
+	void deallocate(void* pointer)
+	{
+		if (pointer == NULL) {
+			return;
+		}
+		AllocationHeader* header = static_cast<AllocationHeader*>(pointer) - 1;
+		MemoryAccounting::recordFree(header->Block.Stage, header->Block.Size);
+		std::free(header);
+	}
+#endif
+}
+
+MemoryAccounting::Scope::Scope(MemoryStage stage)
+	: Previous(CurrentStage)
+{
+	CurrentStage = stage;
+}
+
+MemoryAccounting::Scope::~Scope()
+{
+	CurrentStage = Previous;
+}
+
+MemoryStage MemoryAccounting::getStage()
+{
+	return CurrentStage;
+}
+
+void MemoryAccounting::setStage(MemoryStage stage)
+{
+	CurrentStage = stage;
+}
+
+MemoryAccounting::Statistics MemoryAccounting::getStatistics(MemoryStage stage)
+{
+	return read(stage < MEMORY_STAGE_COUNT ? stage : MEMORY_STAGE_OTHER);
+}
+
+MemoryAccounting::Statistics MemoryAccounting::getTotal()
+{
+	return read(TOTAL);
+}
+
+void MemoryAccounting::reset()
+{
+	for (UINT8 stage = 0; stage <= TOTAL; stage++) {
+		restart(stage);
+	}
+}
+
+const WCHAR * MemoryAccounting::getStageName(MemoryStage stage)
+{
+	switch (stage) {
+	case MEMORY_STAGE_BMP_READ:
+		return L"BMP read";
+	case MEMORY_STAGE_COLOR_CONVERSION:
+		return L"Color conversion";
+	case MEMORY_STAGE_ENTROPY_CODING:
+		return L"Entropy coding";
+	case MEMORY_STAGE_IN3_READ:
+		return L"IN3 read";
+	case MEMORY_STAGE_IN3_WRITE:
+		return L"IN3 write";
+	case MEMORY_STAGE_OPERATIONS:
+		return L"Operations";
+	case MEMORY_STAGE_PREFETCH:
+		return L"Prefetch";
+	default:
+		return L"Other";
+	}
+}
+
+void MemoryAccounting::recordAllocation(MemoryStage stage, UINT64 size)
+{
+	ThreadCounters& counters = getCounters();
+	BOOL owned = &counters != &FallbackCounters;
+	add(counters, stage < MEMORY_STAGE_COUNT ? stage : MEMORY_STAGE_OTHER, size, owned);
+	add(counters, TOTAL, size, owned);
+}
+
+void MemoryAccounting::recordFree(MemoryStage stage, UINT64 size)
+{
+	ThreadCounters& counters = getCounters();
+	BOOL owned = &counters != &FallbackCounters;
+	UINT8 index = stage < MEMORY_STAGE_COUNT ? stage : MEMORY_STAGE_OTHER;
+	addLive(counters.Stages[index], Shared[index], -static_cast<INT64>(size), owned);
+	addLive(counters.Stages[TOTAL], Shared[TOTAL], -static_cast<INT64>(size), owned);
+}
+
+#ifndef IN3_NO_ALLOCATOR_HOOKS
+// Replacements of the global allocation functions
+// Sized deletes forward to these by default; over-aligned allocations use
+// their own functions and are not counted
+void* operator new(size_t size)
+{
+	void* pointer = allocate(size);
+	if (pointer == NULL) {
+		throw std::bad_alloc();
+	}
+	return pointer;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return allocate(size);
+}
+
+void operator delete(void* pointer) noexcept
+{
+	deallocate(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+	deallocate(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept
+{
+	deallocate(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept
+{
+	deallocate(pointer);
+}
+#endif
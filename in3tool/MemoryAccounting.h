@@ -0,0 +1,58 @@
+#pragma once
+#include "commontypes.h"
+
+// Pipeline stages that heap allocations are attributed to
+enum MemoryStage : UINT8 {
+	MEMORY_STAGE_OTHER = 0,
+	MEMORY_STAGE_BMP_READ,
+	MEMORY_STAGE_COLOR_CONVERSION,
+	MEMORY_STAGE_ENTROPY_CODING,
+	MEMORY_STAGE_IN3_READ,
+	MEMORY_STAGE_IN3_WRITE,
+	MEMORY_STAGE_OPERATIONS,
+	MEMORY_STAGE_PREFETCH,
+	MEMORY_STAGE_COUNT
+};
+
+// Counts heap allocations per pipeline stage
+// The global operator new and delete record every allocation against the
+// stage current on the allocating thread, and every free against the stage
+// that allocated the block. Each thread counts into counters of its own,
+// which are summed when read, and publishes its live bytes to the shared
+// peak only every few hundred kilobytes, so the accounting stays enabled
+// in release builds without threads contending on its cache lines. Peaks
+// can therefore read low by that much per thread. Builds that must not replace the
+// allocator of their host process define IN3_NO_ALLOCATOR_HOOKS, which
+// leaves the counters at zero.
+class MemoryAccounting
+{
+public:
+	// Counters of one stage, or of all stages together
+	struct Statistics {
+		UINT64 Allocations = 0;
+		UINT64 BytesAllocated = 0;
+		UINT64 LiveBytes = 0;
+		UINT64 PeakLiveBytes = 0;
+	};
+	// Sets the stage of the current thread until it goes out of scope
+	class Scope
+	{
+	private:
+		MemoryStage Previous;
+	public:
+		Scope(MemoryStage stage);
+		~Scope();
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	};
+	static MemoryStage getStage();
+	static void setStage(MemoryStage stage);
+	static Statistics getStatistics(MemoryStage stage);
+	static Statistics getTotal();
+	// Restart allocation counts and peaks from the bytes live now
+	static void reset();
+	static const WCHAR* getStageName(MemoryStage stage);
+	// Record an allocation or free, called by operator new and delete
+	static void recordAllocation(MemoryStage stage, UINT64 size);
+	static void recordFree(MemoryStage stage, UINT64 size);
+};
@@ -0,0 +1,429 @@
+#include "stdafx.h"
+#define _USE_MATH_DEFINES
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <thread>
+#include <emmintrin.h>
+#include "MemoryAccounting.h"
+#include "NeighborhoodOperation.h"
+#include "WorkStealingPool.h"
+
+// Floats in an SSE vector
+static const INT32 VECTOR_FLOATS = 4;
+
+// Round a count up to whole SSE vectors
+static inline INT32 roundUpToVector(INT32 count)
+{
+	return (count + VECTOR_FLOATS - 1) / VECTOR_FLOATS * VECTOR_FLOATS;
+}
+
+// Dot product of two arrays of whole SSE vectors
+static inline float dotProduct(const float* a, const float* b, INT32 count)
+{
+	__m128 sum = _mm_setzero_ps();
+	for (INT32 i = 0; i < count; i += VECTOR_FLOATS) {
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+	}
+	__m128 swapped = _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(2, 3, 0, 1));
+	sum = _mm_add_ps(sum, swapped);
+	swapped = _mm_movehl_ps(swapped, sum);
+	sum = _mm_add_ss(sum, swapped);
+	return _mm_cvtss_f32(sum);
+}
+
+// Round and clamp a filtered sample to a byte
+static inline BYTE toByte(float sample)
+{
+	return static_cast<BYTE>(std::min(std::max(sample, 0.0f), 255.0f) + 0.5f);
+}
+
+// Lanczos window of three lobes
+static DOUBLE lanczos3(DOUBLE x)
+{
+	if (x == 0.0) {
+		return 1.0;
+	}
+	if (x <= -3.0 || x >= 3.0) {
+		return 0.0;
+	}
+	DOUBLE px = M_PI * x;
+	return 3.0 * std::sin(px) * std::sin(px / 3.0) / (px * px);
+}
+
+void NeighborhoodOperation::InitAxis(
+	FilterAxis& axis,
+	INT32 inputSize,
+	INT32 outputSize,
+	INT32 taps)
+{
+	axis.InputSize = inputSize;
+	axis.OutputSize = outputSize;
+	axis.Taps = std::min(taps, inputSize);
+	axis.TapStride = roundUpToVector(axis.Taps);
+	axis.Starts.assign(outputSize, 0);
+	axis.Weights.assign(static_cast<size_t>(outputSize) * axis.TapStride, 0.0f);
+}
+
+void NeighborhoodOperation::SetTaps(
+	FilterAxis& axis,
+	INT32 output,
+	INT32 idealStart,
+	const std::vector<float>& weights)
+{
+	INT32 start = std::min(std::max(idealStart, 0), axis.InputSize - axis.Taps);
+	axis.Starts[output] = start;
+	float* target = &axis.Weights[static_cast<size_t>(output) * axis.TapStride];
+	for (INT32 k = 0; k < static_cast<INT32>(weights.size()); k++) {
+		INT32 sample = std::min(std::max(idealStart + k, 0), axis.InputSize - 1);
+		target[sample - start] += weights[k];
+	}
+}
+
+NeighborhoodOperation::FilterAxis NeighborhoodOperation::ConvolutionAxis(
+	INT32 size,
+	const std::vector<float>& kernel)
+{
+	FilterAxis axis;
+	INT32 radius = static_cast<INT32>(kernel.size() / 2);
+	InitAxis(axis, size, size, static_cast<INT32>(kernel.size()));
+	for (INT32 i = 0; i < size; i++) {
+		SetTaps(axis, i, i - radius, kernel);
+	}
+	return axis;
+}
+
+NeighborhoodOperation::FilterAxis NeighborhoodOperation::ResampleAxis(
+	INT32 inputSize,
+	INT32 outputSize)
+{
+	FilterAxis axis;
+	DOUBLE scale = static_cast<DOUBLE>(inputSize) / outputSize;
+	DOUBLE filterScale = std::max(scale, 1.0);
+	DOUBLE support = 3.0 * filterScale;
+	INT32 taps = static_cast<INT32>(std::ceil(2.0 * support)) + 1;
+	InitAxis(axis, inputSize, outputSize, taps);
+	std::vector<DOUBLE> window(taps);
+	std::vector<float> weights(taps);
+	for (INT32 i = 0; i < outputSize; i++) {
+		// Samples are centered half a sample past their index
+		DOUBLE center = (i + 0.5) * scale;
+		INT32 idealStart = static_cast<INT32>(std::floor(center - support));
+		DOUBLE total = 0.0;
+		for (INT32 k = 0; k < taps; k++) {
+			window[k] = lanczos3((idealStart + k + 0.5 - center) / filterScale);
+			total += window[k];
+		}
+		for (INT32 k = 0; k < taps; k++) {
+			weights[k] = static_cast<float>(window[k] / total);
+		}
+		SetTaps(axis, i, idealStart, weights);
+	}
+	return axis;
+}
+
+void NeighborhoodOperation::finishRow(
+	const float* const filtered[3],
+	const BitmapFile::Pixel* sourceRow,
+	INT32 width,
+	BitmapFile::Pixel* targetRow)
+{
+	UNREFERENCED_PARAMETER(sourceRow);
+	for (INT32 x = 0; x < width; x++) {
+		targetRow[x].Blue = toByte(filtered[0][x]);
+		targetRow[x].Green = toByte(filtered[1][x]);
+		targetRow[x].Red = toByte(filtered[2][x]);
+	}
+}
+
+NeighborhoodOperation::NeighborhoodOperation(UINT32 threadCount)
+	: ThreadCount(threadCount)
+{
+}
+
+void NeighborhoodOperation::filterBand(
+	const BitmapFile& source,
+	BitmapFile& target,
+	const FilterAxis& horizontal,
+	const FilterAxis& vertical,
+	INT32 firstRow,
+	INT32 endRow)
+{
+	INT32 inputWidth = horizontal.InputSize;
+	INT32 outputWidth = horizontal.OutputSize;
+	INT32 rowStride = roundUpToVector(outputWidth);
+	// Input rows the band reads, including the halo rows of its filter
+	INT32 firstInput = vertical.Starts[firstRow];
+	INT32 inputRows = vertical.Starts[endRow - 1] + vertical.Taps - firstInput;
+	// Blue, green and red planes of an input row, padded for the last
+	// vector of taps, and of the band's rows filtered along the row
+	std::vector<float> inputPlanes[3];
+	std::vector<float> filteredRows[3];
+	std::vector<float> outputPlanes[3];
+	for (UINT8 c = 0; c < 3; c++) {
+		inputPlanes[c].assign(inputWidth + VECTOR_FLOATS, 0.0f);
+		filteredRows[c].assign(static_cast<size_t>(inputRows) * rowStride, 0.0f);
+		outputPlanes[c].assign(rowStride, 0.0f);
+	}
+	// Row pass
+	for (INT32 r = 0; r < inputRows; r++) {
+		const BitmapFile::Pixel* row = source.getRow(static_cast<UINT32>(firstInput + r));
+		for (INT32 x = 0; x < inputWidth; x++) {
+			inputPlanes[0][x] = row[x].Blue;
+			inputPlanes[1][x] = row[x].Green;
+			inputPlanes[2][x] = row[x].Red;
+		}
+		for (UINT8 c = 0; c < 3; c++) {
+			float* filtered = filteredRows[c].data() + static_cast<size_t>(r) * rowStride;
+			for (INT32 x = 0; x < outputWidth; x++) {
+				filtered[x] = dotProduct(
+					&horizontal.Weights[static_cast<size_t>(x) * horizontal.TapStride],
+					inputPlanes[c].data() + horizontal.Starts[x],
+					horizontal.TapStride);
+			}
+		}
+	}
+	// Column pass, four output samples of a row at a time
+	BOOL sameSize = horizontal.InputSize == horizontal.OutputSize &&
+		vertical.InputSize == vertical.OutputSize;
+	const float* planes[3] = { outputPlanes[0].data(), outputPlanes[1].data(), outputPlanes[2].data() };
+	for (INT32 y = firstRow; y < endRow; y++) {
+		const float* weights = &vertical.Weights[static_cast<size_t>(y) * vertical.TapStride];
+		INT32 base = vertical.Starts[y] - firstInput;
+		for (UINT8 c = 0; c < 3; c++) {
+			float* output = outputPlanes[c].data();
+			for (INT32 x = 0; x < rowStride; x += VECTOR_FLOATS) {
+				_mm_storeu_ps(output + x, _mm_setzero_ps());
+			}
+			for (INT32 k = 0; k < vertical.Taps; k++) {
+				__m128 weight = _mm_set1_ps(weights[k]);
+				const float* input = filteredRows[c].data() + static_cast<size_t>(base + k) * rowStride;
+				for (INT32 x = 0; x < rowStride; x += VECTOR_FLOATS) {
+					__m128 sum = _mm_loadu_ps(output + x);
+					sum = _mm_add_ps(sum, _mm_mul_ps(weight, _mm_loadu_ps(input + x)));
+					_mm_storeu_ps(output + x, sum);
+				}
+			}
+		}
+		finishRow(
+			planes,
+			sameSize ? source.getRow(static_cast<UINT32>(y)) : NULL,
+			outputWidth,
+			target.getRow(static_cast<UINT32>(y)));
+	}
+}
+
+std::unique_ptr<BitmapFile> NeighborhoodOperation::apply(const BitmapFile& source)
+{
+	MemoryAccounting::Scope memoryScope(MEMORY_STAGE_OPERATIONS);
+	if (source.getWidth() <= 0 || source.getHeight() <= 0) {
+		return std::unique_ptr<BitmapFile>();
+	}
+	FilterAxis horizontal;
+	FilterAxis vertical;
+	prepare(source, horizontal, vertical);
+	if (horizontal.OutputSize <= 0 || vertical.OutputSize <= 0) {
+		return std::unique_ptr<BitmapFile>();
+	}
+	std::unique_ptr<BitmapFile> target(new BitmapFile(horizontal.OutputSize, vertical.OutputSize));
+	UINT32 threadCount = ThreadCount;
+	if (threadCount == 0) {
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	}
+	// Bands as tall as the cache budget allows for the filtered rows, but
+	// short enough that every thread gets several
+	INT32 outputHeight = vertical.OutputSize;
+	size_t rowBytes = static_cast<size_t>(roundUpToVector(horizontal.OutputSize)) * 3 * sizeof(float);
+	DOUBLE inputRowsPerOutput = std::max(
+		1.0,
+		static_cast<DOUBLE>(vertical.InputSize) / vertical.OutputSize);
+	DOUBLE fittingRows = static_cast<DOUBLE>(BAND_BYTES / rowBytes) - vertical.Taps;
+	INT32 bandRows = static_cast<INT32>(fittingRows / inputRowsPerOutput);
+	INT32 sharedRows = static_cast<INT32>((outputHeight + threadCount * 4 - 1) / (threadCount * 4));
+	bandRows = std::min(bandRows, sharedRows);
+	if (bandRows < MIN_BAND_ROWS) {
+		bandRows = MIN_BAND_ROWS;
+	}
+	if (threadCount == 1 || bandRows >= outputHeight) {
+		for (INT32 y = 0; y < outputHeight; y += bandRows) {
+			filterBand(source, *target, horizontal, vertical, y, std::min(y + bandRows, outputHeight));
+		}
+		return target;
+	}
+	WorkStealingPool pool(threadCount);
+	BitmapFile& targetFile = *target;
+	for (INT32 y = 0; y < outputHeight; y += bandRows) {
+		INT32 endRow = std::min(y + bandRows, outputHeight);
+		pool.submit([this, &source, &targetFile, &horizontal, &vertical, y, endRow]() {
+			filterBand(source, targetFile, horizontal, vertical, y, endRow);
+		});
+	}
+	pool.waitIdle();
+	return target;
+}
+
+std::unique_ptr<BitmapFile> NeighborhoodOperation::applyReference(const BitmapFile& source)
+{
+	if (source.getWidth() <= 0 || source.getHeight() <= 0) {
+		return std::unique_ptr<BitmapFile>();
+	}
+	FilterAxis horizontal;
+	FilterAxis vertical;
+	prepare(source, horizontal, vertical);
+	if (horizontal.OutputSize <= 0 || vertical.OutputSize <= 0) {
+		return std::unique_ptr<BitmapFile>();
+	}
+	std::unique_ptr<BitmapFile> target(new BitmapFile(horizontal.OutputSize, vertical.OutputSize));
+	BOOL sameSize = horizontal.InputSize == horizontal.OutputSize &&
+		vertical.InputSize == vertical.OutputSize;
+	std::vector<float> outputPlanes[3];
+	for (UINT8 c = 0; c < 3; c++) {
+		outputPlanes[c].assign(horizontal.OutputSize, 0.0f);
+	}
+	const float* planes[3] = { outputPlanes[0].data(), outputPlanes[1].data(), outputPlanes[2].data() };
+	for (INT32 y = 0; y < vertical.OutputSize; y++) {
+		const float* rowWeights = &vertical.Weights[static_cast<size_t>(y) * vertical.TapStride];
+		for (INT32 x = 0; x < horizontal.OutputSize; x++) {
+			const float* columnWeights = &horizontal.Weights[static_cast<size_t>(x) * horizontal.TapStride];
+			DOUBLE sums[3] = { 0.0, 0.0, 0.0 };
+			for (INT32 j = 0; j < vertical.Taps; j++) {
+				const BitmapFile::Pixel* row = source.getRow(static_cast<UINT32>(vertical.Starts[y] + j));
+				for (INT32 k = 0; k < horizontal.Taps; k++) {
+					DOUBLE weight = static_cast<DOUBLE>(rowWeights[j]) * columnWeights[k];
+					const BitmapFile::Pixel& pixel = row[horizontal.Starts[x] + k];
+					sums[0] += weight * pixel.Blue;
+					sums[1] += weight * pixel.Green;
+					sums[2] += weight * pixel.Red;
+				}
+			}
+			for (UINT8 c = 0; c < 3; c++) {
+				outputPlanes[c][x] = static_cast<float>(sums[c]);
+			}
+		}
+		finishRow(
+			planes,
+			sameSize ? source.getRow(static_cast<UINT32>(y)) : NULL,
+			horizontal.OutputSize,
+			target->getRow(static_cast<UINT32>(y)));
+	}
+	return target;
+}
+
+BOOL NeighborhoodOperation::MatchesReference(const BitmapFile& source)
+{
+	std::unique_ptr<BitmapFile> filtered = apply(source);
+	std::unique_ptr<BitmapFile> expected = applyReference(source);
+	if (!filtered || !expected ||
+		filtered->getWidth() != expected->getWidth() ||
+		filtered->getHeight() != expected->getHeight()) {
+		return FALSE;
+	}
+	// The passes round to single precision between them and sum in another
+	// order, which moves samples near a rounding boundary by one
+	for (INT32 y = 0; y < expected->getHeight(); y++) {
+		const BitmapFile::Pixel* filteredRow = filtered->getRow(static_cast<UINT32>(y));
+		const BitmapFile::Pixel* expectedRow = expected->getRow(static_cast<UINT32>(y));
+		for (INT32 x = 0; x < expected->getWidth(); x++) {
+			if (std::abs(filteredRow[x].Blue - expectedRow[x].Blue) > 1 ||
+				std::abs(filteredRow[x].Green - expectedRow[x].Green) > 1 ||
+				std::abs(filteredRow[x].Red - expectedRow[x].Red) > 1) {
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+NeighborhoodOperation::~NeighborhoodOperation()
+{
+}
+
+// Gaussian blur
+
+std::vector<float> GaussianBlur::Kernel(DOUBLE sigma)
+{
+	if (!(sigma > 0.0)) {
+		return std::vector<float>(1, 1.0f);
+	}
+	INT32 radius = std::max(1, static_cast<INT32>(std::ceil(3.0 * sigma)));
+	std::vector<DOUBLE> values(2 * radius + 1);
+	DOUBLE total = 0.0;
+	for (INT32 i = -radius; i <= radius; i++) {
+		values[i + radius] = std::exp(-(i * i) / (2.0 * sigma * sigma));
+		total += values[i + radius];
+	}
+	std::vector<float> kernel(values.size());
+	for (size_t i = 0; i < values.size(); i++) {
+		kernel[i] = static_cast<float>(values[i] / total);
+	}
+	return kernel;
+}
+
+GaussianBlur::GaussianBlur(DOUBLE sigma, UINT32 threadCount)
+	: NeighborhoodOperation(threadCount),
+	  Sigma(sigma)
+{
+}
+
+void GaussianBlur::prepare(const BitmapFile& source, FilterAxis& horizontal, FilterAxis& vertical)
+{
+	std::vector<float> kernel = Kernel(Sigma);
+	horizontal = ConvolutionAxis(source.getWidth(), kernel);
+	vertical = ConvolutionAxis(source.getHeight(), kernel);
+}
+
+// Unsharp mask
+
+UnsharpMask::UnsharpMask(DOUBLE sigma, DOUBLE amount, INT32 threshold, UINT32 threadCount)
+	: NeighborhoodOperation(threadCount),
+	  Sigma(sigma),
+	  Amount(amount),
+	  Threshold(threshold)
+{
+}
+
+void UnsharpMask::prepare(const BitmapFile& source, FilterAxis& horizontal, FilterAxis& vertical)
+{
+	std::vector<float> kernel = GaussianBlur::Kernel(Sigma);
+	horizontal = ConvolutionAxis(source.getWidth(), kernel);
+	vertical = ConvolutionAxis(source.getHeight(), kernel);
+}
+
+void UnsharpMask::finishRow(
+	const float* const filtered[3],
+	const BitmapFile::Pixel* sourceRow,
+	INT32 width,
+	BitmapFile::Pixel* targetRow)
+{
+	float amount = static_cast<float>(Amount);
+	float threshold = static_cast<float>(Threshold);
+	for (INT32 x = 0; x < width; x++) {
+		BYTE original[3] = { sourceRow[x].Blue, sourceRow[x].Green, sourceRow[x].Red };
+		BYTE sharpened[3];
+		for (UINT8 c = 0; c < 3; c++) {
+			float difference = original[c] - filtered[c][x];
+			sharpened[c] = std::abs(difference) < threshold ?
+				original[c] :
+				toByte(original[c] + amount * difference);
+		}
+		targetRow[x] = { sharpened[0], sharpened[1], sharpened[2] };
+	}
+}
+
+// Downscale
+
+Downscale::Downscale(INT32 width, INT32 height, UINT32 threadCount)
+	: NeighborhoodOperation(threadCount),
+	  Width(width),
+	  Height(height)
+{
+}
+
+void Downscale::prepare(const BitmapFile& source, FilterAxis& horizontal, FilterAxis& vertical)
+{
+	if (Width <= 0 || Height <= 0) {
+		return;
+	}
+	horizontal = ResampleAxis(source.getWidth(), Width);
+	vertical = ResampleAxis(source.getHeight(), Height);
+}
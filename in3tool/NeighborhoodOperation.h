@@ -0,0 +1,121 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include "BitmapFile.h"
+#include "BitmapUtility.h"
+
+// Base class of operations whose output pixels are weighted sums of
+// neighboring input pixels, filtered separably along rows then columns
+// Each axis is described by the input samples every output sample starts
+// at and their weights, which covers both convolution and resampling. The
+// output is produced in bands of rows sized to keep the filtered rows of a
+// band in cache; a band reads the input rows it covers plus the halo rows
+// its vertical filter reaches. Bands run in parallel, and both passes
+// compute four samples at a time with SSE.
+class NeighborhoodOperation : public BitmapUtility
+{
+public:
+	// Bytes of row-filtered samples a band aims to keep in cache
+	static const size_t BAND_BYTES = 256 * 1024;
+	// Fewest output rows in a band
+	static const INT32 MIN_BAND_ROWS = 4;
+protected:
+	// Filter along one axis
+	// Output sample i is the sum of Taps input samples from Starts[i], each
+	// times its weight. Weights of taps past the edges are folded onto the
+	// edge samples, so every tap lies inside the input. Each output has
+	// TapStride weights, Taps rounded up to whole SSE vectors with zeroes.
+	struct FilterAxis {
+		INT32 InputSize = 0;
+		INT32 OutputSize = 0;
+		INT32 Taps = 0;
+		INT32 TapStride = 0;
+		std::vector<INT32> Starts;
+		std::vector<float> Weights;
+	};
+	// Axis convolving with a centered kernel of odd size
+	static FilterAxis ConvolutionAxis(INT32 size, const std::vector<float>& kernel);
+	// Axis resampling to another size with a Lanczos-3 filter, widened by
+	// the scale when downscaling so that every input sample contributes
+	static FilterAxis ResampleAxis(INT32 inputSize, INT32 outputSize);
+	// Set the filters of both axes for an input bitmap
+	virtual void prepare(const BitmapFile& source, FilterAxis& horizontal, FilterAxis& vertical) = 0;
+	// Write one output row from its filtered blue, green and red samples
+	// The input row at the same position is given when the output has the
+	// dimensions of the input, and is NULL otherwise. The default rounds
+	// and clamps the samples.
+	virtual void finishRow(
+		const float* const filtered[3],
+		const BitmapFile::Pixel* sourceRow,
+		INT32 width,
+		BitmapFile::Pixel* targetRow);
+	// Threads running bands, or zero for one per hardware thread
+	UINT32 ThreadCount;
+	NeighborhoodOperation(UINT32 threadCount);
+private:
+	// Size an axis for a number of taps, limited to the input size
+	static void InitAxis(FilterAxis& axis, INT32 inputSize, INT32 outputSize, INT32 taps);
+	// Set the weights of an output sample whose taps would start at an input
+	// sample, folding the taps past the edges onto the edge samples
+	static void SetTaps(FilterAxis& axis, INT32 output, INT32 idealStart, const std::vector<float>& weights);
+	// Filter the output rows of one band
+	void filterBand(
+		const BitmapFile& source,
+		BitmapFile& target,
+		const FilterAxis& horizontal,
+		const FilterAxis& vertical,
+		INT32 firstRow,
+		INT32 endRow);
+public:
+	// Filter a bitmap into a new one
+	std::unique_ptr<BitmapFile> apply(const BitmapFile& source);
+	// Filter a bitmap one output pixel at a time, summing every tap of both
+	// axes in double precision, with no bands, vectors or threads
+	std::unique_ptr<BitmapFile> applyReference(const BitmapFile& source);
+	// Check apply against applyReference on a bitmap, allowing each channel
+	// to differ by one
+	BOOL MatchesReference(const BitmapFile& source);
+	virtual ~NeighborhoodOperation();
+};
+
+// Gaussian blur with a standard deviation in pixels
+class GaussianBlur : public NeighborhoodOperation {
+private:
+	DOUBLE Sigma;
+protected:
+	virtual void prepare(const BitmapFile& source, FilterAxis& horizontal, FilterAxis& vertical);
+public:
+	// Kernel of a Gaussian, three standard deviations to each side
+	static std::vector<float> Kernel(DOUBLE sigma);
+	GaussianBlur(DOUBLE sigma, UINT32 threadCount = 0);
+};
+
+// Sharpen by adding back the difference from a Gaussian blur
+// Differences smaller than the threshold are left alone, so that flat
+// areas do not gain noise.
+class UnsharpMask : public NeighborhoodOperation {
+private:
+	DOUBLE Sigma;
+	DOUBLE Amount;
+	INT32 Threshold;
+protected:
+	virtual void prepare(const BitmapFile& source, FilterAxis& horizontal, FilterAxis& vertical);
+	virtual void finishRow(
+		const float* const filtered[3],
+		const BitmapFile::Pixel* sourceRow,
+		INT32 width,
+		BitmapFile::Pixel* targetRow);
+public:
+	UnsharpMask(DOUBLE sigma, DOUBLE amount, INT32 threshold = 0, UINT32 threadCount = 0);
+};
+
+// Resize to other dimensions with Lanczos-3 resampling
+class Downscale : public NeighborhoodOperation {
+private:
+	INT32 Width;
+	INT32 Height;
+protected:
+	virtual void prepare(const BitmapFile& source, FilterAxis& horizontal, FilterAxis& vertical);
+public:
+	Downscale(INT32 width, INT32 height, UINT32 threadCount = 0);
+};
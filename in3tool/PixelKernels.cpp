@@ -0,0 +1,120 @@
+#include "stdafx.h"
+#include <algorithm>
+#include "CpuDispatch.h"
+#include "PixelKernels.h"
+
+// Scalar kernels, the reference for every level
+
+void PixelKernels::PixelsToYUV(
+	const BitmapFile::Pixel* pixels,
+	INT8* y,
+	INT8* u,
+	INT8* v,
+	size_t count)
+{
+	// Same operations in the same order as BitmapUtility::NormalizedRGBtoYUV
+	for (size_t i = 0; i < count; i++) {
+		DOUBLE R = pixels[i].Red / (DOUBLE)255;
+		DOUBLE G = pixels[i].Green / (DOUBLE)255;
+		DOUBLE B = pixels[i].Blue / (DOUBLE)255;
+		DOUBLE Y = 0 + (0.299*R) + (0.587*G) + (0.114*B);
+		DOUBLE U = 0.5 - (0.168736*R) - (0.331264*G) + (0.5*B);
+		DOUBLE V = 0.5 + (0.5*R) - (0.418688*G) - (0.081312*B);
+		y[i] = static_cast<INT8>((Y * 255) - 128);
+		u[i] = static_cast<INT8>((U * 255) - 128);
+		v[i] = static_cast<INT8>((V * 255) - 128);
+	}
+}
+
+void PixelKernels::YUVToPixels(
+	const INT8* y,
+	const INT8* u,
+	const INT8* v,
+	BitmapFile::Pixel* pixels,
+	size_t count)
+{
+	// Same operations in the same order as BitmapUtility::YUVtoNormalizedRGB
+	for (size_t i = 0; i < count; i++) {
+		DOUBLE Y = static_cast<DOUBLE>(y[i] + 128) / 255.0;
+		DOUBLE U = static_cast<DOUBLE>(u[i] + 128) / 255.0;
+		DOUBLE V = static_cast<DOUBLE>(v[i] + 128) / 255.0;
+		DOUBLE R = Y + 1.402 * (V - 0.5);
+		DOUBLE G = Y - 0.344136 * (U - 0.5) - 0.714136 * (V - 0.5);
+		DOUBLE B = Y + 1.772 * (U - 0.5);
+		pixels[i].Red = static_cast<BYTE>(std::max(0.0, std::min(R, 1.0)) * 255);
+		pixels[i].Green = static_cast<BYTE>(std::max(0.0, std::min(G, 1.0)) * 255);
+		pixels[i].Blue = static_cast<BYTE>(std::max(0.0, std::min(B, 1.0)) * 255);
+	}
+}
+
+void PixelKernels::PixelsToYCoCgR(
+	const BitmapFile::Pixel* pixels,
+	INT8* y,
+	INT8* co,
+	INT8* cg,
+	size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		INT8 R = static_cast<INT8>(pixels[i].Red);
+		INT8 G = static_cast<INT8>(pixels[i].Green);
+		INT8 B = static_cast<INT8>(pixels[i].Blue);
+		INT8 Co = static_cast<INT8>(R - B);
+		INT8 t = static_cast<INT8>(B + (Co >> 1));
+		INT8 Cg = static_cast<INT8>(G - t);
+		y[i] = static_cast<INT8>(t + (Cg >> 1) - 128);
+		co[i] = Co;
+		cg[i] = Cg;
+	}
+}
+
+void PixelKernels::YCoCgRToPixels(
+	const INT8* y,
+	const INT8* co,
+	const INT8* cg,
+	BitmapFile::Pixel* pixels,
+	size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		INT8 Y = static_cast<INT8>(y[i] + 128);
+		INT8 t = static_cast<INT8>(Y - (cg[i] >> 1));
+		INT8 G = static_cast<INT8>(cg[i] + t);
+		INT8 B = static_cast<INT8>(t - (co[i] >> 1));
+		INT8 R = static_cast<INT8>(B + co[i]);
+		pixels[i].Red = static_cast<BYTE>(R);
+		pixels[i].Green = static_cast<BYTE>(G);
+		pixels[i].Blue = static_cast<BYTE>(B);
+	}
+}
+
+void PixelKernels::BrightenPixels(
+	BitmapFile::Pixel* pixels,
+	size_t count,
+	UINT32 factor)
+{
+	// With hue and saturation kept HSV to RGB is linear in V, so every
+	// channel scales by the same ratio of new to old value: the factor, or
+	// the ratio that takes the largest channel to full value, rounded up so
+	// that channel lands on 255 exactly
+	for (size_t i = 0; i < count; i++) {
+		UINT32 R = pixels[i].Red;
+		UINT32 G = pixels[i].Green;
+		UINT32 B = pixels[i].Blue;
+		UINT32 max = std::max(std::max(R, G), B);
+		UINT32 scale = factor;
+		if (max != 0) {
+			scale = std::min(factor, (CpuDispatch::BRIGHTEN_MAX_FACTOR + max - 1) / max);
+		}
+		// A channel is at most max, so the products stay below 2^32
+		pixels[i].Red = static_cast<BYTE>((R * scale) >> 16);
+		pixels[i].Green = static_cast<BYTE>((G * scale) >> 16);
+		pixels[i].Blue = static_cast<BYTE>((B * scale) >> 16);
+	}
+}
+
+const CpuDispatch::Kernels CpuDispatch::SCALAR_KERNELS = {
+	PixelKernels::PixelsToYUV,
+	PixelKernels::YUVToPixels,
+	PixelKernels::PixelsToYCoCgR,
+	PixelKernels::YCoCgRToPixels,
+	PixelKernels::BrightenPixels
+};
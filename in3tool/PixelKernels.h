@@ -0,0 +1,101 @@
+#pragma once
+#include <tmmintrin.h>
+#include "BitmapFile.h"
+#include "commontypes.h"
+
+// Building blocks of the pixel kernels that CpuDispatch binds
+// The scalar kernels are the reference that every level reproduces, and
+// the vector kernels finish the pixels after their last whole block with
+// them. The vector kernel files share the shuffles below, which only need
+// SSSE3, and every vector level has it.
+class PixelKernels
+{
+public:
+	// Pixels per 128-bit vector of 8-bit samples
+	static const size_t BLOCK = 16;
+	// Scalar kernels
+	static void PixelsToYUV(
+		const BitmapFile::Pixel* pixels,
+		INT8* y,
+		INT8* u,
+		INT8* v,
+		size_t count);
+	static void YUVToPixels(
+		const INT8* y,
+		const INT8* u,
+		const INT8* v,
+		BitmapFile::Pixel* pixels,
+		size_t count);
+	static void PixelsToYCoCgR(
+		const BitmapFile::Pixel* pixels,
+		INT8* y,
+		INT8* co,
+		INT8* cg,
+		size_t count);
+	static void YCoCgRToPixels(
+		const INT8* y,
+		const INT8* co,
+		const INT8* cg,
+		BitmapFile::Pixel* pixels,
+		size_t count);
+	static void BrightenPixels(
+		BitmapFile::Pixel* pixels,
+		size_t count,
+		UINT32 factor);
+};
+
+// Split PixelKernels::BLOCK pixels into vectors of their blue, green and red bytes
+// Static, so each kernel file compiles a private copy for its own level.
+static inline void deinterleave(
+	const BitmapFile::Pixel* pixels,
+	__m128i& blue,
+	__m128i& green,
+	__m128i& red)
+{
+	const __m128i* source = reinterpret_cast<const __m128i*>(pixels);
+	__m128i a = _mm_loadu_si128(source);
+	__m128i b = _mm_loadu_si128(source + 1);
+	__m128i c = _mm_loadu_si128(source + 2);
+	// Each channel gathers every third byte from the three vectors
+	blue = _mm_or_si128(
+		_mm_or_si128(
+			_mm_shuffle_epi8(a, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+			_mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+	green = _mm_or_si128(
+		_mm_or_si128(
+			_mm_shuffle_epi8(a, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+			_mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+	red = _mm_or_si128(
+		_mm_or_si128(
+			_mm_shuffle_epi8(a, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+			_mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+// Join vectors of blue, green and red bytes into PixelKernels::BLOCK pixels
+static inline void interleave(
+	__m128i blue,
+	__m128i green,
+	__m128i red,
+	BitmapFile::Pixel* pixels)
+{
+	__m128i* target = reinterpret_cast<__m128i*>(pixels);
+	// Each output vector takes its bytes from the three channels in turn
+	_mm_storeu_si128(target, _mm_or_si128(
+		_mm_or_si128(
+			_mm_shuffle_epi8(blue, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+			_mm_shuffle_epi8(green, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))),
+		_mm_shuffle_epi8(red, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1))));
+	_mm_storeu_si128(target + 1, _mm_or_si128(
+		_mm_or_si128(
+			_mm_shuffle_epi8(blue, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+			_mm_shuffle_epi8(green, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))),
+		_mm_shuffle_epi8(red, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1))));
+	_mm_storeu_si128(target + 2, _mm_or_si128(
+		_mm_or_si128(
+			_mm_shuffle_epi8(blue, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+			_mm_shuffle_epi8(green, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))),
+		_mm_shuffle_epi8(red, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15))));
+}
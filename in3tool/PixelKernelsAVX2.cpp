@@ -0,0 +1,242 @@
+#include "stdafx.h"
+#include <immintrin.h>
+#include "CpuDispatch.h"
+#include "PixelKernels.h"
+
+// AVX2 kernels, four doubles or thirty-two bytes per operation
+// Built with /arch:AVX2 so the shared SSE shuffles are VEX encoded too,
+// and with /fp:strict so multiplies and adds are never fused, which would
+// round differently from the scalar reference
+
+namespace {
+	// Arithmetic shift right by one of each signed byte (AVX2 has no 8-bit shift)
+	inline __m256i shiftRightSigned8(__m256i x)
+	{
+		__m256i high = _mm256_srai_epi16(x, 1);
+		__m256i low = _mm256_srai_epi16(_mm256_slli_epi16(x, 8), 9);
+		__m256i highMask = _mm256_set1_epi16(static_cast<SHORT>(0xFF00));
+		return _mm256_or_si256(
+			_mm256_and_si256(high, highMask),
+			_mm256_andnot_si256(highMask, low));
+	}
+
+	inline __m256i combine(__m128i low, __m128i high)
+	{
+		return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+	}
+
+	// YUV samples of four pixels, truncated to 32-bit integers
+	inline void yuvOfFour(__m128i blue, __m128i green, __m128i red, __m128i& y, __m128i& u, __m128i& v)
+	{
+		const __m256d scale = _mm256_set1_pd(255.0);
+		const __m256d offset = _mm256_set1_pd(128.0);
+		const __m256d half = _mm256_set1_pd(0.5);
+		__m256d R = _mm256_div_pd(_mm256_cvtepi32_pd(red), scale);
+		__m256d G = _mm256_div_pd(_mm256_cvtepi32_pd(green), scale);
+		__m256d B = _mm256_div_pd(_mm256_cvtepi32_pd(blue), scale);
+		__m256d Y = _mm256_add_pd(
+			_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(0.299), R), _mm256_mul_pd(_mm256_set1_pd(0.587), G)),
+			_mm256_mul_pd(_mm256_set1_pd(0.114), B));
+		__m256d U = _mm256_add_pd(
+			_mm256_sub_pd(
+				_mm256_sub_pd(half, _mm256_mul_pd(_mm256_set1_pd(0.168736), R)),
+				_mm256_mul_pd(_mm256_set1_pd(0.331264), G)),
+			_mm256_mul_pd(half, B));
+		__m256d V = _mm256_sub_pd(
+			_mm256_sub_pd(
+				_mm256_add_pd(half, _mm256_mul_pd(half, R)),
+				_mm256_mul_pd(_mm256_set1_pd(0.418688), G)),
+			_mm256_mul_pd(_mm256_set1_pd(0.081312), B));
+		y = _mm256_cvttpd_epi32(_mm256_sub_pd(_mm256_mul_pd(Y, scale), offset));
+		u = _mm256_cvttpd_epi32(_mm256_sub_pd(_mm256_mul_pd(U, scale), offset));
+		v = _mm256_cvttpd_epi32(_mm256_sub_pd(_mm256_mul_pd(V, scale), offset));
+	}
+
+	void pixelsToYUV(const BitmapFile::Pixel* pixels, INT8* y, INT8* u, INT8* v, size_t count)
+	{
+		size_t i = 0;
+		for (; i + PixelKernels::BLOCK <= count; i += PixelKernels::BLOCK) {
+			__m128i blue, green, red;
+			deinterleave(pixels + i, blue, green, red);
+			__m128i Y[4], U[4], V[4];
+			for (size_t k = 0; k < 4; k++) {
+				yuvOfFour(_mm_cvtepu8_epi32(blue), _mm_cvtepu8_epi32(green), _mm_cvtepu8_epi32(red), Y[k], U[k], V[k]);
+				blue = _mm_srli_si128(blue, 4);
+				green = _mm_srli_si128(green, 4);
+				red = _mm_srli_si128(red, 4);
+			}
+			// Every sample is within the 8-bit range, so saturation never applies
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(y + i), _mm_packs_epi16(
+				_mm_packs_epi32(Y[0], Y[1]), _mm_packs_epi32(Y[2], Y[3])));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(u + i), _mm_packs_epi16(
+				_mm_packs_epi32(U[0], U[1]), _mm_packs_epi32(U[2], U[3])));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(v + i), _mm_packs_epi16(
+				_mm_packs_epi32(V[0], V[1]), _mm_packs_epi32(V[2], V[3])));
+		}
+		_mm256_zeroupper();
+		PixelKernels::PixelsToYUV(pixels + i, y + i, u + i, v + i, count - i);
+	}
+
+	// Channels of four pixels given as 32-bit samples offset to [0,255]
+	inline void rgbOfFour(__m128i y, __m128i u, __m128i v, __m128i& red, __m128i& green, __m128i& blue)
+	{
+		const __m256d scale = _mm256_set1_pd(255.0);
+		const __m256d half = _mm256_set1_pd(0.5);
+		const __m256d zero = _mm256_setzero_pd();
+		const __m256d one = _mm256_set1_pd(1.0);
+		__m256d Y = _mm256_div_pd(_mm256_cvtepi32_pd(y), scale);
+		__m256d U = _mm256_sub_pd(_mm256_div_pd(_mm256_cvtepi32_pd(u), scale), half);
+		__m256d V = _mm256_sub_pd(_mm256_div_pd(_mm256_cvtepi32_pd(v), scale), half);
+		__m256d R = _mm256_add_pd(Y, _mm256_mul_pd(_mm256_set1_pd(1.402), V));
+		__m256d G = _mm256_sub_pd(
+			_mm256_sub_pd(Y, _mm256_mul_pd(_mm256_set1_pd(0.344136), U)),
+			_mm256_mul_pd(_mm256_set1_pd(0.714136), V));
+		__m256d B = _mm256_add_pd(Y, _mm256_mul_pd(_mm256_set1_pd(1.772), U));
+		red = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_max_pd(_mm256_min_pd(R, one), zero), scale));
+		green = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_max_pd(_mm256_min_pd(G, one), zero), scale));
+		blue = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_max_pd(_mm256_min_pd(B, one), zero), scale));
+	}
+
+	void yuvToPixels(const INT8* y, const INT8* u, const INT8* v, BitmapFile::Pixel* pixels, size_t count)
+	{
+		const __m128i offset = _mm_set1_epi32(128);
+		size_t i = 0;
+		for (; i + PixelKernels::BLOCK <= count; i += PixelKernels::BLOCK) {
+			__m128i Y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i));
+			__m128i U = _mm_loadu_si128(reinterpret_cast<const __m128i*>(u + i));
+			__m128i V = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i));
+			__m128i R[4], G[4], B[4];
+			for (size_t k = 0; k < 4; k++) {
+				rgbOfFour(
+					_mm_add_epi32(_mm_cvtepi8_epi32(Y), offset),
+					_mm_add_epi32(_mm_cvtepi8_epi32(U), offset),
+					_mm_add_epi32(_mm_cvtepi8_epi32(V), offset),
+					R[k], G[k], B[k]);
+				Y = _mm_srli_si128(Y, 4);
+				U = _mm_srli_si128(U, 4);
+				V = _mm_srli_si128(V, 4);
+			}
+			interleave(
+				_mm_packus_epi16(_mm_packs_epi32(B[0], B[1]), _mm_packs_epi32(B[2], B[3])),
+				_mm_packus_epi16(_mm_packs_epi32(G[0], G[1]), _mm_packs_epi32(G[2], G[3])),
+				_mm_packus_epi16(_mm_packs_epi32(R[0], R[1]), _mm_packs_epi32(R[2], R[3])),
+				pixels + i);
+		}
+		_mm256_zeroupper();
+		PixelKernels::YUVToPixels(y + i, u + i, v + i, pixels + i, count - i);
+	}
+
+	void pixelsToYCoCgR(const BitmapFile::Pixel* pixels, INT8* y, INT8* co, INT8* cg, size_t count)
+	{
+		static const size_t BLOCK = 2 * PixelKernels::BLOCK;
+		const __m256i offset = _mm256_set1_epi8(-128);
+		size_t i = 0;
+		for (; i + BLOCK <= count; i += BLOCK) {
+			__m128i B0, G0, R0, B1, G1, R1;
+			deinterleave(pixels + i, B0, G0, R0);
+			deinterleave(pixels + i + PixelKernels::BLOCK, B1, G1, R1);
+			__m256i B = combine(B0, B1);
+			__m256i G = combine(G0, G1);
+			__m256i R = combine(R0, R1);
+			// Co = R - B, t = B + (Co >> 1), Cg = G - t, Y = t + (Cg >> 1)
+			__m256i Co = _mm256_sub_epi8(R, B);
+			__m256i t = _mm256_add_epi8(B, shiftRightSigned8(Co));
+			__m256i Cg = _mm256_sub_epi8(G, t);
+			__m256i Y = _mm256_add_epi8(t, shiftRightSigned8(Cg));
+			// Center luma around zero like the YUV planes
+			Y = _mm256_add_epi8(Y, offset);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(y + i), Y);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(co + i), Co);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(cg + i), Cg);
+		}
+		_mm256_zeroupper();
+		PixelKernels::PixelsToYCoCgR(pixels + i, y + i, co + i, cg + i, count - i);
+	}
+
+	void yCoCgRToPixels(const INT8* y, const INT8* co, const INT8* cg, BitmapFile::Pixel* pixels, size_t count)
+	{
+		static const size_t BLOCK = 2 * PixelKernels::BLOCK;
+		const __m256i offset = _mm256_set1_epi8(-128);
+		size_t i = 0;
+		for (; i + BLOCK <= count; i += BLOCK) {
+			__m256i Y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y + i));
+			__m256i Co = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(co + i));
+			__m256i Cg = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cg + i));
+			// Undo the lifting steps in reverse order
+			Y = _mm256_sub_epi8(Y, offset);
+			__m256i t = _mm256_sub_epi8(Y, shiftRightSigned8(Cg));
+			__m256i G = _mm256_add_epi8(Cg, t);
+			__m256i B = _mm256_sub_epi8(t, shiftRightSigned8(Co));
+			__m256i R = _mm256_add_epi8(B, Co);
+			interleave(
+				_mm256_castsi256_si128(B),
+				_mm256_castsi256_si128(G),
+				_mm256_castsi256_si128(R),
+				pixels + i);
+			interleave(
+				_mm256_extracti128_si256(B, 1),
+				_mm256_extracti128_si256(G, 1),
+				_mm256_extracti128_si256(R, 1),
+				pixels + i + PixelKernels::BLOCK);
+		}
+		_mm256_zeroupper();
+		PixelKernels::YCoCgRToPixels(y + i, co + i, cg + i, pixels + i, count - i);
+	}
+
+	// Brighten scale of eight pixels, rounded up from single precision like
+	// the SSE4.2 kernel
+	inline __m256i brightenScaleOfEight(__m128i max, __m256i factor)
+	{
+		const __m256 limit = _mm256_set1_ps(static_cast<float>(CpuDispatch::BRIGHTEN_MAX_FACTOR));
+		__m256 quotient = _mm256_div_ps(limit, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(max)));
+		return _mm256_min_epu32(_mm256_cvttps_epi32(_mm256_ceil_ps(quotient)), factor);
+	}
+
+	// Scale the low eight bytes of a channel
+	inline __m256i brightenOfEight(__m128i channel, __m256i scale)
+	{
+		return _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_cvtepu8_epi32(channel), scale), 16);
+	}
+
+	// Pack sixteen 32-bit channels below 256 back into bytes
+	inline __m128i packOfSixteen(__m256i low, __m256i high)
+	{
+		// The 256-bit pack works within lanes, so put the halves back in order
+		__m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), 0xD8);
+		return _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+	}
+
+	void brightenPixels(BitmapFile::Pixel* pixels, size_t count, UINT32 factor)
+	{
+		const __m256i factors = _mm256_set1_epi32(static_cast<int>(factor));
+		size_t i = 0;
+		for (; i + PixelKernels::BLOCK <= count; i += PixelKernels::BLOCK) {
+			__m128i blue, green, red;
+			deinterleave(pixels + i, blue, green, red);
+			__m128i max = _mm_max_epu8(_mm_max_epu8(blue, green), red);
+			__m256i lowScale = brightenScaleOfEight(max, factors);
+			__m256i highScale = brightenScaleOfEight(_mm_srli_si128(max, 8), factors);
+			interleave(
+				packOfSixteen(
+					brightenOfEight(blue, lowScale),
+					brightenOfEight(_mm_srli_si128(blue, 8), highScale)),
+				packOfSixteen(
+					brightenOfEight(green, lowScale),
+					brightenOfEight(_mm_srli_si128(green, 8), highScale)),
+				packOfSixteen(
+					brightenOfEight(red, lowScale),
+					brightenOfEight(_mm_srli_si128(red, 8), highScale)),
+				pixels + i);
+		}
+		_mm256_zeroupper();
+		PixelKernels::BrightenPixels(pixels + i, count - i, factor);
+	}
+}
+
+const CpuDispatch::Kernels CpuDispatch::AVX2_KERNELS = {
+	pixelsToYUV,
+	yuvToPixels,
+	pixelsToYCoCgR,
+	yCoCgRToPixels,
+	brightenPixels
+};
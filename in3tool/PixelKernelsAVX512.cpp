@@ -0,0 +1,242 @@
+#include "stdafx.h"
+#include <immintrin.h>
+#include "CpuDispatch.h"
+#include "PixelKernels.h"
+
+// AVX-512 kernels, eight doubles or sixty-four bytes per operation
+// Needs AVX-512F and AVX-512BW, and is built with the same /arch:AVX2 and
+// /fp:strict options as the AVX2 kernels
+
+namespace {
+	// Arithmetic shift right by one of each signed byte (AVX-512 has no 8-bit shift)
+	inline __m512i shiftRightSigned8(__m512i x)
+	{
+		__m512i high = _mm512_srai_epi16(x, 1);
+		__m512i low = _mm512_srai_epi16(_mm512_slli_epi16(x, 8), 9);
+		__m512i highMask = _mm512_set1_epi16(static_cast<SHORT>(0xFF00));
+		return _mm512_or_si512(
+			_mm512_and_si512(high, highMask),
+			_mm512_andnot_si512(highMask, low));
+	}
+
+	inline __m256i combine(__m128i low, __m128i high)
+	{
+		return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+	}
+
+	inline __m512i combine(__m256i low, __m256i high)
+	{
+		return _mm512_inserti64x4(_mm512_castsi256_si512(low), high, 1);
+	}
+
+	// YUV samples of eight pixels, truncated to 32-bit integers
+	inline void yuvOfEight(__m256i blue, __m256i green, __m256i red, __m256i& y, __m256i& u, __m256i& v)
+	{
+		const __m512d scale = _mm512_set1_pd(255.0);
+		const __m512d offset = _mm512_set1_pd(128.0);
+		const __m512d half = _mm512_set1_pd(0.5);
+		__m512d R = _mm512_div_pd(_mm512_cvtepi32_pd(red), scale);
+		__m512d G = _mm512_div_pd(_mm512_cvtepi32_pd(green), scale);
+		__m512d B = _mm512_div_pd(_mm512_cvtepi32_pd(blue), scale);
+		__m512d Y = _mm512_add_pd(
+			_mm512_add_pd(_mm512_mul_pd(_mm512_set1_pd(0.299), R), _mm512_mul_pd(_mm512_set1_pd(0.587), G)),
+			_mm512_mul_pd(_mm512_set1_pd(0.114), B));
+		__m512d U = _mm512_add_pd(
+			_mm512_sub_pd(
+				_mm512_sub_pd(half, _mm512_mul_pd(_mm512_set1_pd(0.168736), R)),
+				_mm512_mul_pd(_mm512_set1_pd(0.331264), G)),
+			_mm512_mul_pd(half, B));
+		__m512d V = _mm512_sub_pd(
+			_mm512_sub_pd(
+				_mm512_add_pd(half, _mm512_mul_pd(half, R)),
+				_mm512_mul_pd(_mm512_set1_pd(0.418688), G)),
+			_mm512_mul_pd(_mm512_set1_pd(0.081312), B));
+		y = _mm512_cvttpd_epi32(_mm512_sub_pd(_mm512_mul_pd(Y, scale), offset));
+		u = _mm512_cvttpd_epi32(_mm512_sub_pd(_mm512_mul_pd(U, scale), offset));
+		v = _mm512_cvttpd_epi32(_mm512_sub_pd(_mm512_mul_pd(V, scale), offset));
+	}
+
+	void pixelsToYUV(const BitmapFile::Pixel* pixels, INT8* y, INT8* u, INT8* v, size_t count)
+	{
+		size_t i = 0;
+		for (; i + PixelKernels::BLOCK <= count; i += PixelKernels::BLOCK) {
+			__m128i blue, green, red;
+			deinterleave(pixels + i, blue, green, red);
+			__m512i B = _mm512_cvtepu8_epi32(blue);
+			__m512i G = _mm512_cvtepu8_epi32(green);
+			__m512i R = _mm512_cvtepu8_epi32(red);
+			__m256i Y[2], U[2], V[2];
+			yuvOfEight(
+				_mm512_castsi512_si256(B),
+				_mm512_castsi512_si256(G),
+				_mm512_castsi512_si256(R),
+				Y[0], U[0], V[0]);
+			yuvOfEight(
+				_mm512_extracti64x4_epi64(B, 1),
+				_mm512_extracti64x4_epi64(G, 1),
+				_mm512_extracti64x4_epi64(R, 1),
+				Y[1], U[1], V[1]);
+			// Every sample is within the 8-bit range, so saturation never applies
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(y + i), _mm512_cvtsepi32_epi8(combine(Y[0], Y[1])));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(u + i), _mm512_cvtsepi32_epi8(combine(U[0], U[1])));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(v + i), _mm512_cvtsepi32_epi8(combine(V[0], V[1])));
+		}
+		_mm256_zeroupper();
+		PixelKernels::PixelsToYUV(pixels + i, y + i, u + i, v + i, count - i);
+	}
+
+	// Channels of eight pixels given as 32-bit samples offset to [0,255]
+	inline void rgbOfEight(__m256i y, __m256i u, __m256i v, __m256i& red, __m256i& green, __m256i& blue)
+	{
+		const __m512d scale = _mm512_set1_pd(255.0);
+		const __m512d half = _mm512_set1_pd(0.5);
+		const __m512d zero = _mm512_setzero_pd();
+		const __m512d one = _mm512_set1_pd(1.0);
+		__m512d Y = _mm512_div_pd(_mm512_cvtepi32_pd(y), scale);
+		__m512d U = _mm512_sub_pd(_mm512_div_pd(_mm512_cvtepi32_pd(u), scale), half);
+		__m512d V = _mm512_sub_pd(_mm512_div_pd(_mm512_cvtepi32_pd(v), scale), half);
+		__m512d R = _mm512_add_pd(Y, _mm512_mul_pd(_mm512_set1_pd(1.402), V));
+		__m512d G = _mm512_sub_pd(
+			_mm512_sub_pd(Y, _mm512_mul_pd(_mm512_set1_pd(0.344136), U)),
+			_mm512_mul_pd(_mm512_set1_pd(0.714136), V));
+		__m512d B = _mm512_add_pd(Y, _mm512_mul_pd(_mm512_set1_pd(1.772), U));
+		red = _mm512_cvttpd_epi32(_mm512_mul_pd(_mm512_max_pd(_mm512_min_pd(R, one), zero), scale));
+		green = _mm512_cvttpd_epi32(_mm512_mul_pd(_mm512_max_pd(_mm512_min_pd(G, one), zero), scale));
+		blue = _mm512_cvttpd_epi32(_mm512_mul_pd(_mm512_max_pd(_mm512_min_pd(B, one), zero), scale));
+	}
+
+	void yuvToPixels(const INT8* y, const INT8* u, const INT8* v, BitmapFile::Pixel* pixels, size_t count)
+	{
+		const __m512i offset = _mm512_set1_epi32(128);
+		size_t i = 0;
+		for (; i + PixelKernels::BLOCK <= count; i += PixelKernels::BLOCK) {
+			__m512i Y = _mm512_add_epi32(_mm512_cvtepi8_epi32(
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i))), offset);
+			__m512i U = _mm512_add_epi32(_mm512_cvtepi8_epi32(
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(u + i))), offset);
+			__m512i V = _mm512_add_epi32(_mm512_cvtepi8_epi32(
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i))), offset);
+			__m256i R[2], G[2], B[2];
+			rgbOfEight(
+				_mm512_castsi512_si256(Y),
+				_mm512_castsi512_si256(U),
+				_mm512_castsi512_si256(V),
+				R[0], G[0], B[0]);
+			rgbOfEight(
+				_mm512_extracti64x4_epi64(Y, 1),
+				_mm512_extracti64x4_epi64(U, 1),
+				_mm512_extracti64x4_epi64(V, 1),
+				R[1], G[1], B[1]);
+			interleave(
+				_mm512_cvtusepi32_epi8(combine(B[0], B[1])),
+				_mm512_cvtusepi32_epi8(combine(G[0], G[1])),
+				_mm512_cvtusepi32_epi8(combine(R[0], R[1])),
+				pixels + i);
+		}
+		_mm256_zeroupper();
+		PixelKernels::YUVToPixels(y + i, u + i, v + i, pixels + i, count - i);
+	}
+
+	void pixelsToYCoCgR(const BitmapFile::Pixel* pixels, INT8* y, INT8* co, INT8* cg, size_t count)
+	{
+		static const size_t BLOCK = 4 * PixelKernels::BLOCK;
+		const __m512i offset = _mm512_set1_epi8(-128);
+		size_t i = 0;
+		for (; i + BLOCK <= count; i += BLOCK) {
+			__m128i blue[4], green[4], red[4];
+			for (size_t k = 0; k < 4; k++) {
+				deinterleave(pixels + i + k * PixelKernels::BLOCK, blue[k], green[k], red[k]);
+			}
+			__m512i B = combine(combine(blue[0], blue[1]), combine(blue[2], blue[3]));
+			__m512i G = combine(combine(green[0], green[1]), combine(green[2], green[3]));
+			__m512i R = combine(combine(red[0], red[1]), combine(red[2], red[3]));
+			// Co = R - B, t = B + (Co >> 1), Cg = G - t, Y = t + (Cg >> 1)
+			__m512i Co = _mm512_sub_epi8(R, B);
+			__m512i t = _mm512_add_epi8(B, shiftRightSigned8(Co));
+			__m512i Cg = _mm512_sub_epi8(G, t);
+			__m512i Y = _mm512_add_epi8(t, shiftRightSigned8(Cg));
+			// Center luma around zero like the YUV planes
+			Y = _mm512_add_epi8(Y, offset);
+			_mm512_storeu_si512(y + i, Y);
+			_mm512_storeu_si512(co + i, Co);
+			_mm512_storeu_si512(cg + i, Cg);
+		}
+		_mm256_zeroupper();
+		PixelKernels::PixelsToYCoCgR(pixels + i, y + i, co + i, cg + i, count - i);
+	}
+
+	void yCoCgRToPixels(const INT8* y, const INT8* co, const INT8* cg, BitmapFile::Pixel* pixels, size_t count)
+	{
+		static const size_t BLOCK = 4 * PixelKernels::BLOCK;
+		const __m512i offset = _mm512_set1_epi8(-128);
+		size_t i = 0;
+		for (; i + BLOCK <= count; i += BLOCK) {
+			__m512i Y = _mm512_loadu_si512(y + i);
+			__m512i Co = _mm512_loadu_si512(co + i);
+			__m512i Cg = _mm512_loadu_si512(cg + i);
+			// Undo the lifting steps in reverse order
+			Y = _mm512_sub_epi8(Y, offset);
+			__m512i t = _mm512_sub_epi8(Y, shiftRightSigned8(Cg));
+			__m512i G = _mm512_add_epi8(Cg, t);
+			__m512i B = _mm512_sub_epi8(t, shiftRightSigned8(Co));
+			__m512i R = _mm512_add_epi8(B, Co);
+			__m256i halves[3][2] = {
+				{ _mm512_castsi512_si256(B), _mm512_extracti64x4_epi64(B, 1) },
+				{ _mm512_castsi512_si256(G), _mm512_extracti64x4_epi64(G, 1) },
+				{ _mm512_castsi512_si256(R), _mm512_extracti64x4_epi64(R, 1) }
+			};
+			for (size_t k = 0; k < 2; k++) {
+				interleave(
+					_mm256_castsi256_si128(halves[0][k]),
+					_mm256_castsi256_si128(halves[1][k]),
+					_mm256_castsi256_si128(halves[2][k]),
+					pixels + i + 2 * k * PixelKernels::BLOCK);
+				interleave(
+					_mm256_extracti128_si256(halves[0][k], 1),
+					_mm256_extracti128_si256(halves[1][k], 1),
+					_mm256_extracti128_si256(halves[2][k], 1),
+					pixels + i + (2 * k + 1) * PixelKernels::BLOCK);
+			}
+		}
+		_mm256_zeroupper();
+		PixelKernels::YCoCgRToPixels(y + i, co + i, cg + i, pixels + i, count - i);
+	}
+
+	// Scale sixteen channels, returned as bytes
+	inline __m128i brightenOfSixteen(__m128i channel, __m512i scale)
+	{
+		return _mm512_cvtusepi32_epi8(_mm512_srli_epi32(_mm512_mullo_epi32(_mm512_cvtepu8_epi32(channel), scale), 16));
+	}
+
+	void brightenPixels(BitmapFile::Pixel* pixels, size_t count, UINT32 factor)
+	{
+		const __m512i factors = _mm512_set1_epi32(static_cast<int>(factor));
+		const __m512 limit = _mm512_set1_ps(static_cast<float>(CpuDispatch::BRIGHTEN_MAX_FACTOR));
+		size_t i = 0;
+		for (; i + PixelKernels::BLOCK <= count; i += PixelKernels::BLOCK) {
+			__m128i blue, green, red;
+			deinterleave(pixels + i, blue, green, red);
+			__m128i max = _mm_max_epu8(_mm_max_epu8(blue, green), red);
+			// Rounded up from single precision like the SSE4.2 kernel
+			__m512 quotient = _mm512_div_ps(limit, _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(max)));
+			__m512i scale = _mm512_min_epu32(
+				_mm512_cvttps_epi32(_mm512_roundscale_ps(quotient, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC)),
+				factors);
+			interleave(
+				brightenOfSixteen(blue, scale),
+				brightenOfSixteen(green, scale),
+				brightenOfSixteen(red, scale),
+				pixels + i);
+		}
+		_mm256_zeroupper();
+		PixelKernels::BrightenPixels(pixels + i, count - i, factor);
+	}
+}
+
+const CpuDispatch::Kernels CpuDispatch::AVX512_KERNELS = {
+	pixelsToYUV,
+	yuvToPixels,
+	pixelsToYCoCgR,
+	yCoCgRToPixels,
+	brightenPixels
+};
@@ -0,0 +1,235 @@
+#include "stdafx.h"
+#include <smmintrin.h>
+#include "CpuDispatch.h"
+#include "PixelKernels.h"
+
+// SSE4.2 kernels, two doubles or sixteen bytes per operation
+
+namespace {
+	// Arithmetic shift right by one of each signed byte (SSE has no 8-bit shift)
+	inline __m128i shiftRightSigned8(__m128i x)
+	{
+		__m128i high = _mm_srai_epi16(x, 1);
+		__m128i low = _mm_srai_epi16(_mm_slli_epi16(x, 8), 9);
+		__m128i highMask = _mm_set1_epi16(static_cast<SHORT>(0xFF00));
+		return _mm_or_si128(
+			_mm_and_si128(high, highMask),
+			_mm_andnot_si128(highMask, low));
+	}
+
+	// YUV samples of two pixels, truncated to 32-bit integers in the low half
+	inline void yuvOfTwo(__m128i blue, __m128i green, __m128i red, __m128i& y, __m128i& u, __m128i& v)
+	{
+		const __m128d scale = _mm_set1_pd(255.0);
+		const __m128d offset = _mm_set1_pd(128.0);
+		const __m128d half = _mm_set1_pd(0.5);
+		__m128d R = _mm_div_pd(_mm_cvtepi32_pd(red), scale);
+		__m128d G = _mm_div_pd(_mm_cvtepi32_pd(green), scale);
+		__m128d B = _mm_div_pd(_mm_cvtepi32_pd(blue), scale);
+		__m128d Y = _mm_add_pd(
+			_mm_add_pd(_mm_mul_pd(_mm_set1_pd(0.299), R), _mm_mul_pd(_mm_set1_pd(0.587), G)),
+			_mm_mul_pd(_mm_set1_pd(0.114), B));
+		__m128d U = _mm_add_pd(
+			_mm_sub_pd(
+				_mm_sub_pd(half, _mm_mul_pd(_mm_set1_pd(0.168736), R)),
+				_mm_mul_pd(_mm_set1_pd(0.331264), G)),
+			_mm_mul_pd(half, B));
+		__m128d V = _mm_sub_pd(
+			_mm_sub_pd(
+				_mm_add_pd(half, _mm_mul_pd(half, R)),
+				_mm_mul_pd(_mm_set1_pd(0.418688), G)),
+			_mm_mul_pd(_mm_set1_pd(0.081312), B));
+		y = _mm_cvttpd_epi32(_mm_sub_pd(_mm_mul_pd(Y, scale), offset));
+		u = _mm_cvttpd_epi32(_mm_sub_pd(_mm_mul_pd(U, scale), offset));
+		v = _mm_cvttpd_epi32(_mm_sub_pd(_mm_mul_pd(V, scale), offset));
+	}
+
+	// YUV samples of four pixels given as 32-bit integers
+	inline void yuvOfFour(__m128i blue, __m128i green, __m128i red, __m128i& y, __m128i& u, __m128i& v)
+	{
+		__m128i y0, u0, v0, y1, u1, v1;
+		yuvOfTwo(blue, green, red, y0, u0, v0);
+		yuvOfTwo(_mm_srli_si128(blue, 8), _mm_srli_si128(green, 8), _mm_srli_si128(red, 8), y1, u1, v1);
+		y = _mm_unpacklo_epi64(y0, y1);
+		u = _mm_unpacklo_epi64(u0, u1);
+		v = _mm_unpacklo_epi64(v0, v1);
+	}
+
+	void pixelsToYUV(const BitmapFile::Pixel* pixels, INT8* y, INT8* u, INT8* v, size_t count)
+	{
+		size_t i = 0;
+		for (; i + PixelKernels::BLOCK <= count; i += PixelKernels::BLOCK) {
+			__m128i blue, green, red;
+			deinterleave(pixels + i, blue, green, red);
+			__m128i Y[4], U[4], V[4];
+			yuvOfFour(_mm_cvtepu8_epi32(blue), _mm_cvtepu8_epi32(green), _mm_cvtepu8_epi32(red), Y[0], U[0], V[0]);
+			blue = _mm_srli_si128(blue, 4);
+			green = _mm_srli_si128(green, 4);
+			red = _mm_srli_si128(red, 4);
+			yuvOfFour(_mm_cvtepu8_epi32(blue), _mm_cvtepu8_epi32(green), _mm_cvtepu8_epi32(red), Y[1], U[1], V[1]);
+			blue = _mm_srli_si128(blue, 4);
+			green = _mm_srli_si128(green, 4);
+			red = _mm_srli_si128(red, 4);
+			yuvOfFour(_mm_cvtepu8_epi32(blue), _mm_cvtepu8_epi32(green), _mm_cvtepu8_epi32(red), Y[2], U[2], V[2]);
+			blue = _mm_srli_si128(blue, 4);
+			green = _mm_srli_si128(green, 4);
+			red = _mm_srli_si128(red, 4);
+			yuvOfFour(_mm_cvtepu8_epi32(blue), _mm_cvtepu8_epi32(green), _mm_cvtepu8_epi32(red), Y[3], U[3], V[3]);
+			// Every sample is within the 8-bit range, so saturation never applies
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(y + i), _mm_packs_epi16(
+				_mm_packs_epi32(Y[0], Y[1]), _mm_packs_epi32(Y[2], Y[3])));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(u + i), _mm_packs_epi16(
+				_mm_packs_epi32(U[0], U[1]), _mm_packs_epi32(U[2], U[3])));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(v + i), _mm_packs_epi16(
+				_mm_packs_epi32(V[0], V[1]), _mm_packs_epi32(V[2], V[3])));
+		}
+		PixelKernels::PixelsToYUV(pixels + i, y + i, u + i, v + i, count - i);
+	}
+
+	// Channels of two pixels, truncated to 32-bit integers in the low half
+	inline void rgbOfTwo(__m128i y, __m128i u, __m128i v, __m128i& red, __m128i& green, __m128i& blue)
+	{
+		const __m128d scale = _mm_set1_pd(255.0);
+		const __m128d half = _mm_set1_pd(0.5);
+		const __m128d zero = _mm_setzero_pd();
+		const __m128d one = _mm_set1_pd(1.0);
+		__m128d Y = _mm_div_pd(_mm_cvtepi32_pd(y), scale);
+		__m128d U = _mm_sub_pd(_mm_div_pd(_mm_cvtepi32_pd(u), scale), half);
+		__m128d V = _mm_sub_pd(_mm_div_pd(_mm_cvtepi32_pd(v), scale), half);
+		__m128d R = _mm_add_pd(Y, _mm_mul_pd(_mm_set1_pd(1.402), V));
+		__m128d G = _mm_sub_pd(
+			_mm_sub_pd(Y, _mm_mul_pd(_mm_set1_pd(0.344136), U)),
+			_mm_mul_pd(_mm_set1_pd(0.714136), V));
+		__m128d B = _mm_add_pd(Y, _mm_mul_pd(_mm_set1_pd(1.772), U));
+		red = _mm_cvttpd_epi32(_mm_mul_pd(_mm_max_pd(_mm_min_pd(R, one), zero), scale));
+		green = _mm_cvttpd_epi32(_mm_mul_pd(_mm_max_pd(_mm_min_pd(G, one), zero), scale));
+		blue = _mm_cvttpd_epi32(_mm_mul_pd(_mm_max_pd(_mm_min_pd(B, one), zero), scale));
+	}
+
+	// Channels of four pixels given as 32-bit samples offset to [0,255]
+	inline void rgbOfFour(__m128i y, __m128i u, __m128i v, __m128i& red, __m128i& green, __m128i& blue)
+	{
+		__m128i r0, g0, b0, r1, g1, b1;
+		rgbOfTwo(y, u, v, r0, g0, b0);
+		rgbOfTwo(_mm_srli_si128(y, 8), _mm_srli_si128(u, 8), _mm_srli_si128(v, 8), r1, g1, b1);
+		red = _mm_unpacklo_epi64(r0, r1);
+		green = _mm_unpacklo_epi64(g0, g1);
+		blue = _mm_unpacklo_epi64(b0, b1);
+	}
+
+	void yuvToPixels(const INT8* y, const INT8* u, const INT8* v, BitmapFile::Pixel* pixels, size_t count)
+	{
+		const __m128i offset = _mm_set1_epi32(128);
+		size_t i = 0;
+		for (; i + PixelKernels::BLOCK <= count; i += PixelKernels::BLOCK) {
+			__m128i Y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i));
+			__m128i U = _mm_loadu_si128(reinterpret_cast<const __m128i*>(u + i));
+			__m128i V = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i));
+			__m128i R[4], G[4], B[4];
+			for (size_t k = 0; k < 4; k++) {
+				rgbOfFour(
+					_mm_add_epi32(_mm_cvtepi8_epi32(Y), offset),
+					_mm_add_epi32(_mm_cvtepi8_epi32(U), offset),
+					_mm_add_epi32(_mm_cvtepi8_epi32(V), offset),
+					R[k], G[k], B[k]);
+				Y = _mm_srli_si128(Y, 4);
+				U = _mm_srli_si128(U, 4);
+				V = _mm_srli_si128(V, 4);
+			}
+			interleave(
+				_mm_packus_epi16(_mm_packs_epi32(B[0], B[1]), _mm_packs_epi32(B[2], B[3])),
+				_mm_packus_epi16(_mm_packs_epi32(G[0], G[1]), _mm_packs_epi32(G[2], G[3])),
+				_mm_packus_epi16(_mm_packs_epi32(R[0], R[1]), _mm_packs_epi32(R[2], R[3])),
+				pixels + i);
+		}
+		PixelKernels::YUVToPixels(y + i, u + i, v + i, pixels + i, count - i);
+	}
+
+	void pixelsToYCoCgR(const BitmapFile::Pixel* pixels, INT8* y, INT8* co, INT8* cg, size_t count)
+	{
+		const __m128i offset = _mm_set1_epi8(-128);
+		size_t i = 0;
+		for (; i + PixelKernels::BLOCK <= count; i += PixelKernels::BLOCK) {
+			__m128i B, G, R;
+			deinterleave(pixels + i, B, G, R);
+			// Co = R - B, t = B + (Co >> 1), Cg = G - t, Y = t + (Cg >> 1)
+			__m128i Co = _mm_sub_epi8(R, B);
+			__m128i t = _mm_add_epi8(B, shiftRightSigned8(Co));
+			__m128i Cg = _mm_sub_epi8(G, t);
+			__m128i Y = _mm_add_epi8(t, shiftRightSigned8(Cg));
+			// Center luma around zero like the YUV planes
+			Y = _mm_add_epi8(Y, offset);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(y + i), Y);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(co + i), Co);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(cg + i), Cg);
+		}
+		PixelKernels::PixelsToYCoCgR(pixels + i, y + i, co + i, cg + i, count - i);
+	}
+
+	void yCoCgRToPixels(const INT8* y, const INT8* co, const INT8* cg, BitmapFile::Pixel* pixels, size_t count)
+	{
+		const __m128i offset = _mm_set1_epi8(-128);
+		size_t i = 0;
+		for (; i + PixelKernels::BLOCK <= count; i += PixelKernels::BLOCK) {
+			__m128i Y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i));
+			__m128i Co = _mm_loadu_si128(reinterpret_cast<const __m128i*>(co + i));
+			__m128i Cg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cg + i));
+			// Undo the lifting steps in reverse order
+			Y = _mm_sub_epi8(Y, offset);
+			__m128i t = _mm_sub_epi8(Y, shiftRightSigned8(Cg));
+			__m128i G = _mm_add_epi8(Cg, t);
+			__m128i B = _mm_sub_epi8(t, shiftRightSigned8(Co));
+			__m128i R = _mm_add_epi8(B, Co);
+			interleave(B, G, R, pixels + i);
+		}
+		PixelKernels::YCoCgRToPixels(y + i, co + i, cg + i, pixels + i, count - i);
+	}
+
+	// Brighten scale of four pixels given their largest channels as 32-bit integers
+	// The single precision quotient is off by less than 1/max, so it never
+	// crosses an integer and rounding it up matches the integer division of
+	// the scalar kernel. Black divides to infinity, which converts to
+	// 0x80000000 and loses the unsigned minimum to the factor.
+	inline __m128i brightenScaleOfFour(__m128i max, __m128i factor)
+	{
+		const __m128 limit = _mm_set1_ps(static_cast<float>(CpuDispatch::BRIGHTEN_MAX_FACTOR));
+		__m128 quotient = _mm_div_ps(limit, _mm_cvtepi32_ps(max));
+		return _mm_min_epu32(_mm_cvttps_epi32(_mm_ceil_ps(quotient)), factor);
+	}
+
+	void brightenPixels(BitmapFile::Pixel* pixels, size_t count, UINT32 factor)
+	{
+		const __m128i factors = _mm_set1_epi32(static_cast<int>(factor));
+		size_t i = 0;
+		for (; i + PixelKernels::BLOCK <= count; i += PixelKernels::BLOCK) {
+			__m128i blue, green, red;
+			deinterleave(pixels + i, blue, green, red);
+			__m128i max = _mm_max_epu8(_mm_max_epu8(blue, green), red);
+			__m128i R[4], G[4], B[4];
+			for (size_t k = 0; k < 4; k++) {
+				__m128i scale = brightenScaleOfFour(_mm_cvtepu8_epi32(max), factors);
+				B[k] = _mm_srli_epi32(_mm_mullo_epi32(_mm_cvtepu8_epi32(blue), scale), 16);
+				G[k] = _mm_srli_epi32(_mm_mullo_epi32(_mm_cvtepu8_epi32(green), scale), 16);
+				R[k] = _mm_srli_epi32(_mm_mullo_epi32(_mm_cvtepu8_epi32(red), scale), 16);
+				max = _mm_srli_si128(max, 4);
+				blue = _mm_srli_si128(blue, 4);
+				green = _mm_srli_si128(green, 4);
+				red = _mm_srli_si128(red, 4);
+			}
+			interleave(
+				_mm_packus_epi16(_mm_packus_epi32(B[0], B[1]), _mm_packus_epi32(B[2], B[3])),
+				_mm_packus_epi16(_mm_packus_epi32(G[0], G[1]), _mm_packus_epi32(G[2], G[3])),
+				_mm_packus_epi16(_mm_packus_epi32(R[0], R[1]), _mm_packus_epi32(R[2], R[3])),
+				pixels + i);
+		}
+		PixelKernels::BrightenPixels(pixels + i, count - i, factor);
+	}
+}
+
+const CpuDispatch::Kernels CpuDispatch::SSE42_KERNELS = {
+	pixelsToYUV,
+	yuvToPixels,
+	pixelsToYCoCgR,
+	yCoCgRToPixels,
+	brightenPixels
+};
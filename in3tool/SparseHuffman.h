@@ -0,0 +1,403 @@
+#pragma once
+#include <algorithm>
+#include <limits>
+#include <queue>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "commontypes.h"
+#include "Histogram.h"
+
+// Code length of one symbol of a sparse alphabet
+template <typename T>
+struct SparseLength {
+	T Symbol;
+	UINT8 Length;
+};
+
+// Canonical Huffman code length table over the used symbols only
+// Symbols missing from the table are coded as the escape code followed by
+// the raw bits of the symbol, so a table can be limited to the most
+// frequent symbols of a wide alphabet
+template <typename T>
+struct SparseLengthTable {
+	std::vector<SparseLength<T>> Symbols; // Sorted by unsigned symbol value
+	UINT8 EscapeLength = 0; // Zero when there is no escape code
+};
+
+// Huffman coding over sparse alphabets of 8-bit or 16-bit symbols
+// Tables and decoding structures are sized by the number of used symbols
+// instead of the full range of the symbol type
+template <typename T>
+class SparseHuffman
+{
+	static_assert(sizeof(T) <= 2, "SparseHuffman supports 8-bit and 16-bit symbols");
+	typedef typename std::make_unsigned<T>::type Unsigned;
+public:
+	// Most symbols kept in a table before the rest are escaped
+	static const size_t DEFAULT_MAX_SYMBOLS = 4096;
+	// Longest code length, so codes fit in 32 bits
+	static const UINT8 MAX_CODE_LENGTH = 32;
+	// Raw bits written after an escape code
+	static const UINT8 RAW_BITS = sizeof(T) * 8;
+private:
+	// Table entry in canonical order, the escape sorts after symbols
+	struct CodeEntry {
+		UINT8 Length;
+		BOOL Escape;
+		T Symbol;
+		bool operator<(const CodeEntry& a) const {
+			if (Length != a.Length) {
+				return Length < a.Length;
+			}
+			if (Escape != a.Escape) {
+				return !Escape;
+			}
+			return Symbol < a.Symbol;
+		}
+	};
+	// Canonical code entries with the first code of every length
+	struct CanonicalCodes {
+		std::vector<CodeEntry> Entries;
+		UINT32 FirstCode[MAX_CODE_LENGTH + 2];
+		UINT32 Count[MAX_CODE_LENGTH + 2];
+		UINT32 Offset[MAX_CODE_LENGTH + 2];
+	};
+	static CanonicalCodes canonical(const SparseLengthTable<T>& table);
+	// Huffman code lengths of counts, with no length over the limit
+	static std::vector<UINT8> codeLengths(std::vector<UINT64> counts);
+	static void writeBits(std::vector<bool>& output, UINT32 value, UINT8 length);
+public:
+	// Build a table from the symbol frequencies
+	static SparseLengthTable<T> buildTable(
+		const std::vector<T>& input,
+		size_t maxSymbols = DEFAULT_MAX_SYMBOLS);
+	// Code the symbols with a table
+	static std::vector<bool> encode(
+		const SparseLengthTable<T>& table,
+		const std::vector<T>& input);
+	// Decode a number of symbols starting at a bit position, which is advanced
+	static std::vector<T> decode(
+		const SparseLengthTable<T>& table,
+		const std::vector<bool>& input,
+		size_t& bitPosition,
+		size_t numToDecode);
+	// Table <---> compact bytes of varint symbol deltas and lengths
+	static std::vector<BYTE> serialize(const SparseLengthTable<T>& table);
+	static BOOL deserialize(
+		const BYTE* bytes,
+		UINT64 size,
+		SparseLengthTable<T>& table,
+		UINT64& bytesUsed);
+};
+
+template<typename T>
+inline std::vector<UINT8> SparseHuffman<T>::codeLengths(std::vector<UINT64> counts)
+{
+	std::vector<UINT8> lengths(counts.size(), 0);
+	if (counts.size() == 1) {
+		lengths[0] = 1;
+		return lengths;
+	}
+	for (;;) {
+		// Nodes are the leaves followed by the parents as they are created
+		typedef std::pair<UINT64, size_t> Node;
+		std::priority_queue<Node, std::vector<Node>, std::greater<Node>> sorted;
+		std::vector<size_t> parents(counts.size() * 2, 0);
+		for (size_t i = 0; i < counts.size(); i++) {
+			sorted.push(Node(counts[i], i));
+		}
+		size_t next = counts.size();
+		while (sorted.size() > 1) {
+			Node a = sorted.top();
+			sorted.pop();
+			Node b = sorted.top();
+			sorted.pop();
+			parents[a.second] = next;
+			parents[b.second] = next;
+			sorted.push(Node(a.first + b.first, next));
+			next += 1;
+		}
+		// Depths are found from the root down since parents come later
+		std::vector<UINT32> depths(next, 0);
+		UINT32 maxDepth = 0;
+		for (size_t i = next - 1; i-- > 0;) {
+			depths[i] = depths[parents[i]] + 1;
+		}
+		for (size_t i = 0; i < counts.size(); i++) {
+			maxDepth = std::max(maxDepth, depths[i]);
+		}
+		if (maxDepth <= MAX_CODE_LENGTH) {
+			for (size_t i = 0; i < counts.size(); i++) {
+				lengths[i] = static_cast<UINT8>(depths[i]);
+			}
+			return lengths;
+		}
+		// Flatten the distribution and try again when codes are too long
+		for (size_t i = 0; i < counts.size(); i++) {
+			counts[i] = (counts[i] + 1) / 2;
+		}
+	}
+}
+
+template<typename T>
+inline SparseLengthTable<T> SparseHuffman<T>::buildTable(
+	const std::vector<T>& input,
+	size_t maxSymbols)
+{
+	// Count every symbol of the type's range, which is small enough to
+	// keep on the heap for 8-bit and 16-bit symbols
+	Histogram<T> histogram;
+	histogram.add(input);
+	std::vector<std::pair<UINT64, T>> used;
+	for (size_t i = 0; i <= std::numeric_limits<Unsigned>::max(); i++) {
+		T symbol = static_cast<T>(static_cast<Unsigned>(i));
+		UINT64 count = histogram.getCount(symbol);
+		if (count != 0) {
+			used.push_back(std::pair<UINT64, T>(count, symbol));
+		}
+	}
+	// Keep the most frequent symbols and escape the rest
+	UINT64 escapeCount = 0;
+	if (used.size() > maxSymbols) {
+		std::sort(used.begin(), used.end(), std::greater<std::pair<UINT64, T>>());
+		for (size_t i = maxSymbols; i < used.size(); i++) {
+			escapeCount += used[i].first;
+		}
+		used.resize(maxSymbols);
+	}
+	SparseLengthTable<T> table;
+	if (used.empty() && escapeCount == 0) {
+		return table;
+	}
+	std::vector<UINT64> leafCounts;
+	for (auto it = used.begin(); it != used.end(); it++) {
+		leafCounts.push_back(it->first);
+	}
+	if (escapeCount != 0) {
+		leafCounts.push_back(escapeCount);
+	}
+	std::vector<UINT8> lengths = codeLengths(leafCounts);
+	for (size_t i = 0; i < used.size(); i++) {
+		table.Symbols.push_back({ used[i].second, lengths[i] });
+	}
+	if (escapeCount != 0) {
+		table.EscapeLength = lengths.back();
+	}
+	std::sort(
+		table.Symbols.begin(),
+		table.Symbols.end(),
+		[](const SparseLength<T>& a, const SparseLength<T>& b) {
+			return static_cast<Unsigned>(a.Symbol) < static_cast<Unsigned>(b.Symbol);
+		});
+	return table;
+}
+
+template<typename T>
+inline typename SparseHuffman<T>::CanonicalCodes SparseHuffman<T>::canonical(
+	const SparseLengthTable<T>& table)
+{
+	CanonicalCodes codes;
+	for (auto it = table.Symbols.begin(); it != table.Symbols.end(); it++) {
+		codes.Entries.push_back({ it->Length, FALSE, it->Symbol });
+	}
+	if (table.EscapeLength != 0) {
+		codes.Entries.push_back({ table.EscapeLength, TRUE, T() });
+	}
+	std::sort(codes.Entries.begin(), codes.Entries.end());
+	// First code of each length as in the canonical Huffman construction
+	std::fill(codes.Count, codes.Count + MAX_CODE_LENGTH + 2, 0);
+	for (auto it = codes.Entries.begin(); it != codes.Entries.end(); it++) {
+		codes.Count[it->Length] += 1;
+	}
+	UINT32 code = 0;
+	UINT32 offset = 0;
+	codes.Count[0] = 0;
+	for (UINT8 length = 1; length <= MAX_CODE_LENGTH + 1; length++) {
+		code = (code + codes.Count[length - 1]) << 1;
+		codes.FirstCode[length] = code;
+		codes.Offset[length] = offset;
+		offset += codes.Count[length];
+	}
+	codes.FirstCode[0] = 0;
+	codes.Offset[0] = 0;
+	return codes;
+}
+
+template<typename T>
+inline void SparseHuffman<T>::writeBits(std::vector<bool>& output, UINT32 value, UINT8 length)
+{
+	// Most significant bit first, like the canonical codes
+	for (UINT8 bit = length; bit > 0; bit--) {
+		output.push_back(((value >> (bit - 1)) & 1) != 0);
+	}
+}
+
+template<typename T>
+inline std::vector<bool> SparseHuffman<T>::encode(
+	const SparseLengthTable<T>& table,
+	const std::vector<T>& input)
+{
+	CanonicalCodes codes = canonical(table);
+	// Code and length of every table symbol, found by binary search
+	std::vector<std::pair<T, std::pair<UINT32, UINT8>>> symbolCodes;
+	UINT32 escapeCode = 0;
+	UINT8 length = 0;
+	UINT32 code = 0;
+	for (auto it = codes.Entries.begin(); it != codes.Entries.end(); it++) {
+		if (it->Length != length) {
+			length = it->Length;
+			code = codes.FirstCode[length];
+		}
+		if (it->Escape) {
+			escapeCode = code;
+		}
+		else {
+			symbolCodes.push_back({ it->Symbol, { code, length } });
+		}
+		code += 1;
+	}
+	std::sort(symbolCodes.begin(), symbolCodes.end());
+	std::vector<bool> output;
+	for (auto it = input.begin(); it != input.end(); it++) {
+		auto found = std::lower_bound(
+			symbolCodes.begin(),
+			symbolCodes.end(),
+			*it,
+			[](const std::pair<T, std::pair<UINT32, UINT8>>& entry, T symbol) {
+				return entry.first < symbol;
+			});
+		if (found != symbolCodes.end() && found->first == *it) {
+			writeBits(output, found->second.first, found->second.second);
+		}
+		else {
+			writeBits(output, escapeCode, table.EscapeLength);
+			writeBits(output, static_cast<Unsigned>(*it), RAW_BITS);
+		}
+	}
+	return output;
+}
+
+template<typename T>
+inline std::vector<T> SparseHuffman<T>::decode(
+	const SparseLengthTable<T>& table,
+	const std::vector<bool>& input,
+	size_t& bitPosition,
+	size_t numToDecode)
+{
+	CanonicalCodes codes = canonical(table);
+	std::vector<T> output;
+	output.reserve(numToDecode);
+	while (output.size() < numToDecode && bitPosition < input.size()) {
+		// Extend the code one bit at a time until it falls in the range
+		// of codes of its length
+		UINT32 code = 0;
+		UINT8 length = 0;
+		const CodeEntry* entry = NULL;
+		while (entry == NULL && length < MAX_CODE_LENGTH && bitPosition < input.size()) {
+			code = (code << 1) | (input[bitPosition] ? 1 : 0);
+			bitPosition += 1;
+			length += 1;
+			UINT32 index = code - codes.FirstCode[length];
+			if (code >= codes.FirstCode[length] && index < codes.Count[length]) {
+				entry = &codes.Entries[codes.Offset[length] + index];
+			}
+		}
+		if (entry == NULL) {
+			break;
+		}
+		if (!entry->Escape) {
+			output.push_back(entry->Symbol);
+			continue;
+		}
+		if (bitPosition + RAW_BITS > input.size()) {
+			break;
+		}
+		UINT32 raw = 0;
+		for (UINT8 bit = 0; bit < RAW_BITS; bit++) {
+			raw = (raw << 1) | (input[bitPosition] ? 1 : 0);
+			bitPosition += 1;
+		}
+		output.push_back(static_cast<T>(static_cast<Unsigned>(raw)));
+	}
+	return output;
+}
+
+template<typename T>
+inline std::vector<BYTE> SparseHuffman<T>::serialize(const SparseLengthTable<T>& table)
+{
+	std::vector<BYTE> bytes;
+	// Symbol count and escape length
+	UINT32 count = static_cast<UINT32>(table.Symbols.size());
+	for (UINT8 i = 0; i < 4; i++) {
+		bytes.push_back(static_cast<BYTE>(count >> (8 * i)));
+	}
+	bytes.push_back(table.EscapeLength);
+	// Each symbol as a varint of its distance from the previous symbol
+	Unsigned previous = 0;
+	for (auto it = table.Symbols.begin(); it != table.Symbols.end(); it++) {
+		UINT32 delta = static_cast<Unsigned>(it->Symbol) - previous;
+		previous = static_cast<Unsigned>(it->Symbol);
+		do {
+			BYTE b = delta & 0x7F;
+			delta >>= 7;
+			bytes.push_back(delta != 0 ? (b | 0x80) : b);
+		} while (delta != 0);
+		bytes.push_back(it->Length);
+	}
+	return bytes;
+}
+
+template<typename T>
+inline BOOL SparseHuffman<T>::deserialize(
+	const BYTE* bytes,
+	UINT64 size,
+	SparseLengthTable<T>& table,
+	UINT64& bytesUsed)
+{
+	UINT64 position = 0;
+	if (size < 5) {
+		return FALSE;
+	}
+	UINT32 count = 0;
+	for (UINT8 i = 0; i < 4; i++) {
+		count |= static_cast<UINT32>(bytes[position++]) << (8 * i);
+	}
+	table.EscapeLength = bytes[position++];
+	if (table.EscapeLength > MAX_CODE_LENGTH) {
+		return FALSE;
+	}
+	table.Symbols.clear();
+	// Symbols must be sorted and unique, so every delta after the first is
+	// at least one and none goes past the largest symbol. A delta takes
+	// at most as many 7-bit groups as the symbol has bits, so it cannot
+	// overflow while it is read.
+	static const UINT32 MAX_SYMBOL = std::numeric_limits<Unsigned>::max();
+	UINT32 previous = 0;
+	for (UINT32 i = 0; i < count; i++) {
+		UINT32 delta = 0;
+		UINT8 shift = 0;
+		BYTE b;
+		do {
+			if (position >= size || shift >= RAW_BITS) {
+				return FALSE;
+			}
+			b = bytes[position++];
+			delta |= static_cast<UINT32>(b & 0x7F) << shift;
+			shift += 7;
+		} while (b & 0x80);
+		if (position >= size ||
+			(i > 0 && delta == 0) ||
+			delta > MAX_SYMBOL - previous) {
+			return FALSE;
+		}
+		previous += delta;
+		UINT8 length = bytes[position++];
+		if (length == 0 || length > MAX_CODE_LENGTH) {
+			return FALSE;
+		}
+		table.Symbols.push_back({ static_cast<T>(static_cast<Unsigned>(previous)), length });
+	}
+	bytesUsed = position;
+	return TRUE;
+}
@@ -0,0 +1,154 @@
+#include "stdafx.h"
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include "AsyncFileIO.h"
+#include "MemoryAccounting.h"
+#include "Trace.h"
+
+namespace {
+	struct TraceSpan {
+		const char* Name;
+		UINT64 Start;
+		UINT64 End;
+	};
+	// Spans of one thread
+	struct ThreadRing {
+		TraceSpan Spans[Trace::RING_CAPACITY];
+		// Spans recorded so far, stored after each span is written so that
+		// the exporting thread sees whole spans
+		std::atomic<UINT64> Count;
+		UINT32 ThreadId;
+		const char* Name;
+		UINT32 NameIndex;
+		ThreadRing* Next;
+	};
+	std::atomic<BOOL> Enabled(FALSE);
+	std::atomic<UINT64> Origin(0);
+	// Rings of every thread that has recorded a span, pushed without a lock
+	// and never freed, so the spans of threads that have exited are kept
+	std::atomic<ThreadRing*> Rings(NULL);
+	std::atomic<UINT32> NextThreadId(0);
+	thread_local ThreadRing* CurrentRing = NULL;
+	thread_local const char* CurrentName = NULL;
+	thread_local UINT32 CurrentNameIndex = 0;
+
+	ThreadRing* currentRing()
+	{
+		if (CurrentRing != NULL) {
+			return CurrentRing;
+		}
+		MemoryAccounting::Scope memoryScope(MEMORY_STAGE_OTHER);
+		ThreadRing* ring = new ThreadRing;
+		ring->Count.store(0, std::memory_order_relaxed);
+		ring->ThreadId = NextThreadId++;
+		ring->Name = CurrentName;
+		ring->NameIndex = CurrentNameIndex;
+		ring->Next = Rings.load(std::memory_order_relaxed);
+		while (!Rings.compare_exchange_weak(
+			ring->Next,
+			ring,
+			std::memory_order_release,
+			std::memory_order_relaxed)) {
+		}
+		CurrentRing = ring;
+		return ring;
+	}
+
+	// Microseconds since tracing was enabled, as trace events count time
+	DOUBLE microseconds(UINT64 time)
+	{
+		UINT64 origin = Origin.load(std::memory_order_relaxed);
+		return time > origin ? (time - origin) / 1000.0 : 0.0;
+	}
+}
+
+Trace::Scope::Scope(const char* name)
+	: Name(NULL),
+	  Start(0)
+{
+	if (Enabled.load(std::memory_order_relaxed)) {
+		Name = name;
+		Start = now();
+	}
+}
+
+Trace::Scope::~Scope()
+{
+	if (Name == NULL) {
+		return;
+	}
+	ThreadRing* ring = currentRing();
+	UINT64 count = ring->Count.load(std::memory_order_relaxed);
+	TraceSpan& span = ring->Spans[count % RING_CAPACITY];
+	span.Name = Name;
+	span.Start = Start;
+	span.End = now();
+	ring->Count.store(count + 1, std::memory_order_release);
+}
+
+BOOL Trace::enable()
+{
+#ifdef IN3_TRACE
+	Origin.store(now(), std::memory_order_relaxed);
+	Enabled.store(TRUE, std::memory_order_relaxed);
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+BOOL Trace::isEnabled()
+{
+	return Enabled.load(std::memory_order_relaxed);
+}
+
+void Trace::setThreadName(const char* name, UINT32 index)
+{
+	CurrentName = name;
+	CurrentNameIndex = index;
+	if (CurrentRing != NULL) {
+		CurrentRing->Name = name;
+		CurrentRing->NameIndex = index;
+	}
+}
+
+BOOL Trace::exportJson(const std::wstring& fileName)
+{
+	std::ostringstream json;
+	json << std::fixed << std::setprecision(3);
+	json << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	BOOL first = TRUE;
+	for (ThreadRing* ring = Rings.load(std::memory_order_acquire); ring != NULL; ring = ring->Next) {
+		json << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":";
+		json << ring->ThreadId << ",\"args\":{\"name\":\"";
+		if (ring->Name != NULL) {
+			json << ring->Name << ' ' << ring->NameIndex;
+		}
+		else {
+			json << "Thread " << ring->ThreadId;
+		}
+		json << "\"}}";
+		first = FALSE;
+		UINT64 count = ring->Count.load(std::memory_order_acquire);
+		UINT64 oldest = count > RING_CAPACITY ? count - RING_CAPACITY : 0;
+		for (UINT64 i = oldest; i < count; i++) {
+			const TraceSpan& span = ring->Spans[i % RING_CAPACITY];
+			DOUBLE start = microseconds(span.Start);
+			json << ",\n{\"name\":\"" << span.Name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":";
+			json << ring->ThreadId << ",\"ts\":" << start;
+			json << ",\"dur\":" << microseconds(span.End) - start << "}";
+		}
+	}
+	json << "\n]}\n";
+	std::string text = json.str();
+	return AsyncFileIO::WriteWholeFile(fileName, std::vector<BYTE>(text.begin(), text.end()));
+}
+
+UINT64 Trace::now()
+{
+	return static_cast<UINT64>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <string>
+#include "commontypes.h"
+
+// Timeline of scoped spans around pipeline stages and worker tasks
+// Each thread records its spans into a ring buffer of its own, which only
+// that thread writes, so recording takes no lock; once a ring is full its
+// oldest spans are overwritten. Spans are recorded only after tracing is
+// enabled, and export as Chrome trace event JSON that trace viewers show
+// as a timeline per thread. Builds that do not define IN3_TRACE compile
+// the IN3_TRACE_ macros to nothing, so spans cost nothing there.
+class Trace
+{
+public:
+	// Spans kept per thread before the oldest are overwritten
+	static const UINT32 RING_CAPACITY = 1 << 16;
+	// Records a span from construction to destruction on the current thread
+	// The name must outlive the trace, as string literals do
+	class Scope
+	{
+	private:
+		const char* Name;
+		UINT64 Start;
+	public:
+		Scope(const char* name);
+		~Scope();
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	};
+	// Start recording spans, returning FALSE if tracing is compiled out
+	static BOOL enable();
+	static BOOL isEnabled();
+	// Name the current thread in the timeline, numbered when there are
+	// several threads of the name
+	// The name must outlive the trace, as string literals do
+	static void setThreadName(const char* name, UINT32 index);
+	// Write every recorded span to a file of Chrome trace events
+	// Spans recorded while the file is written may be missing or torn, so
+	// the traced work should have finished
+	static BOOL exportJson(const std::wstring& fileName);
+	// Nanoseconds on the clock spans are timed with
+	static UINT64 now();
+};
+
+#ifdef IN3_TRACE
+#define IN3_TRACE_JOIN(a, b) a##b
+#define IN3_TRACE_NAME(line) IN3_TRACE_JOIN(traceScope, line)
+#define IN3_TRACE_SCOPE(name) Trace::Scope IN3_TRACE_NAME(__LINE__)(name)
+#define IN3_TRACE_THREAD(name, index) Trace::setThreadName(name, index)
+#else
+#define IN3_TRACE_SCOPE(name) ((void)0)
+#define IN3_TRACE_THREAD(name, index) ((void)0)
+#endif
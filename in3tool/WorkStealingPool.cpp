@@ -0,0 +1,132 @@
+#include "stdafx.h"
+#include <algorithm>
+#include "Trace.h"
+#include "WorkStealingPool.h"
+
+thread_local WorkStealingPool* WorkStealingPool::CurrentPool = NULL;
+thread_local UINT32 WorkStealingPool::CurrentWorker = 0;
+
+BOOL WorkStealingPool::popTask(UINT32 index, Task& task)
+{
+	Worker& worker = *Workers[index];
+	std::lock_guard<std::mutex> lock(worker.Lock);
+	if (worker.Tasks.empty()) {
+		return FALSE;
+	}
+	task = std::move(worker.Tasks.back());
+	worker.Tasks.pop_back();
+	return TRUE;
+}
+
+BOOL WorkStealingPool::stealTask(UINT32 thief, Task& task)
+{
+	// Visit the other workers starting after the thief
+	UINT32 count = static_cast<UINT32>(Workers.size());
+	for (UINT32 i = 1; i < count; i++) {
+		Worker& victim = *Workers[(thief + i) % count];
+		std::lock_guard<std::mutex> lock(victim.Lock);
+		if (!victim.Tasks.empty()) {
+			task = std::move(victim.Tasks.front());
+			victim.Tasks.pop_front();
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+void WorkStealingPool::run(UINT32 index)
+{
+	CurrentPool = this;
+	CurrentWorker = index;
+	IN3_TRACE_THREAD("Worker", index);
+	for (;;) {
+		Task task;
+		if (popTask(index, task) || stealTask(index, task)) {
+			QueuedTasks -= 1;
+			{
+				IN3_TRACE_SCOPE("Task");
+				task();
+			}
+			// Wake waiters when the last outstanding task finishes
+			if (--PendingTasks == 0) {
+				std::lock_guard<std::mutex> lock(IdleLock);
+				AllDone.notify_all();
+			}
+			continue;
+		}
+		// Sleep until a task is queued anywhere or the pool is stopping
+		std::unique_lock<std::mutex> lock(IdleLock);
+		WorkAvailable.wait(lock, [this]() {
+			return Stopping || QueuedTasks > 0;
+		});
+		if (Stopping && QueuedTasks == 0) {
+			return;
+		}
+	}
+}
+
+void WorkStealingPool::submit(Task task)
+{
+	PendingTasks += 1;
+	// Tasks spawned by a worker go on its own deque, others round robin
+	UINT32 index;
+	if (CurrentPool == this) {
+		index = CurrentWorker;
+	}
+	else {
+		index = NextWorker++ % static_cast<UINT32>(Workers.size());
+	}
+	{
+		Worker& worker = *Workers[index];
+		std::lock_guard<std::mutex> lock(worker.Lock);
+		worker.Tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock(IdleLock);
+		QueuedTasks += 1;
+	}
+	WorkAvailable.notify_one();
+}
+
+void WorkStealingPool::waitIdle()
+{
+	std::unique_lock<std::mutex> lock(IdleLock);
+	AllDone.wait(lock, [this]() {
+		return PendingTasks == 0;
+	});
+}
+
+UINT32 WorkStealingPool::getThreadCount() const
+{
+	return static_cast<UINT32>(Threads.size());
+}
+
+WorkStealingPool::WorkStealingPool(UINT32 threadCount)
+	: PendingTasks(0),
+	  QueuedTasks(0),
+	  NextWorker(0),
+	  Stopping(FALSE)
+{
+	if (threadCount == 0) {
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	}
+	for (UINT32 i = 0; i < threadCount; i++) {
+		Workers.push_back(std::unique_ptr<Worker>(new Worker));
+	}
+	for (UINT32 i = 0; i < threadCount; i++) {
+		Threads.push_back(std::thread(&WorkStealingPool::run, this, i));
+	}
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	waitIdle();
+	{
+		std::lock_guard<std::mutex> lock(IdleLock);
+		Stopping = TRUE;
+	}
+	WorkAvailable.notify_all();
+	for (auto it = Threads.begin(); it != Threads.end(); it++) {
+		it->join();
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Pool of worker threads that each own a deque of tasks
+// A worker runs its own newest task first and steals the oldest task of
+// another worker when its deque is empty, so tasks spawned by a task stay
+// on the same core while idle workers take over whatever is left
+class WorkStealingPool
+{
+public:
+	typedef std::function<void()> Task;
+private:
+	// Per-worker task deque
+	struct Worker {
+		std::mutex Lock;
+		std::deque<Task> Tasks;
+	};
+	std::vector<std::unique_ptr<Worker>> Workers;
+	std::vector<std::thread> Threads;
+	// Tasks submitted but not yet finished
+	std::atomic<UINT64> PendingTasks;
+	// Tasks sitting in a deque waiting to be run
+	std::atomic<INT64> QueuedTasks;
+	// Worker that receives the next task submitted from outside the pool
+	std::atomic<UINT32> NextWorker;
+	// Sleeping and waking of idle workers and waiters
+	std::mutex IdleLock;
+	std::condition_variable WorkAvailable;
+	std::condition_variable AllDone;
+	BOOL Stopping;
+	// Pool and worker index of the calling thread, if it is a worker
+	static thread_local WorkStealingPool* CurrentPool;
+	static thread_local UINT32 CurrentWorker;
+	// Take a task from the back of a worker's own deque
+	BOOL popTask(UINT32 index, Task& task);
+	// Take a task from the front of another worker's deque
+	BOOL stealTask(UINT32 thief, Task& task);
+	// Worker thread loop
+	void run(UINT32 index);
+public:
+	// Queue a task, on the calling worker's own deque when called from a task
+	void submit(Task task);
+	// Block until every submitted task, including nested ones, has finished
+	void waitIdle();
+	// Number of worker threads
+	UINT32 getThreadCount() const;
+	// Create the pool with one thread per hardware thread when zero
+	WorkStealingPool(UINT32 threadCount = 0);
+	~WorkStealingPool();
+};
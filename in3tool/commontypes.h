@@ -9,13 +9,139 @@
 template <typename T>
 using LengthTable = std::array<UINT8, std::numeric_limits<T>::max() - std::numeric_limits<T>::min() + 1>;
 
+// Read-only view of contiguous elements owned elsewhere
+template <typename T>
+class Span {
+private:
+	const T* Data;
+	size_t Size;
+public:
+	Span();
+	Span(const T* data, size_t size);
+	Span(const std::vector<T>& vector);
+	const T* data() const;
+	size_t size() const;
+	BOOL empty() const;
+	const T* begin() const;
+	const T* end() const;
+	const T& operator[](size_t i) const;
+	// View of count elements starting at an offset
+	Span<T> subspan(size_t offset, size_t count) const;
+};
+
+template<typename T>
+inline Span<T>::Span()
+	: Data(NULL),
+	  Size(0)
+{
+}
+
+template<typename T>
+inline Span<T>::Span(const T* data, size_t size)
+	: Data(data),
+	  Size(size)
+{
+}
+
+template<typename T>
+inline Span<T>::Span(const std::vector<T>& vector)
+	: Data(vector.data()),
+	  Size(vector.size())
+{
+}
+
+template<typename T>
+inline const T* Span<T>::data() const
+{
+	return Data;
+}
+
+template<typename T>
+inline size_t Span<T>::size() const
+{
+	return Size;
+}
+
+template<typename T>
+inline BOOL Span<T>::empty() const
+{
+	return Size == 0;
+}
+
+template<typename T>
+inline const T* Span<T>::begin() const
+{
+	return Data;
+}
+
+template<typename T>
+inline const T* Span<T>::end() const
+{
+	return Data + Size;
+}
+
+template<typename T>
+inline const T& Span<T>::operator[](size_t i) const
+{
+	return Data[i];
+}
+
+template<typename T>
+inline Span<T> Span<T>::subspan(size_t offset, size_t count) const
+{
+	return Span<T>(Data + offset, count);
+}
+
+// IN3 file format versions
+// Version 1 files have 16-bit dimensions and 32-bit plane sizes
+// Version 2 files have 64-bit dimensions and 64-bit plane sizes
+static const UINT16 IN3_VERSION_1 = 1;
+static const UINT16 IN3_VERSION_2 = 2;
+
+// Color transforms between the bitmap pixels and the coded planes
+enum IN3ColorTransform : UINT8 {
+	COLOR_TRANSFORM_YUV = 0, // Floating point YUV quantized to 8 bits
+	COLOR_TRANSFORM_YCOCG_R = 1, // Integer reversible YCoCg-R (lossless)
+	COLOR_TRANSFORM_PALETTE = 2 // Y plane of indices into a palette, U and V unused
+};
+
+// Most entries of the palette of an image coded as palette indices
+static const UINT16 IN3_MAX_PALETTE_SIZE = 256;
+
+// Largest quantization step of the samples of a plane
+static const UINT8 IN3_MAX_QUANTIZATION_STEP = 64;
+
+// Codings of a plane's samples
+// Headers written before plane modes read as zero, which is Huffman coding
+enum IN3PlaneMode : UINT8 {
+	PLANE_MODE_HUFFMAN = 0, // Canonical Huffman codes of the plane's length table
+	PLANE_MODE_CONSTANT = 1, // Every sample is the plane's constant sample, no payload
+	PLANE_MODE_RAW = 2, // One byte per sample
+	// Blocks of samples each Huffman coded with one of several tables
+	// The payload starts with the table count and the samples per block
+	// (one byte and four bytes, least significant first), then every table
+	// after the first, which is the plane's length table, then the table of
+	// each block (one byte each) and the coded blocks back-to-back
+	// Readers that predate a mode decode nothing for its plane, as if it
+	// were damaged
+	PLANE_MODE_BLOCKS = 3
+};
+
 // Structures
 // File structure types
 // Structure packing set to 1-byte to have continuous reading
 #pragma pack(push, 1)
-// IN3 File Header With Tables
+// IN3 File Header Magic And Version Detection Prefix
+// Version 1 files store nonzero dimensions here, version 2 files store zeroes
+struct IN3HeaderPrefix {
+	UINT8 MagicByteI;
+	UINT8 MagicByteN;
+	UINT16 LegacyWidth;
+	UINT16 LegacyHeight;
+};
+// Version 1 IN3 File Header With Tables
 template <typename T>
-struct IN3Header {
+struct IN3HeaderV1 {
 	UINT8 MagicByteI = 73; // 'I' == 73
 	UINT8 MagicByteN = 78; // 'N' == 78
 	UINT16 Width;
@@ -27,21 +153,207 @@ struct IN3Header {
 	LengthTable<T> UTable;
 	LengthTable<T> VTable;
 };
+// Version 2 IN3 File Header With Tables
+// The legacy dimensions are zero so that it is never mistaken for version 1
+// HeaderSize is the number of header bytes before the plane data so that
+// fields appended to the header later can be skipped or zero-filled
+template <typename T>
+struct IN3Header {
+	UINT8 MagicByteI = 73; // 'I' == 73
+	UINT8 MagicByteN = 78; // 'N' == 78
+	UINT16 LegacyWidth = 0;
+	UINT16 LegacyHeight = 0;
+	UINT16 Version = IN3_VERSION_2;
+	UINT32 HeaderSize = sizeof(IN3Header<T>);
+	UINT64 Width;
+	UINT64 Height;
+	UINT64 YSize;
+	UINT64 USize;
+	UINT64 VSize;
+	LengthTable<T> YTable;
+	LengthTable<T> UTable;
+	LengthTable<T> VTable;
+	UINT8 ColorTransform = COLOR_TRANSFORM_YUV;
+	// Sample quantization step of the Y, U and V planes
+	// 1 for lossless samples, 0 in files written before quantization
+	UINT8 QuantizationSteps[3] = { 1, 1, 1 };
+	// Coding of the Y, U and V planes, and the coded sample of constant ones
+	// Length tables of planes not Huffman coded are all zero, and those of
+	// block coded planes hold their first table
+	UINT8 PlaneModes[3] = { PLANE_MODE_HUFFMAN, PLANE_MODE_HUFFMAN, PLANE_MODE_HUFFMAN };
+	T ConstantSamples[3] = { 0, 0, 0 };
+	// Entries of the palette of a palette coded file, which end the header
+	// so that HeaderSize counts them, or zero
+	UINT16 PaletteSize = 0;
+	IN3Header();
+	IN3Header(const IN3HeaderV1<T>& header);
+};
+// IN3 Palette Entry, one per index of a palette coded file
+struct IN3PaletteEntry {
+	UINT8 Blue;
+	UINT8 Green;
+	UINT8 Red;
+};
+// IN3 High Bit Depth File Header
+// Each plane is stored as its compact sparse length table followed by the
+// coded prediction residuals of its 16-bit samples
+struct IN3WideHeader {
+	UINT8 MagicByteI = 73; // 'I' == 73
+	UINT8 MagicByteW = 87; // 'W' == 87
+	UINT16 Version = 1;
+	UINT32 HeaderSize = sizeof(IN3WideHeader);
+	UINT8 SampleBits; // Significant bits per sample, 9 to 16
+	UINT8 PlaneCount; // 1 for grayscale, 3 for RGB
+	UINT8 ColorTransform = COLOR_TRANSFORM_YUV; // YCoCg-R or none
+	UINT8 Reserved = 0;
+	UINT64 Width;
+	UINT64 Height;
+	UINT64 PlaneSize[3];
+};
+// IN3 Archive File Header
+// Images are stored back-to-back after the header, each as its key,
+// dimensions, color transform, palette if palette coded, then the size,
+// quantization step, mode, constant sample and run-length coded length
+// table of each plane, and the packed planes. The index at IndexOffset
+// lists the images sorted by the hash of their key.
+struct IN3ArchiveHeader {
+	UINT8 MagicByteI = 73; // 'I' == 73
+	UINT8 MagicByteN = 78; // 'N' == 78
+	UINT8 MagicByteA = 65; // 'A' == 65
+	UINT8 Version = 1;
+	UINT32 HeaderSize = sizeof(IN3ArchiveHeader);
+	UINT64 ImageCount;
+	UINT64 IndexOffset;
+};
+// IN3 Archive Index Entry
+struct IN3ArchiveIndexEntry {
+	UINT64 KeyHash;
+	UINT64 Offset;
+};
+// IN3 Sequence File Header
+// Frames follow the header, then the frame index at IndexOffset
+struct IN3SequenceHeader {
+	UINT8 MagicByteI = 73; // 'I' == 73
+	UINT8 MagicByteN = 78; // 'N' == 78
+	UINT8 MagicByteS = 83; // 'S' == 83
+	UINT8 Version = 1;
+	UINT8 ColorTransform = COLOR_TRANSFORM_YUV;
+	UINT32 KeyFrameInterval;
+	UINT32 BlockSize;
+	UINT64 Width;
+	UINT64 Height;
+	UINT64 FrameCount;
+	UINT64 IndexOffset;
+};
+// IN3 Sequence Frame Flags
+static const UINT8 IN3_FRAME_KEY = 0x01; // Samples coded directly, not as a residual
+static const UINT8 IN3_FRAME_TABLES = 0x02; // Length tables follow the frame header
+// IN3 Sequence Frame Header
+// Followed by the length tables if IN3_FRAME_TABLES is set, then the
+// changed block mask (residual frames only) and the coded planes
+struct IN3FrameHeader {
+	UINT8 Flags;
+	UINT64 MaskSize;
+	UINT64 YSize;
+	UINT64 USize;
+	UINT64 VSize;
+};
+// IN3 Sequence Frame Index Entry
+// TableOffset is the offset of the frame whose length tables this frame uses
+struct IN3FrameIndexEntry {
+	UINT64 Offset;
+	UINT64 TableOffset;
+	UINT8 Flags;
+};
+// IN3 Compression Cache Entry Header
+// Followed by DataSize bytes of the IN3 file compressed from the pixels of
+// the key, which is the hash of the pixels and encoder settings and the
+// image dimensions
+struct IN3CacheEntryHeader {
+	UINT8 MagicByteI = 73; // 'I' == 73
+	UINT8 MagicByteN = 78; // 'N' == 78
+	UINT8 MagicByteC = 67; // 'C' == 67
+	UINT8 Version = 1;
+	UINT64 KeyHash;
+	UINT64 Width;
+	UINT64 Height;
+	UINT64 DataSize;
+};
 #pragma pack(pop)
+
+template<typename T>
+inline IN3Header<T>::IN3Header()
+{
+}
+
+template<typename T>
+inline IN3Header<T>::IN3Header(const IN3HeaderV1<T>& header)
+	: Width(header.Width),
+	  Height(header.Height),
+	  YSize(header.YSize),
+	  USize(header.USize),
+	  VSize(header.VSize),
+	  YTable(header.YTable),
+	  UTable(header.UTable),
+	  VTable(header.VTable)
+{
+}
+
+// High bit depth image of one (grayscale) or three (RGB) sample planes
+struct WideImage {
+	UINT64 Width = 0;
+	UINT64 Height = 0;
+	UINT8 SampleBits = 16;
+	UINT8 PlaneCount = 0;
+	std::vector<UINT16> Planes[3];
+};
+
+// Layouts of pixels in buffers owned by the caller of the codec
+enum PixelFormat : UINT8 {
+	PIXEL_FORMAT_RGB = 0,
+	PIXEL_FORMAT_BGR = 1, // As BitmapFile stores its pixels
+	PIXEL_FORMAT_RGBA = 2, // Alpha ignored when encoding, 255 when decoding
+	PIXEL_FORMAT_BGRA = 3,
+	PIXEL_FORMAT_RGBX = 4, // Padding byte ignored and left untouched
+	PIXEL_FORMAT_BGRX = 5,
+	// Separate planes of Y, U and V samples as coded with the YUV color
+	// transform, offset by 128 to be unsigned
+	PIXEL_FORMAT_YUV_PLANAR = 6
+};
+
+// Pixels in a buffer owned elsewhere, rows top to bottom
+// Packed formats use only the first plane. The codec only reads the
+// pixels when encoding.
+struct PixelBuffer {
+	PixelFormat Format = PIXEL_FORMAT_RGB;
+	UINT64 Width = 0;
+	UINT64 Height = 0;
+	BYTE* Planes[3] = { NULL, NULL, NULL };
+	// Bytes from the start of a row of a plane to the start of the next
+	size_t Strides[3] = { 0, 0, 0 };
+};
+
 // Y, U, and V vectors
 template <typename T>
 struct YUVVectors {
 	std::vector<T> Y;
 	std::vector<T> U;
 	std::vector<T> V;
-	UINT64 Width;
-	UINT64 Height;
+	UINT64 Width = 0;
+	UINT64 Height = 0;
 	UINT64 getWidth() const;
 	UINT64 getHeight() const;
+	// Deep copy, for the few places that keep planes after passing them on
+	YUVVectors<T> clone() const;
 	YUVVectors();
 	YUVVectors(
 		const UINT64 width,
 		const UINT64 height);
+	// Planes are moved through the pipeline, never copied implicitly
+	YUVVectors(const YUVVectors<T>&) = delete;
+	YUVVectors<T>& operator=(const YUVVectors<T>&) = delete;
+	YUVVectors(YUVVectors<T>&&) = default;
+	YUVVectors<T>& operator=(YUVVectors<T>&&) = default;
 };
 
 template<typename T>
@@ -56,6 +368,18 @@ inline UINT64 YUVVectors<T>::getHeight() const
 	return Height;
 }
 
+template<typename T>
+inline YUVVectors<T> YUVVectors<T>::clone() const
+{
+	YUVVectors<T> copy;
+	copy.Y = Y;
+	copy.U = U;
+	copy.V = V;
+	copy.Width = Width;
+	copy.Height = Height;
+	return copy;
+}
+
 template<typename T>
 inline YUVVectors<T>::YUVVectors()
 {
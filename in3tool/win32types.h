@@ -0,0 +1,38 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Win32 integer types for builds without windows.h
+// Only the codec sources that libin3 compiles are built this way; code that
+// opens files or windows stays Windows only.
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef char CHAR;
+typedef wchar_t WCHAR;
+typedef float FLOAT;
+typedef double DOUBLE;
+typedef int8_t INT8;
+typedef uint8_t UINT8;
+typedef int16_t INT16;
+typedef uint16_t UINT16;
+typedef int16_t SHORT;
+typedef uint16_t USHORT;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+typedef unsigned int UINT;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
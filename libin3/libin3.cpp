@@ -0,0 +1,394 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+#include "Codec.h"
+#include "IN3File.h"
+#include "libin3.h"
+
+// Codec keeps no state besides its settings, which are only read while
+// coding, so a context is shared by threads without locking
+struct in3_context {
+	Codec ImageCodec;
+	in3_context(const Codec::Settings& settings)
+		: ImageCodec(settings)
+	{
+	}
+};
+
+// Largest dimension a BitmapFile holds
+static const UINT64 MAX_DIMENSION = std::numeric_limits<INT32>::max();
+
+// Bytes of each pixel of a format
+static UINT64 bytesPerPixel(in3_pixel_format format)
+{
+	return format == IN3_PIXEL_FORMAT_RGB || format == IN3_PIXEL_FORMAT_BGR ? 3 : 4;
+}
+
+// Bytes of pixels rows stride bytes apart, or zero if they overflow
+static size_t pixelBufferSize(
+	UINT64 width,
+	UINT64 height,
+	in3_pixel_format format,
+	size_t stride)
+{
+	if (width == 0 || height == 0 ||
+		width > MAX_DIMENSION || height > MAX_DIMENSION ||
+		static_cast<UINT32>(format) > IN3_PIXEL_FORMAT_BGRX ||
+		stride < width * bytesPerPixel(format)) {
+		return 0;
+	}
+	UINT64 size = width * bytesPerPixel(format);
+	if ((height - 1) > (std::numeric_limits<size_t>::max() - size) / stride) {
+		return 0;
+	}
+	return static_cast<size_t>((height - 1) * stride + size);
+}
+
+// Caller's pixels as a codec pixel buffer
+// The in3_pixel_format values match the packed PixelFormat values.
+static PixelBuffer makePixelBuffer(
+	uint8_t* pixels,
+	in3_pixel_format format,
+	UINT64 width,
+	UINT64 height,
+	size_t stride)
+{
+	PixelBuffer buffer;
+	buffer.Format = static_cast<PixelFormat>(format);
+	buffer.Width = width;
+	buffer.Height = height;
+	buffer.Planes[0] = pixels;
+	buffer.Strides[0] = stride;
+	return buffer;
+}
+
+// Size of the settings structure of interface version 3, the oldest accepted
+static const size_t SETTINGS_SIZE_V3 = offsetof(in3_settings, effort);
+
+static BOOL convertSettings(const in3_settings& settings, Codec::Settings& codecSettings)
+{
+	if (settings.struct_size < SETTINGS_SIZE_V3 ||
+		settings.color_transform > IN3_COLOR_TRANSFORM_YCOCG_R ||
+		!(settings.target_bits_per_pixel >= 0.0)) {
+		return FALSE;
+	}
+	codecSettings.ColorTransform = static_cast<IN3ColorTransform>(settings.color_transform);
+	for (UINT8 p = 0; p < 3; p++) {
+		if (settings.quantization_steps[p] < 1 || settings.quantization_steps[p] > IN3_MAX_QUANTIZATION_STEP) {
+			return FALSE;
+		}
+		codecSettings.QuantizationSteps[p] = settings.quantization_steps[p];
+	}
+	codecSettings.TargetBitsPerPixel = settings.target_bits_per_pixel;
+	codecSettings.HistogramThreads = settings.histogram_threads;
+	if (settings.max_palette_colors > IN3_MAX_PALETTE_SIZE) {
+		return FALSE;
+	}
+	codecSettings.MaxPaletteColors = static_cast<UINT16>(settings.max_palette_colors);
+	if (settings.struct_size >= offsetof(in3_settings, effort) + sizeof(settings.effort)) {
+		switch (settings.effort) {
+		case IN3_EFFORT_DEFAULT:
+			codecSettings.Effort = Codec::EFFORT_DEFAULT;
+			break;
+		case IN3_EFFORT_HIGH:
+			codecSettings.Effort = Codec::EFFORT_HIGH;
+			break;
+		default:
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+uint32_t in3_version(void)
+{
+	return IN3_API_VERSION;
+}
+
+const char* in3_status_string(in3_status status)
+{
+	switch (status) {
+	case IN3_OK:
+		return "OK";
+	case IN3_ERROR_INVALID_ARGUMENT:
+		return "Invalid argument";
+	case IN3_ERROR_BUFFER_TOO_SMALL:
+		return "Buffer too small";
+	case IN3_ERROR_CORRUPT_DATA:
+		return "Not an IN3 image or damaged";
+	case IN3_ERROR_OUT_OF_MEMORY:
+		return "Out of memory";
+	default:
+		return "Internal error";
+	}
+}
+
+void in3_settings_default(in3_settings* settings)
+{
+	if (settings == NULL) {
+		return;
+	}
+	Codec::Settings defaults;
+	std::memset(settings, 0, sizeof(*settings));
+	settings->struct_size = sizeof(*settings);
+	settings->color_transform = static_cast<uint32_t>(defaults.ColorTransform);
+	for (UINT8 p = 0; p < 3; p++) {
+		settings->quantization_steps[p] = defaults.QuantizationSteps[p];
+	}
+	settings->target_bits_per_pixel = defaults.TargetBitsPerPixel;
+	settings->histogram_threads = defaults.HistogramThreads;
+	settings->max_palette_colors = defaults.MaxPaletteColors;
+	settings->effort = IN3_EFFORT_DEFAULT;
+}
+
+in3_status in3_context_create(
+	const in3_settings* settings,
+	in3_context** context)
+{
+	if (context == NULL) {
+		return IN3_ERROR_INVALID_ARGUMENT;
+	}
+	*context = NULL;
+	Codec::Settings codecSettings;
+	if (settings != NULL && !convertSettings(*settings, codecSettings)) {
+		return IN3_ERROR_INVALID_ARGUMENT;
+	}
+	*context = new (std::nothrow) in3_context(codecSettings);
+	return *context != NULL ? IN3_OK : IN3_ERROR_OUT_OF_MEMORY;
+}
+
+void in3_context_destroy(in3_context* context)
+{
+	delete context;
+}
+
+size_t in3_encode_bound(uint32_t width, uint32_t height)
+{
+	// Every plane is stored raw when coding would not make it smaller, so
+	// each takes at most a byte per pixel. A palette coded image also
+	// stores an entry per color after the header, and has no more colors
+	// than pixels.
+	UINT64 pixels = static_cast<UINT64>(width) * height;
+	UINT64 paletteBytes = std::min<UINT64>(pixels, IN3_MAX_PALETTE_SIZE) * sizeof(IN3PaletteEntry);
+	if (width == 0 || height == 0 ||
+		width > MAX_DIMENSION || height > MAX_DIMENSION ||
+		pixels > (std::numeric_limits<size_t>::max() - sizeof(IN3Header<INT8>) - paletteBytes) / 3) {
+		return 0;
+	}
+	return static_cast<size_t>(sizeof(IN3Header<INT8>) + paletteBytes + pixels * 3);
+}
+
+in3_status in3_encode(
+	in3_context* context,
+	const uint8_t* pixels,
+	uint32_t width,
+	uint32_t height,
+	size_t stride,
+	uint8_t* output,
+	size_t output_capacity,
+	size_t* output_size)
+{
+	return in3_encode_format(
+		context,
+		pixels,
+		IN3_PIXEL_FORMAT_RGB,
+		width,
+		height,
+		stride,
+		output,
+		output_capacity,
+		output_size);
+}
+
+in3_status in3_encode_format(
+	in3_context* context,
+	const uint8_t* pixels,
+	in3_pixel_format format,
+	uint32_t width,
+	uint32_t height,
+	size_t stride,
+	uint8_t* output,
+	size_t output_capacity,
+	size_t* output_size)
+{
+	if (context == NULL || pixels == NULL || output_size == NULL ||
+		(output == NULL && output_capacity != 0) ||
+		pixelBufferSize(width, height, format, stride) == 0) {
+		return IN3_ERROR_INVALID_ARGUMENT;
+	}
+	*output_size = 0;
+	try {
+		// The codec only reads the pixels it is asked to encode
+		std::unique_ptr<IN3File> in3File = context->ImageCodec.compress(makePixelBuffer(
+			const_cast<uint8_t*>(pixels),
+			format,
+			width,
+			height,
+			stride));
+		if (!in3File) {
+			return IN3_ERROR_INVALID_ARGUMENT;
+		}
+		UINT64 size = in3File->getSavedSize();
+		*output_size = static_cast<size_t>(size);
+		if (size > output_capacity) {
+			return IN3_ERROR_BUFFER_TOO_SMALL;
+		}
+		in3File->SaveToBuffer(output);
+		return IN3_OK;
+	}
+	catch (const std::bad_alloc&) {
+		return IN3_ERROR_OUT_OF_MEMORY;
+	}
+	catch (...) {
+		return IN3_ERROR_INTERNAL;
+	}
+}
+
+// Header of an encoded image whose planes fit in the data
+static in3_status readImageHeader(
+	const uint8_t* data,
+	size_t size,
+	IN3Header<INT8>& header,
+	UINT64& headerSize)
+{
+	if (data == NULL || size == 0) {
+		return IN3_ERROR_INVALID_ARGUMENT;
+	}
+	headerSize = IN3File::ReadHeader(data, size, header);
+	UINT64 planeBytes = size - headerSize;
+	if (!IN3File::IsValidHeader(header) ||
+		header.Width == 0 || header.Height == 0 ||
+		header.Width > MAX_DIMENSION || header.Height > MAX_DIMENSION ||
+		header.YSize > planeBytes ||
+		header.USize > planeBytes - header.YSize ||
+		header.VSize > planeBytes - header.YSize - header.USize) {
+		return IN3_ERROR_CORRUPT_DATA;
+	}
+	return IN3_OK;
+}
+
+in3_status in3_get_info(
+	const uint8_t* data,
+	size_t size,
+	in3_image_info* info)
+{
+	if (info == NULL) {
+		return IN3_ERROR_INVALID_ARGUMENT;
+	}
+	IN3Header<INT8> header;
+	UINT64 headerSize = 0;
+	in3_status status = readImageHeader(data, size, header, headerSize);
+	if (status != IN3_OK) {
+		return status;
+	}
+	info->width = static_cast<uint32_t>(header.Width);
+	info->height = static_cast<uint32_t>(header.Height);
+	info->decoded_size = pixelBufferSize(
+		header.Width,
+		header.Height,
+		IN3_PIXEL_FORMAT_RGB,
+		static_cast<size_t>(header.Width * 3));
+	return info->decoded_size != 0 ? IN3_OK : IN3_ERROR_CORRUPT_DATA;
+}
+
+in3_status in3_decode(
+	in3_context* context,
+	const uint8_t* data,
+	size_t size,
+	uint8_t* pixels,
+	size_t stride,
+	size_t pixels_capacity)
+{
+	return in3_decode_format(
+		context,
+		data,
+		size,
+		IN3_PIXEL_FORMAT_RGB,
+		pixels,
+		stride,
+		pixels_capacity);
+}
+
+in3_status in3_decode_format(
+	in3_context* context,
+	const uint8_t* data,
+	size_t size,
+	in3_pixel_format format,
+	uint8_t* pixels,
+	size_t stride,
+	size_t pixels_capacity)
+{
+	if (context == NULL || pixels == NULL) {
+		return IN3_ERROR_INVALID_ARGUMENT;
+	}
+	IN3Header<INT8> header;
+	UINT64 headerSize = 0;
+	in3_status status = readImageHeader(data, size, header, headerSize);
+	if (status != IN3_OK) {
+		return status;
+	}
+	// Checked before decoding so that a damaged header cannot make the
+	// decoder allocate more than the caller expects to receive
+	size_t required = pixelBufferSize(header.Width, header.Height, format, stride);
+	if (required == 0) {
+		return IN3_ERROR_INVALID_ARGUMENT;
+	}
+	if (required > pixels_capacity) {
+		return IN3_ERROR_BUFFER_TOO_SMALL;
+	}
+	try {
+		IN3File in3File(Span<BYTE>(data, size));
+		BOOL decoded = context->ImageCodec.decompress(
+			in3File,
+			makePixelBuffer(pixels, format, header.Width, header.Height, stride));
+		return decoded ? IN3_OK : IN3_ERROR_CORRUPT_DATA;
+	}
+	catch (const std::bad_alloc&) {
+		return IN3_ERROR_OUT_OF_MEMORY;
+	}
+	catch (...) {
+		return IN3_ERROR_INTERNAL;
+	}
+}
+
+in3_status in3_decode_luma(
+	in3_context* context,
+	const uint8_t* data,
+	size_t size,
+	uint8_t* luma,
+	size_t stride,
+	size_t luma_capacity)
+{
+	if (context == NULL || luma == NULL) {
+		return IN3_ERROR_INVALID_ARGUMENT;
+	}
+	IN3Header<INT8> header;
+	UINT64 headerSize = 0;
+	in3_status status = readImageHeader(data, size, header, headerSize);
+	if (status != IN3_OK) {
+		return status;
+	}
+	// Checked before decoding, as for pixels
+	if (stride < header.Width ||
+		(header.Height - 1) > (std::numeric_limits<size_t>::max() - header.Width) / stride) {
+		return IN3_ERROR_INVALID_ARGUMENT;
+	}
+	if ((header.Height - 1) * stride + header.Width > luma_capacity) {
+		return IN3_ERROR_BUFFER_TOO_SMALL;
+	}
+	try {
+		IN3File in3File(Span<BYTE>(data, size));
+		BOOL decoded = context->ImageCodec.decompressLuma(in3File, luma, stride);
+		return decoded ? IN3_OK : IN3_ERROR_CORRUPT_DATA;
+	}
+	catch (const std::bad_alloc&) {
+		return IN3_ERROR_OUT_OF_MEMORY;
+	}
+	catch (...) {
+		return IN3_ERROR_INTERNAL;
+	}
+}
@@ -0,0 +1,194 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// C interface of the IN3 codec for embedding in other programs
+// Images are encoded from and decoded into buffers owned by the caller;
+// the library never opens files. A context holds encoder settings that are
+// fixed when it is created, so one context may be used by any number of
+// threads at the same time.
+
+#if defined(_WIN32)
+#ifdef LIBIN3_EXPORTS
+#define IN3_API __declspec(dllexport)
+#else
+#define IN3_API __declspec(dllimport)
+#endif
+#else
+#define IN3_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Version of this interface, raised when a function or structure changes
+#define IN3_API_VERSION 4
+
+// Results of the library functions
+typedef enum in3_status {
+	IN3_OK = 0,
+	// A pointer was NULL, a dimension was zero or a setting was out of range
+	IN3_ERROR_INVALID_ARGUMENT = 1,
+	// The output buffer is smaller than the size returned with this result
+	IN3_ERROR_BUFFER_TOO_SMALL = 2,
+	// The input is not an IN3 image or is damaged
+	IN3_ERROR_CORRUPT_DATA = 3,
+	IN3_ERROR_OUT_OF_MEMORY = 4,
+	IN3_ERROR_INTERNAL = 5
+} in3_status;
+
+// Color transform applied before entropy coding
+typedef enum in3_color_transform {
+	IN3_COLOR_TRANSFORM_YUV = 0,
+	// Lossless integer transform, quantization steps are ignored
+	IN3_COLOR_TRANSFORM_YCOCG_R = 1
+} in3_color_transform;
+
+// Encoder effort, trading encoding time for size
+typedef enum in3_effort {
+	// One code table per plane, built from the histogram of the plane
+	IN3_EFFORT_DEFAULT = 0,
+	// Blocks of each plane pick one of a few code tables clustered from
+	// their histograms; images encoded this way need interface version 4
+	// to decode
+	IN3_EFFORT_HIGH = 1
+} in3_effort;
+
+// Layouts of pixels, with rows top to bottom stride bytes apart
+typedef enum in3_pixel_format {
+	IN3_PIXEL_FORMAT_RGB = 0,
+	IN3_PIXEL_FORMAT_BGR = 1,
+	// Alpha is ignored when encoding and set to 255 when decoding
+	IN3_PIXEL_FORMAT_RGBA = 2,
+	IN3_PIXEL_FORMAT_BGRA = 3,
+	// The padding byte is ignored when encoding and left untouched when
+	// decoding
+	IN3_PIXEL_FORMAT_RGBX = 4,
+	IN3_PIXEL_FORMAT_BGRX = 5
+} in3_pixel_format;
+
+// Encoder settings
+// Fill with in3_settings_default before changing fields, so that fields
+// added by later versions keep their defaults
+typedef struct in3_settings {
+	// Size of this structure, set by in3_settings_default
+	uint32_t struct_size;
+	uint32_t color_transform;
+	// Quantization step of the Y, U and V samples from 1 to 64, 1 for lossless
+	uint8_t quantization_steps[3];
+	// Target size of the coded planes in bits per pixel, or zero to use
+	// the fixed steps
+	double target_bits_per_pixel;
+	// Threads counting each plane histogram, or zero for one per hardware
+	// thread
+	uint32_t histogram_threads;
+	// Images of at most this many distinct colors, up to 256, are coded
+	// losslessly as indices into a palette, or zero to never use one
+	// Added in interface version 3 in what was padding before, which
+	// in3_settings_default of earlier versions left zero
+	uint32_t max_palette_colors;
+	// An in3_effort
+	// Added in interface version 4 at the end of the structure, so that
+	// structures of earlier versions, whose struct_size ends before it,
+	// encode with the default effort
+	uint32_t effort;
+} in3_settings;
+
+// Dimensions of an encoded image
+typedef struct in3_image_info {
+	uint32_t width;
+	uint32_t height;
+	// Bytes of the decoded pixels with rows packed back-to-back
+	size_t decoded_size;
+} in3_image_info;
+
+typedef struct in3_context in3_context;
+
+// Version of the interface the library was built with
+IN3_API uint32_t in3_version(void);
+// Description of a result
+IN3_API const char* in3_status_string(in3_status status);
+
+IN3_API void in3_settings_default(in3_settings* settings);
+// Create a context, with the default settings if settings is NULL
+IN3_API in3_status in3_context_create(
+	const in3_settings* settings,
+	in3_context** context);
+IN3_API void in3_context_destroy(in3_context* context);
+
+// Largest encoded size of an image, or zero if the dimensions are too large
+IN3_API size_t in3_encode_bound(uint32_t width, uint32_t height);
+
+// Encode 24-bit pixels stored red, green, blue with rows top to bottom,
+// stride bytes apart
+// On success or IN3_ERROR_BUFFER_TOO_SMALL, output_size is the size of
+// the encoded image. A buffer of in3_encode_bound bytes is always large
+// enough.
+IN3_API in3_status in3_encode(
+	in3_context* context,
+	const uint8_t* pixels,
+	uint32_t width,
+	uint32_t height,
+	size_t stride,
+	uint8_t* output,
+	size_t output_capacity,
+	size_t* output_size);
+
+// Encode pixels of any format the same way, reading them in place
+IN3_API in3_status in3_encode_format(
+	in3_context* context,
+	const uint8_t* pixels,
+	in3_pixel_format format,
+	uint32_t width,
+	uint32_t height,
+	size_t stride,
+	uint8_t* output,
+	size_t output_capacity,
+	size_t* output_size);
+
+// Read the dimensions of an encoded image without decoding it
+IN3_API in3_status in3_get_info(
+	const uint8_t* data,
+	size_t size,
+	in3_image_info* info);
+
+// Decode into 24-bit pixels stored red, green, blue with rows top to bottom,
+// stride bytes apart
+// The buffer must hold stride * (height - 1) + width * 3 bytes.
+IN3_API in3_status in3_decode(
+	in3_context* context,
+	const uint8_t* data,
+	size_t size,
+	uint8_t* pixels,
+	size_t stride,
+	size_t pixels_capacity);
+
+// Decode straight into pixels of any format
+// The buffer must hold stride * (height - 1) + width times the bytes of a
+// pixel.
+IN3_API in3_status in3_decode_format(
+	in3_context* context,
+	const uint8_t* data,
+	size_t size,
+	in3_pixel_format format,
+	uint8_t* pixels,
+	size_t stride,
+	size_t pixels_capacity);
+
+// Decode only the luma of an image into 8-bit gray samples with rows top to
+// bottom, stride bytes apart
+// Skips the chroma planes and the color conversion of images coded with
+// the YUV transform. The buffer must hold stride * (height - 1) + width
+// bytes.
+IN3_API in3_status in3_decode_luma(
+	in3_context* context,
+	const uint8_t* data,
+	size_t size,
+	uint8_t* luma,
+	size_t stride,
+	size_t luma_capacity);
+
+#ifdef __cplusplus
+}
+#endif